@@ -11,8 +11,19 @@ struct backend_ops {
     int (*create)(struct fuse_args *, struct demuxfs_data *);
     int (*destroy)(struct demuxfs_data *);
 	int (*set_frequency)(uint32_t, struct demuxfs_data *);
+	/* Reads the next packet. Backends that receive several packets at a time
+	 * stamp priv->latency->packet_ingest_ns once per datagram or buffer. */
     int (*read)(struct demuxfs_data *);
 	int (*process)(struct ts_header *, void **, struct demuxfs_data *);
+	/* Optional: reads up to the given number of packets, stored back to back.
+	 * Returns the number of packets read. Replaces read() and process(). */
+	int (*read_batch)(struct demuxfs_data *, const uint8_t **, size_t);
+	/* Optional: adds (true) or removes (false) a PID from the set of PIDs the
+	 * input delivers. Backends without it deliver the whole transport stream. */
+	int (*set_pid_filter)(uint16_t, bool, struct demuxfs_data *);
+	/* Optional: switches to another input, such as a file, named as in the
+	 * backend's options. Used by the scan mode in place of set_frequency(). */
+	int (*set_source)(const char *, struct demuxfs_data *);
     bool (*keep_alive)(struct demuxfs_data *);
 	void (*usage)(void);
 };
@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "compressed.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Size of each chunk produced by the gzip reader */
+#define GZIP_CHUNK_SIZE (1024 * 1024)
+
+/* Chunks a slot holds before its producer waits for the consumer. Must be a power of two. */
+#define SLOT_CHUNKS     16
+
+/* Sequence number used when the end of the stream is not known yet */
+#define SEQ_INFINITE UINT64_MAX
+
+/**
+ * Decompressed data is handed to the consumer in sequence. Each sequence
+ * number is decoded into the slot given by seq % window_size, so producers
+ * may run at most window_size sequence numbers ahead of the consumer. A slot
+ * is a FIFO of up to SLOT_CHUNKS chunks, which the producer fills while the
+ * consumer drains it, so memory stays bounded however large a sequence is.
+ *
+ * With zstd, each sequence number is one independently decodable frame,
+ * streamed in ZSTD_DStreamOutSize() chunks, and several workers decode
+ * frames out of order. With gzip a single worker fills one chunk per
+ * sequence number.
+ */
+struct chunk {
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+struct slot {
+	struct chunk chunks[SLOT_CHUNKS];
+	unsigned int head;          /**< Chunks produced */
+	unsigned int tail;          /**< Chunks consumed */
+	bool done;                  /**< The producer won't add more chunks */
+};
+
+struct zstd_frame {
+	size_t offset;
+	size_t size;
+};
+
+struct compressed_source {
+	enum compressed_format format;
+	int loops;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t produced;
+	pthread_cond_t consumed;
+	struct slot *window;
+	int window_size;
+	uint64_t next_claim;        /**< Next sequence number to be claimed by a producer */
+	uint64_t next_consume;      /**< Sequence number of the chunk being consumed */
+	uint64_t total;             /**< Number of chunks in the stream, SEQ_INFINITE if unknown */
+	bool error;
+	bool stop;
+
+	/* Consumer-side cursor, only touched by the reader thread. Points into
+	 * the slot of next_consume. */
+	struct chunk *current;
+	size_t offset;
+
+	pthread_t *threads;
+	int num_threads;
+
+#ifdef USE_ZLIB
+	gzFile gz;
+#endif
+	/* zstd input is mmap'ed and indexed by frame */
+	void *map;
+	size_t map_size;
+	struct zstd_frame *frames;
+	size_t num_frames;
+};
+
+enum compressed_format compressed_source_detect(const char *path)
+{
+	unsigned char magic[4];
+	enum compressed_format format = COMPRESSED_NONE;
+	FILE *fp = fopen(path, "r");
+	struct stat statbuf;
+
+	if (! fp)
+		return COMPRESSED_NONE;
+	/* Don't consume data from FIFOs; they are always treated as raw TS */
+	if (fstat(fileno(fp), &statbuf) == 0 && S_ISREG(statbuf.st_mode) &&
+		fread(magic, sizeof(magic), 1, fp) == 1) {
+		if (magic[0] == 0x1f && magic[1] == 0x8b)
+			format = COMPRESSED_GZIP;
+		else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+			format = COMPRESSED_ZSTD;
+	}
+	fclose(fp);
+	return format;
+}
+
+/**
+ * Waits for a free slot in the window and claims the next sequence number.
+ * @return false if the producer must quit.
+ */
+static bool compressed_claim(struct compressed_source *src, uint64_t *seq)
+{
+	pthread_mutex_lock(&src->mutex);
+	while (! src->stop && ! src->error && src->next_claim < src->total &&
+		src->next_claim >= src->next_consume + src->window_size)
+		pthread_cond_wait(&src->consumed, &src->mutex);
+	if (src->stop || src->error || src->next_claim >= src->total) {
+		pthread_mutex_unlock(&src->mutex);
+		return false;
+	}
+	*seq = src->next_claim++;
+	pthread_mutex_unlock(&src->mutex);
+	return true;
+}
+
+/**
+ * Waits until the slot of @seq has room for one more chunk.
+ * @return the chunk to fill, or NULL if the producer must quit.
+ */
+static struct chunk *compressed_get_chunk(struct compressed_source *src, uint64_t seq)
+{
+	struct slot *slot = &src->window[seq % src->window_size];
+	struct chunk *chunk = NULL;
+
+	pthread_mutex_lock(&src->mutex);
+	while (! src->stop && ! src->error && slot->head - slot->tail == SLOT_CHUNKS)
+		pthread_cond_wait(&src->consumed, &src->mutex);
+	if (! src->stop && ! src->error)
+		chunk = &slot->chunks[slot->head % SLOT_CHUNKS];
+	pthread_mutex_unlock(&src->mutex);
+	return chunk;
+}
+
+/**
+ * Hands the chunk returned by compressed_get_chunk() to the consumer.
+ */
+static void compressed_put_chunk(struct compressed_source *src, uint64_t seq)
+{
+	pthread_mutex_lock(&src->mutex);
+	src->window[seq % src->window_size].head++;
+	pthread_cond_broadcast(&src->produced);
+	pthread_mutex_unlock(&src->mutex);
+}
+
+/**
+ * Tells the consumer that @seq has been decoded in full, or that decoding failed.
+ */
+static void compressed_publish(struct compressed_source *src, uint64_t seq, bool error)
+{
+	pthread_mutex_lock(&src->mutex);
+	if (error)
+		src->error = true;
+	else
+		src->window[seq % src->window_size].done = true;
+	pthread_cond_broadcast(&src->produced);
+	pthread_mutex_unlock(&src->mutex);
+}
+
+static bool chunk_reserve(struct chunk *chunk, size_t capacity)
+{
+	if (chunk->capacity >= capacity)
+		return true;
+	char *data = realloc(chunk->data, capacity);
+	if (! data)
+		return false;
+	chunk->data = data;
+	chunk->capacity = capacity;
+	return true;
+}
+
+#ifdef USE_ZLIB
+static void *compressed_gzip_thread(void *arg)
+{
+	struct compressed_source *src = (struct compressed_source *) arg;
+	size_t since_rewind = 0;
+	uint64_t seq;
+
+	trace_set_thread_name("gzip");
+	while (compressed_claim(src, &seq)) {
+		struct chunk *chunk = compressed_get_chunk(src, seq);
+		if (! chunk)
+			break;
+		bool error = ! chunk_reserve(chunk, GZIP_CHUNK_SIZE);
+		uint64_t start = trace_begin();
+
+		chunk->len = 0;
+		while (! error && chunk->len < GZIP_CHUNK_SIZE) {
+			int n = gzread(src->gz, &chunk->data[chunk->len], GZIP_CHUNK_SIZE - chunk->len);
+			if (n < 0) {
+				int errnum;
+				fprintf(stderr, "gzread: %s\n", gzerror(src->gz, &errnum));
+				error = true;
+			} else if (n == 0) {
+				/* Stop looping over files that decompress to nothing */
+				if (src->loops == 0 || since_rewind == 0)
+					break;
+				if (src->loops > 0)
+					src->loops--;
+				dprintf("Rewinding TS file");
+				since_rewind = 0;
+				if (gzrewind(src->gz) < 0)
+					error = true;
+			} else {
+				chunk->len += n;
+				since_rewind += n;
+			}
+		}
+		trace_end("decompress", "gzip_chunk", start, "bytes", chunk->len);
+		if (! error && chunk->len == 0) {
+			/* End of stream: nothing was produced for this sequence number */
+			pthread_mutex_lock(&src->mutex);
+			src->total = seq;
+			pthread_cond_broadcast(&src->produced);
+			pthread_mutex_unlock(&src->mutex);
+			break;
+		}
+		if (! error)
+			compressed_put_chunk(src, seq);
+		compressed_publish(src, seq, error);
+		if (error)
+			break;
+	}
+	return NULL;
+}
+#endif /* USE_ZLIB */
+
+#ifdef USE_ZSTD
+/**
+ * Streams a frame into the slot of @seq, one ZSTD_DStreamOutSize() chunk at a time.
+ * @return the number of bytes decompressed or -1 on errors.
+ */
+static ssize_t compressed_zstd_decompress_frame(struct compressed_source *src, ZSTD_DCtx *dctx,
+		uint64_t seq, const char *frame, size_t frame_size)
+{
+	ZSTD_inBuffer in = { frame, frame_size, 0 };
+	size_t chunk_size = ZSTD_DStreamOutSize(), total = 0;
+
+	ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	while (true) {
+		struct chunk *chunk = compressed_get_chunk(src, seq);
+		if (! chunk || ! chunk_reserve(chunk, chunk_size))
+			return -1;
+
+		ZSTD_outBuffer out = { chunk->data, chunk_size, 0 };
+		size_t ret;
+		do
+			ret = ZSTD_decompressStream(dctx, &out, &in);
+		while (! ZSTD_isError(ret) && ret != 0 && out.pos < out.size && in.pos < in.size);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "ZSTD_decompressStream: %s\n", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		chunk->len = out.pos;
+		total += out.pos;
+		if (out.pos)
+			compressed_put_chunk(src, seq);
+		if (ret == 0)
+			return total;
+		if (out.pos < out.size && in.pos == in.size) {
+			fprintf(stderr, "Error: truncated zstd frame\n");
+			return -1;
+		}
+	}
+}
+
+static void *compressed_zstd_thread(void *arg)
+{
+	struct compressed_source *src = (struct compressed_source *) arg;
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	uint64_t seq;
+
+	if (! dctx) {
+		compressed_publish(src, 0, true);
+		return NULL;
+	}
+	trace_set_thread_name("zstd");
+	while (compressed_claim(src, &seq)) {
+		struct zstd_frame *frame = &src->frames[seq % src->num_frames];
+		uint64_t start = trace_begin();
+		ssize_t len = compressed_zstd_decompress_frame(src, dctx, seq,
+				(const char *) src->map + frame->offset, frame->size);
+		trace_end("decompress", "zstd_frame", start, "bytes", len);
+		compressed_publish(src, seq, len < 0);
+		if (len < 0)
+			break;
+	}
+	ZSTD_freeDCtx(dctx);
+	return NULL;
+}
+
+/**
+ * Builds the index of frames held by the mmap'ed file. Skippable frames are
+ * indexed as well; they simply decompress to empty chunks.
+ */
+static bool compressed_zstd_index_frames(struct compressed_source *src)
+{
+	size_t offset = 0, capacity = 0;
+
+	while (offset < src->map_size) {
+		size_t size = ZSTD_findFrameCompressedSize((const char *) src->map + offset,
+				src->map_size - offset);
+		if (ZSTD_isError(size)) {
+			fprintf(stderr, "Error: invalid zstd frame at offset %zu: %s\n",
+					offset, ZSTD_getErrorName(size));
+			return false;
+		}
+		if (src->num_frames == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			struct zstd_frame *frames = realloc(src->frames, capacity * sizeof(struct zstd_frame));
+			if (! frames)
+				return false;
+			src->frames = frames;
+		}
+		src->frames[src->num_frames].offset = offset;
+		src->frames[src->num_frames].size = size;
+		src->num_frames++;
+		offset += size;
+	}
+	return src->num_frames > 0;
+}
+#endif /* USE_ZSTD */
+
+static int compressed_open_format(struct compressed_source *src, const char *path)
+{
+	switch (src->format) {
+		case COMPRESSED_GZIP:
+#ifdef USE_ZLIB
+			src->gz = gzopen(path, "rb");
+			if (! src->gz) {
+				perror(path);
+				return -1;
+			}
+			gzbuffer(src->gz, 256 * 1024);
+			return 0;
+#else
+			fprintf(stderr, "Error: %s is gzip-compressed, but gzip support was not compiled in\n", path);
+			return -1;
+#endif
+		case COMPRESSED_ZSTD:
+#ifdef USE_ZSTD
+		{
+			struct stat statbuf;
+			int fd = open(path, O_RDONLY);
+			if (fd < 0 || fstat(fd, &statbuf) < 0) {
+				perror(path);
+				if (fd >= 0)
+					close(fd);
+				return -1;
+			}
+			src->map_size = statbuf.st_size;
+			src->map = mmap(NULL, src->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (src->map == MAP_FAILED) {
+				perror("mmap");
+				src->map = NULL;
+				return -1;
+			}
+			madvise(src->map, src->map_size, MADV_SEQUENTIAL);
+			if (! compressed_zstd_index_frames(src))
+				return -1;
+			if (src->loops >= 0)
+				src->total = src->num_frames * (uint64_t) (src->loops + 1);
+			if (src->num_threads > src->num_frames && src->loops == 0)
+				src->num_threads = src->num_frames;
+			return 0;
+		}
+#else
+			fprintf(stderr, "Error: %s is zstd-compressed, but zstd support was not compiled in\n", path);
+			return -1;
+#endif
+		default:
+			return -1;
+	}
+}
+
+struct compressed_source *compressed_source_open(const char *path, enum compressed_format format,
+		int threads, int loops)
+{
+	void *(*worker)(void *) = NULL;
+	struct compressed_source *src = calloc(1, sizeof(struct compressed_source));
+	assert(src);
+
+	src->format = format;
+	src->loops = loops;
+	src->total = SEQ_INFINITE;
+	src->num_threads = format == COMPRESSED_ZSTD && threads > 0 ? threads : 1;
+	pthread_mutex_init(&src->mutex, NULL);
+	pthread_cond_init(&src->produced, NULL);
+	pthread_cond_init(&src->consumed, NULL);
+
+	if (compressed_open_format(src, path) < 0) {
+		compressed_source_close(src);
+		return NULL;
+	}
+
+#ifdef USE_ZLIB
+	if (format == COMPRESSED_GZIP)
+		worker = compressed_gzip_thread;
+#endif
+#ifdef USE_ZSTD
+	if (format == COMPRESSED_ZSTD)
+		worker = compressed_zstd_thread;
+#endif
+	/* Leave room for every worker to decode one frame ahead while the consumer drains another */
+	src->window_size = src->num_threads * 2 + 2;
+	src->window = calloc(src->window_size, sizeof(struct slot));
+	src->threads = calloc(src->num_threads, sizeof(pthread_t));
+	assert(src->window);
+	assert(src->threads);
+
+	for (int i=0; i<src->num_threads; ++i) {
+		if (pthread_create(&src->threads[i], NULL, worker, src) != 0) {
+			perror("pthread_create");
+			src->num_threads = i;
+			compressed_source_close(src);
+			return NULL;
+		}
+	}
+	return src;
+}
+
+/**
+ * Makes src->current point to the chunk being consumed, waiting for the
+ * producers if needed.
+ * @return 1 if a chunk is available, 0 at the end of the stream and -1 on errors.
+ */
+static int compressed_next_chunk(struct compressed_source *src)
+{
+	struct slot *slot;
+
+	pthread_mutex_lock(&src->mutex);
+	slot = &src->window[src->next_consume % src->window_size];
+	if (src->current) {
+		slot->tail++;
+		src->current = NULL;
+		src->offset = 0;
+		pthread_cond_broadcast(&src->consumed);
+	}
+	while (! src->error && src->next_consume < src->total) {
+		slot = &src->window[src->next_consume % src->window_size];
+		if (slot->head != slot->tail) {
+			src->current = &slot->chunks[slot->tail % SLOT_CHUNKS];
+			break;
+		} else if (slot->done) {
+			/* Hand the slot over to the sequence number window_size ahead */
+			slot->head = slot->tail = 0;
+			slot->done = false;
+			src->next_consume++;
+			pthread_cond_broadcast(&src->consumed);
+		} else {
+			/* The parser is stalled until the decompressors catch up */
+			uint64_t start = trace_begin();
+			pthread_cond_wait(&src->produced, &src->mutex);
+			trace_end("decompress", "wait_decompressed", start, "chunk", src->next_consume);
+		}
+	}
+	pthread_mutex_unlock(&src->mutex);
+
+	if (src->current)
+		return 1;
+	return src->error ? -1 : 0;
+}
+
+ssize_t compressed_source_read(struct compressed_source *src, void *buf, size_t len)
+{
+	size_t n = 0;
+
+	while (n < len) {
+		if (! src->current || src->offset == src->current->len) {
+			int ret = compressed_next_chunk(src);
+			if (ret < 0)
+				return -1;
+			else if (ret == 0)
+				break;
+			continue;
+		}
+		size_t count = src->current->len - src->offset;
+		if (count > len - n)
+			count = len - n;
+		memcpy((char *) buf + n, &src->current->data[src->offset], count);
+		src->offset += count;
+		n += count;
+	}
+	return n;
+}
+
+bool compressed_source_eof(struct compressed_source *src)
+{
+	struct slot *slot;
+	unsigned int pending;
+	bool eof;
+
+	if (src->current && src->offset < src->current->len)
+		return false;
+	pthread_mutex_lock(&src->mutex);
+	slot = &src->window[src->next_consume % src->window_size];
+	pending = slot->head - slot->tail - (src->current ? 1 : 0);
+	eof = src->error || src->next_consume >= src->total ||
+		(src->next_consume + 1 >= src->total && slot->done && pending == 0);
+	pthread_mutex_unlock(&src->mutex);
+	return eof;
+}
+
+void compressed_source_close(struct compressed_source *src)
+{
+	if (! src)
+		return;
+
+	pthread_mutex_lock(&src->mutex);
+	src->stop = true;
+	pthread_cond_broadcast(&src->consumed);
+	pthread_cond_broadcast(&src->produced);
+	pthread_mutex_unlock(&src->mutex);
+	for (int i=0; src->threads && i<src->num_threads; ++i)
+		pthread_join(src->threads[i], NULL);
+
+	if (src->window) {
+		for (int i=0; i<src->window_size; ++i)
+			for (int j=0; j<SLOT_CHUNKS; ++j)
+				free(src->window[i].chunks[j].data);
+		free(src->window);
+	}
+	free(src->threads);
+#ifdef USE_ZLIB
+	if (src->gz)
+		gzclose(src->gz);
+#endif
+	if (src->map)
+		munmap(src->map, src->map_size);
+	free(src->frames);
+	pthread_cond_destroy(&src->consumed);
+	pthread_cond_destroy(&src->produced);
+	pthread_mutex_destroy(&src->mutex);
+	free(src);
+}
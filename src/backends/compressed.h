@@ -0,0 +1,59 @@
+#ifndef __compressed_h
+#define __compressed_h
+
+#ifdef USE_FILESRC
+
+#include <sys/types.h>
+#include <stdbool.h>
+
+enum compressed_format {
+	COMPRESSED_NONE,
+	COMPRESSED_GZIP,
+	COMPRESSED_ZSTD,
+};
+
+struct compressed_source;
+
+/**
+ * Inspects the magic bytes of a file and tells whether it holds a gzip
+ * or zstd stream.
+ * @param path path to the file
+ * @return the detected format or COMPRESSED_NONE if the file is not
+ *  compressed (or could not be opened).
+ */
+enum compressed_format compressed_source_detect(const char *path);
+
+/**
+ * Opens a compressed capture and starts the decompression threads.
+ * @param path path to the compressed file
+ * @param format format returned by compressed_source_detect()
+ * @param threads number of zstd decompression threads (gzip always uses one)
+ * @param loops how many times to loop on EOF, -1 means infinite
+ * @return a handle on success or NULL on error.
+ */
+struct compressed_source *compressed_source_open(const char *path, enum compressed_format format,
+		int threads, int loops);
+
+/**
+ * Reads decompressed data, blocking until @len bytes are available.
+ * @param src handle returned by compressed_source_open()
+ * @param buf output buffer
+ * @param len number of bytes to read
+ * @return number of bytes read, which is less than @len only at the end of
+ *  the stream, or -1 on decompression errors.
+ */
+ssize_t compressed_source_read(struct compressed_source *src, void *buf, size_t len);
+
+/**
+ * Tells whether all decompressed data has been consumed.
+ */
+bool compressed_source_eof(struct compressed_source *src);
+
+/**
+ * Stops the decompression threads and releases all resources.
+ */
+void compressed_source_close(struct compressed_source *src);
+
+#endif /* USE_FILESRC */
+
+#endif /* __compressed_h */
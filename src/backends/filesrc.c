@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "filesrc.h"
+#include "compressed.h"
 #include "fsutils.h"
 #include "byteops.h"
 #include "backend.h"
@@ -37,11 +38,23 @@ struct input_parser {
 	char *filesrc;				/**< File source (cmdline option) */
 	FILE *fp;					/**< File source handle */
 	char *packet;				/**< Current TS packet being processed */
+	uint8_t *batch;				/**< Packets returned by read_batch() */
 	bool packet_valid;			/**< True if TS packet is valid, False if it's not */
 	uint8_t packet_size;		/**< Packet size (188, 204, 208 bytes) */
 	int fileloop;				/**< How many times to loop the file on EOF (cmdline option) */
+	int decompress_threads;		/**< Number of zstd decompression threads (cmdline option) */
+	struct compressed_source *compressed; /**< Decompressor, if the input is a .ts.gz or .ts.zst capture */
+	char *lookahead;			/**< Decompressed data consumed while searching for the sync byte */
+	size_t lookahead_len;		/**< Number of bytes in the lookahead buffer */
+	size_t lookahead_pos;		/**< Number of lookahead bytes already handed to the parser */
 };
 
+/* Largest packet size supported: 188 bytes plus 20 bytes of error correction */
+#define FILESRC_MAX_PACKET_SIZE 208
+
+/* Enough decompressed data to check the sync byte of 6 consecutive 208-byte packets */
+#define FILESRC_LOOKAHEAD_SIZE (FILESRC_MAX_PACKET_SIZE * 6)
+
 /**
  * Command line parsing routines.
  */
@@ -49,7 +62,8 @@ void filesrc_usage(void)
 {
 	fprintf(stderr, "\nFILESRC options:\n"
 			"    -o filesrc=FILE          transport stream input file\n"
-			"    -o fileloop=<count>      how many times to loop on EOF, -1 means infinite (default: 0)\n");
+			"    -o fileloop=<count>      how many times to loop on EOF, -1 means infinite (default: 0)\n"
+			"    -o decompress_threads=N  number of threads decoding .ts.zst frames (default: number of CPUs)\n");
 }
 
 #define FILESRC_OPT(templ,offset,value) { templ, offsetof(struct input_parser, offset), value }
@@ -57,6 +71,7 @@ void filesrc_usage(void)
 static struct fuse_opt filesrc_opts[] = {
 	FILESRC_OPT("filesrc=%s",   filesrc, 0),
 	FILESRC_OPT("fileloop=%d",  fileloop, 0),
+	FILESRC_OPT("decompress_threads=%d", decompress_threads, 0),
 	FUSE_OPT_END
 };
 
@@ -104,52 +119,159 @@ static bool search_sync_byte(struct input_parser *p, uint8_t packet_size)
 	}
 }
 
+static bool search_sync_byte_lookahead(struct input_parser *p, uint8_t packet_size)
+{
+	size_t offset;
+
+	for (offset=0; offset < p->lookahead_len; offset += packet_size)
+		if (p->lookahead[offset] != TS_SYNC_BYTE)
+			return false;
+	return p->lookahead_len >= ((size_t) packet_size) * 2;
+}
+
 /**
- * filesrc_create_parser: backend's create() method.
+ * Reads decompressed data, draining the lookahead buffer first.
+ * @return number of bytes read, which is less than @len at the end of the
+ *  stream, or -1 on errors.
  */
-int filesrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
+static ssize_t filesrc_read_compressed(struct input_parser *p, char *buf, size_t len)
 {
-    struct input_parser *p = calloc(1, sizeof(struct input_parser));
-    assert(p);
+	size_t n = 0;
 
-	int ret = fuse_opt_parse(args, p, filesrc_opts, filesrc_parse_opts);
-	if (ret < 0) {
-		free(p);
-		return -1;
+	if (p->lookahead_pos < p->lookahead_len) {
+		n = p->lookahead_len - p->lookahead_pos;
+		if (n > len)
+			n = len;
+		memcpy(buf, &p->lookahead[p->lookahead_pos], n);
+		p->lookahead_pos += n;
 	}
-	if (! p->filesrc) {
-		fprintf(stderr, "Error: missing '-o filesrc=FILE' option\n");
-		free(p);
-		return -1;
+	if (n < len) {
+		ssize_t ret = compressed_source_read(p->compressed, &buf[n], len - n);
+		if (ret < 0)
+			return -1;
+		n += ret;
 	}
-	p->fp = fopen(p->filesrc, "r");
-	if (! p->fp) {
-		perror(p->filesrc);
-		free(p);
+	return n;
+}
+
+/**
+ * Starts decompressing a .ts.gz or .ts.zst capture and reads enough data
+ * to tell the packet size.
+ */
+static int filesrc_open_compressed(struct input_parser *p, const char *path, enum compressed_format format)
+{
+	int threads = p->decompress_threads;
+	ssize_t n;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* Looping is performed by the decompressor */
+	p->compressed = compressed_source_open(path, format, threads, p->fileloop);
+	p->fileloop = 0;
+	if (! p->compressed)
+		return -1;
+
+	p->lookahead = malloc(FILESRC_LOOKAHEAD_SIZE);
+	assert(p->lookahead);
+	n = compressed_source_read(p->compressed, p->lookahead, FILESRC_LOOKAHEAD_SIZE);
+	if (n < 0) {
+		compressed_source_close(p->compressed);
+		free(p->lookahead);
 		return -1;
 	}
+	p->lookahead_len = n;
+	return 0;
+}
+
+/**
+ * Opens @path and detects its packet size.
+ * @return 0 on success or -1 on errors.
+ */
+static int filesrc_open(struct input_parser *p, const char *path, struct demuxfs_data *priv)
+{
+	enum compressed_format format = compressed_source_detect(path);
+	if (format != COMPRESSED_NONE) {
+		if (filesrc_open_compressed(p, path, format) < 0)
+			return -1;
+	} else {
+		p->fp = fopen(path, "r");
+		if (! p->fp) {
+			perror(path);
+			return -1;
+		}
+	}
 
 	/* Search for 188, 204 and 208-byte packets */
 	uint8_t packet_size[] = { 188, 204, 208 };
 	bool found_sync_byte = false;
 	for (int i=0; i<sizeof(packet_size)/sizeof(uint8_t); ++i) {
-		found_sync_byte = search_sync_byte(p, packet_size[i]);
+		if (p->compressed)
+			found_sync_byte = search_sync_byte_lookahead(p, packet_size[i]);
+		else
+			found_sync_byte = search_sync_byte(p, packet_size[i]);
 		if (found_sync_byte) {
 			p->packet_size = packet_size[i];
 			break;
 		}
 	}
 	if (! found_sync_byte) {
-		fprintf(stderr, "Error: %s doesn't seem to be a valid transport stream.\n", p->filesrc);
-		fclose(p->fp);
-		free(p);
+		fprintf(stderr, "Error: %s doesn't seem to be a valid transport stream.\n", path);
+		if (p->compressed) {
+			compressed_source_close(p->compressed);
+			free(p->lookahead);
+			p->compressed = NULL;
+			p->lookahead = NULL;
+		} else
+			fclose(p->fp);
+		p->fp = NULL;
 		return -1;
 	}
-	p->packet = (char *) malloc(p->packet_size * sizeof(char));
 
 	/* Configure packet size */
 	priv->options.packet_size = p->packet_size;
 	priv->options.packet_error_correction_bytes = p->packet_size - 188;
+	return 0;
+}
+
+static void filesrc_close(struct input_parser *p)
+{
+	if (p->compressed) {
+		compressed_source_close(p->compressed);
+		free(p->lookahead);
+		p->compressed = NULL;
+		p->lookahead = NULL;
+		p->lookahead_len = p->lookahead_pos = 0;
+	} else if (p->fp)
+		fclose(p->fp);
+	p->fp = NULL;
+}
+
+/**
+ * filesrc_create_parser: backend's create() method.
+ */
+int filesrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
+{
+    struct input_parser *p = calloc(1, sizeof(struct input_parser));
+    assert(p);
+
+	int ret = fuse_opt_parse(args, p, filesrc_opts, filesrc_parse_opts);
+	if (ret < 0) {
+		free(p);
+		return -1;
+	}
+	if (! p->filesrc && ! priv->options.scan_sources) {
+		fprintf(stderr, "Error: missing '-o filesrc=FILE' option\n");
+		free(p);
+		return -1;
+	}
+	/* In scan mode the files are opened by set_source() */
+	if (p->filesrc && filesrc_open(p, p->filesrc, priv) < 0) {
+		free(p);
+		return -1;
+	}
+	/* Large enough for any packet size, as set_source() may switch to another file */
+	p->packet = (char *) malloc(FILESRC_MAX_PACKET_SIZE * sizeof(char));
+	p->batch = (uint8_t *) malloc(TS_BATCH_PACKETS * FILESRC_MAX_PACKET_SIZE);
 
 	priv->parser = p;
 	return 0;
@@ -161,10 +283,26 @@ int filesrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
 int filesrc_destroy_parser(struct demuxfs_data *priv)
 {
 	free(priv->parser->packet);
-	fclose(priv->parser->fp);
+	free(priv->parser->batch);
+	filesrc_close(priv->parser);
     free(priv->parser);
 	return 0;
 }
+
+/**
+ * filesrc_set_source: backend's set_source() method.
+ */
+int filesrc_set_source(const char *path, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+
+	filesrc_close(p);
+	/* Scanned files are read once */
+	p->fileloop = 0;
+	if (filesrc_open(p, path, priv) < 0)
+		return -ENOENT;
+	return 0;
+}
 	
 /**
  * filesrc_set_frequency: no-op.
@@ -184,6 +322,15 @@ int filesrc_set_frequency(uint32_t frequency, struct demuxfs_data *priv)
 int filesrc_read_packet(struct demuxfs_data *priv)
 {
 	struct input_parser *p = priv->parser;
+
+	if (p->compressed) {
+		ssize_t n = filesrc_read_compressed(p, p->packet, p->packet_size);
+		p->packet_valid = n == p->packet_size;
+		if (n < 0)
+			return -1;
+		return p->packet_valid ? 0 : -ENODATA;
+	}
+
 	size_t n = fread(p->packet, p->packet_size, 1, p->fp);
 	if (n <= 0 && feof(p->fp)) {
 		p->packet_valid = false;
@@ -215,17 +362,47 @@ int filesrc_process_packet(struct ts_header *header, void **payload, struct demu
 		return -EINVAL;
 
 	*payload = (void *) &p->packet[4];
+	ts_decode_header((const uint8_t *) p->packet, header);
+	return 0;
+}
+
+/**
+ * filesrc_read_batch: backend's read_batch() method.
+ * @return number of packets read, -1 on error and -ENODATA if there's no
+ *  more data to be read.
+ */
+int filesrc_read_batch(struct demuxfs_data *priv, const uint8_t **packets, size_t max_packets)
+{
+	struct input_parser *p = priv->parser;
+	size_t n;
 
-	header->sync_byte                    =  p->packet[0];
-	header->transport_error_indicator    = (p->packet[1] >> 7) & 0x01;
-	header->payload_unit_start_indicator = (p->packet[1] >> 6) & 0x01;
-	header->transport_priority           = (p->packet[1] >> 5) & 0x01;
-	header->pid                          = CONVERT_TO_16(p->packet[1], p->packet[2]) & 0x1fff;
-	header->transport_scrambling_control = (p->packet[3] >> 6) & 0x03;
-	header->adaptation_field             = (p->packet[3] >> 4) & 0x03;
-	header->continuity_counter           = (p->packet[3]) & 0x0f;
+	if (max_packets > TS_BATCH_PACKETS)
+		max_packets = TS_BATCH_PACKETS;
 
-	return 0;
+	if (p->compressed) {
+		/* Only short at the end of the stream, where a partial packet is dropped */
+		ssize_t len = filesrc_read_compressed(p, (char *) p->batch, max_packets * p->packet_size);
+		if (len < 0)
+			return -1;
+		n = len / p->packet_size;
+		if (n == 0)
+			return -ENODATA;
+	} else {
+		n = fread(p->batch, p->packet_size, max_packets, p->fp);
+		if (n < max_packets && feof(p->fp)) {
+			/* Rewind right away, as keep_alive() checks for EOF */
+			if (p->fileloop == -1 || p->fileloop--) {
+				dprintf("Rewinding TS file");
+				rewind(p->fp);
+			} else if (n == 0)
+				return -ENODATA;
+		} else if (n == 0) {
+			perror("fread");
+			return -1;
+		}
+	}
+	*packets = p->batch;
+	return n;
 }
 
 /**
@@ -233,7 +410,13 @@ int filesrc_process_packet(struct ts_header *header, void **payload, struct demu
  */
 bool filesrc_keep_alive(struct demuxfs_data *priv)
 {
-	return !feof(priv->parser->fp);
+	struct input_parser *p = priv->parser;
+
+	if (p->compressed)
+		return p->lookahead_pos < p->lookahead_len || ! compressed_source_eof(p->compressed);
+	if (! p->fp)
+		return false;
+	return !feof(p->fp);
 }
 
 struct backend_ops filesrc_backend_ops = {
@@ -242,6 +425,8 @@ struct backend_ops filesrc_backend_ops = {
 	.set_frequency = filesrc_set_frequency,
     .read = filesrc_read_packet,
     .process = filesrc_process_packet,
+	.read_batch = filesrc_read_batch,
+	.set_source = filesrc_set_source,
     .keep_alive = filesrc_keep_alive,
 	.usage = filesrc_usage,
 };
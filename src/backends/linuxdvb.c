@@ -41,6 +41,8 @@
 #define LINUXDVB_DEFAULT_SYMBOL_RATE      0
 #define LINUXDVB_DEFAULT_QPSK_VOLTAGE     13
 #define LINUXDVB_DEFAULT_QPSK_TONE        0
+#define LINUXDVB_DEFAULT_BUFFER_SIZE      (188 * 16384)
+#define LINUXDVB_LOCK_TIMEOUT             10
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3,0,0)
 #undef  DVB_API_VERSION
@@ -55,12 +57,25 @@ struct input_parser {
 	int qpsk_voltage;
 	int symbol_rate;
 	int qpsk_tone;
+	int buffer_size;
+	int full_ts;
 	int frontend_fd;
 	int demux_fd;
 	int dvr_fd;
 	char *packet;
 	bool packet_valid;
 	uint8_t packet_size;
+	uint8_t *batch;         /**< Packets returned by read_batch() */
+	size_t batch_len;       /**< Bytes of complete packets handed out by the last read_batch() */
+	size_t batch_partial;   /**< Bytes of an incomplete packet that follow them */
+	bool pid_filters[TS_NULL_PID];  /**< PIDs routed to the DVR device */
+};
+
+/* PIDs of the tables parsed without being announced by the PAT or a PMT */
+static const uint16_t linuxdvb_psi_pids[] = {
+	TS_PAT_PID, TS_CAT_PID, TS_NIT_PID, TS_SDT_PID, TS_H_EIT_PID, TS_M_EIT_PID,
+	TS_L_EIT_PID, TS_RST_PID, TS_TDT_PID, TS_DCT_PID, TS_DIT_PID, TS_SIT_PID,
+	TS_PCAT_PID, TS_SDTT1_PID, TS_SDTT2_PID, TS_BIT_PID, TS_NBIT_PID, TS_CDT_PID,
 };
 
 static int linuxdvb_set_frequency_v3(uint32_t frequency, struct demuxfs_data *priv);
@@ -78,14 +93,17 @@ void linuxdvb_usage(void)
 			"    -o frequency=FREQ        Frequency (default=%d -- do not configure frontend)\n"
 			"    -o symbol_rate=RATE      Symbol rate (default=%d)\n"
 			"    -o qpsk_voltage=<13|18>  QPSK voltage (default=%d)\n"
-			"    -o qpsk_tone=<1|0>       QPSK tone (default=%d)\n",
+			"    -o qpsk_tone=<1|0>       QPSK tone (default=%d)\n"
+			"    -o buffer_size=BYTES     DVR ring buffer size (default=%d)\n"
+			"    -o full_ts               route every PID to the DVR rather than only the parsed ones\n",
 			LINUXDVB_DEFAULT_FRONTEND_DEVICE,
 			LINUXDVB_DEFAULT_DEMUX_DEVICE,
 			LINUXDVB_DEFAULT_DVR_DEVICE,
 			LINUXDVB_DEFAULT_FREQUENCY,
 			LINUXDVB_DEFAULT_SYMBOL_RATE,
 			LINUXDVB_DEFAULT_QPSK_VOLTAGE,
-			LINUXDVB_DEFAULT_QPSK_TONE
+			LINUXDVB_DEFAULT_QPSK_TONE,
+			LINUXDVB_DEFAULT_BUFFER_SIZE
 			);
 }
 
@@ -99,6 +117,8 @@ static struct fuse_opt linuxdvb_opts[] = {
 	LINUXDVB_OPT("symbol_rate=%d", symbol_rate, 0),
 	LINUXDVB_OPT("qpsk_voltage=%d", qpsk_voltage, 0),
 	LINUXDVB_OPT("qpsk_tone=%d", qpsk_tone, 0),
+	LINUXDVB_OPT("buffer_size=%d", buffer_size, 0),
+	LINUXDVB_OPT("full_ts", full_ts, 1),
 	FUSE_OPT_END
 };
 
@@ -200,6 +220,9 @@ int linuxdvb_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
 	if (! p->qpsk_tone)
 		p->qpsk_tone = LINUXDVB_DEFAULT_QPSK_TONE;
 
+	if (! p->buffer_size)
+		p->buffer_size = LINUXDVB_DEFAULT_BUFFER_SIZE;
+
 	if (p->qpsk_voltage != 13 && p->qpsk_voltage != 18) {
 		fprintf(stderr, "Invalid value '%d' for qpsk_voltage\n", p->qpsk_voltage);
 		ret = -EINVAL;
@@ -215,8 +238,8 @@ int linuxdvb_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
 	if (p->frequency < 1000000)
 		p->frequency *=1000;
 
-	/* Open the frontend device if a non-zero frequency has been set */
-	if (p->frequency) {
+	/* Open the frontend device if a non-zero frequency has been set or if scanning */
+	if (p->frequency || priv->options.scan_sources) {
 		p->frontend_fd = open(p->frontend_device, O_RDWR);
 		if (p->frontend_fd < 0) {
 			perror(p->frontend_device);
@@ -242,23 +265,55 @@ int linuxdvb_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
 		goto out_free;
 	}
 
+	/* The DVR ring must be sized before the filter is started */
+	ret = ioctl(p->dvr_fd, DMX_SET_BUFFER_SIZE, (unsigned long) p->buffer_size);
+	if (ret < 0)
+		perror("DMX_SET_BUFFER_SIZE");
+
+	/*
+	 * Unless the full transport stream was requested, the filter starts with
+	 * the PAT and further PIDs are added as the tables that announce them are
+	 * parsed and as readers come and go. PID 0x2000 routes every packet.
+	 */
 	struct dmx_pes_filter_params pes_filter;
 	memset(&pes_filter, 0, sizeof(pes_filter));
-	pes_filter.pid      = 0x2000;
+	pes_filter.pid      = p->full_ts ? 0x2000 : TS_PAT_PID;
 	pes_filter.input    = DMX_IN_FRONTEND;
 	pes_filter.output   = DMX_OUT_TS_TAP;
 	pes_filter.pes_type = DMX_PES_OTHER;
-	pes_filter.flags    = DMX_IMMEDIATE_START;
+	pes_filter.flags    = 0;
 
 	ret = ioctl(p->demux_fd, DMX_SET_PES_FILTER, &pes_filter);
 	if (ret < 0) {
 		perror("DMX_SET_PES_FILTER");
+		ret = -errno;
 		goto out_free;
 	}
-	
+
+	if (! p->full_ts) {
+		p->pid_filters[TS_PAT_PID] = true;
+		for (size_t i=1; i<sizeof(linuxdvb_psi_pids)/sizeof(linuxdvb_psi_pids[0]); ++i) {
+			uint16_t pid = linuxdvb_psi_pids[i];
+			if (ioctl(p->demux_fd, DMX_ADD_PID, &pid) < 0) {
+				perror("DMX_ADD_PID");
+				continue;
+			}
+			p->pid_filters[pid] = true;
+		}
+	}
+
+	ret = ioctl(p->demux_fd, DMX_START);
+	if (ret < 0) {
+		perror("DMX_START");
+		ret = -errno;
+		goto out_free;
+	}
+
+
 	/* Configure the packet size */
 	p->packet_size = 188;
 	p->packet = (char *) malloc(p->packet_size);
+	p->batch = (uint8_t *) malloc(TS_BATCH_PACKETS * p->packet_size);
 
 	/* Propagate user options back to the caller */
 	priv->options.packet_size = p->packet_size;
@@ -296,10 +351,24 @@ int linuxdvb_destroy_parser(struct demuxfs_data *priv)
 	close(p->demux_fd);
 	close(p->dvr_fd);
 	free(p->packet);
+	free(p->batch);
 	free(p);
 	return 0;
 }
 
+/* Drops whatever the DVR device has buffered */
+static void linuxdvb_flush_dvr(struct input_parser *p)
+{
+	int flags = fcntl(p->dvr_fd, F_GETFL);
+
+	if (flags < 0 || fcntl(p->dvr_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return;
+	while (read(p->dvr_fd, p->batch, TS_BATCH_PACKETS * p->packet_size) > 0)
+		continue;
+	fcntl(p->dvr_fd, F_SETFL, flags);
+	p->batch_len = p->batch_partial = 0;
+}
+
 #define DECLARE_PROPERTY(varname,command) \
 	struct dtv_properties varname; \
 	struct dtv_property varname ## _ ## command; \
@@ -344,15 +413,31 @@ int linuxdvb_set_frequency(uint32_t frequency, struct demuxfs_data *priv)
 	if (p->frontend_fd < 0)
 		return 0;
 
+	if (frequency < 1000000)
+		frequency *= 1000;
+	p->frequency = frequency;
+
+	/* Packets of the previous multiplex must not reach the parsers */
+	if (ioctl(p->demux_fd, DMX_STOP) < 0)
+		perror("DMX_STOP");
+	linuxdvb_flush_dvr(p);
+
 	DECLARE_PROPERTY(properties, DTV_API_VERSION);
 	ret = ioctl(p->frontend_fd, FE_GET_PROPERTY, &properties);
 	if (ret == 0 && (properties.props[0].u.data & 0x500) == 0x500) {
 		fprintf(stderr, "APIv5\n");
-		return linuxdvb_set_frequency_v5(frequency, priv);
+		ret = linuxdvb_set_frequency_v5(frequency, priv);
 	} else {
 		fprintf(stderr, "APIv3\n");
-		return linuxdvb_set_frequency_v3(frequency, priv);
+		ret = linuxdvb_set_frequency_v3(frequency, priv);
 	}
+
+	if (ioctl(p->demux_fd, DMX_START) < 0) {
+		perror("DMX_START");
+		if (ret == 0)
+			ret = -errno;
+	}
+	return ret;
 }
 
 static int linuxdvb_set_frequency_v3(uint32_t frequency, struct demuxfs_data *priv)
@@ -558,9 +643,10 @@ static int linuxdvb_set_frequency_v5(uint32_t frequency, struct demuxfs_data *pr
 		return -errno;
 	}
 
+	/* Polled every 100ms so that the scan mode moves on as soon as there's a lock */
 	fe_status_t status;
 	char fe_status[256]; 
-	while (true) {
+	for (int i=0; i<LINUXDVB_LOCK_TIMEOUT*10; ++i) {
 		ret = ioctl(p->frontend_fd, FE_READ_STATUS, &status);
 		if (ret < 0) {
 			perror("FE_READ_STATUS");
@@ -570,9 +656,11 @@ static int linuxdvb_set_frequency_v5(uint32_t frequency, struct demuxfs_data *pr
 			fprintf(stderr, "Tuner successfully set to frequency %d\n", p->frequency);
 			return 0;
 		}
-		linuxdvb_get_frontend_status(status, fe_status, sizeof(fe_status));
-		fprintf(stdout, "Waiting to get a lock on the frontend... (status=%s)\n", fe_status);
-		usleep(1000000);
+		if (i % 10 == 0) {
+			linuxdvb_get_frontend_status(status, fe_status, sizeof(fe_status));
+			fprintf(stdout, "Waiting to get a lock on the frontend... (status=%s)\n", fe_status);
+		}
+		usleep(100000);
 	}
 
 	fprintf(stderr, "Timed out tuning to frequency %d\n", p->frequency);
@@ -606,16 +694,66 @@ int linuxdvb_process_packet(struct ts_header *header, void **payload, struct dem
 		return -EINVAL;
 
 	*payload = (void *) &p->packet[4];
+	ts_decode_header((const uint8_t *) p->packet, header);
+	return 0;
+}
+
+/**
+ * linuxdvb_read_batch: backend's read_batch() method. Drains as many packets
+ * as the DVR device has buffered, up to @max_packets, with a single read().
+ */
+int linuxdvb_read_batch(struct demuxfs_data *priv, const uint8_t **packets, size_t max_packets)
+{
+	struct input_parser *p = priv->parser;
+	ssize_t n;
+
+	if (max_packets > TS_BATCH_PACKETS)
+		max_packets = TS_BATCH_PACKETS;
+	if (p->batch_partial)
+		memmove(p->batch, &p->batch[p->batch_len], p->batch_partial);
+
+	n = read(p->dvr_fd, &p->batch[p->batch_partial], max_packets * p->packet_size - p->batch_partial);
+	if (n <= 0) {
+		p->batch_len = 0;
+		return 0;
+	}
+	n += p->batch_partial;
+	p->batch_len = n - n % p->packet_size;
+	p->batch_partial = n % p->packet_size;
+
+	*packets = p->batch;
+	return p->batch_len / p->packet_size;
+}
+
+static bool linuxdvb_is_psi_pid(uint16_t pid)
+{
+	for (size_t i=0; i<sizeof(linuxdvb_psi_pids)/sizeof(linuxdvb_psi_pids[0]); ++i)
+		if (linuxdvb_psi_pids[i] == pid)
+			return true;
+	return false;
+}
+
+/**
+ * linuxdvb_set_pid_filter: backend's set_pid_filter() method. Requests are
+ * counted by ts_request_pid(), so this is only called when the first owner
+ * of a PID comes and when the last one goes.
+ */
+int linuxdvb_set_pid_filter(uint16_t pid, bool enable, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	int ret;
 
-	header->sync_byte                    =  p->packet[0];
-	header->transport_error_indicator    = (p->packet[1] >> 7) & 0x01;
-	header->payload_unit_start_indicator = (p->packet[1] >> 6) & 0x01;
-	header->transport_priority           = (p->packet[1] >> 5) & 0x01;
-	header->pid                          = CONVERT_TO_16(p->packet[1], p->packet[2]) & 0x1fff;
-	header->transport_scrambling_control = (p->packet[3] >> 6) & 0x03;
-	header->adaptation_field             = (p->packet[3] >> 4) & 0x03;
-	header->continuity_counter           = (p->packet[3]) & 0x0f;
+	/* The PIDs of the PAT and of the other fixed tables stay in place */
+	if (p->full_ts || pid >= TS_NULL_PID || linuxdvb_is_psi_pid(pid) || p->pid_filters[pid] == enable)
+		return 0;
 
+	ret = ioctl(p->demux_fd, enable ? DMX_ADD_PID : DMX_REMOVE_PID, &pid);
+	if (ret < 0) {
+		ret = -errno;
+		fprintf(stderr, "Failed to %s PID %#x: %s\n", enable ? "add" : "remove", pid, strerror(errno));
+		return ret;
+	}
+	p->pid_filters[pid] = enable;
 	return 0;
 }
 
@@ -628,13 +766,15 @@ bool linuxdvb_keep_alive(struct demuxfs_data *priv)
 }
 
 struct backend_ops linuxdvb_backend_ops = {
-	.create        = linuxdvb_create_parser,
-	.destroy       = linuxdvb_destroy_parser,
-	.set_frequency = linuxdvb_set_frequency,
-	.read          = linuxdvb_read_packet,
-	.process       = linuxdvb_process_packet,
-	.keep_alive    = linuxdvb_keep_alive,
-	.usage         = linuxdvb_usage,
+	.create         = linuxdvb_create_parser,
+	.destroy        = linuxdvb_destroy_parser,
+	.set_frequency  = linuxdvb_set_frequency,
+	.read           = linuxdvb_read_packet,
+	.process        = linuxdvb_process_packet,
+	.read_batch     = linuxdvb_read_batch,
+	.set_pid_filter = linuxdvb_set_pid_filter,
+	.keep_alive     = linuxdvb_keep_alive,
+	.usage          = linuxdvb_usage,
 };
 
 struct backend_ops *backend_get_ops(void)
@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "pcapsrc.h"
+#include "byteops.h"
+#include "backend.h"
+#include "rtp.h"
+#include "ts.h"
+#include "stats.h"
+
+/* Largest capture record we are willing to handle */
+#define PCAPSRC_MAX_RECORD_SIZE (256 * 1024)
+
+/* Maximum number of interfaces described in a pcapng section */
+#define PCAPSRC_MAX_INTERFACES 32
+
+enum pcap_format {
+	FORMAT_PCAP,
+	FORMAT_PCAPNG,
+};
+
+struct input_parser {
+	char *pcapsrc;				/**< Capture file (cmdline option) */
+	int udp_port;				/**< Only consider datagrams sent to this UDP port (cmdline option) */
+	int rtp_reorder;			/**< RTP reorder window, in datagrams (cmdline option) */
+	FILE *fp;					/**< Capture file handle */
+	enum pcap_format format;	/**< Capture file format */
+	bool swapped;				/**< True if the capture has a different endianness than ours */
+	uint16_t linktype;			/**< Link-layer type (classic pcap) */
+	uint16_t if_linktype[PCAPSRC_MAX_INTERFACES]; /**< Link-layer type of each interface (pcapng) */
+	int num_interfaces;			/**< Number of interfaces in the current pcapng section */
+	char *record;				/**< Current capture record */
+	bool eof;					/**< True once the capture has been fully read */
+
+	/* Selected UDP flow; the first one carrying TS is used unless udp_port is given */
+	bool flow_locked;
+	uint8_t flow_dst[16];
+	uint16_t flow_dst_port;
+
+	struct rtp_reorder *reorder;/**< RTP reorder window */
+	const char *packet;			/**< Current TS packet being processed */
+	bool packet_valid;			/**< True if TS packet is valid, False if it's not */
+	uint8_t packet_size;		/**< Packet size (always 188) */
+};
+
+/**
+ * Command line parsing routines.
+ */
+void pcapsrc_usage(void)
+{
+	fprintf(stderr, "\nPCAPSRC options:\n"
+			"    -o pcapsrc=FILE          pcap or pcapng capture of UDP or RTP encapsulated TS\n"
+			"    -o udp_port=PORT         only use datagrams sent to this UDP port (default: first flow with TS)\n"
+			"    -o rtp_reorder=<count>   RTP reorder window, in datagrams (default: %d)\n",
+			RTP_DEFAULT_REORDER_DEPTH);
+}
+
+#define PCAPSRC_OPT(templ,offset,value) { templ, offsetof(struct input_parser, offset), value }
+
+static struct fuse_opt pcapsrc_opts[] = {
+	PCAPSRC_OPT("pcapsrc=%s",     pcapsrc, 0),
+	PCAPSRC_OPT("udp_port=%d",    udp_port, 0),
+	PCAPSRC_OPT("rtp_reorder=%d", rtp_reorder, 0),
+	FUSE_OPT_END
+};
+
+static int pcapsrc_parse_opts(void *priv, const char *arg, int key, struct fuse_args *outargs)
+{
+	return 1;
+}
+
+static inline uint32_t pcapsrc_u32(struct input_parser *p, uint32_t value)
+{
+	return p->swapped ? bswap_32(value) : value;
+}
+
+static inline uint16_t pcapsrc_u16(struct input_parser *p, uint16_t value)
+{
+	return p->swapped ? bswap_16(value) : value;
+}
+
+static bool pcapsrc_read_exact(struct input_parser *p, void *buf, size_t len)
+{
+	if (fread(buf, len, 1, p->fp) == 1)
+		return true;
+	if (ferror(p->fp))
+		perror("fread");
+	return false;
+}
+
+static int pcapsrc_read_file_header(struct input_parser *p)
+{
+	uint32_t magic;
+	uint8_t header[24];
+
+	if (! pcapsrc_read_exact(p, header, sizeof(header)))
+		return -1;
+	memcpy(&magic, header, sizeof(magic));
+
+	if (magic == PCAP_MAGIC_USEC || magic == PCAP_MAGIC_NSEC ||
+		magic == bswap_32(PCAP_MAGIC_USEC) || magic == bswap_32(PCAP_MAGIC_NSEC)) {
+		uint32_t linktype;
+		p->format = FORMAT_PCAP;
+		p->swapped = magic == bswap_32(PCAP_MAGIC_USEC) || magic == bswap_32(PCAP_MAGIC_NSEC);
+		memcpy(&linktype, &header[20], sizeof(linktype));
+		p->linktype = pcapsrc_u32(p, linktype) & 0xffff;
+		return 0;
+	} else if (magic == PCAPNG_SECTION_HEADER) {
+		uint32_t byte_order, block_len;
+		p->format = FORMAT_PCAPNG;
+		memcpy(&byte_order, &header[8], sizeof(byte_order));
+		p->swapped = byte_order == bswap_32(PCAPNG_BYTE_ORDER_MAGIC);
+		memcpy(&block_len, &header[4], sizeof(block_len));
+		block_len = pcapsrc_u32(p, block_len);
+		/* Skip the remainder of the section header block */
+		if (block_len < sizeof(header) || fseek(p->fp, block_len - sizeof(header), SEEK_CUR) < 0)
+			return -1;
+		return 0;
+	}
+	return -1;
+}
+
+/**
+ * Reads the next capture record holding a link-layer frame.
+ * @return length of the frame, 0 at the end of the capture or -1 on errors.
+ */
+static ssize_t pcapsrc_read_record(struct input_parser *p, uint16_t *linktype)
+{
+	if (p->format == FORMAT_PCAP) {
+		uint32_t header[4], caplen;
+		if (! pcapsrc_read_exact(p, header, sizeof(header)))
+			return ferror(p->fp) ? -1 : 0;
+		caplen = pcapsrc_u32(p, header[2]);
+		if (caplen > PCAPSRC_MAX_RECORD_SIZE) {
+			fprintf(stderr, "Error: capture record too large (%u bytes)\n", caplen);
+			return -1;
+		}
+		if (! pcapsrc_read_exact(p, p->record, caplen))
+			return ferror(p->fp) ? -1 : 0;
+		*linktype = p->linktype;
+		return caplen;
+	}
+
+	while (true) {
+		uint32_t header[2], type, block_len, body_len, caplen, interface_id;
+		if (! pcapsrc_read_exact(p, header, sizeof(header)))
+			return ferror(p->fp) ? -1 : 0;
+		type = header[0];
+		if (type == PCAPNG_SECTION_HEADER) {
+			/* A new section may have a different byte order */
+			uint32_t byte_order;
+			if (! pcapsrc_read_exact(p, &byte_order, sizeof(byte_order)))
+				return ferror(p->fp) ? -1 : 0;
+			p->swapped = byte_order == bswap_32(PCAPNG_BYTE_ORDER_MAGIC);
+			p->num_interfaces = 0;
+			block_len = pcapsrc_u32(p, header[1]);
+			if (block_len < 12 || fseek(p->fp, block_len - 12, SEEK_CUR) < 0)
+				return -1;
+			continue;
+		}
+
+		type = pcapsrc_u32(p, type);
+		block_len = pcapsrc_u32(p, header[1]);
+		if (block_len < 12 || block_len - 12 > PCAPSRC_MAX_RECORD_SIZE) {
+			fprintf(stderr, "Error: invalid pcapng block length %u\n", block_len);
+			return -1;
+		}
+		/* Block body, followed by the trailing copy of the block length */
+		body_len = block_len - 12;
+		if (! pcapsrc_read_exact(p, p->record, body_len + 4))
+			return ferror(p->fp) ? -1 : 0;
+
+		switch (type) {
+			case PCAPNG_INTERFACE_DESC:
+				if (p->num_interfaces < PCAPSRC_MAX_INTERFACES && body_len >= 2) {
+					uint16_t value;
+					memcpy(&value, p->record, sizeof(value));
+					p->if_linktype[p->num_interfaces++] = pcapsrc_u16(p, value);
+				}
+				continue;
+			case PCAPNG_ENHANCED_PACKET:
+			case PCAPNG_PACKET:
+				if (body_len < 20)
+					continue;
+				if (type == PCAPNG_ENHANCED_PACKET) {
+					memcpy(&interface_id, p->record, sizeof(interface_id));
+					interface_id = pcapsrc_u32(p, interface_id);
+				} else {
+					uint16_t value;
+					memcpy(&value, p->record, sizeof(value));
+					interface_id = pcapsrc_u16(p, value);
+				}
+				memcpy(&caplen, &p->record[12], sizeof(caplen));
+				caplen = pcapsrc_u32(p, caplen);
+				if (interface_id >= p->num_interfaces || caplen > body_len - 20)
+					continue;
+				memmove(p->record, &p->record[20], caplen);
+				*linktype = p->if_linktype[interface_id];
+				return caplen;
+			case PCAPNG_SIMPLE_PACKET:
+				if (body_len < 4 || p->num_interfaces == 0)
+					continue;
+				memcpy(&caplen, p->record, sizeof(caplen));
+				caplen = pcapsrc_u32(p, caplen);
+				if (caplen > body_len - 4)
+					caplen = body_len - 4;
+				memmove(p->record, &p->record[4], caplen);
+				*linktype = p->if_linktype[0];
+				return caplen;
+			default:
+				continue;
+		}
+	}
+}
+
+/**
+ * Strips the link-layer, IP and UDP headers from a captured frame.
+ * @return a pointer to the UDP payload or NULL if the frame doesn't hold a
+ *  UDP datagram of the selected flow.
+ */
+static const char *pcapsrc_get_udp_payload(struct input_parser *p, const uint8_t *frame, size_t len,
+		uint16_t linktype, size_t *payload_len)
+{
+	const uint8_t *ip, *udp, *dst;
+	uint16_t ethertype, dst_port, udp_len;
+	size_t offset, dst_len;
+	uint8_t version;
+
+	switch (linktype) {
+		case LINKTYPE_ETHERNET:
+			if (len < 14)
+				return NULL;
+			ethertype = CONVERT_TO_16(frame[12], frame[13]);
+			offset = 14;
+			while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) && len >= offset + 4) {
+				ethertype = CONVERT_TO_16(frame[offset+2], frame[offset+3]);
+				offset += 4;
+			}
+			if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6)
+				return NULL;
+			break;
+		case LINKTYPE_LINUX_SLL:
+			offset = 16;
+			break;
+		case LINKTYPE_LINUX_SLL2:
+			offset = 20;
+			break;
+		case LINKTYPE_NULL:
+			offset = 4;
+			break;
+		case LINKTYPE_RAW:
+			offset = 0;
+			break;
+		default:
+			return NULL;
+	}
+	if (len <= offset)
+		return NULL;
+
+	ip = &frame[offset];
+	len -= offset;
+	version = ip[0] >> 4;
+	if (version == 4) {
+		size_t ihl = (ip[0] & 0x0f) * 4;
+		uint16_t fragment = CONVERT_TO_16(ip[6], ip[7]);
+		/* Fragmented datagrams are not reassembled */
+		if (len < 20 || ihl < 20 || len < ihl || ip[9] != IPPROTO_UDP_NUMBER || (fragment & 0x3fff))
+			return NULL;
+		udp = &ip[ihl];
+		len -= ihl;
+		dst = &ip[16];
+		dst_len = 4;
+	} else if (version == 6) {
+		if (len < 40 || ip[6] != IPPROTO_UDP_NUMBER)
+			return NULL;
+		udp = &ip[40];
+		len -= 40;
+		dst = &ip[24];
+		dst_len = 16;
+	} else
+		return NULL;
+
+	if (len < 8)
+		return NULL;
+	dst_port = CONVERT_TO_16(udp[2], udp[3]);
+	udp_len = CONVERT_TO_16(udp[4], udp[5]);
+	if (udp_len < 8 || udp_len > len)
+		return NULL;
+	if (p->udp_port && dst_port != p->udp_port)
+		return NULL;
+	if (p->flow_locked && (dst_port != p->flow_dst_port || memcmp(dst, p->flow_dst, dst_len)))
+		return NULL;
+
+	*payload_len = udp_len - 8;
+	if (! p->flow_locked) {
+		/* Lock on the first flow that looks like TS */
+		size_t ts_len;
+		uint16_t seq;
+		bool is_rtp;
+		if (! rtp_get_ts_payload((const char *) &udp[8], *payload_len, &ts_len, &seq, &is_rtp))
+			return NULL;
+		memset(p->flow_dst, 0, sizeof(p->flow_dst));
+		memcpy(p->flow_dst, dst, dst_len);
+		p->flow_dst_port = dst_port;
+		p->flow_locked = true;
+		dprintf("Using %s TS flow to UDP port %d", is_rtp ? "RTP" : "UDP", dst_port);
+	}
+	return (const char *) &udp[8];
+}
+
+/**
+ * pcapsrc_create_parser: backend's create() method.
+ */
+int pcapsrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
+{
+	struct input_parser *p = calloc(1, sizeof(struct input_parser));
+	assert(p);
+
+	p->rtp_reorder = RTP_DEFAULT_REORDER_DEPTH;
+	int ret = fuse_opt_parse(args, p, pcapsrc_opts, pcapsrc_parse_opts);
+	if (ret < 0) {
+		free(p);
+		return -1;
+	}
+	if (! p->pcapsrc) {
+		fprintf(stderr, "Error: missing '-o pcapsrc=FILE' option\n");
+		free(p);
+		return -1;
+	}
+	p->fp = fopen(p->pcapsrc, "r");
+	if (! p->fp) {
+		perror(p->pcapsrc);
+		free(p);
+		return -1;
+	}
+	if (pcapsrc_read_file_header(p) < 0) {
+		fprintf(stderr, "Error: %s doesn't seem to be a pcap or pcapng capture.\n", p->pcapsrc);
+		fclose(p->fp);
+		free(p);
+		return -1;
+	}
+	p->record = malloc(PCAPSRC_MAX_RECORD_SIZE + 4);
+	assert(p->record);
+	p->reorder = rtp_reorder_new(p->rtp_reorder, priv);
+
+	/* Configure packet size */
+	p->packet_size = 188;
+	priv->options.packet_size = p->packet_size;
+	priv->options.packet_error_correction_bytes = 0;
+
+	priv->parser = p;
+	return 0;
+}
+
+/**
+ * pcapsrc_destroy_parser: backend's destroy() method.
+ */
+int pcapsrc_destroy_parser(struct demuxfs_data *priv)
+{
+	rtp_reorder_destroy(priv->parser->reorder);
+	free(priv->parser->record);
+	fclose(priv->parser->fp);
+	free(priv->parser);
+	return 0;
+}
+
+/**
+ * pcapsrc_set_frequency: no-op.
+ */
+int pcapsrc_set_frequency(uint32_t frequency, struct demuxfs_data *priv)
+{
+	(void) frequency;
+	(void) priv;
+	return -ENOSYS;
+}
+
+/**
+ * pcapsrc_read_packet: backend's read() method.
+ * @return 0 on success, -1 on error and -ENODATA if there's no more
+ *  data to be read.
+ */
+int pcapsrc_read_packet(struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+
+	while (! (p->packet = rtp_reorder_next_packet(p->reorder, p->packet_size))) {
+		uint16_t linktype, seq;
+		size_t udp_len, ts_len;
+		const char *udp, *ts;
+		bool is_rtp;
+		ssize_t n;
+
+		if (p->eof) {
+			p->packet_valid = false;
+			return -ENODATA;
+		}
+		n = pcapsrc_read_record(p, &linktype);
+		if (n < 0) {
+			p->packet_valid = false;
+			return -1;
+		} else if (n == 0) {
+			p->eof = true;
+			rtp_reorder_flush(p->reorder);
+			continue;
+		}
+		if (priv->latency)
+			priv->latency->packet_ingest_ns = stats_now();
+		udp = pcapsrc_get_udp_payload(p, (const uint8_t *) p->record, n, linktype, &udp_len);
+		if (! udp)
+			continue;
+		ts = rtp_get_ts_payload(udp, udp_len, &ts_len, &seq, &is_rtp);
+		if (! ts)
+			continue;
+		rtp_reorder_push(p->reorder, ts, ts_len - (ts_len % p->packet_size), seq, is_rtp);
+	}
+	p->packet_valid = true;
+	return 0;
+}
+
+/**
+ * pcapsrc_process_packet: backend's process() method.
+ */
+int pcapsrc_process_packet(struct ts_header *header, void **payload, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	const char *packet = p->packet;
+
+	if (! p->packet_valid)
+		return -EINVAL;
+	else if (! header || ! payload)
+		return -EINVAL;
+
+	*payload = (void *) &packet[4];
+	ts_decode_header((const uint8_t *) packet, header);
+	return 0;
+}
+
+/**
+ * pcapsrc_keep_alive: backend's keep_alive() method.
+ */
+bool pcapsrc_keep_alive(struct demuxfs_data *priv)
+{
+	return ! priv->parser->eof || priv->parser->packet_valid;
+}
+
+struct backend_ops pcapsrc_backend_ops = {
+	.create = pcapsrc_create_parser,
+	.destroy = pcapsrc_destroy_parser,
+	.set_frequency = pcapsrc_set_frequency,
+	.read = pcapsrc_read_packet,
+	.process = pcapsrc_process_packet,
+	.keep_alive = pcapsrc_keep_alive,
+	.usage = pcapsrc_usage,
+};
+
+struct backend_ops *backend_get_ops(void)
+{
+	return &pcapsrc_backend_ops;
+}
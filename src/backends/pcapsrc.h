@@ -0,0 +1,42 @@
+#ifndef __pcapsrc_h
+#define __pcapsrc_h
+
+#ifdef USE_PCAPSRC
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <byteswap.h>
+#include <arpa/inet.h>
+
+/* Classic pcap magic numbers (microsecond and nanosecond timestamps) */
+#define PCAP_MAGIC_USEC         0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+
+/* pcapng block types */
+#define PCAPNG_SECTION_HEADER   0x0a0d0d0a
+#define PCAPNG_INTERFACE_DESC   0x00000001
+#define PCAPNG_PACKET           0x00000002
+#define PCAPNG_SIMPLE_PACKET    0x00000003
+#define PCAPNG_ENHANCED_PACKET  0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+/* Link-layer header types */
+#define LINKTYPE_NULL           0
+#define LINKTYPE_ETHERNET       1
+#define LINKTYPE_RAW            101
+#define LINKTYPE_LINUX_SLL      113
+#define LINKTYPE_LINUX_SLL2     276
+
+#define ETHERTYPE_IPV4          0x0800
+#define ETHERTYPE_IPV6          0x86dd
+#define ETHERTYPE_VLAN          0x8100
+#define ETHERTYPE_QINQ          0x88a8
+
+#define IPPROTO_UDP_NUMBER      17
+
+#endif /* USE_PCAPSRC */
+
+#endif /* __pcapsrc_h */
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "byteops.h"
+#include "ts.h"
+#include "rtp.h"
+
+/* Sequence number jumps larger than this are taken as a sender restart */
+#define RTP_MAX_SEQ_JUMP 3000
+
+/* Window distances are computed in int16_t, so the window must stay well below 32768 */
+#define RTP_MAX_REORDER_DEPTH 16384
+
+struct rtp_slot {
+	bool valid;
+	uint16_t seq;
+	char *data;
+	size_t len;
+	size_t capacity;
+};
+
+struct rtp_reorder {
+	struct demuxfs_data *priv;
+	struct rtp_slot *slots;
+	int depth;                  /**< Maximum number of datagrams held */
+	uint16_t slot_mask;         /**< Number of slots minus one; the slot count is a power of two */
+	bool synchronized;
+	uint16_t next_seq;          /**< Sequence number of the next datagram to be released */
+	uint16_t highest_seq;       /**< Highest sequence number seen so far */
+
+	/* Released TS data, consumed by rtp_reorder_next_packet() */
+	char *out;
+	size_t out_len;
+	size_t out_pos;
+	size_t out_capacity;
+};
+
+const char *rtp_get_ts_payload(const char *data, size_t len, size_t *ts_len, uint16_t *seq, bool *is_rtp)
+{
+	const uint8_t *p = (const uint8_t *) data;
+	size_t header_len;
+
+	/* Raw TS over UDP */
+	if (len >= 188 && p[0] == TS_SYNC_BYTE) {
+		*is_rtp = false;
+		*ts_len = len;
+		return data;
+	}
+
+	/* RTP version 2 */
+	if (len < 12 || (p[0] >> 6) != 2)
+		return NULL;
+	header_len = 12 + (p[0] & 0x0f) * 4;
+	if ((p[0] >> 4) & 0x01) {
+		/* Header extension */
+		if (len < header_len + 4)
+			return NULL;
+		header_len += 4 + CONVERT_TO_16(p[header_len+2], p[header_len+3]) * 4;
+	}
+	if ((p[0] >> 5) & 0x01) {
+		/* Padding */
+		if (p[len-1] > len)
+			return NULL;
+		len -= p[len-1];
+	}
+	if (len < header_len + 188 || p[header_len] != TS_SYNC_BYTE)
+		return NULL;
+
+	*is_rtp = true;
+	*seq = CONVERT_TO_16(p[2], p[3]);
+	*ts_len = len - header_len;
+	return &data[header_len];
+}
+
+struct rtp_reorder *rtp_reorder_new(int depth, struct demuxfs_data *priv)
+{
+	struct rtp_reorder *r = calloc(1, sizeof(struct rtp_reorder));
+	assert(r);
+
+	r->priv = priv;
+	if (depth > RTP_MAX_REORDER_DEPTH) {
+		TS_WARNING("RTP reorder window of %d datagrams is too large, using %d", depth, RTP_MAX_REORDER_DEPTH);
+		depth = RTP_MAX_REORDER_DEPTH;
+	}
+	r->depth = depth > 0 ? depth : 1;
+	/*
+	 * Slots are indexed by the low bits of the sequence number, which keeps
+	 * the datagrams of a window apart across the 16-bit wrap
+	 */
+	while (r->slot_mask + 1 < r->depth)
+		r->slot_mask = (r->slot_mask << 1) | 1;
+	r->slots = calloc(r->slot_mask + 1, sizeof(struct rtp_slot));
+	assert(r->slots);
+	return r;
+}
+
+void rtp_reorder_destroy(struct rtp_reorder *r)
+{
+	if (! r)
+		return;
+	for (int i=0; i<=r->slot_mask; ++i)
+		free(r->slots[i].data);
+	free(r->slots);
+	free(r->out);
+	free(r);
+}
+
+static void rtp_reorder_output(struct rtp_reorder *r, const char *data, size_t len)
+{
+	/* Reclaim space used by packets that have already been consumed */
+	if (r->out_pos == r->out_len)
+		r->out_pos = r->out_len = 0;
+	else if (r->out_pos && r->out_len + len > r->out_capacity) {
+		memmove(r->out, &r->out[r->out_pos], r->out_len - r->out_pos);
+		r->out_len -= r->out_pos;
+		r->out_pos = 0;
+	}
+	if (r->out_len + len > r->out_capacity) {
+		r->out_capacity = (r->out_len + len) * 2;
+		r->out = realloc(r->out, r->out_capacity);
+		assert(r->out);
+	}
+	memcpy(&r->out[r->out_len], data, len);
+	r->out_len += len;
+}
+
+/**
+ * Releases the datagram expected next, or accounts it as lost if it never
+ * arrived, and moves the window forward.
+ */
+static void rtp_reorder_advance(struct rtp_reorder *r)
+{
+	struct rtp_slot *slot = &r->slots[r->next_seq & r->slot_mask];
+
+	if (slot->valid && slot->seq == r->next_seq) {
+		rtp_reorder_output(r, slot->data, slot->len);
+		slot->valid = false;
+	} else {
+		r->priv->stats.transport_lost++;
+		if (r->priv->options.verbose_mask & CONTINUITY_ERROR)
+			TS_WARNING("RTP datagram %d was lost", r->next_seq);
+	}
+	r->next_seq++;
+}
+
+void rtp_reorder_push(struct rtp_reorder *r, const char *ts, size_t ts_len, uint16_t seq, bool is_rtp)
+{
+	struct rtp_slot *slot;
+	int16_t distance;
+
+	if (! is_rtp) {
+		rtp_reorder_output(r, ts, ts_len);
+		return;
+	}
+
+	distance = (int16_t) (seq - r->next_seq);
+	if (! r->synchronized || abs(distance) > RTP_MAX_SEQ_JUMP) {
+		if (r->synchronized) {
+			TS_WARNING("RTP sequence number jumped from %d to %d, resynchronizing", r->next_seq, seq);
+			rtp_reorder_flush(r);
+		}
+		r->synchronized = true;
+		r->next_seq = r->highest_seq = seq;
+		distance = 0;
+	}
+
+	if (distance < 0) {
+		/* Duplicate, or too late to be reordered */
+		r->priv->stats.transport_duplicates++;
+		return;
+	}
+	if ((int16_t) (seq - r->highest_seq) < 0)
+		r->priv->stats.transport_reordered++;
+	else
+		r->highest_seq = seq;
+
+	/* Make room for this datagram, giving up on the ones that didn't arrive in time */
+	while ((int16_t) (seq - r->next_seq) >= r->depth)
+		rtp_reorder_advance(r);
+
+	slot = &r->slots[seq & r->slot_mask];
+	if (slot->valid && slot->seq == seq) {
+		r->priv->stats.transport_duplicates++;
+		return;
+	}
+	if (slot->capacity < ts_len) {
+		slot->data = realloc(slot->data, ts_len);
+		assert(slot->data);
+		slot->capacity = ts_len;
+	}
+	memcpy(slot->data, ts, ts_len);
+	slot->len = ts_len;
+	slot->seq = seq;
+	slot->valid = true;
+
+	/* Release all datagrams that are now in order */
+	while (r->slots[r->next_seq & r->slot_mask].valid &&
+		r->slots[r->next_seq & r->slot_mask].seq == r->next_seq)
+		rtp_reorder_advance(r);
+}
+
+void rtp_reorder_flush(struct rtp_reorder *r)
+{
+	if (! r->synchronized)
+		return;
+	while ((int16_t) (r->highest_seq - r->next_seq) >= 0)
+		rtp_reorder_advance(r);
+}
+
+const char *rtp_reorder_next_packet(struct rtp_reorder *r, size_t packet_size)
+{
+	const char *packet;
+
+	if (r->out_len - r->out_pos < packet_size)
+		return NULL;
+	packet = &r->out[r->out_pos];
+	r->out_pos += packet_size;
+	return packet;
+}
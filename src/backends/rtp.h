@@ -0,0 +1,61 @@
+#ifndef __rtp_h
+#define __rtp_h
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RTP_PAYLOAD_TYPE_MP2T 33
+#define RTP_DEFAULT_REORDER_DEPTH 32
+
+struct demuxfs_data;
+struct rtp_reorder;
+
+/**
+ * Locates the transport stream packets carried by a UDP payload, which may
+ * either be raw TS (usually 7x188 bytes) or RTP-encapsulated TS.
+ * @param data UDP payload
+ * @param len length of the UDP payload
+ * @param ts_len on return, holds the number of bytes of TS data
+ * @param seq on return, holds the RTP sequence number (if @is_rtp is true)
+ * @param is_rtp on return, tells whether the payload was RTP-encapsulated
+ * @return a pointer to the first TS packet or NULL if the payload doesn't carry TS data.
+ */
+const char *rtp_get_ts_payload(const char *data, size_t len, size_t *ts_len, uint16_t *seq, bool *is_rtp);
+
+/**
+ * Creates an RTP reorder window. Datagrams are released in sequence number
+ * order; missing, reordered and duplicate datagrams are accounted in priv->stats.
+ * @param depth maximum number of datagrams held while waiting for a missing one,
+ *  up to 16384
+ * @param priv private data
+ */
+struct rtp_reorder *rtp_reorder_new(int depth, struct demuxfs_data *priv);
+void rtp_reorder_destroy(struct rtp_reorder *r);
+
+/**
+ * Pushes a datagram into the reorder window.
+ * @param r reorder window
+ * @param ts TS data carried by the datagram, as returned by rtp_get_ts_payload()
+ * @param ts_len length of the TS data
+ * @param seq RTP sequence number
+ * @param is_rtp false if the datagram has no RTP header; it's then released immediately.
+ */
+void rtp_reorder_push(struct rtp_reorder *r, const char *ts, size_t ts_len, uint16_t seq, bool is_rtp);
+
+/**
+ * Releases all datagrams held by the reorder window, counting the gaps
+ * between them. Used at the end of the input.
+ */
+void rtp_reorder_flush(struct rtp_reorder *r);
+
+/**
+ * Returns the next released TS packet. The pointer remains valid until the
+ * next call to rtp_reorder_push() or rtp_reorder_flush().
+ * @param r reorder window
+ * @param packet_size TS packet size
+ * @return a pointer to the packet or NULL if no packets have been released.
+ */
+const char *rtp_reorder_next_packet(struct rtp_reorder *r, size_t packet_size);
+
+#endif /* __rtp_h */
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "udpsrc.h"
+#include "byteops.h"
+#include "backend.h"
+#include "rtp.h"
+#include "ts.h"
+#include "stats.h"
+#include "trace.h"
+
+#define UDPSRC_DEFAULT_RCVBUF          (8 * 1024 * 1024)
+#define UDPSRC_DEFAULT_BATCH           64
+#define UDPSRC_MAX_DATAGRAM_SIZE       2048
+#define UDPSRC_RECEIVE_TIMEOUT_MS      500
+
+struct input_parser {
+	char *udpsrc;				/**< Address to listen to (cmdline option) */
+	char *udp_iface;			/**< Address of the interface joining the multicast group (cmdline option) */
+	int rcvbuf;					/**< Socket receive buffer size (cmdline option) */
+	int batch;					/**< Number of datagrams received per system call (cmdline option) */
+	int rtp_reorder;			/**< RTP reorder window, in datagrams (cmdline option) */
+	int sock;					/**< Socket descriptor */
+
+	/* recvmmsg() state */
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+	char *datagrams;
+	char *controls;
+	size_t control_len;
+
+	struct timespec last_arrival; /**< Kernel timestamp of the last datagram received */
+
+	struct rtp_reorder *reorder;/**< RTP reorder window */
+	const char *packet;			/**< Current TS packet being processed */
+	bool packet_valid;			/**< True if TS packet is valid, False if it's not */
+	uint8_t packet_size;		/**< Packet size (always 188) */
+};
+
+/**
+ * Command line parsing routines.
+ */
+void udpsrc_usage(void)
+{
+	fprintf(stderr, "\nUDPSRC options:\n"
+			"    -o udpsrc=ADDR:PORT      unicast or multicast address to receive UDP or RTP encapsulated TS from\n"
+			"                             (IPv6 addresses go within brackets, eg: [ff15::1]:5000)\n"
+			"    -o udp_iface=ADDR        address of the interface used to join the multicast group (default: any)\n"
+			"    -o rcvbuf=BYTES          socket receive buffer size (default: %d)\n"
+			"    -o batch=<count>         number of datagrams received per system call (default: %d)\n"
+			"    -o rtp_reorder=<count>   RTP reorder window, in datagrams (default: %d)\n",
+			UDPSRC_DEFAULT_RCVBUF,
+			UDPSRC_DEFAULT_BATCH,
+			RTP_DEFAULT_REORDER_DEPTH);
+}
+
+#define UDPSRC_OPT(templ,offset,value) { templ, offsetof(struct input_parser, offset), value }
+
+static struct fuse_opt udpsrc_opts[] = {
+	UDPSRC_OPT("udpsrc=%s",      udpsrc, 0),
+	UDPSRC_OPT("udp_iface=%s",   udp_iface, 0),
+	UDPSRC_OPT("rcvbuf=%d",      rcvbuf, 0),
+	UDPSRC_OPT("batch=%d",       batch, 0),
+	UDPSRC_OPT("rtp_reorder=%d", rtp_reorder, 0),
+	FUSE_OPT_END
+};
+
+static int udpsrc_parse_opts(void *priv, const char *arg, int key, struct fuse_args *outargs)
+{
+	return 1;
+}
+
+/**
+ * Resolves an ADDR:PORT or [ADDR]:PORT string.
+ */
+static struct addrinfo *udpsrc_resolve(const char *address)
+{
+	char *host = strdup(address), *port, *end;
+	struct addrinfo hints, *result = NULL;
+	int ret;
+
+	if (host[0] == '[' && (end = strchr(host, ']')) && end[1] == ':') {
+		*end = '\0';
+		port = &end[2];
+		memmove(host, &host[1], strlen(&host[1]) + 1);
+	} else if ((port = strrchr(host, ':'))) {
+		*port++ = '\0';
+	} else {
+		fprintf(stderr, "Error: '%s' is not in the ADDR:PORT format\n", address);
+		free(host);
+		return NULL;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	ret = getaddrinfo(strlen(host) ? host : NULL, port, &hints, &result);
+	if (ret != 0) {
+		fprintf(stderr, "Error: cannot resolve '%s': %s\n", address, gai_strerror(ret));
+		result = NULL;
+	}
+	free(host);
+	return result;
+}
+
+static int udpsrc_join_group(struct input_parser *p, const struct addrinfo *ai)
+{
+	if (ai->ai_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ai->ai_addr;
+		struct ip_mreq mreq;
+		if (! IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+			return 0;
+		mreq.imr_multiaddr = sin->sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (p->udp_iface && inet_pton(AF_INET, p->udp_iface, &mreq.imr_interface) != 1) {
+			fprintf(stderr, "Error: invalid interface address '%s'\n", p->udp_iface);
+			return -1;
+		}
+		if (setsockopt(p->sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+			perror("IP_ADD_MEMBERSHIP");
+			return -1;
+		}
+	} else if (ai->ai_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ai->ai_addr;
+		struct ipv6_mreq mreq;
+		if (! IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+			return 0;
+		mreq.ipv6mr_multiaddr = sin6->sin6_addr;
+		mreq.ipv6mr_interface = 0;
+		if (setsockopt(p->sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0) {
+			perror("IPV6_JOIN_GROUP");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int udpsrc_open_socket(struct input_parser *p)
+{
+	struct addrinfo *ai = udpsrc_resolve(p->udpsrc);
+	struct timeval timeout = { 0, UDPSRC_RECEIVE_TIMEOUT_MS * 1000 };
+	int one = 1, rcvbuf;
+	socklen_t len = sizeof(rcvbuf);
+
+	if (! ai)
+		return -1;
+	p->sock = socket(ai->ai_family, SOCK_DGRAM, 0);
+	if (p->sock < 0) {
+		perror("socket");
+		freeaddrinfo(ai);
+		return -1;
+	}
+	setsockopt(p->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	/* Bursts from the headend easily overflow the default receive buffer */
+	if (setsockopt(p->sock, SOL_SOCKET, SO_RCVBUFFORCE, &p->rcvbuf, sizeof(p->rcvbuf)) < 0)
+		setsockopt(p->sock, SOL_SOCKET, SO_RCVBUF, &p->rcvbuf, sizeof(p->rcvbuf));
+	if (getsockopt(p->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == 0 && rcvbuf < p->rcvbuf)
+		TS_WARNING("Socket receive buffer limited to %d bytes (see net.core.rmem_max)", rcvbuf);
+
+	if (setsockopt(p->sock, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0)
+		perror("SO_TIMESTAMPNS");
+	/* Let the parser thread check whether it must quit every now and then */
+	setsockopt(p->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (bind(p->sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+		perror("bind");
+		goto out_error;
+	}
+	if (udpsrc_join_group(p, ai) < 0)
+		goto out_error;
+
+	freeaddrinfo(ai);
+	return 0;
+
+out_error:
+	close(p->sock);
+	freeaddrinfo(ai);
+	return -1;
+}
+
+/**
+ * udpsrc_create_parser: backend's create() method.
+ */
+int udpsrc_create_parser(struct fuse_args *args, struct demuxfs_data *priv)
+{
+	struct input_parser *p = calloc(1, sizeof(struct input_parser));
+	assert(p);
+
+	p->rcvbuf = UDPSRC_DEFAULT_RCVBUF;
+	p->batch = UDPSRC_DEFAULT_BATCH;
+	p->rtp_reorder = RTP_DEFAULT_REORDER_DEPTH;
+	int ret = fuse_opt_parse(args, p, udpsrc_opts, udpsrc_parse_opts);
+	if (ret < 0) {
+		free(p);
+		return -1;
+	}
+	if (! p->udpsrc) {
+		fprintf(stderr, "Error: missing '-o udpsrc=ADDR:PORT' option\n");
+		free(p);
+		return -1;
+	}
+	if (p->batch <= 0)
+		p->batch = 1;
+	if (udpsrc_open_socket(p) < 0) {
+		free(p);
+		return -1;
+	}
+
+	p->control_len = CMSG_SPACE(sizeof(struct timespec));
+	p->msgs = calloc(p->batch, sizeof(struct mmsghdr));
+	p->iovecs = calloc(p->batch, sizeof(struct iovec));
+	p->datagrams = malloc(p->batch * UDPSRC_MAX_DATAGRAM_SIZE);
+	p->controls = malloc(p->batch * p->control_len);
+	assert(p->msgs && p->iovecs && p->datagrams && p->controls);
+	for (int i=0; i<p->batch; ++i) {
+		p->iovecs[i].iov_base = &p->datagrams[i * UDPSRC_MAX_DATAGRAM_SIZE];
+		p->iovecs[i].iov_len = UDPSRC_MAX_DATAGRAM_SIZE;
+		p->msgs[i].msg_hdr.msg_iov = &p->iovecs[i];
+		p->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	p->reorder = rtp_reorder_new(p->rtp_reorder, priv);
+
+	/* Configure packet size */
+	p->packet_size = 188;
+	priv->options.packet_size = p->packet_size;
+	priv->options.packet_error_correction_bytes = 0;
+
+	priv->parser = p;
+	return 0;
+}
+
+/**
+ * udpsrc_destroy_parser: backend's destroy() method.
+ */
+int udpsrc_destroy_parser(struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+
+	close(p->sock);
+	rtp_reorder_destroy(p->reorder);
+	free(p->msgs);
+	free(p->iovecs);
+	free(p->datagrams);
+	free(p->controls);
+	free(p);
+	return 0;
+}
+
+/**
+ * udpsrc_set_frequency: no-op.
+ */
+int udpsrc_set_frequency(uint32_t frequency, struct demuxfs_data *priv)
+{
+	(void) frequency;
+	(void) priv;
+	return -ENOSYS;
+}
+
+/**
+ * Keeps track of the largest interval between two consecutive datagrams,
+ * as timestamped by the kernel.
+ */
+static void udpsrc_account_arrival(struct input_parser *p, struct msghdr *msg, struct demuxfs_data *priv)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			if (p->last_arrival.tv_sec) {
+				int64_t delta = (int64_t) (ts.tv_sec - p->last_arrival.tv_sec) * 1000000000LL +
+					(ts.tv_nsec - p->last_arrival.tv_nsec);
+				if (delta > 0 && (uint64_t) delta > priv->stats.transport_max_interarrival_ns)
+					priv->stats.transport_max_interarrival_ns = delta;
+			}
+			p->last_arrival = ts;
+			break;
+		}
+	}
+}
+
+/**
+ * Receives a batch of datagrams and feeds them to the reorder window.
+ * @return 0 on success (including timeouts) or -1 on error.
+ */
+static int udpsrc_receive_batch(struct input_parser *p, struct demuxfs_data *priv)
+{
+	uint64_t start;
+	int n;
+
+	for (int i=0; i<p->batch; ++i) {
+		p->msgs[i].msg_hdr.msg_control = &p->controls[i * p->control_len];
+		p->msgs[i].msg_hdr.msg_controllen = p->control_len;
+		p->msgs[i].msg_hdr.msg_flags = 0;
+	}
+	start = trace_begin();
+	n = recvmmsg(p->sock, p->msgs, p->batch, MSG_WAITFORONE, NULL);
+	trace_end("backend", "recvmmsg", start, "datagrams", n);
+	if (n < 0) {
+		/* Don't hold datagrams waiting for a missing one if the stream stalled */
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			rtp_reorder_flush(p->reorder);
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		perror("recvmmsg");
+		return -1;
+	}
+	if (priv->latency)
+		priv->latency->packet_ingest_ns = stats_now();
+
+	for (int i=0; i<n; ++i) {
+		const char *ts;
+		size_t ts_len;
+		uint16_t seq;
+		bool is_rtp;
+
+		if (p->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+		udpsrc_account_arrival(p, &p->msgs[i].msg_hdr, priv);
+		ts = rtp_get_ts_payload(p->iovecs[i].iov_base, p->msgs[i].msg_len, &ts_len, &seq, &is_rtp);
+		if (ts)
+			rtp_reorder_push(p->reorder, ts, ts_len - (ts_len % p->packet_size), seq, is_rtp);
+	}
+	return 0;
+}
+
+/**
+ * udpsrc_read_packet: backend's read() method.
+ * @return 0 on success or -1 on error. When no data arrives in time, 0 is
+ *  returned and the packet is flagged as invalid.
+ */
+int udpsrc_read_packet(struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+
+	p->packet = rtp_reorder_next_packet(p->reorder, p->packet_size);
+	if (! p->packet) {
+		if (udpsrc_receive_batch(p, priv) < 0) {
+			p->packet_valid = false;
+			return -1;
+		}
+		p->packet = rtp_reorder_next_packet(p->reorder, p->packet_size);
+	}
+	p->packet_valid = p->packet != NULL;
+	return 0;
+}
+
+/**
+ * udpsrc_process_packet: backend's process() method.
+ */
+int udpsrc_process_packet(struct ts_header *header, void **payload, struct demuxfs_data *priv)
+{
+	struct input_parser *p = priv->parser;
+	const char *packet = p->packet;
+
+	if (! p->packet_valid)
+		return -EINVAL;
+	else if (! header || ! payload)
+		return -EINVAL;
+
+	*payload = (void *) &packet[4];
+	ts_decode_header((const uint8_t *) packet, header);
+	return 0;
+}
+
+/**
+ * udpsrc_keep_alive: backend's keep_alive() method.
+ */
+bool udpsrc_keep_alive(struct demuxfs_data *priv)
+{
+	return true;
+}
+
+struct backend_ops udpsrc_backend_ops = {
+	.create = udpsrc_create_parser,
+	.destroy = udpsrc_destroy_parser,
+	.set_frequency = udpsrc_set_frequency,
+	.read = udpsrc_read_packet,
+	.process = udpsrc_process_packet,
+	.keep_alive = udpsrc_keep_alive,
+	.usage = udpsrc_usage,
+};
+
+struct backend_ops *backend_get_ops(void)
+{
+	return &udpsrc_backend_ops;
+}
@@ -0,0 +1,21 @@
+#ifndef __udpsrc_h
+#define __udpsrc_h
+
+#ifdef USE_UDPSRC
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#endif /* USE_UDPSRC */
+
+#endif /* __udpsrc_h */
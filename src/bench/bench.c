@@ -0,0 +1,885 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "hash.h"
+#include "buffer.h"
+#include "crc32.h"
+#include "log.h"
+#include "stats.h"
+#include "ts.h"
+#include "harness.h"
+#include "tables/pes.h"
+#include "tables/descriptors/descriptors.h"
+#include "tables/psi.h"
+#include "tables/eit.h"
+#include "tables/sdt.h"
+#include "dsm-cc/dsmcc.h"
+#include "dsm-cc/dii.h"
+#include "dsm-cc/ait.h"
+#include <getopt.h>
+
+/*
+ * Microbenchmarks of the data structures and kernels the parsers spend
+ * their time in. Results are written as JSON, one benchmark per line, so
+ * that a previous run can be used as a baseline for the next one.
+ */
+
+#define BENCH_MAX_RESULTS 128
+
+struct bench_options {
+	const char *filter;             /**< Only run benchmarks whose name contains this string */
+	const char *output;             /**< JSON output, stdout if NULL */
+	const char *baseline;           /**< JSON output of a previous run */
+	double threshold;               /**< Slowdown, in percent, reported as a regression */
+	uint32_t min_time_ms;           /**< Minimum duration of each measurement */
+	uint32_t repeat;                /**< Measurements per benchmark; the median is reported */
+};
+
+struct bench_result {
+	char name[64];
+	uint64_t iterations;
+	double ns_per_op;               /**< Median of all measurements */
+	double min_ns_per_op;
+	uint32_t bytes_per_op;
+};
+
+struct bench;
+typedef void (*bench_function_t)(struct bench *b, uint64_t iterations);
+
+struct bench {
+	const char *name;
+	bench_function_t run;
+	int param;
+	uint32_t bytes_per_op;
+	/* Per-benchmark state, set up before the measurements */
+	void *state;
+	void (*setup)(struct bench *b);
+	void (*teardown)(struct bench *b);
+};
+
+/* Keeps the compiler from discarding the results of the code being measured */
+static volatile uintptr_t bench_sink;
+
+static struct demuxfs_data *bench_priv;
+
+/**
+ * Hash table
+ */
+#define BENCH_HASH_SIZE DEMUXFS_MAX_PIDS
+
+struct bench_hash_state {
+	struct hash_table *table;
+	ino_t keys[BENCH_HASH_SIZE];
+	int num_keys;
+};
+
+/* Keys are table identities, such as EIT sub-tables of many services on one PID */
+static ino_t bench_hash_key(int i)
+{
+	return TS_TABLE_IDENTITY(0x12, 0x4e + (i & 0x1), 0x100 + i * 7, i & 0x3);
+}
+
+static void bench_hash_setup(struct bench *b)
+{
+	struct bench_hash_state *s = calloc(1, sizeof(*s));
+
+	s->table = hashtable_new(BENCH_HASH_SIZE);
+	s->num_keys = BENCH_HASH_SIZE * b->param / 100;
+	for (int i=0; i<s->num_keys; ++i) {
+		s->keys[i] = bench_hash_key(i);
+		hashtable_add(s->table, s->keys[i], (void *) (uintptr_t) (i + 1), NULL);
+	}
+	b->state = s;
+}
+
+static void bench_hash_teardown(struct bench *b)
+{
+	struct bench_hash_state *s = b->state;
+	hashtable_destroy(s->table, NULL);
+	free(s);
+}
+
+static void bench_hashtable_get_hit(struct bench *b, uint64_t iterations)
+{
+	struct bench_hash_state *s = b->state;
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i)
+		sum += (uintptr_t) hashtable_get(s->table, s->keys[i % s->num_keys]);
+	bench_sink = sum;
+}
+
+static void bench_hashtable_get_miss(struct bench *b, uint64_t iterations)
+{
+	struct bench_hash_state *s = b->state;
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i)
+		sum += (uintptr_t) hashtable_get(s->table, bench_hash_key(BENCH_HASH_SIZE + (i & 0xff)));
+	bench_sink = sum;
+}
+
+static void bench_hashtable_add_del(struct bench *b, uint64_t iterations)
+{
+	struct bench_hash_state *s = b->state;
+
+	for (uint64_t i=0; i<iterations; ++i) {
+		ino_t key = bench_hash_key(BENCH_HASH_SIZE + (i & 0xff));
+		hashtable_add(s->table, key, (void *) 1, NULL);
+		hashtable_del(s->table, key);
+	}
+}
+
+/**
+ * CRC32
+ */
+static void bench_crc32_setup(struct bench *b)
+{
+	char *section = malloc(b->param);
+
+	for (int i=0; i<b->param; ++i)
+		section[i] = i * 31;
+	b->state = section;
+}
+
+static void bench_free_state(struct bench *b)
+{
+	free(b->state);
+}
+
+static void bench_crc32_check(struct bench *b, uint64_t iterations)
+{
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i)
+		sum += crc32_check(b->state, b->param);
+	bench_sink = sum;
+}
+
+/**
+ * Reassembly buffers. Each operation appends one TS packet payload; the
+ * buffer is reset once it holds param bytes.
+ */
+static void bench_buffer_append(struct bench *b, uint64_t iterations, bool pes)
+{
+	char payload[184];
+	struct buffer *buffer = buffer_create(0x100, pes ? 0 : MAX_SECTION_SIZE, pes);
+
+	memset(payload, 0xa5, sizeof(payload));
+	for (uint64_t i=0; i<iterations; ++i) {
+		if (buffer_get_current_size(buffer) + sizeof(payload) > (size_t) b->param)
+			buffer_reset_size(buffer);
+		buffer_append(buffer, payload, sizeof(payload));
+	}
+	buffer_destroy(buffer);
+}
+
+static void bench_buffer_append_psi(struct bench *b, uint64_t iterations)
+{
+	bench_buffer_append(b, iterations, false);
+}
+
+static void bench_buffer_append_pes(struct bench *b, uint64_t iterations)
+{
+	bench_buffer_append(b, iterations, true);
+}
+
+/**
+ * Path lookups. "wide" trees have param children under the root, "deep"
+ * trees are chains of param directories.
+ */
+struct bench_tree_state {
+	struct dentry *root;
+	char **names;
+	char *path;
+};
+
+static void bench_tree_setup(struct bench *b, bool deep)
+{
+	struct bench_tree_state *s = calloc(1, sizeof(*s));
+	struct dentry *parent;
+	size_t path_len = 0;
+
+	s->root = CREATE_DIRECTORY(bench_priv->root, "bench");
+	s->names = calloc(b->param, sizeof(char *));
+	s->path = calloc(b->param, 16);
+	parent = s->root;
+	for (int i=0; i<b->param; ++i) {
+		struct dentry *child;
+		asprintf(&s->names[i], "Version_%d", i);
+		child = CREATE_DIRECTORY(parent, "%s", s->names[i]);
+		path_len += sprintf(&s->path[path_len], "/%s", s->names[i]);
+		if (deep)
+			parent = child;
+	}
+	b->state = s;
+}
+
+static void bench_wide_setup(struct bench *b)
+{
+	bench_tree_setup(b, false);
+}
+
+static void bench_deep_setup(struct bench *b)
+{
+	bench_tree_setup(b, true);
+}
+
+static void bench_tree_teardown(struct bench *b)
+{
+	struct bench_tree_state *s = b->state;
+
+	fsutils_dispose_tree(s->root);
+	for (int i=0; i<b->param; ++i)
+		free(s->names[i]);
+	free(s->names);
+	free(s->path);
+	free(s);
+}
+
+static void bench_fsutils_get_child(struct bench *b, uint64_t iterations)
+{
+	struct bench_tree_state *s = b->state;
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i)
+		sum += (uintptr_t) fsutils_get_child(s->root, s->names[i % b->param]);
+	bench_sink = sum;
+}
+
+static void bench_fsutils_get_dentry(struct bench *b, uint64_t iterations)
+{
+	struct bench_tree_state *s = b->state;
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i)
+		sum += (uintptr_t) fsutils_get_dentry(s->root, s->path);
+	bench_sink = sum;
+}
+
+/**
+ * Descriptor loop of an EIT event as broadcast by ISDB-Tb stations: short
+ * event, component, content and parental rating descriptors. Each operation
+ * parses the loop into a fresh directory and disposes of it.
+ */
+static const uint8_t bench_eit_descriptors[] = {
+	/* short_event_descriptor: "por", name and text */
+	0x4d, 0x2f, 'p', 'o', 'r',
+	0x0d, 'J', 'o', 'r', 'n', 'a', 'l', ' ', 'N', 'a', 'c', 'i', 'o', 'n',
+	0x1c, 'A', 's', ' ', 'n', 'o', 't', 'i', 'c', 'i', 'a', 's', ' ', 'm', 'a', 'i', 's', ' ',
+	      'i', 'm', 'p', 'o', 'r', 't', 'a', 'n', 't', 'e', 's',
+	/* component_descriptor: H.264 1080i video */
+	0x50, 0x06, 0xf5, 0xb3, 0x00, 'p', 'o', 'r',
+	/* content_descriptor: news */
+	0x54, 0x02, 0x00, 0xff,
+	/* parental_rating_descriptor */
+	0x55, 0x04, 'B', 'R', 'A', 0x01,
+};
+#define BENCH_EIT_NUM_DESCRIPTORS 4
+
+static void bench_descriptors_parse(struct bench *b, uint64_t iterations)
+{
+	for (uint64_t i=0; i<iterations; ++i) {
+		struct dentry *parent = CREATE_DIRECTORY(bench_priv->root, "Event_01");
+		descriptors_parse((const char *) bench_eit_descriptors, sizeof(bench_eit_descriptors),
+			BENCH_EIT_NUM_DESCRIPTORS, parent, bench_priv);
+		fsutils_dispose_tree(parent);
+	}
+}
+
+/**
+ * PES header parsing. param holds the PTS_DTS_flags of the packet.
+ */
+static void bench_pes_setup(struct bench *b)
+{
+	uint8_t *payload = calloc(1, 184);
+
+	payload[2] = 0x01;
+	payload[3] = 0xe0;
+	payload[6] = 0x80;
+	payload[7] = b->param << 6;
+	payload[8] = b->param == 0x3 ? 10 : b->param == 0x2 ? 5 : 0;
+	b->state = payload;
+}
+
+static void bench_pes_parse_audio_video_payload(struct bench *b, uint64_t iterations)
+{
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i) {
+		uint32_t data_len = 184;
+		sum += (uintptr_t) pes_parse_audio_video_payload(b->state, 184, &data_len) + data_len;
+	}
+	bench_sink = sum;
+}
+
+/**
+ * Parsing of malformed sections. Each benchmark mutates a well-formed seed
+ * into a corpus of sections with flipped bits, random bytes and truncations,
+ * so that length fields point past the end of the data. The sections are
+ * handed straight to the parsers, as if their CRC had matched, and each one
+ * is kept in an allocation of its exact size so that reads past its end are
+ * caught by AddressSanitizer.
+ */
+#define BENCH_FUZZ_CORPUS_SIZE 256
+
+struct bench_fuzz_state {
+	char *sections[BENCH_FUZZ_CORPUS_SIZE];
+	uint32_t lengths[BENCH_FUZZ_CORPUS_SIZE];
+};
+
+/* PES header with every optional field present, followed by stuffing and data */
+static const uint8_t bench_fuzz_pes[] = {
+	0x00, 0x00, 0x01, 0xe0, 0x00, 0x00,
+	/* flags: all optional fields, PES_header_data_length */
+	0x80, 0xff, 48,
+	/* PTS, DTS */
+	0x31, 0x00, 0x01, 0x00, 0x01, 0x11, 0x00, 0x01, 0x00, 0x01,
+	/* ESCR, ES_rate, trick mode, additional_copy_info, previous_PES_packet_CRC */
+	0x04, 0x00, 0x04, 0x00, 0x04, 0x01, 0x80, 0x00, 0x01, 0x1f, 0x80, 0x00, 0x00,
+	/* extension flags, PES_private_data, pack_field_length, sequence counter, P-STD buffer */
+	0xf1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00, 0x80, 0x80, 0x60, 0x00,
+	/* PES_extension_field_length, stuffing */
+	0x80, 0xff, 0xff,
+	/* data */
+	0x00, 0x00, 0x00, 0x01, 0x09, 0xf0, 0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x28, 0xac, 0xd9,
+};
+
+/* AIT of two applications carrying application, name and transport protocol descriptors */
+static const uint8_t bench_fuzz_ait[] = {
+	0x74, 0xf0, 0x00, 0x00, 0x10, 0xc1, 0x00, 0x00,
+	/* common_descriptors_length, application_loop_length */
+	0xf0, 0x00, 0xf0, 0x52,
+	/* organization_id, application_id, application_control_code, descriptors loop length */
+	0x00, 0x00, 0x00, 0x0a, 0x00, 0x01, 0x01, 0xf0, 0x1c,
+	/* application descriptor */
+	0x00, 0x09, 0x05, 0x00, 0x01, 0x01, 0x00, 0x00, 0xe0, 0x01, 0x01,
+	/* application name descriptor */
+	0x01, 0x08, 'p', 'o', 'r', 0x04, 'm', 'a', 'i', 'n',
+	/* transport protocol descriptor: object carousel */
+	0x02, 0x05, 0x00, 0x01, 0x01, 0x00, 0x0a,
+	0x00, 0x00, 0x00, 0x0a, 0x00, 0x02, 0x02, 0xf0, 0x24,
+	/* application name descriptor */
+	0x01, 0x09, 'p', 'o', 'r', 0x05, 'g', 'u', 'i', 'd', 'e',
+	/* transport protocol descriptor: IP with two URLs */
+	0x02, 0x17, 0x00, 0x02, 0x02, 0x00, 0x00,
+	0x08, 'h', 't', 't', 'p', ':', '/', '/', 'a',
+	0x08, 'h', 't', 't', 'p', ':', '/', '/', 'b',
+	/* CRC_32 */
+	0x00, 0x00, 0x00, 0x00,
+};
+#define BENCH_FUZZ_AIT_HEADER 8
+
+/* DII of two modules with a compatibility descriptor and a biopModuleInfo */
+static const uint8_t bench_fuzz_dii[] = {
+	0x3b, 0xb0, 0x00, 0x00, 0x02, 0xc1, 0x00, 0x00,
+	/* dsmccMessageHeader */
+	0x11, 0x03, 0x10, 0x02, 0x80, 0x00, 0x00, 0x02, 0xff, 0x00, 0x00, 0x00,
+	/* downloadId, blockSize, windowSize, ackPeriod, tCDownloadWindow, tCDownloadScenario */
+	0x00, 0x00, 0x00, 0x01, 0x0f, 0xa0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	/* compatibilityDescriptor */
+	0x00, 0x11, 0x00, 0x01, 0x02, 0x0d, 0x01, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01, 0x01,
+	0x01, 0x02, 0xab, 0xcd,
+	/* numberOfModules */
+	0x00, 0x02,
+	/* moduleId, moduleSize, moduleVersion, moduleInfoLength, biopModuleInfo */
+	0x00, 0x01, 0x00, 0x00, 0x10, 0x00, 0x01, 0x15,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+	0x00, 0x00, 0x00, 0x17, 0x00, 0x0a, 0x00, 0x00,
+	0x00, 0x02, 0x00, 0x00, 0x00, 0x20, 0x01, 0x00,
+	/* privateDataLength */
+	0x00, 0x00,
+	/* CRC_32 */
+	0x00, 0x00, 0x00, 0x00,
+};
+#define BENCH_FUZZ_DII_HEADER 20
+
+/* EIT present/following of two events carrying short event, component, content and rating descriptors */
+static const uint8_t bench_fuzz_eit[] = {
+	0x4e, 0xf0, 0x00, 0x00, 0x01, 0xc1, 0x00, 0x01,
+	/* transport_stream_id, original_network_id, segment_last_section_number, last_table_id */
+	0x00, 0x01, 0x00, 0x01, 0x01, 0x4e,
+	/* event_id, start_time, duration, running_status, free_CA_mode, descriptors_loop_length */
+	0x00, 0x01, 0xe4, 0x7a, 0x20, 0x00, 0x00, 0x01, 0x00, 0x00, 0x80, 0x1e,
+	/* short event descriptor */
+	0x4d, 0x12, 'p', 'o', 'r', 0x07, 'J', 'o', 'r', 'n', 'a', 'l', ' ', 0x06, 'N', 'o', 't', 'i', 'c', 'i',
+	/* content descriptor */
+	0x54, 0x02, 0x00, 0xff,
+	/* parental rating descriptor */
+	0x55, 0x04, 'B', 'R', 'A', 0x01,
+	0x00, 0x02, 0xe4, 0x7a, 0x21, 0x00, 0x00, 0x00, 0x30, 0x00, 0x20, 0x0c,
+	/* component descriptor */
+	0x50, 0x06, 0xf5, 0xb3, 0x00, 'p', 'o', 'r',
+	/* content descriptor */
+	0x54, 0x02, 0x02, 0xff,
+	/* CRC_32 */
+	0x00, 0x00, 0x00, 0x00,
+};
+#define BENCH_FUZZ_EIT_HEADER 8
+
+/* SDT of two services carrying service descriptors */
+static const uint8_t bench_fuzz_sdt[] = {
+	0x42, 0xf0, 0x00, 0x00, 0x01, 0xc1, 0x00, 0x00,
+	/* original_network_id, reserved_future_use */
+	0x00, 0x01, 0xff,
+	/* service_id, EIT flags, running_status, free_CA_mode, descriptors_loop_length */
+	0x00, 0x01, 0xfd, 0x80, 0x0f,
+	/* service descriptor */
+	0x48, 0x0d, 0x01, 0x04, 'T', 'V', '-', 'A', 0x06, 'C', 'a', 'n', 'a', 'l', '1',
+	0x00, 0x02, 0xfd, 0x80, 0x0d,
+	/* service descriptor */
+	0x48, 0x0b, 0x01, 0x04, 'T', 'V', '-', 'A', 0x04, 'I', 'n', 'f', 'o',
+	/* CRC_32 */
+	0x00, 0x00, 0x00, 0x00,
+};
+#define BENCH_FUZZ_SDT_HEADER 8
+
+static uint32_t bench_fuzz_random(uint32_t *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/**
+ * Fills the corpus with mutations of @data that leave its first @header_size bytes alone.
+ */
+static void bench_fuzz_setup(struct bench *b, const uint8_t *data, uint32_t size, uint32_t header_size)
+{
+	struct bench_fuzz_state *state = calloc(1, sizeof(struct bench_fuzz_state));
+	uint8_t section[size];
+	uint32_t seed = 0x2545f491;
+
+	/* Sections carry their own section_length */
+	memcpy(section, data, size);
+	if (section[1] & 0x80) {
+		section[1] |= (size - 3) >> 8;
+		section[2] = (size - 3) & 0xff;
+	}
+
+	for (int i=0; i<BENCH_FUZZ_CORPUS_SIZE; ++i) {
+		uint32_t len = size, mutations = 1 + bench_fuzz_random(&seed) % 4;
+		char *copy;
+
+		state->sections[i] = copy = malloc(size);
+		memcpy(copy, section, size);
+		for (uint32_t m=0; m<mutations; ++m) {
+			uint32_t r = bench_fuzz_random(&seed), offset = header_size + r % (size - header_size);
+			if (r & 0x80000000)
+				copy[offset] ^= 1 << (r >> 28 & 0x7);
+			else
+				copy[offset] = r >> 16;
+		}
+		if (bench_fuzz_random(&seed) & 1)
+			len = header_size + bench_fuzz_random(&seed) % (size - header_size + 1);
+		if (len < size) {
+			state->sections[i] = realloc(copy, len);
+			assert(state->sections[i]);
+		}
+		state->lengths[i] = len;
+	}
+	b->state = state;
+}
+
+static void bench_fuzz_teardown(struct bench *b)
+{
+	struct bench_fuzz_state *state = b->state;
+
+	for (int i=0; i<BENCH_FUZZ_CORPUS_SIZE; ++i)
+		free(state->sections[i]);
+	bench_free_state(b);
+}
+
+static void bench_fuzz_pes_setup(struct bench *b)
+{
+	bench_fuzz_setup(b, bench_fuzz_pes, sizeof(bench_fuzz_pes), 6);
+}
+
+static void bench_fuzz_ait_setup(struct bench *b)
+{
+	bench_fuzz_setup(b, bench_fuzz_ait, sizeof(bench_fuzz_ait), BENCH_FUZZ_AIT_HEADER);
+}
+
+static void bench_fuzz_dii_setup(struct bench *b)
+{
+	bench_fuzz_setup(b, bench_fuzz_dii, sizeof(bench_fuzz_dii), BENCH_FUZZ_DII_HEADER);
+}
+
+static void bench_fuzz_eit_setup(struct bench *b)
+{
+	bench_fuzz_setup(b, bench_fuzz_eit, sizeof(bench_fuzz_eit), BENCH_FUZZ_EIT_HEADER);
+}
+
+static void bench_fuzz_sdt_setup(struct bench *b)
+{
+	bench_fuzz_setup(b, bench_fuzz_sdt, sizeof(bench_fuzz_sdt), BENCH_FUZZ_SDT_HEADER);
+}
+
+static void bench_parse_fuzzed_pes(struct bench *b, uint64_t iterations)
+{
+	struct bench_fuzz_state *state = b->state;
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i) {
+		uint32_t n = i % BENCH_FUZZ_CORPUS_SIZE, data_len = 0;
+		sum += (uintptr_t) pes_parse_audio_video_payload(state->sections[n], state->lengths[n],
+			&data_len) + data_len;
+	}
+	bench_sink = sum;
+}
+
+/**
+ * Parses table sections of the corpus. The version number changes on every
+ * operation so that no section is skipped as a repetition of the previous one.
+ */
+static void bench_parse_fuzzed_section(struct bench *b, uint64_t iterations, uint16_t pid,
+		int (*parse)(const struct ts_header *, const char *, uint32_t, struct demuxfs_data *))
+{
+	struct bench_fuzz_state *state = b->state;
+	struct ts_header header;
+
+	memset(&header, 0, sizeof(header));
+	header.pid = pid;
+	for (uint64_t i=0; i<iterations; ++i) {
+		uint32_t n = i % BENCH_FUZZ_CORPUS_SIZE;
+		char *section = state->sections[n];
+		section[5] = 0xc1 | ((i & 0x1f) << 1);
+		parse(&header, section, state->lengths[n], bench_priv);
+	}
+}
+
+static void bench_parse_fuzzed_ait(struct bench *b, uint64_t iterations)
+{
+	bench_parse_fuzzed_section(b, iterations, 0x103, ait_parse);
+}
+
+static void bench_parse_fuzzed_dii(struct bench *b, uint64_t iterations)
+{
+	bench_parse_fuzzed_section(b, iterations, 0x104, dii_parse);
+}
+
+static void bench_parse_fuzzed_eit(struct bench *b, uint64_t iterations)
+{
+	bench_parse_fuzzed_section(b, iterations, TS_H_EIT_PID, eit_parse);
+}
+
+static void bench_parse_fuzzed_sdt(struct bench *b, uint64_t iterations)
+{
+	bench_parse_fuzzed_section(b, iterations, TS_SDT_PID, sdt_parse);
+}
+
+/**
+ * TS header decoding, per packet and in batches. Each operation decodes
+ * the headers of TS_BATCH_PACKETS packets.
+ */
+static void bench_ts_headers_setup(struct bench *b)
+{
+	uint8_t *packets = calloc(TS_BATCH_PACKETS, 188);
+
+	for (int i=0; i<TS_BATCH_PACKETS; ++i) {
+		uint8_t *packet = &packets[i * 188];
+		uint16_t pid = 0x100 + (i * 37) % 12;
+		packet[0] = TS_SYNC_BYTE;
+		packet[1] = (i % 8 == 0 ? 0x40 : 0) | (pid >> 8);
+		packet[2] = pid & 0xff;
+		packet[3] = (i % 5 == 0 ? 0x30 : 0x10) | (i & 0x0f);
+	}
+	b->state = packets;
+}
+
+static void bench_ts_decode_header(struct bench *b, uint64_t iterations)
+{
+	const uint8_t *packets = b->state;
+	struct ts_header header;
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i)
+		for (int j=0; j<TS_BATCH_PACKETS; ++j) {
+			ts_decode_header(&packets[j * 188], &header);
+			sum += header.pid + header.payload_unit_start_indicator + header.continuity_counter;
+		}
+	bench_sink = sum;
+}
+
+static void bench_ts_classify_packets(struct bench *b, uint64_t iterations)
+{
+	struct ts_packet_info info[TS_BATCH_PACKETS];
+	uintptr_t sum = 0;
+
+	for (uint64_t i=0; i<iterations; ++i) {
+		ts_classify_packets(b->state, TS_BATCH_PACKETS, 188, info);
+		sum += info[i % TS_BATCH_PACKETS].pid;
+	}
+	bench_sink = sum;
+}
+
+static struct bench benchmarks[] = {
+	{ "hashtable_get_hit/fill_25",  bench_hashtable_get_hit,  25, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_hit/fill_50",  bench_hashtable_get_hit,  50, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_hit/fill_75",  bench_hashtable_get_hit,  75, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_hit/fill_95",  bench_hashtable_get_hit,  95, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_miss/fill_25", bench_hashtable_get_miss, 25, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_miss/fill_50", bench_hashtable_get_miss, 50, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_miss/fill_75", bench_hashtable_get_miss, 75, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_get_miss/fill_95", bench_hashtable_get_miss, 95, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_add_del/fill_25",  bench_hashtable_add_del,  25, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_add_del/fill_50",  bench_hashtable_add_del,  50, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_add_del/fill_75",  bench_hashtable_add_del,  75, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "hashtable_add_del/fill_95",  bench_hashtable_add_del,  95, 0, NULL, bench_hash_setup, bench_hash_teardown },
+	{ "crc32_check/16",     bench_crc32_check,     16,   16, NULL, bench_crc32_setup, bench_free_state },
+	{ "crc32_check/184",    bench_crc32_check,    184,  184, NULL, bench_crc32_setup, bench_free_state },
+	{ "crc32_check/1024",   bench_crc32_check,   1024, 1024, NULL, bench_crc32_setup, bench_free_state },
+	{ "crc32_check/4096",   bench_crc32_check,   4096, 4096, NULL, bench_crc32_setup, bench_free_state },
+	{ "buffer_append/psi_1024",  bench_buffer_append_psi,  1024, 184, NULL, NULL, NULL },
+	{ "buffer_append/psi_4096",  bench_buffer_append_psi,  4096, 184, NULL, NULL, NULL },
+	{ "buffer_append/pes_65536", bench_buffer_append_pes, 65536, 184, NULL, NULL, NULL },
+	{ "buffer_append/pes_1048576", bench_buffer_append_pes, 1048576, 184, NULL, NULL, NULL },
+	{ "fsutils_get_child/wide_16",   bench_fsutils_get_child,   16, 0, NULL, bench_wide_setup, bench_tree_teardown },
+	{ "fsutils_get_child/wide_256",  bench_fsutils_get_child,  256, 0, NULL, bench_wide_setup, bench_tree_teardown },
+	{ "fsutils_get_child/wide_4096", bench_fsutils_get_child, 4096, 0, NULL, bench_wide_setup, bench_tree_teardown },
+	{ "fsutils_get_dentry/deep_4",   bench_fsutils_get_dentry,   4, 0, NULL, bench_deep_setup, bench_tree_teardown },
+	{ "fsutils_get_dentry/deep_16",  bench_fsutils_get_dentry,  16, 0, NULL, bench_deep_setup, bench_tree_teardown },
+	{ "fsutils_get_dentry/deep_64",  bench_fsutils_get_dentry,  64, 0, NULL, bench_deep_setup, bench_tree_teardown },
+	{ "fsutils_get_dentry/wide_4096", bench_fsutils_get_dentry, 4096, 0, NULL, bench_wide_setup, bench_tree_teardown },
+	{ "descriptors_parse/eit_event", bench_descriptors_parse, 0, sizeof(bench_eit_descriptors), NULL, NULL, NULL },
+	{ "pes_parse_audio_video_payload/no_pts", bench_pes_parse_audio_video_payload, 0x0, 0, NULL, bench_pes_setup, bench_free_state },
+	{ "pes_parse_audio_video_payload/pts",    bench_pes_parse_audio_video_payload, 0x2, 0, NULL, bench_pes_setup, bench_free_state },
+	{ "pes_parse_audio_video_payload/pts_dts", bench_pes_parse_audio_video_payload, 0x3, 0, NULL, bench_pes_setup, bench_free_state },
+	{ "parse_fuzzed/pes", bench_parse_fuzzed_pes, 0, 0, NULL, bench_fuzz_pes_setup, bench_fuzz_teardown },
+	{ "parse_fuzzed/ait", bench_parse_fuzzed_ait, 0, 0, NULL, bench_fuzz_ait_setup, bench_fuzz_teardown },
+	{ "parse_fuzzed/dii", bench_parse_fuzzed_dii, 0, 0, NULL, bench_fuzz_dii_setup, bench_fuzz_teardown },
+	{ "parse_fuzzed/eit", bench_parse_fuzzed_eit, 0, 0, NULL, bench_fuzz_eit_setup, bench_fuzz_teardown },
+	{ "parse_fuzzed/sdt", bench_parse_fuzzed_sdt, 0, 0, NULL, bench_fuzz_sdt_setup, bench_fuzz_teardown },
+	{ "ts_decode_header/batch_256",    bench_ts_decode_header,    0, 0, NULL, bench_ts_headers_setup, bench_free_state },
+	{ "ts_classify_packets/batch_256", bench_ts_classify_packets, 0, 0, NULL, bench_ts_headers_setup, bench_free_state },
+	{ NULL, NULL, 0, 0, NULL, NULL, NULL }
+};
+
+static double bench_measure(struct bench *b, uint64_t iterations)
+{
+	uint64_t start = stats_now();
+	b->run(b, iterations);
+	return (double) (stats_now() - start);
+}
+
+static int bench_compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Finds how many iterations fill the minimum measurement time, then takes
+ * options->repeat measurements of that many iterations.
+ */
+static void bench_run(struct bench *b, const struct bench_options *options, struct bench_result *result)
+{
+	uint64_t min_ns = (uint64_t) options->min_time_ms * 1000000, iterations = 1;
+	double elapsed, samples[options->repeat];
+
+	if (b->setup)
+		b->setup(b);
+
+	while ((elapsed = bench_measure(b, iterations)) < min_ns / 10 && iterations < (1ULL << 40))
+		iterations *= 2;
+	if (elapsed < min_ns)
+		iterations = iterations * min_ns / (elapsed > 0 ? elapsed : 1);
+
+	for (uint32_t r=0; r<options->repeat; ++r)
+		samples[r] = bench_measure(b, iterations) / iterations;
+	qsort(samples, options->repeat, sizeof(double), bench_compare_double);
+
+	if (b->teardown)
+		b->teardown(b);
+
+	snprintf(result->name, sizeof(result->name), "%s", b->name);
+	result->iterations = iterations;
+	result->ns_per_op = samples[options->repeat / 2];
+	result->min_ns_per_op = samples[0];
+	result->bytes_per_op = b->bytes_per_op;
+}
+
+static void bench_write_json(FILE *fp, struct bench_result *results, int num_results)
+{
+	fprintf(fp, "{\n\"benchmarks\": [\n");
+	for (int i=0; i<num_results; ++i) {
+		struct bench_result *r = &results[i];
+		fprintf(fp, "  {\"name\": \"%s\", \"iterations\": %" PRIu64 ", \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f",
+			r->name, r->iterations, r->ns_per_op, r->min_ns_per_op);
+		if (r->bytes_per_op)
+			fprintf(fp, ", \"mb_per_s\": %.1f", r->bytes_per_op * 1e3 / r->ns_per_op);
+		fprintf(fp, "}%s\n", i + 1 < num_results ? "," : "");
+	}
+	fprintf(fp, "]\n}\n");
+}
+
+/**
+ * Reads the "name" and "ns_per_op" fields of a file written by bench_write_json().
+ * Returns the number of results read or a negative errno.
+ */
+static int bench_read_json(const char *path, struct bench_result *results, int max_results)
+{
+	char line[512];
+	int num_results = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (! fp)
+		return -errno;
+	while (num_results < max_results && fgets(line, sizeof(line), fp)) {
+		struct bench_result *r = &results[num_results];
+		char *name = strstr(line, "\"name\": \"");
+		char *ns = strstr(line, "\"ns_per_op\": ");
+		char *end;
+
+		if (! name || ! ns)
+			continue;
+		name += strlen("\"name\": \"");
+		end = strchr(name, '"');
+		if (! end || end - name >= (int) sizeof(r->name))
+			continue;
+		memset(r, 0, sizeof(*r));
+		memcpy(r->name, name, end - name);
+		r->ns_per_op = strtod(ns + strlen("\"ns_per_op\": "), NULL);
+		num_results++;
+	}
+	fclose(fp);
+	return num_results;
+}
+
+/**
+ * Prints how each benchmark moved relative to the baseline.
+ * Returns the number of benchmarks that got slower than the threshold.
+ */
+static int bench_compare(struct bench_result *baseline, int num_baseline,
+		struct bench_result *results, int num_results, double threshold)
+{
+	int regressions = 0;
+
+	fprintf(stderr, "%-40s %12s %12s %9s\n", "Benchmark", "Baseline", "Current", "Change");
+	for (int i=0; i<num_results; ++i) {
+		struct bench_result *r = &results[i], *base = NULL;
+
+		for (int j=0; j<num_baseline; ++j)
+			if (! strcmp(baseline[j].name, r->name)) {
+				base = &baseline[j];
+				break;
+			}
+		if (! base || base->ns_per_op <= 0) {
+			fprintf(stderr, "%-40s %12s %9.1fns %9s\n", r->name, "-", r->ns_per_op, "new");
+			continue;
+		}
+
+		double change = 100 * (r->ns_per_op - base->ns_per_op) / base->ns_per_op;
+		bool regressed = change > threshold;
+		fprintf(stderr, "%-40s %10.1fns %10.1fns %+8.1f%%%s\n", r->name,
+			base->ns_per_op, r->ns_per_op, change, regressed ? "  REGRESSION" : "");
+		regressions += regressed;
+	}
+	return regressions;
+}
+
+static void bench_usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n\n"
+			"    -f FILTER     only run benchmarks whose name contains FILTER\n"
+			"    -o FILE       write the results to FILE instead of stdout\n"
+			"    -b FILE       compare the results against a previous run stored in FILE\n"
+			"    -T PERCENT    slowdown reported as a regression when comparing (default: 10)\n"
+			"    -t MS         minimum duration of each measurement (default: 200)\n"
+			"    -r COUNT      measurements per benchmark, the median is reported (default: 5)\n"
+			"    -l            list the benchmarks and exit\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_options options = { NULL, NULL, NULL, 10, 200, 5 };
+	struct bench_result results[BENCH_MAX_RESULTS];
+	int opt, num_results = 0, ret = 0;
+
+	while ((opt = getopt(argc, argv, "f:o:b:T:t:r:lh")) != -1) {
+		switch (opt) {
+			case 'f': options.filter = optarg; break;
+			case 'o': options.output = optarg; break;
+			case 'b': options.baseline = optarg; break;
+			case 'T': options.threshold = atof(optarg); break;
+			case 't': options.min_time_ms = atoi(optarg); break;
+			case 'r': options.repeat = atoi(optarg); break;
+			case 'l':
+				for (struct bench *b = benchmarks; b->name; ++b)
+					printf("%s\n", b->name);
+				return 0;
+			default:
+				bench_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (options.repeat == 0 || options.min_time_ms == 0) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	log_set_level(LOG_LEVEL_ERROR);
+	bench_priv = harness_new();
+
+	for (struct bench *b = benchmarks; b->name && num_results < BENCH_MAX_RESULTS; ++b) {
+		if (options.filter && ! strstr(b->name, options.filter))
+			continue;
+		bench_run(b, &options, &results[num_results]);
+		fprintf(stderr, "%-40s %10.1f ns/op\n", b->name, results[num_results].ns_per_op);
+		num_results++;
+	}
+
+	FILE *fp = options.output ? fopen(options.output, "w") : stdout;
+	if (! fp) {
+		perror(options.output);
+		ret = 1;
+	} else {
+		bench_write_json(fp, results, num_results);
+		if (fp != stdout)
+			fclose(fp);
+	}
+
+	if (options.baseline) {
+		struct bench_result baseline[BENCH_MAX_RESULTS];
+		int num_baseline = bench_read_json(options.baseline, baseline, BENCH_MAX_RESULTS);
+		if (num_baseline < 0) {
+			fprintf(stderr, "%s: %s\n", options.baseline, strerror(-num_baseline));
+			ret = 1;
+		} else {
+			fprintf(stderr, "\n");
+			if (bench_compare(baseline, num_baseline, results, num_results, options.threshold))
+				ret = 1;
+		}
+	}
+
+	harness_destroy(bench_priv);
+	return ret;
+}
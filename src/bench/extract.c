@@ -0,0 +1,646 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "buffer.h"
+#include "byteops.h"
+#include "hash.h"
+#include "ts.h"
+#include "log.h"
+#include "stats.h"
+#include "harness.h"
+#include "tables/psi.h"
+#include "tables/pat.h"
+#include "tables/pmt.h"
+#include "tables/pes.h"
+#include <getopt.h>
+#include <sys/mman.h>
+
+/*
+ * Offline extraction of the elementary streams of a capture file. A prepass
+ * runs the PAT and PMT parsers over the beginning of the file to find the
+ * audio, video and PES PIDs. The file is then split into chunks aligned on
+ * packet boundaries, which are processed on separate threads.
+ *
+ * A chunk usually starts in the middle of a PES packet, so a worker cannot
+ * tell whether the first bytes it sees for a PID are ES data or the tail of
+ * a PES header. Those bytes are kept aside until all workers are done and
+ * resolved with the state the previous chunk ended with, in file order.
+ */
+
+#define EXTRACT_PACKET_SIZE    188
+#define EXTRACT_NUM_PIDS       8192
+#define EXTRACT_MAX_STREAMS    128
+
+/* Chunks smaller than this aren't worth a thread of their own */
+#define EXTRACT_MIN_CHUNK_SIZE (8 * 1024 * 1024)
+
+#define EXTRACT_WRITE_BUFFER_SIZE (256 * 1024)
+
+/* How far back a worker looks for the previous packet of a PID to detect duplicates */
+#define EXTRACT_MAX_LOOKBACK   (1024 * 1024)
+
+/* Default amount of data the PSI prepass reads before giving up on missing PMTs */
+#define EXTRACT_DEFAULT_PREPASS_MB 64
+
+struct extract_options {
+	const char *input;
+	const char *output_dir;
+	uint32_t threads;
+	uint32_t prepass_mb;
+	bool verbose;
+};
+
+/* What to do with the payload of the PES packet in progress */
+enum extract_pes_state {
+	EXTRACT_PES_UNKNOWN,            /**< The chunk started in the middle of a PES packet */
+	EXTRACT_PES_NONE,               /**< No PES packet has started since the beginning of the file */
+	EXTRACT_PES_DATA,               /**< Payload holds ES data once the header has been skipped */
+	EXTRACT_PES_DISCARD,            /**< Padding stream or corrupted PES header */
+};
+
+struct extract_pes {
+	enum extract_pes_state state;
+	uint32_t header_left;           /**< PES header bytes yet to be skipped */
+};
+
+/**
+ * The output of one chunk for one PID.
+ */
+struct extract_part {
+	struct extract_pes pes;         /**< State at the end of the chunk */
+	struct buffer *head;            /**< Payload seen before the first PES header of the chunk */
+	char *path;                     /**< ES data that follows the first PES header of the chunk */
+	FILE *fp;
+	bool seen;                      /**< A packet of this PID has been seen in the chunk */
+	int last_cc;
+};
+
+struct extract_stream {
+	uint16_t pid;
+	const char *type;
+	char *path;
+	uint64_t bytes;
+};
+
+struct extract_job;
+
+struct extract_chunk {
+	struct extract_job *job;
+	const uint8_t *data;
+	size_t size;
+	int index;
+	struct extract_part parts[EXTRACT_MAX_STREAMS];
+	uint64_t discarded_packets;     /**< Errored or scrambled packets */
+	pthread_t thread;
+	int ret;
+};
+
+struct extract_job {
+	struct extract_options options;
+	const uint8_t *data;
+	size_t size;
+	int16_t stream_index[EXTRACT_NUM_PIDS];
+	struct extract_stream streams[EXTRACT_MAX_STREAMS];
+	int num_streams;
+	struct extract_chunk *chunks;
+	int num_chunks;
+};
+
+static int extract_usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options] FILE\n\n"
+			"    -o DIR        directory to write the elementary streams to (default: .)\n"
+			"    -j THREADS    number of worker threads (default: number of CPUs)\n"
+			"    -P MB         maximum amount of data read looking for PMTs (default: %d)\n"
+			"    -v            show parser warnings\n", argv0, EXTRACT_DEFAULT_PREPASS_MB);
+	return 1;
+}
+
+static const uint8_t *extract_payload(const uint8_t *packet, size_t *payload_len)
+{
+	uint8_t adaptation_field = (packet[3] >> 4) & 0x03;
+	size_t offset = 4;
+
+	if (adaptation_field == 0x00 || adaptation_field == 0x02)
+		return NULL;
+	if (adaptation_field == 0x03)
+		offset += 1 + packet[4];
+	if (offset >= EXTRACT_PACKET_SIZE)
+		return NULL;
+	*payload_len = EXTRACT_PACKET_SIZE - offset;
+	return &packet[offset];
+}
+
+/**
+ * PSI prepass: feeds the PAT and PMT parsers until every program announced
+ * in the PAT has had its PMT parsed, then collects the PIDs the PMT parser
+ * registered PES parsers for.
+ */
+static int extract_prepass(struct extract_job *job)
+{
+	struct demuxfs_data *priv = harness_new();
+	size_t limit = (size_t) job->options.prepass_mb * 1024 * 1024;
+	struct pat_table *pat = NULL;
+	bool complete = false;
+	size_t offset;
+
+	for (offset = 0; offset + EXTRACT_PACKET_SIZE <= job->size && offset < limit && ! complete;
+			offset += EXTRACT_PACKET_SIZE) {
+		const uint8_t *packet = &job->data[offset];
+		uint16_t pid = CONVERT_TO_16(packet[1], packet[2]) & 0x1fff;
+
+		if (packet[0] != TS_SYNC_BYTE) {
+			TS_ERROR("lost sync at offset %zd", offset);
+			harness_destroy(priv);
+			return -EINVAL;
+		}
+		/* Only PSI is needed here, so don't bother the PES and carousel parsers */
+		if (pid != TS_PAT_PID && hashtable_get(priv->psi_parsers, pid) != (void *) pmt_parse)
+			continue;
+		harness_feed(priv, packet);
+
+		pat = hashtable_get(priv->psi_tables, TS_TABLE_IDENTITY(TS_PAT_PID, TS_PAT_TABLE_ID, 0, 0));
+		if (pat) {
+			complete = true;
+			for (uint16_t i=0; i<pat->num_programs && complete; ++i)
+				if (pat->programs[i].program_number)
+					complete = hashtable_get(priv->psi_tables,
+						TS_TABLE_IDENTITY(pat->programs[i].pid, TS_PMT_TABLE_ID, 0, 0)) != NULL;
+		}
+	}
+
+	if (! pat) {
+		TS_ERROR("no PAT found in the first %zd bytes", offset);
+		harness_destroy(priv);
+		return -ENOENT;
+	}
+	if (! complete)
+		fprintf(stderr, "Not all PMTs were found in the first %zd bytes, extracting the streams announced so far\n", offset);
+
+	for (int pid=0; pid<EXTRACT_NUM_PIDS; ++pid) {
+		parse_function_t parser = hashtable_get(priv->pes_parsers, pid);
+		const char *type = NULL;
+
+		if (parser == (parse_function_t) pes_parse_video)
+			type = "video";
+		else if (parser == (parse_function_t) pes_parse_audio)
+			type = "audio";
+		else if (hashtable_get(priv->psi_parsers, pid) == (void *) pes_parse_other)
+			type = "other";
+		if (! type)
+			continue;
+		if (job->num_streams == EXTRACT_MAX_STREAMS) {
+			TS_WARNING("too many streams, ignoring pid %#x", pid);
+			continue;
+		}
+
+		struct extract_stream *stream = &job->streams[job->num_streams];
+		stream->pid = pid;
+		stream->type = type;
+		asprintf(&stream->path, "%s/%#x.es", job->options.output_dir, pid);
+		job->stream_index[pid] = job->num_streams++;
+	}
+
+	harness_destroy(priv);
+	return 0;
+}
+
+/**
+ * Advances the PES state over the payload of one TS packet.
+ * @return the ES data held by the payload, with its length in @len, or NULL.
+ */
+static const uint8_t *extract_pes_payload(struct extract_pes *pes, bool pusi,
+		const uint8_t *payload, size_t *len)
+{
+	size_t skip;
+
+	if (pusi) {
+		if (*len < 6 || payload[0] || payload[1] || payload[2] != 0x01) {
+			pes->state = EXTRACT_PES_DISCARD;
+			return NULL;
+		}
+		switch (pes_identify_stream_id(payload[3])) {
+			case PES_PADDING_STREAM:
+				pes->state = EXTRACT_PES_DISCARD;
+				return NULL;
+			case PES_PROGRAM_STREAM_MAP:
+			case PES_PRIVATE_STREAM_2:
+			case PES_ECM_STREAM:
+			case PES_EMM_STREAM:
+			case PES_PROGRAM_STREAM_DIRECTORY:
+			case PES_DSMCC_STREAM:
+			case PES_H222_1_TYPE_E:
+				/* Packet data bytes follow PES_packet_length */
+				pes->header_left = 6;
+				break;
+			default:
+				if (*len < 9) {
+					pes->state = EXTRACT_PES_DISCARD;
+					return NULL;
+				}
+				pes->header_left = 9 + payload[8];
+				break;
+		}
+		pes->state = EXTRACT_PES_DATA;
+	}
+	if (pes->state != EXTRACT_PES_DATA)
+		return NULL;
+
+	skip = pes->header_left < *len ? pes->header_left : *len;
+	pes->header_left -= skip;
+	*len -= skip;
+	return &payload[skip];
+}
+
+/**
+ * Finds the continuity_counter of the last packet of @pid in the previous
+ * chunk, so that a duplicate packet split from its original by the chunk
+ * boundary is still recognized.
+ * @return the continuity_counter or -1 if not found.
+ */
+static int extract_previous_cc(struct extract_chunk *chunk, uint16_t pid)
+{
+	const uint8_t *limit = chunk->data - EXTRACT_MAX_LOOKBACK / EXTRACT_PACKET_SIZE * EXTRACT_PACKET_SIZE;
+	const uint8_t *packet;
+	size_t len;
+
+	if (limit < chunk->job->data)
+		limit = chunk->job->data;
+	for (packet = chunk->data - EXTRACT_PACKET_SIZE; packet >= limit; packet -= EXTRACT_PACKET_SIZE)
+		if ((CONVERT_TO_16(packet[1], packet[2]) & 0x1fff) == pid && extract_payload(packet, &len))
+			return packet[3] & 0x0f;
+	return -1;
+}
+
+static void *extract_worker(void *data)
+{
+	struct extract_chunk *chunk = (struct extract_chunk *) data;
+	struct extract_job *job = chunk->job;
+
+	for (size_t offset=0; offset<chunk->size; offset+=EXTRACT_PACKET_SIZE) {
+		const uint8_t *packet = &chunk->data[offset];
+		uint16_t pid = CONVERT_TO_16(packet[1], packet[2]) & 0x1fff;
+		int index = job->stream_index[pid];
+		const uint8_t *payload;
+		size_t len;
+
+		if (packet[0] != TS_SYNC_BYTE) {
+			TS_ERROR("lost sync at offset %zd", chunk->data + offset - job->data);
+			chunk->ret = -EINVAL;
+			break;
+		}
+		if (index < 0)
+			continue;
+		if ((packet[1] & 0x80) || (packet[3] & 0xc0)) {
+			/* transport_error_indicator or transport_scrambling_control set */
+			chunk->discarded_packets++;
+			continue;
+		}
+		payload = extract_payload(packet, &len);
+		if (! payload)
+			continue;
+
+		struct extract_part *part = &chunk->parts[index];
+		bool pusi = packet[1] & 0x40;
+		int cc = packet[3] & 0x0f;
+
+		if (! part->seen) {
+			part->seen = true;
+			if (chunk->index > 0)
+				part->last_cc = extract_previous_cc(chunk, pid);
+		}
+		if (cc == part->last_cc)
+			/* Duplicate packet */
+			continue;
+		part->last_cc = cc;
+
+		if (part->pes.state == EXTRACT_PES_UNKNOWN && ! pusi) {
+			/* Resolved once the state of the previous chunk is known */
+			if (buffer_append(part->head, (const char *) payload, len) < 0) {
+				chunk->ret = -ENOMEM;
+				break;
+			}
+			continue;
+		}
+
+		payload = extract_pes_payload(&part->pes, pusi, payload, &len);
+		if (payload && len && fwrite(payload, 1, len, part->fp) != len) {
+			chunk->ret = -errno;
+			break;
+		}
+	}
+
+	for (int i=0; i<job->num_streams; ++i) {
+		if (fclose(chunk->parts[i].fp) != 0 && chunk->ret == 0)
+			chunk->ret = -errno;
+		chunk->parts[i].fp = NULL;
+	}
+	return NULL;
+}
+
+static int extract_write_all(int fd, const void *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		data = (const char *) data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Appends the file at @path to @fd, in the kernel when the filesystem allows it.
+ */
+static int extract_append_file(int fd, const char *path)
+{
+	char buf[EXTRACT_WRITE_BUFFER_SIZE];
+	int ret = 0, in = open(path, O_RDONLY);
+	ssize_t n;
+
+	if (in < 0)
+		return -errno;
+	while ((n = copy_file_range(in, NULL, fd, NULL, 1 << 30, 0)) > 0)
+		;
+	if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+		ret = -errno;
+	else if (n < 0) {
+		while ((n = read(in, buf, sizeof(buf))) > 0 && (ret = extract_write_all(fd, buf, n)) == 0)
+			;
+		if (n < 0)
+			ret = -errno;
+	}
+	close(in);
+	return ret;
+}
+
+/**
+ * Builds the output file of one stream from the output of all chunks.
+ */
+static int extract_stitch(struct extract_job *job, int index)
+{
+	struct extract_stream *stream = &job->streams[index];
+	struct extract_pes pes = job->chunks[0].parts[index].pes;
+	struct stat st;
+	int fd, ret = 0;
+
+	/* The first chunk always knows its state, so its output goes first, unchanged */
+	if (rename(job->chunks[0].parts[index].path, stream->path) < 0)
+		return -errno;
+	/* Not O_APPEND: copy_file_range() refuses to write to such files */
+	fd = open(stream->path, O_WRONLY);
+	if (fd < 0 || lseek(fd, 0, SEEK_END) < 0)
+		return -errno;
+
+	for (int i=1; i<job->num_chunks && ret == 0; ++i) {
+		struct extract_part *part = &job->chunks[i].parts[index];
+		size_t len = part->head->current_size;
+		const uint8_t *data = extract_pes_payload(&pes, false,
+				(const uint8_t *) part->head->data, &len);
+
+		if (data && len)
+			ret = extract_write_all(fd, data, len);
+		if (ret == 0)
+			ret = extract_append_file(fd, part->path);
+		unlink(part->path);
+		if (part->pes.state != EXTRACT_PES_UNKNOWN)
+			pes = part->pes;
+	}
+
+	if (ret == 0 && fstat(fd, &st) == 0)
+		stream->bytes = st.st_size;
+	if (close(fd) < 0 && ret == 0)
+		ret = -errno;
+	return ret;
+}
+
+struct extract_stitcher {
+	struct extract_job *job;
+	int next_stream;
+	int ret;
+};
+
+static void *extract_stitch_thread(void *data)
+{
+	struct extract_stitcher *stitcher = (struct extract_stitcher *) data;
+	int index, ret;
+
+	while ((index = __atomic_fetch_add(&stitcher->next_stream, 1, __ATOMIC_RELAXED)) < stitcher->job->num_streams) {
+		ret = extract_stitch(stitcher->job, index);
+		if (ret < 0) {
+			TS_ERROR("%s: %s", stitcher->job->streams[index].path, strerror(-ret));
+			__atomic_store_n(&stitcher->ret, ret, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+static int extract_create_chunks(struct extract_job *job)
+{
+	size_t num_packets = job->size / EXTRACT_PACKET_SIZE;
+	size_t chunk_packets;
+
+	job->num_chunks = job->options.threads;
+	if (job->size / job->num_chunks < EXTRACT_MIN_CHUNK_SIZE)
+		job->num_chunks = job->size / EXTRACT_MIN_CHUNK_SIZE;
+	if (job->num_chunks == 0)
+		job->num_chunks = 1;
+	chunk_packets = num_packets / job->num_chunks;
+
+	job->chunks = (struct extract_chunk *) calloc(job->num_chunks, sizeof(struct extract_chunk));
+	if (! job->chunks)
+		return -ENOMEM;
+
+	for (int i=0; i<job->num_chunks; ++i) {
+		struct extract_chunk *chunk = &job->chunks[i];
+		chunk->job = job;
+		chunk->index = i;
+		chunk->data = &job->data[i * chunk_packets * EXTRACT_PACKET_SIZE];
+		chunk->size = (i == job->num_chunks - 1 ? num_packets - i * chunk_packets : chunk_packets) *
+			EXTRACT_PACKET_SIZE;
+
+		for (int j=0; j<job->num_streams; ++j) {
+			struct extract_part *part = &chunk->parts[j];
+			part->pes.state = i == 0 ? EXTRACT_PES_NONE : EXTRACT_PES_UNKNOWN;
+			part->last_cc = -1;
+			part->head = buffer_create(job->streams[j].pid, 0, true);
+			asprintf(&part->path, "%s/.%#x.es.%d", job->options.output_dir, job->streams[j].pid, i);
+			part->fp = fopen(part->path, "w");
+			if (! part->head || ! part->fp) {
+				int ret = part->fp ? -ENOMEM : -errno;
+				TS_ERROR("%s: %s", part->path, strerror(-ret));
+				return ret;
+			}
+			setvbuf(part->fp, NULL, _IOFBF, EXTRACT_WRITE_BUFFER_SIZE);
+		}
+	}
+	return 0;
+}
+
+static void extract_destroy_chunks(struct extract_job *job)
+{
+	for (int i=0; job->chunks && i<job->num_chunks; ++i) {
+		for (int j=0; j<job->num_streams; ++j) {
+			struct extract_part *part = &job->chunks[i].parts[j];
+			if (part->fp)
+				fclose(part->fp);
+			if (part->path)
+				unlink(part->path);
+			buffer_destroy(part->head);
+			free(part->path);
+		}
+	}
+	free(job->chunks);
+	job->chunks = NULL;
+}
+
+static double extract_seconds(uint64_t start_ns, uint64_t end_ns)
+{
+	return (end_ns - start_ns) / 1e9;
+}
+
+static int extract_run(struct extract_job *job)
+{
+	struct extract_stitcher stitcher = { job, 0, 0 };
+	pthread_t stitch_threads[EXTRACT_MAX_STREAMS];
+	uint64_t discarded_packets = 0;
+	uint64_t t0, t1, t2, t3;
+	int ret, num_stitchers;
+
+	t0 = stats_now();
+	ret = extract_prepass(job);
+	if (ret < 0)
+		return ret;
+	if (job->num_streams == 0) {
+		TS_ERROR("the PMTs don't announce any elementary streams");
+		return -ENOENT;
+	}
+
+	t1 = stats_now();
+	ret = extract_create_chunks(job);
+	for (int i=0; i<job->num_chunks && ret == 0; ++i)
+		if (pthread_create(&job->chunks[i].thread, NULL, extract_worker, &job->chunks[i]) != 0)
+			ret = -errno;
+	for (int i=0; i<job->num_chunks; ++i) {
+		if (job->chunks[i].thread) {
+			pthread_join(job->chunks[i].thread, NULL);
+			if (job->chunks[i].ret < 0 && ret == 0)
+				ret = job->chunks[i].ret;
+		}
+		discarded_packets += job->chunks[i].discarded_packets;
+	}
+
+	t2 = stats_now();
+	num_stitchers = job->options.threads < (uint32_t) job->num_streams ? job->options.threads : job->num_streams;
+	if (ret == 0) {
+		for (int i=0; i<num_stitchers; ++i)
+			pthread_create(&stitch_threads[i], NULL, extract_stitch_thread, &stitcher);
+		for (int i=0; i<num_stitchers; ++i)
+			pthread_join(stitch_threads[i], NULL);
+		ret = stitcher.ret;
+	}
+	t3 = stats_now();
+	extract_destroy_chunks(job);
+	if (ret < 0)
+		return ret;
+
+	fprintf(stderr, "%-8s %-6s %16s  %s\n", "PID", "Type", "Bytes", "File");
+	for (int i=0; i<job->num_streams; ++i)
+		fprintf(stderr, "%#-8x %-6s %16" PRIu64 "  %s\n", job->streams[i].pid,
+			job->streams[i].type, job->streams[i].bytes, job->streams[i].path);
+	if (discarded_packets)
+		fprintf(stderr, "%" PRIu64 " errored or scrambled packets discarded\n", discarded_packets);
+	fprintf(stderr, "PSI prepass %.2fs, demux %.2fs on %d threads (%.1f MB/s), stitching %.2fs\n",
+		extract_seconds(t0, t1), extract_seconds(t1, t2), job->num_chunks,
+		job->size / 1e6 / extract_seconds(t1, t2), extract_seconds(t2, t3));
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct extract_job *job;
+	struct stat st;
+	size_t start = 0;
+	uint8_t *data;
+	int opt, fd, ret;
+
+	job = (struct extract_job *) calloc(1, sizeof(struct extract_job));
+	assert(job);
+	job->options.output_dir = ".";
+	job->options.prepass_mb = EXTRACT_DEFAULT_PREPASS_MB;
+	job->options.threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "o:j:P:vh")) != -1) {
+		switch (opt) {
+			case 'o': job->options.output_dir = optarg; break;
+			case 'j': job->options.threads = atoi(optarg); break;
+			case 'P': job->options.prepass_mb = atoi(optarg); break;
+			case 'v': job->options.verbose = true; break;
+			default:  return extract_usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || job->options.threads == 0 || job->options.prepass_mb == 0)
+		return extract_usage(argv[0]);
+	job->options.input = argv[optind];
+	log_set_level(job->options.verbose ? LOG_LEVEL_WARNING : LOG_LEVEL_ERROR);
+
+	fd = open(job->options.input, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(job->options.input);
+		return 1;
+	}
+	data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", job->options.input, st.st_size ? strerror(errno) : "empty file");
+		return 1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	/* Chunks are cut at multiples of the packet size from the first sync byte */
+	while (start < EXTRACT_PACKET_SIZE && start + EXTRACT_PACKET_SIZE < (size_t) st.st_size &&
+			(data[start] != TS_SYNC_BYTE || data[start + EXTRACT_PACKET_SIZE] != TS_SYNC_BYTE))
+		start++;
+	job->data = &data[start];
+	job->size = (st.st_size - start) / EXTRACT_PACKET_SIZE * EXTRACT_PACKET_SIZE;
+	memset(job->stream_index, 0xff, sizeof(job->stream_index));
+
+	ret = extract_run(job);
+	if (ret < 0)
+		fprintf(stderr, "%s: %s\n", job->options.input, strerror(-ret));
+
+	for (int i=0; i<job->num_streams; ++i)
+		free(job->streams[i].path);
+	munmap(data, st.st_size);
+	free(job);
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "hash.h"
+#include "buffer.h"
+#include "ts.h"
+#include "stats.h"
+#include "mem.h"
+#include "harness.h"
+#include "tables/descriptors/descriptors.h"
+#include "dsm-cc/descriptors/descriptors.h"
+
+/* FIFO paths are resolved against this directory, which doesn't need to exist */
+#define HARNESS_MOUNT_POINT "/nonexistent/demuxfs-bench"
+
+static struct dentry *harness_create_rootfs(void)
+{
+	struct dentry *dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+
+	dentry->name = strdup("/");
+	dentry->inode = 1;
+	dentry->mode = S_IFDIR | 0555;
+	INIT_LIST_HEAD(&dentry->children);
+	INIT_LIST_HEAD(&dentry->xattrs);
+	INIT_LIST_HEAD(&dentry->list);
+
+	return dentry;
+}
+
+struct demuxfs_data *harness_new(void)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) calloc(1, sizeof(struct demuxfs_data));
+	assert(priv);
+
+	priv->options.standard = SBTVD_STANDARD;
+	priv->options.packet_size = 188;
+	priv->options.tmpdir = strdup(FS_DEFAULT_TMPDIR);
+	priv->mount_point = strdup(HARNESS_MOUNT_POINT);
+
+	priv->psi_tables = hashtable_new(DEMUXFS_MAX_PIDS);
+	hashtable_set_accounting(priv->psi_tables, MEM_TABLES);
+	priv->pes_tables = hashtable_new(DEMUXFS_MAX_PIDS);
+	priv->psi_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
+	priv->pes_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
+	priv->packet_buffer = hashtable_new(DEMUXFS_MAX_PIDS);
+	priv->ts_descriptors = descriptors_init(priv);
+	priv->dsmcc_descriptors = dsmcc_descriptors_init(priv);
+	priv->root = harness_create_rootfs();
+	priv->latency = stats_latency_new();
+	stats_create_dentries(priv);
+
+	return priv;
+}
+
+void harness_destroy(struct demuxfs_data *priv)
+{
+	descriptors_destroy(priv->ts_descriptors);
+	dsmcc_descriptors_destroy(priv->dsmcc_descriptors);
+	hashtable_destroy(priv->pes_parsers, NULL);
+	hashtable_destroy(priv->psi_parsers, NULL);
+	hashtable_destroy(priv->pes_tables, NULL);
+	hashtable_destroy(priv->psi_tables, (hashtable_free_function_t) free);
+	hashtable_destroy(priv->packet_buffer, (hashtable_free_function_t) buffer_destroy);
+	fsutils_dispose_tree(priv->root);
+	stats_latency_destroy(priv->latency);
+	free(priv->options.tmpdir);
+	free(priv->mount_point);
+	free(priv);
+}
+
+int harness_feed(struct demuxfs_data *priv, const uint8_t *packet)
+{
+	struct ts_header header;
+	int ret;
+
+	ts_decode_header(packet, &header);
+	priv->latency->packet_ingest_ns = stats_now();
+	ret = ts_parse_packet(&header, (const char *) &packet[4], priv);
+	return ret == -ENOBUFS ? 0 : ret;
+}
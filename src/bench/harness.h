@@ -0,0 +1,25 @@
+#ifndef __harness_h
+#define __harness_h
+
+/*
+ * Runs the demux pipeline in-process, without FUSE or a backend. Packets are
+ * handed to the same parsers the ts_parser_thread calls and the resulting
+ * tree is kept in memory, so that benchmarks can inspect it directly.
+ */
+
+/**
+ * Creates the parser state the same way demuxfs_init() does.
+ */
+struct demuxfs_data *harness_new(void);
+
+/**
+ * Releases everything allocated by harness_new() and by the parsers.
+ */
+void harness_destroy(struct demuxfs_data *priv);
+
+/**
+ * Parses one 188-byte TS packet.
+ */
+int harness_feed(struct demuxfs_data *priv, const uint8_t *packet);
+
+#endif /* __harness_h */
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "ts.h"
+#include "log.h"
+#include "mem.h"
+#include "stats.h"
+#include "harness.h"
+#include "tsgen.h"
+#include <getopt.h>
+#include <math.h>
+
+/*
+ * Long-running leak and slowdown check. The parser is fed hours of simulated
+ * time, either from the synthetic stream generator, whose tables change
+ * versions every few seconds, or from a capture file played in a loop. Memory
+ * usage is sampled periodically and the run fails if it keeps growing once
+ * the tree has reached its steady state.
+ */
+
+#define SOAK_MAX_DIRS 32
+
+struct soak_options {
+	double duration_hours;          /**< Simulated time to run for */
+	uint32_t sample_interval_s;     /**< Simulated time between samples */
+	uint32_t max_slope_kb;          /**< Maximum accounted memory growth, in KiB per simulated hour */
+	uint32_t max_rss_slope_kb;      /**< Maximum RSS growth, in KiB per simulated hour */
+	uint64_t bitrate;               /**< Bitrate used to convert capture file packets to time */
+	const char *input;              /**< Capture file to loop, or NULL to generate a stream */
+	struct tsgen_options tsgen;
+	bool verbose;
+};
+
+struct soak_sample {
+	double hours;                   /**< Simulated time */
+	double wall_seconds;
+	int64_t rss;
+	int64_t accounted;              /**< Subsystems plus the filesystem tree */
+	struct mem_usage subsystem[MEM_SUBSYSTEMS];
+	struct mem_usage tree;
+	double packets_per_second;      /**< Throughput since the previous sample */
+	int64_t dentries[SOAK_MAX_DIRS];
+};
+
+struct soak_run {
+	struct soak_options options;
+	struct demuxfs_data *priv;
+	struct soak_sample *samples;
+	size_t num_samples;
+	size_t max_samples;
+	/* Top-level directories seen so far. Dentry counts are indexed by position. */
+	char *dirs[SOAK_MAX_DIRS];
+	size_t num_dirs;
+	uint64_t packets;
+	uint64_t last_sample_packets;
+	uint64_t last_sample_ns;
+	uint64_t start_ns;
+};
+
+static int64_t soak_get_rss(void)
+{
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (! fp)
+		return 0;
+	if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+	return (int64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+static size_t soak_dir_index(struct soak_run *run, const char *name)
+{
+	size_t i;
+
+	for (i=0; i<run->num_dirs; ++i)
+		if (! strcmp(run->dirs[i], name))
+			return i;
+	if (run->num_dirs == SOAK_MAX_DIRS)
+		return SOAK_MAX_DIRS;
+	run->dirs[run->num_dirs] = strdup(name);
+	return run->num_dirs++;
+}
+
+static void soak_take_sample(struct soak_run *run, double hours)
+{
+	struct soak_sample *sample;
+	struct dentry *child;
+	uint64_t now = stats_now();
+
+	if (run->num_samples == run->max_samples) {
+		size_t max_samples = run->max_samples ? run->max_samples * 2 : 64;
+		struct soak_sample *samples = realloc(run->samples, max_samples * sizeof(*samples));
+		assert(samples);
+		run->samples = samples;
+		run->max_samples = max_samples;
+	}
+	sample = &run->samples[run->num_samples++];
+	memset(sample, 0, sizeof(*sample));
+
+	sample->hours = hours;
+	sample->wall_seconds = (now - run->start_ns) / 1e9;
+	sample->rss = soak_get_rss();
+	for (int i=0; i<MEM_SUBSYSTEMS; ++i) {
+		mem_get_usage(i, &sample->subsystem[i]);
+		sample->accounted += sample->subsystem[i].bytes;
+	}
+	list_for_each_entry(child, &run->priv->root->children, list) {
+		struct mem_usage usage = { 0, 0 };
+		size_t index = soak_dir_index(run, child->name);
+
+		mem_tree_usage(child, &usage);
+		if (index < SOAK_MAX_DIRS)
+			sample->dentries[index] = usage.objects;
+		sample->tree.bytes += usage.bytes;
+		sample->tree.objects += usage.objects;
+	}
+	sample->accounted += sample->tree.bytes;
+	if (now > run->last_sample_ns)
+		sample->packets_per_second = (run->packets - run->last_sample_packets) * 1e9 / (now - run->last_sample_ns);
+	run->last_sample_packets = run->packets;
+	run->last_sample_ns = now;
+
+	if (run->options.verbose) {
+		printf("%7.2fh %8.1fs rss=%" PRId64 "K accounted=%" PRId64 "K tree=%" PRId64 " dentries, %.0f packets/s:",
+			sample->hours, sample->wall_seconds, sample->rss / 1024, sample->accounted / 1024,
+			sample->tree.objects, sample->packets_per_second);
+		for (size_t i=0; i<run->num_dirs; ++i)
+			printf(" %s=%" PRId64, run->dirs[i], sample->dentries[i]);
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+/**
+ * Least-squares slope of the values selected by @offset, in units per
+ * simulated hour, over samples [first, last).
+ */
+static double soak_slope(struct soak_run *run, size_t first, size_t last, size_t offset)
+{
+	double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, n = last - first;
+
+	if (n < 2)
+		return 0;
+	for (size_t i=first; i<last; ++i) {
+		double x = run->samples[i].hours;
+		double y = *(int64_t *) ((char *) &run->samples[i] + offset);
+		sum_x += x;
+		sum_y += y;
+		sum_xx += x * x;
+		sum_xy += x * y;
+	}
+	double denominator = n * sum_xx - sum_x * sum_x;
+	return denominator != 0 ? (n * sum_xy - sum_x * sum_y) / denominator : 0;
+}
+
+static double soak_mean_throughput(struct soak_run *run, size_t first, size_t last)
+{
+	double sum = 0;
+
+	for (size_t i=first; i<last; ++i)
+		sum += run->samples[i].packets_per_second;
+	return last > first ? sum / (last - first) : 0;
+}
+
+/**
+ * Prints the summary of the run.
+ * Returns 0 if memory stayed within the configured slopes or 1 otherwise.
+ */
+static int soak_report(struct soak_run *run)
+{
+	struct soak_options *options = &run->options;
+	size_t n = run->num_samples, first = n / 2;
+	struct soak_sample *head, *tail;
+	int ret = 0;
+
+	if (n < 4) {
+		fprintf(stderr, "Not enough samples (%zu) to evaluate the run, increase the duration\n", n);
+		return 1;
+	}
+	head = &run->samples[first];
+	tail = &run->samples[n-1];
+
+	/* Memory growth is only measured over the second half, once every table has been published */
+	double accounted_slope = soak_slope(run, first, n, offsetof(struct soak_sample, accounted));
+	double rss_slope = soak_slope(run, first, n, offsetof(struct soak_sample, rss));
+
+	printf("\nSimulated %.2f hours in %.1f seconds, %" PRIu64 " packets\n",
+		tail->hours, tail->wall_seconds, run->packets);
+	printf("\n%-12s %14s %14s %16s\n", "Memory", "Midpoint", "End", "Slope (KiB/h)");
+	printf("%-12s %13" PRId64 "K %13" PRId64 "K %16.1f\n", "rss",
+		head->rss / 1024, tail->rss / 1024, rss_slope / 1024);
+	printf("%-12s %13" PRId64 "K %13" PRId64 "K %16.1f\n", "accounted",
+		head->accounted / 1024, tail->accounted / 1024, accounted_slope / 1024);
+	for (int i=0; i<MEM_SUBSYSTEMS; ++i) {
+		size_t offset = offsetof(struct soak_sample, subsystem) + i * sizeof(struct mem_usage);
+		printf("%-12s %13" PRId64 "K %13" PRId64 "K %16.1f   %" PRId64 " -> %" PRId64 " objects\n",
+			mem_subsystem_name(i), head->subsystem[i].bytes / 1024, tail->subsystem[i].bytes / 1024,
+			soak_slope(run, first, n, offset) / 1024,
+			head->subsystem[i].objects, tail->subsystem[i].objects);
+	}
+	printf("%-12s %13" PRId64 "K %13" PRId64 "K %16.1f   %" PRId64 " -> %" PRId64 " dentries\n", "tree",
+		head->tree.bytes / 1024, tail->tree.bytes / 1024,
+		soak_slope(run, first, n, offsetof(struct soak_sample, tree.bytes)) / 1024,
+		head->tree.objects, tail->tree.objects);
+
+	printf("\n%-12s %14s %14s %16s\n", "Directory", "Midpoint", "End", "Slope (/h)");
+	for (size_t d=0; d<run->num_dirs; ++d) {
+		size_t offset = offsetof(struct soak_sample, dentries) + d * sizeof(int64_t);
+		printf("%-12s %14" PRId64 " %14" PRId64 " %16.1f\n", run->dirs[d],
+			head->dentries[d], tail->dentries[d], soak_slope(run, first, n, offset));
+	}
+
+	/* The first sample covers the warmup, so it's left out of the throughput figures */
+	double mean = soak_mean_throughput(run, 1, n), variance = 0;
+	double min = run->samples[1].packets_per_second, max = min;
+	for (size_t i=1; i<n; ++i) {
+		double pps = run->samples[i].packets_per_second;
+		variance += (pps - mean) * (pps - mean);
+		min = pps < min ? pps : min;
+		max = pps > max ? pps : max;
+	}
+	variance /= n - 1;
+	size_t quarter = (n - 1) / 4 ? (n - 1) / 4 : 1;
+	double first_quarter = soak_mean_throughput(run, 1, 1 + quarter);
+	double last_quarter = soak_mean_throughput(run, n - quarter, n);
+
+	printf("\nThroughput: mean %.0f packets/s, min %.0f, max %.0f, coefficient of variation %.1f%%\n",
+		mean, min, max, mean ? 100 * sqrt(variance) / mean : 0);
+	printf("Last quarter runs at %.1f%% of the first quarter's throughput\n",
+		first_quarter ? 100 * last_quarter / first_quarter : 0);
+
+	if (accounted_slope / 1024 > options->max_slope_kb) {
+		printf("FAIL: accounted memory grows %.1f KiB/h, limit is %u KiB/h\n",
+			accounted_slope / 1024, options->max_slope_kb);
+		ret = 1;
+	}
+	if (rss_slope / 1024 > options->max_rss_slope_kb) {
+		printf("FAIL: RSS grows %.1f KiB/h, limit is %u KiB/h\n",
+			rss_slope / 1024, options->max_rss_slope_kb);
+		ret = 1;
+	}
+	if (ret == 0)
+		printf("PASS\n");
+	return ret;
+}
+
+static int soak_run_generator(struct soak_run *run)
+{
+	struct soak_options *options = &run->options;
+	uint64_t total_ticks = options->duration_hours * 3600 * 1000 / TSGEN_TICK_MS;
+	uint64_t sample_ticks = (uint64_t) options->sample_interval_s * 1000 / TSGEN_TICK_MS;
+	struct tsgen *gen = tsgen_new(&options->tsgen);
+
+	if (! gen)
+		return -ENOMEM;
+	if (! sample_ticks)
+		sample_ticks = 1;
+
+	for (uint64_t tick=1; tick<=total_ticks; ++tick) {
+		const uint8_t *packets;
+		size_t num_packets = tsgen_tick(gen, &packets);
+
+		for (size_t i=0; i<num_packets; ++i) {
+			int ret = harness_feed(run->priv, &packets[i * 188]);
+			if (ret < 0) {
+				fprintf(stderr, "Error parsing generated packet: %s\n", strerror(-ret));
+				tsgen_free(gen);
+				return ret;
+			}
+		}
+		run->packets += num_packets;
+		if ((tick % sample_ticks) == 0)
+			soak_take_sample(run, tick * TSGEN_TICK_MS / 3600000.0);
+	}
+	printf("%" PRIu64 " version changes generated\n", tsgen_versions(gen));
+	tsgen_free(gen);
+	return 0;
+}
+
+/**
+ * Reads the next packet from @fp, rewinding on EOF like filesrc does with
+ * fileloop=-1.
+ */
+static int soak_read_packet(FILE *fp, uint8_t *packet)
+{
+	for (int attempts=0; attempts<2; ++attempts) {
+		int c;
+		while ((c = fgetc(fp)) != EOF && c != TS_SYNC_BYTE)
+			;
+		if (c == TS_SYNC_BYTE && fread(&packet[1], 187, 1, fp) == 1) {
+			packet[0] = TS_SYNC_BYTE;
+			return 0;
+		}
+		rewind(fp);
+	}
+	return -ENODATA;
+}
+
+static int soak_run_capture(struct soak_run *run)
+{
+	struct soak_options *options = &run->options;
+	uint64_t packets_per_hour = options->bitrate * 3600 / (188 * 8);
+	uint64_t total_packets = options->duration_hours * packets_per_hour;
+	uint64_t sample_packets = (uint64_t) options->sample_interval_s * packets_per_hour / 3600;
+	uint8_t packet[188];
+	FILE *fp = fopen(options->input, "r");
+
+	if (! fp) {
+		perror(options->input);
+		return -errno;
+	}
+	if (! sample_packets)
+		sample_packets = 1;
+
+	while (run->packets < total_packets) {
+		int ret = soak_read_packet(fp, packet);
+		if (ret < 0) {
+			fprintf(stderr, "%s: no transport stream packets found\n", options->input);
+			fclose(fp);
+			return ret;
+		}
+		/* Errors in captures are reported by the parsers themselves */
+		harness_feed(run->priv, packet);
+		if ((++run->packets % sample_packets) == 0)
+			soak_take_sample(run, (double) run->packets / packets_per_hour);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void soak_usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [options]\n\n"
+			"    -d HOURS      simulated time to run for (default: 4)\n"
+			"    -s SECONDS    simulated time between samples (default: 300)\n"
+			"    -m KIB        fail if accounted memory grows faster than KIB per simulated hour (default: 64)\n"
+			"    -M KIB        fail if the RSS grows faster than KIB per simulated hour (default: 1024)\n"
+			"    -i FILE       loop FILE instead of generating a stream\n"
+			"    -r BITRATE    bitrate of FILE in bits per second, used to compute simulated time (default: 19000000)\n"
+			"    -c SECONDS    simulated time between version changes of the generated tables (default: 2)\n"
+			"    -t LIST       comma-separated list of tables that change versions: pmt, eit, ait, carousel, all or none (default: all)\n"
+			"    -p            generate PES packets on the audio and video PIDs\n"
+			"    -v            print every sample\n", argv0);
+}
+
+int main(int argc, char **argv)
+{
+	struct soak_run run;
+	int opt, ret;
+
+	memset(&run, 0, sizeof(run));
+	run.options.duration_hours = 4;
+	run.options.sample_interval_s = 300;
+	run.options.max_slope_kb = 64;
+	run.options.max_rss_slope_kb = 1024;
+	run.options.bitrate = 19000000;
+	run.options.tsgen.churn_interval_ms = 2000;
+	run.options.tsgen.churn_mask = TSGEN_CHURN_ALL;
+
+	while ((opt = getopt(argc, argv, "d:s:m:M:i:r:c:t:pvh")) != -1) {
+		switch (opt) {
+			case 'd': run.options.duration_hours = atof(optarg); break;
+			case 's': run.options.sample_interval_s = atoi(optarg); break;
+			case 'm': run.options.max_slope_kb = atoi(optarg); break;
+			case 'M': run.options.max_rss_slope_kb = atoi(optarg); break;
+			case 'i': run.options.input = optarg; break;
+			case 'r': run.options.bitrate = strtoull(optarg, NULL, 10); break;
+			case 'c': run.options.tsgen.churn_interval_ms = atof(optarg) * 1000; break;
+			case 'p': run.options.tsgen.pes = true; break;
+			case 'v': run.options.verbose = true; break;
+			case 't':
+				ret = tsgen_parse_churn_mask(optarg);
+				if (ret < 0) {
+					fprintf(stderr, "Invalid table list '%s'\n", optarg);
+					return 1;
+				}
+				run.options.tsgen.churn_mask = ret;
+				break;
+			default:
+				soak_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (run.options.duration_hours <= 0 || run.options.bitrate < 188 * 8) {
+		soak_usage(argv[0]);
+		return 1;
+	}
+
+	/* The parsers are chatty at the default level, which would dominate the run time */
+	log_set_level(run.options.verbose ? LOG_LEVEL_WARNING : LOG_LEVEL_ERROR);
+
+	run.priv = harness_new();
+	run.start_ns = run.last_sample_ns = stats_now();
+	soak_take_sample(&run, 0);
+
+	ret = run.options.input ? soak_run_capture(&run) : soak_run_generator(&run);
+	if (ret == 0)
+		ret = soak_report(&run);
+	else
+		ret = 1;
+
+	harness_destroy(run.priv);
+	for (size_t i=0; i<run.num_dirs; ++i)
+		free(run.dirs[i]);
+	free(run.samples);
+	return ret;
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "ts.h"
+#include "crc32.h"
+#include "tsgen.h"
+
+#define TSGEN_PACKET_SIZE      188
+#define TSGEN_MAX_SECTION_SIZE 4096
+#define TSGEN_NUM_PIDS         8192
+
+/* Repetition intervals, in ticks */
+#define TSGEN_EIT_INTERVAL     2
+#define TSGEN_DII_INTERVAL     5
+#define TSGEN_CAROUSEL_CYCLE   10
+
+#define TSGEN_TRANSPORT_STREAM_ID 0x0001
+#define TSGEN_PROGRAM_NUMBER      0x0001
+#define TSGEN_BLOCK_SIZE          1024
+/* Carousels keep their downloadId, updates are signalled by transactionId and module versions */
+#define TSGEN_DOWNLOAD_ID         0x00000001
+
+/* Sizes of the carousel modules. The first one spans several blocks. */
+static const uint32_t tsgen_module_sizes[] = { 3000, 1500 };
+#define TSGEN_NUM_MODULES (sizeof(tsgen_module_sizes) / sizeof(tsgen_module_sizes[0]))
+
+struct tsgen {
+	struct tsgen_options options;
+	uint64_t ticks;
+	uint64_t versions;
+	uint32_t churn_ticks;
+	/* Version numbers, incremented on each churn */
+	uint8_t pmt_version;
+	uint8_t eit_version;
+	uint8_t ait_version;
+	uint8_t dii_version;
+	uint8_t module_version;
+	bool extra_audio;
+	/* Continuity counters */
+	uint8_t continuity_counter[TSGEN_NUM_PIDS];
+	/* Packets generated by the current tick */
+	uint8_t *packets;
+	size_t num_packets;
+	size_t max_packets;
+	/* Scratch space in which sections are built */
+	uint8_t section[TSGEN_MAX_SECTION_SIZE];
+};
+
+static uint8_t *tsgen_new_packet(struct tsgen *gen, uint16_t pid, bool payload_unit_start)
+{
+	uint8_t *packet;
+
+	if (gen->num_packets == gen->max_packets) {
+		size_t max_packets = gen->max_packets ? gen->max_packets * 2 : 64;
+		uint8_t *packets = realloc(gen->packets, max_packets * TSGEN_PACKET_SIZE);
+		assert(packets);
+		gen->packets = packets;
+		gen->max_packets = max_packets;
+	}
+	packet = &gen->packets[gen->num_packets++ * TSGEN_PACKET_SIZE];
+	packet[0] = TS_SYNC_BYTE;
+	packet[1] = (payload_unit_start ? 0x40 : 0x00) | ((pid >> 8) & 0x1f);
+	packet[2] = pid & 0xff;
+	/* Payload only */
+	packet[3] = 0x10 | gen->continuity_counter[pid];
+	gen->continuity_counter[pid] = (gen->continuity_counter[pid] + 1) & 0x0f;
+	return packet;
+}
+
+/**
+ * Splits a section in as many TS packets as needed. Every section starts
+ * in a new packet, so the pointer_field is always zero.
+ */
+static void tsgen_put_section(struct tsgen *gen, uint16_t pid, const uint8_t *section, size_t len)
+{
+	size_t offset = 0;
+	bool first = true;
+
+	while (offset < len) {
+		uint8_t *packet = tsgen_new_packet(gen, pid, first);
+		size_t pos = 4, room, chunk;
+
+		if (first)
+			packet[pos++] = 0;
+		room = TSGEN_PACKET_SIZE - pos;
+		chunk = len - offset < room ? len - offset : room;
+		memcpy(&packet[pos], &section[offset], chunk);
+		memset(&packet[pos + chunk], 0xff, room - chunk);
+		offset += chunk;
+		first = false;
+	}
+}
+
+static void tsgen_put_pes(struct tsgen *gen, uint16_t pid, uint8_t stream_id)
+{
+	uint8_t *packet = tsgen_new_packet(gen, pid, true);
+	uint8_t *pes = &packet[4];
+
+	memset(pes, 0, TSGEN_PACKET_SIZE - 4);
+	/* packet_start_code_prefix, stream_id and an unbounded PES_packet_length */
+	pes[2] = 0x01;
+	pes[3] = stream_id;
+	/* '10', no scrambling, no PTS/DTS and no header data */
+	pes[6] = 0x80;
+}
+
+/**
+ * Writes the long section header. The section_length field is filled in
+ * by tsgen_section_finish().
+ */
+static size_t tsgen_section_start(uint8_t *s, uint8_t table_id, uint16_t identifier,
+		uint8_t version, uint8_t section_number, uint8_t last_section_number)
+{
+	s[0] = table_id;
+	s[1] = 0xb0;
+	s[2] = 0x00;
+	s[3] = identifier >> 8;
+	s[4] = identifier & 0xff;
+	s[5] = 0xc0 | ((version & 0x1f) << 1) | 0x01;
+	s[6] = section_number;
+	s[7] = last_section_number;
+	return 8;
+}
+
+static size_t tsgen_section_finish(uint8_t *s, size_t len)
+{
+	uint16_t section_length = len + 4 - 3;
+	uint32_t crc;
+
+	s[1] = (s[1] & 0xf0) | ((section_length >> 8) & 0x0f);
+	s[2] = section_length & 0xff;
+	crc = crc32_calc((const char *) s, len);
+	s[len++] = crc >> 24;
+	s[len++] = crc >> 16;
+	s[len++] = crc >> 8;
+	s[len++] = crc;
+	return len;
+}
+
+static inline size_t tsgen_put16(uint8_t *s, size_t i, uint16_t value)
+{
+	s[i] = value >> 8;
+	s[i+1] = value & 0xff;
+	return i + 2;
+}
+
+static inline size_t tsgen_put32(uint8_t *s, size_t i, uint32_t value)
+{
+	s[i] = value >> 24;
+	s[i+1] = value >> 16;
+	s[i+2] = value >> 8;
+	s[i+3] = value & 0xff;
+	return i + 4;
+}
+
+static void tsgen_put_pat(struct tsgen *gen)
+{
+	uint8_t *s = gen->section;
+	size_t i = tsgen_section_start(s, TS_PAT_TABLE_ID, TSGEN_TRANSPORT_STREAM_ID, 0, 0, 0);
+
+	i = tsgen_put16(s, i, TSGEN_PROGRAM_NUMBER);
+	i = tsgen_put16(s, i, 0xe000 | TSGEN_PMT_PID);
+	tsgen_put_section(gen, TS_PAT_PID, s, tsgen_section_finish(s, i));
+}
+
+static size_t tsgen_put_pmt_stream(uint8_t *s, size_t i, uint8_t stream_type, uint16_t pid)
+{
+	s[i++] = stream_type;
+	i = tsgen_put16(s, i, 0xe000 | pid);
+	/* No ES descriptors */
+	return tsgen_put16(s, i, 0xf000);
+}
+
+static void tsgen_put_pmt(struct tsgen *gen)
+{
+	uint8_t *s = gen->section;
+	size_t i = tsgen_section_start(s, TS_PMT_TABLE_ID, TSGEN_PROGRAM_NUMBER, gen->pmt_version, 0, 0);
+
+	i = tsgen_put16(s, i, 0xe000 | TSGEN_VIDEO_PID);
+	i = tsgen_put16(s, i, 0xf000);
+	/* H.264 video, AAC audio and an object carousel */
+	i = tsgen_put_pmt_stream(s, i, 0x1b, TSGEN_VIDEO_PID);
+	i = tsgen_put_pmt_stream(s, i, 0x0f, TSGEN_AUDIO_PID);
+	if (gen->extra_audio)
+		i = tsgen_put_pmt_stream(s, i, 0x0f, TSGEN_EXTRA_AUDIO_PID);
+	i = tsgen_put_pmt_stream(s, i, 0x0b, TSGEN_CAROUSEL_PID);
+	tsgen_put_section(gen, TSGEN_PMT_PID, s, tsgen_section_finish(s, i));
+}
+
+static inline uint8_t tsgen_bcd(unsigned value)
+{
+	return ((value / 10) << 4) | (value % 10);
+}
+
+/**
+ * EIT present/following. Event names and start times change with each
+ * version, so the dentries created for them differ between versions.
+ */
+static void tsgen_put_eit(struct tsgen *gen)
+{
+	uint64_t seconds = gen->ticks * TSGEN_TICK_MS / 1000;
+
+	for (uint8_t section_number=0; section_number<2; ++section_number) {
+		uint8_t *s = gen->section;
+		char name[32];
+		int name_len = snprintf(name, sizeof(name), "Event %u/%u", gen->eit_version, section_number);
+		uint64_t start = seconds + section_number * 300;
+		size_t i = tsgen_section_start(s, TS_H_EIT_P_F_TABLE_ID, TSGEN_PROGRAM_NUMBER,
+				gen->eit_version, section_number, 1);
+
+		i = tsgen_put16(s, i, TSGEN_TRANSPORT_STREAM_ID);
+		/* original_network_id, segment_last_section_number and last_table_id */
+		i = tsgen_put16(s, i, 0x0001);
+		s[i++] = 1;
+		s[i++] = TS_H_EIT_P_F_TABLE_ID;
+
+		/* Event: MJD plus BCD start time, 5 minutes long */
+		i = tsgen_put16(s, i, (gen->eit_version << 8) | section_number);
+		i = tsgen_put16(s, i, 60000 + (start / 86400));
+		s[i++] = tsgen_bcd((start / 3600) % 24);
+		s[i++] = tsgen_bcd((start / 60) % 60);
+		s[i++] = tsgen_bcd(start % 60);
+		s[i++] = 0x00;
+		s[i++] = 0x05;
+		s[i++] = 0x00;
+
+		/* running_status, free_CA_mode and a short event descriptor */
+		uint16_t descriptors_loop_length = 2 + 3 + 1 + name_len + 1;
+		i = tsgen_put16(s, i, ((section_number == 0 ? 4 : 1) << 13) | descriptors_loop_length);
+		s[i++] = 0x4d;
+		s[i++] = descriptors_loop_length - 2;
+		memcpy(&s[i], "por", 3);
+		i += 3;
+		s[i++] = name_len;
+		memcpy(&s[i], name, name_len);
+		i += name_len;
+		s[i++] = 0;
+		tsgen_put_section(gen, TS_H_EIT_PID, s, tsgen_section_finish(s, i));
+	}
+}
+
+static void tsgen_put_ait(struct tsgen *gen)
+{
+	uint8_t *s = gen->section;
+	/* Ginga-J application type, no common descriptors and no applications */
+	size_t i = tsgen_section_start(s, TS_AIT_TABLE_ID, 0x000a, gen->ait_version, 0, 0);
+
+	i = tsgen_put16(s, i, 0xf000);
+	i = tsgen_put16(s, i, 0xf000);
+	tsgen_put_section(gen, TSGEN_CAROUSEL_PID, s, tsgen_section_finish(s, i));
+}
+
+static size_t tsgen_put_dsmcc_header(uint8_t *s, size_t i, uint16_t message_id,
+		uint32_t transaction_or_download_id, uint16_t message_length)
+{
+	s[i++] = 0x11;
+	s[i++] = 0x03;
+	i = tsgen_put16(s, i, message_id);
+	i = tsgen_put32(s, i, transaction_or_download_id);
+	s[i++] = 0xff;
+	s[i++] = 0x00;
+	return tsgen_put16(s, i, message_length);
+}
+
+static void tsgen_put_dii(struct tsgen *gen)
+{
+	uint8_t *s = gen->section;
+	uint32_t transaction_id = 0x80000000 | (gen->dii_version << 1);
+	size_t i = tsgen_section_start(s, TS_DII_TABLE_ID, transaction_id & 0xffff, gen->dii_version, 0, 0);
+	size_t message_start;
+
+	i = tsgen_put_dsmcc_header(s, i, 0x1002, transaction_id, 0);
+	message_start = i;
+	i = tsgen_put32(s, i, TSGEN_DOWNLOAD_ID);
+	i = tsgen_put16(s, i, TSGEN_BLOCK_SIZE);
+	/* windowSize, ackPeriod, tCDownloadWindow and tCDownloadScenario */
+	s[i++] = 0;
+	s[i++] = 0;
+	i = tsgen_put32(s, i, 0);
+	i = tsgen_put32(s, i, 0);
+	/* Empty compatibility descriptor */
+	i = tsgen_put16(s, i, 0);
+	i = tsgen_put16(s, i, TSGEN_NUM_MODULES);
+	for (uint16_t m=0; m<TSGEN_NUM_MODULES; ++m) {
+		i = tsgen_put16(s, i, m + 1);
+		i = tsgen_put32(s, i, tsgen_module_sizes[m]);
+		s[i++] = gen->module_version;
+		s[i++] = 0;
+	}
+	/* No private data */
+	i = tsgen_put16(s, i, 0);
+	tsgen_put16(s, message_start - 2, i - message_start);
+	tsgen_put_section(gen, TSGEN_CAROUSEL_PID, s, tsgen_section_finish(s, i));
+}
+
+static void tsgen_put_ddb(struct tsgen *gen, uint16_t module_id, uint32_t module_size)
+{
+	uint16_t num_blocks = (module_size + TSGEN_BLOCK_SIZE - 1) / TSGEN_BLOCK_SIZE;
+
+	for (uint16_t block=0; block<num_blocks; ++block) {
+		uint8_t *s = gen->section;
+		uint32_t block_size = module_size - block * TSGEN_BLOCK_SIZE;
+		size_t i;
+
+		if (block_size > TSGEN_BLOCK_SIZE)
+			block_size = TSGEN_BLOCK_SIZE;
+		i = tsgen_section_start(s, TS_DDB_TABLE_ID, module_id, gen->module_version,
+				block & 0xff, (num_blocks - 1) & 0xff);
+		i = tsgen_put_dsmcc_header(s, i, 0x1003, TSGEN_DOWNLOAD_ID, 6 + block_size);
+		i = tsgen_put16(s, i, module_id);
+		s[i++] = gen->module_version;
+		s[i++] = 0xff;
+		i = tsgen_put16(s, i, block);
+		memset(&s[i], (uint8_t) gen->versions, block_size);
+		i += block_size;
+		tsgen_put_section(gen, TSGEN_CAROUSEL_PID, s, tsgen_section_finish(s, i));
+	}
+}
+
+static void tsgen_churn(struct tsgen *gen)
+{
+	uint32_t mask = gen->options.churn_mask;
+
+	if (mask & TSGEN_CHURN_PMT) {
+		gen->pmt_version = (gen->pmt_version + 1) & 0x1f;
+		gen->extra_audio = ! gen->extra_audio;
+	}
+	if (mask & TSGEN_CHURN_EIT)
+		gen->eit_version = (gen->eit_version + 1) & 0x1f;
+	if (mask & TSGEN_CHURN_AIT)
+		gen->ait_version = (gen->ait_version + 1) & 0x1f;
+	if (mask & TSGEN_CHURN_CAROUSEL) {
+		gen->dii_version = (gen->dii_version + 1) & 0x1f;
+		gen->module_version++;
+	}
+	gen->versions++;
+}
+
+size_t tsgen_tick(struct tsgen *gen, const uint8_t **packets)
+{
+	uint64_t tick = gen->ticks;
+
+	gen->num_packets = 0;
+	if (gen->churn_ticks && tick && (tick % gen->churn_ticks) == 0)
+		tsgen_churn(gen);
+
+	tsgen_put_pat(gen);
+	tsgen_put_pmt(gen);
+	if ((tick % TSGEN_EIT_INTERVAL) == 0)
+		tsgen_put_eit(gen);
+	if ((tick % TSGEN_CAROUSEL_CYCLE) == 0) {
+		tsgen_put_ait(gen);
+		for (uint16_t m=0; m<TSGEN_NUM_MODULES; ++m)
+			tsgen_put_ddb(gen, m + 1, tsgen_module_sizes[m]);
+	}
+	if ((tick % TSGEN_DII_INTERVAL) == 0)
+		tsgen_put_dii(gen);
+	if (gen->options.pes) {
+		tsgen_put_pes(gen, TSGEN_VIDEO_PID, 0xe0);
+		tsgen_put_pes(gen, TSGEN_AUDIO_PID, 0xc0);
+		if (gen->extra_audio)
+			tsgen_put_pes(gen, TSGEN_EXTRA_AUDIO_PID, 0xc1);
+	}
+
+	gen->ticks++;
+	*packets = gen->packets;
+	return gen->num_packets;
+}
+
+uint64_t tsgen_versions(struct tsgen *gen)
+{
+	return gen->versions;
+}
+
+int tsgen_parse_churn_mask(const char *list)
+{
+	char *copy = strdup(list), *saveptr = NULL, *name;
+	int mask = 0;
+
+	for (name = strtok_r(copy, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		if (! strcasecmp(name, "pmt"))
+			mask |= TSGEN_CHURN_PMT;
+		else if (! strcasecmp(name, "eit"))
+			mask |= TSGEN_CHURN_EIT;
+		else if (! strcasecmp(name, "ait"))
+			mask |= TSGEN_CHURN_AIT;
+		else if (! strcasecmp(name, "carousel"))
+			mask |= TSGEN_CHURN_CAROUSEL;
+		else if (! strcasecmp(name, "all"))
+			mask |= TSGEN_CHURN_ALL;
+		else if (strcasecmp(name, "none")) {
+			mask = -1;
+			break;
+		}
+	}
+	free(copy);
+	return mask;
+}
+
+struct tsgen *tsgen_new(const struct tsgen_options *options)
+{
+	struct tsgen *gen = calloc(1, sizeof(struct tsgen));
+	if (! gen)
+		return NULL;
+
+	gen->options = *options;
+	gen->churn_ticks = options->churn_interval_ms / TSGEN_TICK_MS;
+	if (options->churn_interval_ms && ! gen->churn_ticks)
+		gen->churn_ticks = 1;
+	return gen;
+}
+
+void tsgen_free(struct tsgen *gen)
+{
+	if (gen) {
+		free(gen->packets);
+		free(gen);
+	}
+}
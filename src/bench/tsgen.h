@@ -0,0 +1,66 @@
+#ifndef __tsgen_h
+#define __tsgen_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Simulated time covered by each call to tsgen_tick() */
+#define TSGEN_TICK_MS 100
+
+#define TSGEN_PMT_PID         0x100
+#define TSGEN_VIDEO_PID       0x101
+#define TSGEN_AUDIO_PID       0x102
+#define TSGEN_CAROUSEL_PID    0x103
+#define TSGEN_EXTRA_AUDIO_PID 0x104
+
+/* Tables whose versions change every churn interval */
+enum tsgen_churn {
+	TSGEN_CHURN_PMT      = (1 << 0),
+	TSGEN_CHURN_EIT      = (1 << 1),
+	TSGEN_CHURN_AIT      = (1 << 2),
+	TSGEN_CHURN_CAROUSEL = (1 << 3),
+	TSGEN_CHURN_ALL      = 0x0f,
+};
+
+struct tsgen_options {
+	uint32_t churn_interval_ms;    /**< Simulated time between version changes, 0 disables churn */
+	uint32_t churn_mask;           /**< Bitmask of enum tsgen_churn */
+	bool pes;                      /**< Emit PES packets on the audio and video PIDs */
+};
+
+/**
+ * Synthetic transport stream: one program with video, audio and an object
+ * carousel PID carrying AIT, DII and DDB sections, plus EIT present/following
+ * on PID 0x12. Every churn interval the PMT toggles an extra audio stream and
+ * the other tables get new versions, so that each interval replaces the
+ * current version of every table in the filesystem.
+ *
+ * The carousel modules are opaque blocks rather than BIOP messages: they go
+ * through the DII/DDB bookkeeping and the /DSM-CC publication path, but no
+ * files are extracted from them.
+ */
+struct tsgen;
+
+struct tsgen *tsgen_new(const struct tsgen_options *options);
+void tsgen_free(struct tsgen *gen);
+
+/**
+ * Generates the packets that make up the next TSGEN_TICK_MS of the stream.
+ * @packets: set to an array of 188-byte packets, valid until the next call.
+ * Returns the number of packets in the array.
+ */
+size_t tsgen_tick(struct tsgen *gen, const uint8_t **packets);
+
+/**
+ * Number of version changes applied so far.
+ */
+uint64_t tsgen_versions(struct tsgen *gen);
+
+/**
+ * Parses a comma-separated list of table names (pmt, eit, ait, carousel, all
+ * or none) into a churn mask. Returns -1 if a name isn't recognized.
+ */
+int tsgen_parse_churn_mask(const char *list);
+
+#endif /* __tsgen_h */
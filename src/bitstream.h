@@ -0,0 +1,202 @@
+#ifndef __bitstream_h
+#define __bitstream_h
+
+/*
+ * Bounds-checked reader of big-endian fields. Reading past the end of the
+ * data returns zeros, moves to the end and sets a sticky error flag instead of
+ * touching memory beyond it, so that a parser can read a whole structure and
+ * check bitstream_error() once, and loops that run while there is data left
+ * always terminate. Fields are loaded unaligned and byte-swapped with
+ * __builtin_bswap, and the bounds check selects between the data and a block
+ * of zeros without branching.
+ *
+ * Bit reads keep a cursor within the current byte. Byte reads must start on
+ * a byte boundary: call bitstream_align() after reading a number of bits that
+ * is not a multiple of 8.
+ */
+
+struct bitstream {
+	const uint8_t *data;
+	uint32_t size;
+	/* Offset of the next byte to read, never greater than size */
+	uint32_t pos;
+	/* Bits of data[pos] consumed by bitstream_read_bits() */
+	uint8_t bit;
+	bool error;
+};
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BITSTREAM_BE16(x) __builtin_bswap16(x)
+#define BITSTREAM_BE32(x) __builtin_bswap32(x)
+#define BITSTREAM_BE64(x) __builtin_bswap64(x)
+#else
+#define BITSTREAM_BE16(x) (x)
+#define BITSTREAM_BE32(x) (x)
+#define BITSTREAM_BE64(x) (x)
+#endif
+
+/* Read instead of the data when a field lies past its end */
+static const uint8_t bitstream_zeros[8];
+
+static inline void bitstream_init(struct bitstream *bs, const void *data, uint32_t size)
+{
+	bs->data = (const uint8_t *) data;
+	bs->size = size;
+	bs->pos = 0;
+	bs->bit = 0;
+	bs->error = false;
+}
+
+/**
+ * Consumes @n bytes, which must be 8 or less.
+ * @return a pointer to them, or to zeros if fewer than @n bytes are left.
+ */
+static inline const uint8_t *bitstream_consume(struct bitstream *bs, uint32_t n)
+{
+	bool ok = bs->size - bs->pos >= n;
+	const uint8_t *p = ok ? bs->data + bs->pos : bitstream_zeros;
+
+	bs->pos = ok ? bs->pos + n : bs->size;
+	bs->error |= ! ok;
+	return p;
+}
+
+static inline uint8_t bitstream_read_u8(struct bitstream *bs)
+{
+	return *bitstream_consume(bs, 1);
+}
+
+static inline uint16_t bitstream_read_u16(struct bitstream *bs)
+{
+	uint16_t v;
+	memcpy(&v, bitstream_consume(bs, 2), sizeof(v));
+	return BITSTREAM_BE16(v);
+}
+
+static inline uint32_t bitstream_read_u24(struct bitstream *bs)
+{
+	const uint8_t *p = bitstream_consume(bs, 3);
+	uint16_t v;
+	memcpy(&v, p + 1, sizeof(v));
+	return ((uint32_t) p[0] << 16) | BITSTREAM_BE16(v);
+}
+
+static inline uint32_t bitstream_read_u32(struct bitstream *bs)
+{
+	uint32_t v;
+	memcpy(&v, bitstream_consume(bs, 4), sizeof(v));
+	return BITSTREAM_BE32(v);
+}
+
+static inline uint64_t bitstream_read_u40(struct bitstream *bs)
+{
+	const uint8_t *p = bitstream_consume(bs, 5);
+	uint32_t v;
+	memcpy(&v, p + 1, sizeof(v));
+	return ((uint64_t) p[0] << 32) | BITSTREAM_BE32(v);
+}
+
+static inline uint64_t bitstream_read_u64(struct bitstream *bs)
+{
+	uint64_t v;
+	memcpy(&v, bitstream_consume(bs, 8), sizeof(v));
+	return BITSTREAM_BE64(v);
+}
+
+/**
+ * Reads @n bits, up to 32, most significant first.
+ */
+static inline uint32_t bitstream_read_bits(struct bitstream *bs, unsigned n)
+{
+	uint32_t v = 0;
+
+	while (n) {
+		unsigned avail = 8 - bs->bit, take = n < avail ? n : avail;
+
+		if (bs->pos == bs->size) {
+			bs->bit = 0;
+			bs->error = true;
+			return 0;
+		}
+		v = (v << take) | ((bs->data[bs->pos] >> (avail - take)) & ((1 << take) - 1));
+		bs->bit += take;
+		if (bs->bit == 8) {
+			bs->bit = 0;
+			bs->pos++;
+		}
+		n -= take;
+	}
+	return v;
+}
+
+/**
+ * Skips the rest of a partially read byte.
+ */
+static inline void bitstream_align(struct bitstream *bs)
+{
+	bs->pos += bs->bit != 0;
+	bs->bit = 0;
+}
+
+static inline void bitstream_skip(struct bitstream *bs, uint32_t n)
+{
+	bool ok = bs->size - bs->pos >= n;
+
+	bs->pos = ok ? bs->pos + n : bs->size;
+	bs->error |= ! ok;
+}
+
+/**
+ * Consumes @n bytes of variable length.
+ * @return a pointer to them, or NULL if fewer than @n bytes are left or if
+ * @bs has already run past its end, in which case @n is likely bogus.
+ */
+static inline const char *bitstream_read_bytes(struct bitstream *bs, uint32_t n)
+{
+	const uint8_t *p = bs->data + bs->pos;
+
+	if (bs->error || bs->size - bs->pos < n) {
+		bs->pos = bs->size;
+		bs->error = true;
+		return NULL;
+	}
+	bs->pos += n;
+	return (const char *) p;
+}
+
+/**
+ * Sets up @sub to read the next @n bytes, typically a loop whose length is
+ * given by a field, and skips them in @bs. A loop that runs past the end of
+ * the data is cut short and flags both readers, and @sub inherits the error
+ * flag of @bs, so that checking @sub after the last read of @bs covers both.
+ */
+static inline void bitstream_sub(struct bitstream *bs, uint32_t n, struct bitstream *sub)
+{
+	uint32_t left = bs->size - bs->pos;
+
+	bitstream_init(sub, bs->data + bs->pos, n < left ? n : left);
+	sub->error = bs->error | (n > left);
+	bitstream_skip(bs, n);
+}
+
+static inline uint32_t bitstream_remaining(const struct bitstream *bs)
+{
+	return bs->size - bs->pos;
+}
+
+static inline uint32_t bitstream_position(const struct bitstream *bs)
+{
+	return bs->pos;
+}
+
+static inline const char *bitstream_pointer(const struct bitstream *bs)
+{
+	return (const char *) bs->data + bs->pos;
+}
+
+static inline bool bitstream_error(const struct bitstream *bs)
+{
+	return bs->error;
+}
+
+#endif /* __bitstream_h */
@@ -30,6 +30,7 @@
 #include "demuxfs.h"
 #include "byteops.h"
 #include "buffer.h"
+#include "mem.h"
 #include "ts.h"
 #include "tables/pes.h"
 
@@ -42,7 +43,7 @@ struct buffer *buffer_create(uint16_t pid, size_t size, bool pes_data)
 		return NULL;
 	}
 
-	buffer = (struct buffer *) calloc(1, sizeof(struct buffer));
+	buffer = (struct buffer *) mem_calloc(MEM_BUFFERS, 1, sizeof(struct buffer));
 	if (! buffer) {
 		perror("malloc");
 		return NULL;
@@ -53,10 +54,10 @@ struct buffer *buffer_create(uint16_t pid, size_t size, bool pes_data)
 		buffer->pes_unbounded_data = true;
 	}
 
-	buffer->data = (char *) calloc(size, sizeof(char));
+	buffer->data = (char *) mem_calloc(MEM_BUFFERS, size, sizeof(char));
 	if (! buffer->data) {
 		perror("malloc");
-		free(buffer);
+		mem_free(MEM_BUFFERS, buffer);
 		return NULL;
 	}
 
@@ -72,9 +73,9 @@ void buffer_destroy(struct buffer *buffer)
 {
 	if (buffer) {
 		if (buffer->data)
-			free(buffer->data);
+			mem_free(MEM_BUFFERS, buffer->data);
 		buffer->data = NULL;
-		free(buffer);
+		mem_free(MEM_BUFFERS, buffer);
 	}
 }
 
@@ -105,11 +106,10 @@ int buffer_append(struct buffer *buffer, const char *buf, size_t size)
 	if (buffer->current_size == 0) {
 		if (size > buffer->max_size) {
 			/* Reusing the slot */
-			free(buffer->data);
-			buffer->data = (char *) malloc(sizeof(char) * size);
+			mem_free(MEM_BUFFERS, buffer->data);
+			buffer->data = (char *) mem_malloc(MEM_BUFFERS, sizeof(char) * size);
 			if (! buffer->data) {
 				buffer->max_size = 0;
-				free(buffer->data);
 				return -ENOMEM;
 			}
 			buffer->max_size = size;
@@ -122,7 +122,7 @@ int buffer_append(struct buffer *buffer, const char *buf, size_t size)
 		if (buffer->current_size + to_write > buffer->max_size) {
 			int required_room = buffer->current_size + to_write;
 			int new_size = required_room > MAX_SECTION_SIZE ? required_room : MAX_SECTION_SIZE;
-			char *ptr = (char *) realloc(buffer->data, new_size);
+			char *ptr = (char *) mem_realloc(MEM_BUFFERS, buffer->data, new_size);
 			if (! ptr) {
 				dprintf("Error reallocating memory");
 				return -ENOMEM;
@@ -10,6 +10,8 @@ struct buffer {
 	size_t max_size;
 	size_t current_size;
 	uint8_t continuity_counter;
+	/* Ingest timestamp of the first packet appended since the last reset */
+	uint64_t ingest_ns;
 	bool holds_pes_data;
 	bool pes_unbounded_data;
 };
@@ -55,7 +55,7 @@ static void crc32_init_table()
 	}
 }
 
-bool crc32_check(const char *buf, uint32_t len)
+uint32_t crc32_calc(const char *buf, uint32_t len)
 {
 	uint32_t i, remainder = INITIAL_REMAINDER;
 	static bool table_initialized = false;
@@ -70,5 +70,10 @@ bool crc32_check(const char *buf, uint32_t len)
 		remainder = crc32_table[table_idx] ^ (remainder << 8);
 	}
 
-	return remainder ? false : true;
+	return remainder;
+}
+
+bool crc32_check(const char *buf, uint32_t len)
+{
+	return crc32_calc(buf, len) ? false : true;
 }
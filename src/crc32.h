@@ -1,6 +1,11 @@
 #ifndef _crc32_h
 #define _crc32_h
 
+/**
+ * Computes the MPEG-2 CRC32 of @buf. Running it over a section that
+ * includes its CRC32 field yields zero when the section is intact.
+ */
+uint32_t crc32_calc(const char *buf, uint32_t len);
 bool crc32_check(const char *buf, uint32_t len);
 
 #endif /* _crc32_h */
@@ -34,6 +34,12 @@
 #include "fifo.h"
 #include "ts.h"
 #include "snapshot.h"
+#include "stats.h"
+#include "mem.h"
+#include "journal.h"
+#include "query.h"
+#include "dsm-cc/carousel.h"
+#include "dsm-cc/mpe.h"
 #include "tables/descriptors/descriptors.h"
 #include "dsm-cc/descriptors/descriptors.h"
 
@@ -60,15 +66,42 @@ static int do_getattr(struct dentry *dentry, struct stat *stbuf)
 	return 0;
 }
 
+/**
+ * Resolves @path. Dentries of /History views must be handed back to
+ * demuxfs_put_dentry(), as the view they belong to is held meanwhile.
+ */
+static struct dentry *demuxfs_get_dentry(const char *path, struct demuxfs_data *priv)
+{
+	struct dentry *dentry = NULL;
+
+	if (priv->journal)
+		/* /History views are built on their first lookup */
+		dentry = journal_lookup(path, priv);
+	if (! dentry)
+		dentry = fsutils_get_dentry(priv->root, path);
+	if (! dentry && priv->carousels)
+		/* On-demand carousel directories are listed on their first lookup */
+		dentry = carousel_lookup(path, priv);
+	return dentry;
+}
+
+static void demuxfs_put_dentry(struct dentry *dentry, struct demuxfs_data *priv)
+{
+	if (priv->journal)
+		journal_put(dentry, priv);
+}
+
 static int demuxfs_getattr(const char *path, struct stat *stbuf)
 {
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry;
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
+	int ret;
 
-	dentry = fsutils_get_dentry(priv->root, path);
 	if (! dentry)
 		return -ENOENT;
-	return do_getattr(dentry, stbuf);
+	ret = do_getattr(dentry, stbuf);
+	demuxfs_put_dentry(dentry, priv);
+	return ret;
 }
 
 static int demuxfs_fgetattr(const char *path, struct stat *stbuf,
@@ -78,18 +111,65 @@ static int demuxfs_fgetattr(const char *path, struct stat *stbuf,
 	return do_getattr(dentry, stbuf);
 }
 
+/* Block size reported by statfs. Usage is rounded up to this granularity. */
+#define DEMUXFS_STATFS_BLOCK_SIZE 4096
+
+static int demuxfs_statfs(const char *path, struct statvfs *stbuf)
+{
+	struct demuxfs_data *priv = fuse_get_context()->private_data;
+	struct mem_usage total, tree;
+
+	mem_get_total_usage(priv, &total, &tree);
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = DEMUXFS_STATFS_BLOCK_SIZE;
+	stbuf->f_frsize = DEMUXFS_STATFS_BLOCK_SIZE;
+	stbuf->f_blocks = (total.bytes + DEMUXFS_STATFS_BLOCK_SIZE - 1) / DEMUXFS_STATFS_BLOCK_SIZE;
+	stbuf->f_files = tree.objects;
+	stbuf->f_fsid = DEMUXFS_SUPER_MAGIC;
+	stbuf->f_namemax = NAME_MAX;
+	return 0;
+}
+
+static int demuxfs_release(const char *path, struct fuse_file_info *fi);
+
 static int demuxfs_open(const char *path, struct fuse_file_info *fi)
 {
 	int ret = 0;
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
 	if (! dentry)
 		return -ENOENT;
+	if (priv->carousels && (ret = carousel_fetch(dentry, priv)) < 0) {
+		demuxfs_put_dentry(dentry, priv);
+		return ret;
+	}
 
 	pthread_mutex_lock(&dentry->mutex);
 	dentry->refcount++;
 	fi->fh = DENTRY_TO_FILEHANDLE(dentry);
 	pthread_mutex_unlock(&dentry->mutex);
+
+	if (DEMUXFS_IS_STATS(dentry)) {
+		/* Contents are generated on open; bypass the page cache so readers see them */
+		ret = stats_update_file(dentry, priv);
+		fi->direct_io = 1;
+	} else if (DEMUXFS_IS_CAPTURE(dentry)) {
+		/* Captures are live streams and each reader keeps its own position */
+		struct mpe_reader *reader = mpe_open(dentry, priv);
+		if (! reader) {
+			pthread_mutex_lock(&dentry->mutex);
+			dentry->refcount--;
+			pthread_mutex_unlock(&dentry->mutex);
+			demuxfs_put_dentry(dentry, priv);
+			return -ENOMEM;
+		}
+		fi->fh = READER_TO_FILEHANDLE(reader);
+		fi->direct_io = 1;
+		fi->nonseekable = 1;
+	}
+	if (ret < 0)
+		/* Failed opens are not released by FUSE */
+		demuxfs_release(path, fi);
 	return ret;
 }
 
@@ -100,12 +180,16 @@ static int demuxfs_flush(const char *path, struct fuse_file_info *fi)
 
 static int demuxfs_release(const char *path, struct fuse_file_info *fi)
 {
+	struct demuxfs_data *priv = fuse_get_context()->private_data;
 	struct dentry *dentry = FILEHANDLE_TO_DENTRY(fi->fh);
 	pthread_mutex_lock(&dentry->mutex);
 	dentry->refcount--;
 	if (DEMUXFS_IS_SNAPSHOT(dentry))
 		snapshot_destroy_video_context(dentry);
 	pthread_mutex_unlock(&dentry->mutex);
+	if (FILEHANDLE_IS_READER(fi->fh))
+		mpe_release((struct mpe_reader *) FILEHANDLE_TO_READER(fi->fh));
+	demuxfs_put_dentry(dentry, priv);
 	return 0;
 }
 
@@ -120,7 +204,10 @@ static int demuxfs_read(const char *path, char *buf, size_t size, off_t offset,
 	if (! dentry)
 		return -ENOENT;
 
-	if (DEMUXFS_IS_SNAPSHOT(dentry)) {
+	if (FILEHANDLE_IS_READER(fi->fh)) {
+		return mpe_read((struct mpe_reader *) FILEHANDLE_TO_READER(fi->fh), buf, size,
+			fi->flags & O_NONBLOCK);
+	} else if (DEMUXFS_IS_SNAPSHOT(dentry)) {
 		pthread_mutex_lock(&dentry->mutex);
 		if (! dentry->contents) {
 			/* Initialize software decoder context */
@@ -150,32 +237,93 @@ static int demuxfs_read(const char *path, char *buf, size_t size, off_t offset,
 	return read_size;
 }
 
+/* Per-open state of directories, so that concurrent listings don't share a cursor */
+struct dir_reader {
+	/* struct reader_handle always comes first */
+	struct reader_handle handle;
+	/* Last child listed, valid while the directory's unlink_count holds the value seen */
+	struct dentry *cursor;
+	uint32_t unlink_count;
+};
+
 static int demuxfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	return demuxfs_open(path, fi);
+	struct dir_reader *reader;
+	struct dentry *dentry;
+	int ret = demuxfs_open(path, fi);
+	if (ret < 0)
+		return ret;
+
+	dentry = FILEHANDLE_TO_DENTRY(fi->fh);
+	reader = (struct dir_reader *) calloc(1, sizeof(struct dir_reader));
+	if (! reader) {
+		demuxfs_release(path, fi);
+		return -ENOMEM;
+	}
+	reader->handle.dentry = dentry;
+	fi->fh = READER_TO_FILEHANDLE(reader);
+	return 0;
 }
 
 static int demuxfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
-	return demuxfs_release(path, fi);
+	struct demuxfs_data *priv = fuse_get_context()->private_data;
+	struct dentry *dentry = FILEHANDLE_TO_DENTRY(fi->fh);
+	pthread_mutex_lock(&dentry->mutex);
+	dentry->refcount--;
+	pthread_mutex_unlock(&dentry->mutex);
+	free(FILEHANDLE_TO_READER(fi->fh));
+	demuxfs_put_dentry(dentry, priv);
+	return 0;
 }
 
+/* Offset of the readdir entry that follows @entry; 1 and 2 follow "." and ".." */
+#define READDIR_OFFSET(entry) ((entry)->offset + 2)
+
 static int demuxfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, 
 		off_t offset, struct fuse_file_info *fi)
 {
 	struct dentry *dentry = FILEHANDLE_TO_DENTRY(fi->fh);
+	struct dir_reader *reader = (struct dir_reader *) FILEHANDLE_TO_READER(fi->fh);
+	struct dentry *entry, *cursor;
+	uint32_t unlink_count;
+	struct stat stbuf;
 
-	if (filler(buf, ".",  NULL, 0))
-		return -ENOBUFS;
-	if (filler(buf, "..", NULL, 0))
-		return -ENOBUFS;
 	if (! dentry)
 		return -ENOENT;
+	if (offset < 1 && filler(buf, ".", NULL, 1))
+		return 0;
+	if (offset < 2 && filler(buf, "..", NULL, 2))
+		return 0;
+
+	read_lock();
+	/*
+	 * Children are sorted by offset, so a listing resumes right after the
+	 * child with the given offset. Continuations of the previous call on
+	 * this handle don't need to look for it, unless a child has been
+	 * unlinked since, which may have been the cursor itself.
+	 */
+	unlink_count = __atomic_load_n(&dentry->unlink_count, __ATOMIC_ACQUIRE);
+	cursor = reader->unlink_count == unlink_count ? reader->cursor : NULL;
+	if (! cursor || READDIR_OFFSET(cursor) != offset) {
+		cursor = NULL;
+		list_for_each_entry(entry, &dentry->children, list) {
+			if (READDIR_OFFSET(entry) > offset)
+				break;
+			cursor = entry;
+		}
+	}
 
-	struct dentry *entry;
-	list_for_each_entry(entry, &dentry->children, list)
-		if (filler(buf, entry->name, NULL, 0))
-			return -ENOBUFS;
+	reader->unlink_count = unlink_count;
+	reader->cursor = cursor;
+	entry = list_prepare_entry(cursor, &dentry->children, list);
+	list_for_each_entry_continue(entry, &dentry->children, list) {
+		do_getattr(entry, &stbuf);
+		if (filler(buf, entry->name, &stbuf, READDIR_OFFSET(entry)))
+			break;
+		reader->cursor = entry;
+	}
+	read_unlock();
 
 	return 0;
 }
@@ -183,77 +331,69 @@ static int demuxfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int demuxfs_readlink(const char *path, char *buf, size_t size)
 {
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
+	int ret = -EINVAL;
 	if (! dentry)
 		return -ENOENT;
 	if (dentry->mode & S_IFLNK) {
 		snprintf(buf, size, "%s", dentry->contents);
-		return 0;
+		ret = 0;
 	}
-	return -EINVAL;
+	demuxfs_put_dentry(dentry, priv);
+	return ret;
 }
 
 static int demuxfs_access(const char *path, int mode)
 {
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
+	int ret = 0;
 	if (! dentry)
 		return -ENOENT;
 	else if (mode & W_OK)
-		return -EACCES;
+		ret = -EACCES;
 	else if (mode & X_OK && !S_ISDIR(dentry->mode))
-		return -EACCES;
-	return 0;
+		ret = -EACCES;
+	demuxfs_put_dentry(dentry, priv);
+	return ret;
 }
 
 static int demuxfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
 	int ret;
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
 	if (! dentry)
 		return -ENOENT;
 
 	if (strncmp(name, "user.", 5))
-		return -EPERM;
+		ret = -EPERM;
 	else if ((flags & XATTR_CREATE) && xattr_exists(dentry, name))
-		return -EEXIST;
+		ret = -EEXIST;
 	else if ((flags & XATTR_REPLACE) && !xattr_exists(dentry, name))
-		return -ENOATTR;
-
-	pthread_mutex_lock(&dentry->mutex);
-	xattr_remove(dentry, name);
-	ret = xattr_add(dentry, name, value, size, true);
-	pthread_mutex_unlock(&dentry->mutex);
+		ret = -ENOATTR;
+	else {
+		pthread_mutex_lock(&dentry->mutex);
+		xattr_remove(dentry, name);
+		ret = xattr_add(dentry, name, value, size);
+		pthread_mutex_unlock(&dentry->mutex);
+	}
+	demuxfs_put_dentry(dentry, priv);
 	return ret;
 }
 
 static int demuxfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
 	int ret;
-	struct xattr *xattr;
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
 	if (! dentry)
 		return -ENOENT;
 
 	read_lock();
-	xattr = xattr_get(dentry, name);
-	if (! xattr) {
-		ret = -ENOATTR;
-		goto out;
-	}
-	if (size == 0) {
-		ret = xattr->size;
-		goto out;
-	} else if (size < xattr->size) {
-		ret = -ERANGE;
-		goto out;
-	}
-	memcpy(value, xattr->value, xattr->size);
-	ret = xattr->size;
-out:
+	ret = xattr_get(dentry, name, value, size);
 	read_unlock();
+	demuxfs_put_dentry(dentry, priv);
 	return ret;
 }
 
@@ -261,13 +401,14 @@ static int demuxfs_listxattr(const char *path, char *list, size_t size)
 {
 	int ret;
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
 	if (! dentry)
 		return -ENOENT;
 	
 	read_lock();
 	ret = xattr_list(dentry, list, size);
 	read_unlock();
+	demuxfs_put_dentry(dentry, priv);
 
 	return ret;
 }
@@ -276,13 +417,35 @@ static int demuxfs_removexattr(const char *path, const char *name)
 {
 	int ret;
 	struct demuxfs_data *priv = fuse_get_context()->private_data;
-	struct dentry *dentry = fsutils_get_dentry(priv->root, path);
+	struct dentry *dentry = demuxfs_get_dentry(path, priv);
 	if (! dentry)
 		return -ENOENT;
 
 	write_lock();
 	ret = xattr_remove(dentry, name);
 	write_unlock();
+	demuxfs_put_dentry(dentry, priv);
+
+	return ret;
+}
+
+static int demuxfs_ioctl(const char *path, int cmd, void *arg,
+		struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+	int ret;
+	struct demuxfs_data *priv = fuse_get_context()->private_data;
+	struct dentry *dentry = FILEHANDLE_TO_DENTRY(fi->fh);
+
+	if ((unsigned int) cmd != DEMUXFS_IOC_QUERY)
+		return -ENOTTY;
+	if (! dentry)
+		return -ENOENT;
+	if (! (flags & FUSE_IOCTL_DIR) || ! S_ISDIR(dentry->mode))
+		return -ENOTDIR;
+
+	read_lock();
+	ret = query_execute(dentry, data, priv);
+	read_unlock();
 
 	return ret;
 }
@@ -307,7 +470,8 @@ struct fuse_operations demuxfs_ops = {
 	.getxattr    = demuxfs_getxattr,
 	.listxattr   = demuxfs_listxattr,
 	.removexattr = demuxfs_removexattr,
-	.statfs      = NULL,
+	.statfs      = demuxfs_statfs,
+	.ioctl       = demuxfs_ioctl,
 	/* Not implemented on DemuxFS */
 	.fsync       = NULL,
 	.utimens     = NULL,
@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -24,12 +25,9 @@
 #include "list.h"
 #include "priv.h"
 #include "colors.h"
+#include "log.h"
 
-#define dprintf(x...) do { \
-        fprintf(stderr, x); \
-        fprintf(stderr, colorGray " (%s:%s:%d)" colorNormal, __FILE__, __FUNCTION__, __LINE__); \
-        fprintf(stderr, "\n"); \
-	} while(0)
+#define dprintf(x...) log_message(LOG_LEVEL_INFO, x)
 
 #define DEMUXFS_SUPER_MAGIC 0xaa55
 
@@ -46,8 +44,6 @@ struct xattr {
 	/* Extended attribute value */
 	char *value;
 	ssize_t size;
-	/* Should name+value be freed, putname is set to true */
-	bool putname;
 	/* Private */
 	struct list_head list;
 };
@@ -60,6 +56,8 @@ enum {
 	OBJ_TYPE_AUDIO_FIFO  = (1 << 4) | OBJ_TYPE_FIFO,
 	OBJ_TYPE_VIDEO_FIFO  = (1 << 5) | OBJ_TYPE_FIFO,
 	OBJ_TYPE_SNAPSHOT    = (1 << 6),
+	OBJ_TYPE_STATS       = (1 << 7),
+	OBJ_TYPE_CAPTURE     = (1 << 8),
 };
 
 #define DEMUXFS_IS_FILE(d)       (d->obj_type == OBJ_TYPE_FILE)
@@ -68,6 +66,8 @@ enum {
 #define DEMUXFS_IS_AUDIO_FIFO(d) (d->obj_type == OBJ_TYPE_AUDIO_FIFO)
 #define DEMUXFS_IS_VIDEO_FIFO(d) (d->obj_type == OBJ_TYPE_VIDEO_FIFO)
 #define DEMUXFS_IS_SNAPSHOT(d)   (d->obj_type == OBJ_TYPE_SNAPSHOT)
+#define DEMUXFS_IS_STATS(d)      (d->obj_type == OBJ_TYPE_STATS)
+#define DEMUXFS_IS_CAPTURE(d)    (d->obj_type == OBJ_TYPE_CAPTURE)
 
 struct dentry {
 	/* The inode number, generated from the transport stream PID and the table_id */
@@ -82,6 +82,10 @@ struct dentry {
 	time_t mtime;
 	/* DemuxFS object type (FIFO, snapshot, regular file, directory) */
 	int obj_type;
+	/* Value of the system.format xattr (enum xattr_format) */
+	uint8_t format;
+	/* Table restored by a warm start and not seen on the live stream yet (system.stale) */
+	bool stale;
 	/* Reference count */
 	uint32_t refcount;
 	/* File contents */
@@ -98,18 +102,36 @@ struct dentry {
 	struct list_head children;
 	/* List in which this dentry is linked in */
 	struct list_head list;
+	/* Position in the parent's list of children, which readdir offsets derive from */
+	off_t offset;
+	/* Position given to the last child linked in */
+	off_t last_child_offset;
+	/* Number of children unlinked so far. Readdir cursors are valid while it holds still. */
+	uint32_t unlink_count;
 
 	/* Private data */
 	void *priv;
 };
 
+/* Per-open state of files whose readers keep their own position. It comes first in the reader's struct. */
+struct reader_handle {
+	struct dentry *dentry;
+};
+
+/* File handles hold either the dentry or, tagged with their lowest bit, the reader_handle */
 #if (__WORDSIZE == 64)
-#define FILEHANDLE_TO_DENTRY(fh) ((struct dentry *)(uint64_t)(fh))
-#define DENTRY_TO_FILEHANDLE(de) ((uint64_t)(de))
+#define FILEHANDLE_TO_POINTER(fh) ((void *)(uint64_t)((fh) & ~1ULL))
+#define DENTRY_TO_FILEHANDLE(de)  ((uint64_t)(de))
+#define READER_TO_FILEHANDLE(rh)  ((uint64_t)(rh) | 1)
 #else
-#define FILEHANDLE_TO_DENTRY(fh) ((struct dentry *)(uint32_t)(fh))
-#define DENTRY_TO_FILEHANDLE(de) ((uint64_t)(uint32_t)(de))
+#define FILEHANDLE_TO_POINTER(fh) ((void *)(uint32_t)((fh) & ~1ULL))
+#define DENTRY_TO_FILEHANDLE(de)  ((uint64_t)(uint32_t)(de))
+#define READER_TO_FILEHANDLE(rh)  ((uint64_t)(uint32_t)(rh) | 1)
 #endif
+#define FILEHANDLE_IS_READER(fh)  ((fh) & 1)
+#define FILEHANDLE_TO_READER(fh)  ((struct reader_handle *) FILEHANDLE_TO_POINTER(fh))
+#define FILEHANDLE_TO_DENTRY(fh)  (FILEHANDLE_IS_READER(fh) ? FILEHANDLE_TO_READER(fh)->dentry : \
+		(struct dentry *) FILEHANDLE_TO_POINTER(fh))
 
 /* This definition imposes the maximum size of the hash tables */
 #define DEMUXFS_MAX_PIDS 256
@@ -128,9 +150,31 @@ enum error_type {
 	ALL_ERRORS       = 0xff,
 };
 
+/* Transport stream health counters */
+struct ts_statistics {
+	/* Continuity counter errors detected by the TS parser */
+	uint64_t continuity_errors;
+	/* PSI sections discarded due to CRC errors */
+	uint64_t crc_errors;
+	/* Datagrams lost, reordered or duplicated by the IP transport (UDP/RTP backends) */
+	uint64_t transport_lost;
+	uint64_t transport_reordered;
+	uint64_t transport_duplicates;
+	/* Largest interval between two consecutive datagrams, as timestamped by the kernel */
+	uint64_t transport_max_interarrival_ns;
+};
+
 struct descriptor;
 struct dsmcc_descriptor;
 struct backend_ops;
+struct latency_stats;
+struct warmstart;
+struct journal;
+struct scan;
+struct carousel_list;
+struct stream_events;
+struct mpe_list;
+struct dispatch;
 
 struct user_options {
 	bool parse_pes;
@@ -139,6 +183,20 @@ struct user_options {
 	enum transmission_type standard;
 	uint32_t frequency;
 	char *tmpdir;
+	/* Path of the warm start snapshot, or NULL if disabled */
+	char *warmstart;
+	bool warmstart_carousels;
+	/* Fetch DSM-CC carousel objects as they are looked up instead of keeping every block */
+	bool ondemand_carousels;
+	/* Path of the section journal, or NULL if disabled */
+	char *journal;
+	/* Frequencies or files visited by the scan mode, or NULL if disabled */
+	char **scan_sources;
+	int num_scan_sources;
+	/* Seconds to wait for the tables of a multiplex before moving on */
+	int scan_timeout;
+	/* Number of threads that parse the EIT, SDT, NIT and AIT, or 0 to parse them on the packet thread */
+	int parse_threads;
 	enum error_type verbose_mask;
 };
 
@@ -149,9 +207,19 @@ struct demuxfs_data {
 	char *opt_tmpdir;
 	char *opt_backend;
 	char *opt_report;
+	char *opt_loglevel;
+	int opt_lograte;
+	char *opt_trace;
+	char *opt_warmstart;
+	bool opt_warmstart_carousels;
+	bool opt_ondemand_carousels;
+	char *opt_journal;
+	char *opt_scan;
+	int opt_scan_timeout;
+	int opt_parse_threads;
 	/* "psi_tables" holds PSI structures (ie: PAT, PMT, NIT..) */
 	struct hash_table *psi_tables;
-	/* "pes_tables" holds structures from PES packets that we're parsing */
+	/* "pes_tables" binds PES PIDs to the FIFOs fed by their packets (struct pes_sink) */
 	struct hash_table *pes_tables;
 	/* "psi_parsers" holds pointers to parsers of known PSI PIDs */
 	struct hash_table *psi_parsers;
@@ -175,6 +243,26 @@ struct demuxfs_data {
 	pthread_t ts_parser_id;
 	/* User-defined options */
 	struct user_options options;
+	/* Transport stream health counters */
+	struct ts_statistics stats;
+	/* Per-stage latency histograms, exported under /Stats/latency */
+	struct latency_stats *latency;
+	/* Sections kept for the warm start snapshot, exported under /Stats/warmstart */
+	struct warmstart *warmstart;
+	/* Section journal backing the /History views */
+	struct journal *journal;
+	/* Multiplexes visited by the scan mode, exported under /Scan */
+	struct scan *scan;
+	/* DSM-CC object carousels fetched on demand, or NULL if disabled */
+	struct carousel_list *carousels;
+	/* DSM-CC stream events waiting for their trigger time */
+	struct stream_events *stream_events;
+	/* Captures of the MPE streams, exported as IP.pcap files */
+	struct mpe_list *mpe;
+	/* Threads that parse tables off the packet thread, or NULL if disabled */
+	struct dispatch *dispatch;
+	/* Number of owners of each PID filtered by the backend, see ts_request_pid() */
+	uint16_t *pid_requests;
 	/* Backend implementation */
 	struct backend_ops *backend;
 };
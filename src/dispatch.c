@@ -0,0 +1,355 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "buffer.h"
+#include "hash.h"
+#include "mem.h"
+#include "ts.h"
+#include "dispatch.h"
+#include "tables/psi.h"
+#include "tables/eit.h"
+#include "tables/sdt.h"
+#include "tables/nit.h"
+#include "dsm-cc/ait.h"
+#include "dsm-cc/dsmcc.h"
+#include "trace.h"
+
+enum job_state {
+	JOB_QUEUED,
+	JOB_BUILDING,
+	JOB_BUILT,
+};
+
+struct dispatch_job {
+	struct ts_header header;
+	/* Copy of the section, stamped with the ingest time of its first packet */
+	struct buffer section;
+	/* Time at which the section was complete */
+	uint64_t complete_ns;
+	build_function_t build;
+	publish_function_t publish;
+	/* Parses the whole section on the publisher when there's no build function */
+	parse_function_t parse;
+	struct built_table built;
+	int ret;
+	enum job_state state;
+};
+
+struct dispatch {
+	pthread_mutex_t mutex;
+	/* Signaled when a job is queued for the workers, or on shutdown */
+	pthread_cond_t work_cond;
+	/* Signaled when a job is built, or on shutdown */
+	pthread_cond_t built_cond;
+	/* Signaled when a job has been published */
+	pthread_cond_t room_cond;
+	/* Taken while changing the tree */
+	pthread_mutex_t tree_mutex;
+	/*
+	 * Jobs are numbered in arrival order. Those from @published to @queued
+	 * are in flight and those from @claimed to @queued wait for a worker.
+	 */
+	struct dispatch_job *jobs;
+	uint64_t queued;
+	uint64_t claimed;
+	uint64_t published;
+	bool stop;
+	int num_workers;
+	pthread_t workers[DISPATCH_MAX_THREADS];
+	pthread_t publisher;
+};
+
+void dispatch_lock(struct demuxfs_data *priv)
+{
+	if (priv->dispatch)
+		pthread_mutex_lock(&priv->dispatch->tree_mutex);
+}
+
+void dispatch_unlock(struct demuxfs_data *priv)
+{
+	if (priv->dispatch)
+		pthread_mutex_unlock(&priv->dispatch->tree_mutex);
+}
+
+bool dispatch_table_is_new(struct psi_common_header *table, struct demuxfs_data *priv)
+{
+	struct psi_common_header *current;
+	bool is_new;
+
+	if (! table->current_next_indicator)
+		return false;
+	dispatch_lock(priv);
+	current = hashtable_get(priv->psi_tables, table->dentry->inode);
+	is_new = ! current || current->version_number != table->version_number;
+	dispatch_unlock(priv);
+	return is_new;
+}
+
+int dispatch_parse_now(build_function_t build, publish_function_t publish, const struct ts_header *header,
+		const char *payload, uint32_t payload_len, struct demuxfs_data *priv)
+{
+	struct built_table built = { NULL, NULL };
+	int ret;
+
+	ret = build(header, payload, payload_len, &built, priv);
+	if (ret < 0 || ! built.table)
+		return ret;
+	return publish(header, &built, priv);
+}
+
+/**
+ * Tells how a section parsed by @parse_function is handled off the packet thread.
+ * @return false if it is parsed by the packet thread.
+ */
+static bool dispatch_get_functions(parse_function_t parse_function, uint8_t table_id,
+		build_function_t *build, publish_function_t *publish)
+{
+	*build = NULL;
+	*publish = NULL;
+	if (parse_function == eit_parse) {
+		*build = eit_build;
+		*publish = eit_publish;
+	} else if (parse_function == sdt_parse) {
+		*build = sdt_build;
+		*publish = sdt_publish;
+	} else if (parse_function == nit_parse) {
+		*build = nit_build;
+		*publish = nit_publish;
+	} else if (parse_function == dsmcc_parse && table_id == TS_AIT_TABLE_ID) {
+		*build = ait_build;
+		*publish = ait_publish;
+	} else if (parse_function == dsmcc_parse &&
+		(table_id == TS_DII_TABLE_ID || table_id == TS_DDB_TABLE_ID)) {
+		/* Carousel sections are parsed whole by the publisher */
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool dispatch_section(const struct ts_header *header, parse_function_t parse_function,
+		struct buffer *buffer, struct demuxfs_data *priv)
+{
+	struct dispatch *d = priv->dispatch;
+	struct dispatch_job *job;
+	build_function_t build;
+	publish_function_t publish;
+	char *section;
+
+	if (! d || ! dispatch_get_functions(parse_function, buffer->data[0], &build, &publish))
+		return false;
+	section = mem_malloc(MEM_BUFFERS, buffer->current_size);
+	if (! section)
+		return false;
+	memcpy(section, buffer->data, buffer->current_size);
+
+	pthread_mutex_lock(&d->mutex);
+	while (d->queued - d->published >= DISPATCH_MAX_PENDING)
+		pthread_cond_wait(&d->room_cond, &d->mutex);
+	job = &d->jobs[d->queued % DISPATCH_MAX_PENDING];
+	memset(job, 0, sizeof(*job));
+	job->header = *header;
+	job->section.data = section;
+	job->section.pid = header->pid;
+	job->section.max_size = buffer->current_size;
+	job->section.current_size = buffer->current_size;
+	job->section.ingest_ns = buffer->ingest_ns;
+	job->complete_ns = priv->latency ? stats_now() : 0;
+	job->build = build;
+	job->publish = publish;
+	job->parse = parse_function;
+	job->state = build ? JOB_QUEUED : JOB_BUILT;
+	d->queued++;
+	if (build)
+		pthread_cond_signal(&d->work_cond);
+	else
+		pthread_cond_signal(&d->built_cond);
+	pthread_mutex_unlock(&d->mutex);
+	return true;
+}
+
+static void *dispatch_worker_thread(void *data)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) data;
+	struct dispatch *d = priv->dispatch;
+	struct dispatch_job *job;
+
+	pthread_mutex_lock(&d->mutex);
+	for (;;) {
+		while (d->claimed == d->queued && ! d->stop)
+			pthread_cond_wait(&d->work_cond, &d->mutex);
+		if (d->claimed == d->queued)
+			break;
+		job = &d->jobs[d->claimed++ % DISPATCH_MAX_PENDING];
+		if (job->state != JOB_QUEUED)
+			/* Nothing to build */
+			continue;
+		job->state = JOB_BUILDING;
+		pthread_mutex_unlock(&d->mutex);
+
+		job->ret = job->build(&job->header, job->section.data, job->section.current_size, &job->built, priv);
+
+		pthread_mutex_lock(&d->mutex);
+		job->state = JOB_BUILT;
+		pthread_cond_signal(&d->built_cond);
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return NULL;
+}
+
+static void dispatch_publish(struct dispatch_job *job, struct demuxfs_data *priv)
+{
+	uint64_t generation;
+
+	dispatch_lock(priv);
+	generation = priv->psi_tables->generation;
+	if (! job->build) {
+		job->ret = job->parse(&job->header, job->section.data, job->section.current_size, priv);
+	} else {
+		/*
+		 * Sections skipped by the worker repeated the version that was current
+		 * then, which the sections published since may have replaced.
+		 */
+		if (job->ret >= 0 && ! job->built.table)
+			job->ret = job->build(&job->header, job->section.data, job->section.current_size, &job->built, priv);
+		if (job->ret >= 0 && job->built.table)
+			job->ret = job->publish(&job->header, &job->built, priv);
+	}
+	ts_section_parsed(&job->header, &job->section, job->ret, job->complete_ns, generation, priv);
+	dispatch_unlock(priv);
+}
+
+static void *dispatch_publisher_thread(void *data)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) data;
+	struct dispatch *d = priv->dispatch;
+	struct dispatch_job *job;
+
+	pthread_mutex_lock(&d->mutex);
+	for (;;) {
+		while (d->published == d->queued && ! d->stop)
+			pthread_cond_wait(&d->built_cond, &d->mutex);
+		if (d->published == d->queued)
+			break;
+		/* Jobs are published in the order they were queued */
+		job = &d->jobs[d->published % DISPATCH_MAX_PENDING];
+		while (job->state != JOB_BUILT)
+			pthread_cond_wait(&d->built_cond, &d->mutex);
+		pthread_mutex_unlock(&d->mutex);
+
+		dispatch_publish(job, priv);
+		mem_free(MEM_BUFFERS, job->section.data);
+
+		pthread_mutex_lock(&d->mutex);
+		d->published++;
+		pthread_cond_signal(&d->room_cond);
+	}
+	pthread_mutex_unlock(&d->mutex);
+	return NULL;
+}
+
+int dispatch_init(struct demuxfs_data *priv)
+{
+	int num_workers = priv->options.parse_threads;
+	pthread_mutexattr_t attr;
+	struct dispatch *d;
+
+	if (num_workers <= 0)
+		return 0;
+	if (num_workers > DISPATCH_MAX_THREADS)
+		num_workers = DISPATCH_MAX_THREADS;
+
+	d = (struct dispatch *) calloc(1, sizeof(struct dispatch));
+	if (! d)
+		return -ENOMEM;
+	d->jobs = (struct dispatch_job *) mem_calloc(MEM_BUFFERS, DISPATCH_MAX_PENDING, sizeof(struct dispatch_job));
+	if (! d->jobs) {
+		free(d);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&d->mutex, NULL);
+	pthread_cond_init(&d->work_cond, NULL);
+	pthread_cond_init(&d->built_cond, NULL);
+	pthread_cond_init(&d->room_cond, NULL);
+	/* Parsers that run with the lock held take it again to look up the current version of their table */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&d->tree_mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	priv->dispatch = d;
+	for (d->num_workers=0; d->num_workers<num_workers; ++d->num_workers)
+		if (pthread_create(&d->workers[d->num_workers], NULL, dispatch_worker_thread, priv) != 0)
+			break;
+	if (! d->num_workers || pthread_create(&d->publisher, NULL, dispatch_publisher_thread, priv) != 0) {
+		TS_WARNING("failed to start the parser threads, parsing on the packet thread");
+		pthread_mutex_lock(&d->mutex);
+		d->stop = true;
+		pthread_cond_broadcast(&d->work_cond);
+		pthread_mutex_unlock(&d->mutex);
+		for (int i=0; i<d->num_workers; ++i)
+			pthread_join(d->workers[i], NULL);
+		priv->dispatch = NULL;
+		pthread_mutex_destroy(&d->tree_mutex);
+		pthread_cond_destroy(&d->room_cond);
+		pthread_cond_destroy(&d->built_cond);
+		pthread_cond_destroy(&d->work_cond);
+		pthread_mutex_destroy(&d->mutex);
+		mem_free(MEM_BUFFERS, d->jobs);
+		free(d);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+void dispatch_destroy(struct demuxfs_data *priv)
+{
+	struct dispatch *d = priv->dispatch;
+
+	if (! d)
+		return;
+	/* The threads leave once every queued section has been published */
+	pthread_mutex_lock(&d->mutex);
+	d->stop = true;
+	pthread_cond_broadcast(&d->work_cond);
+	pthread_cond_broadcast(&d->built_cond);
+	pthread_mutex_unlock(&d->mutex);
+	for (int i=0; i<d->num_workers; ++i)
+		pthread_join(d->workers[i], NULL);
+	pthread_join(d->publisher, NULL);
+
+	priv->dispatch = NULL;
+	pthread_mutex_destroy(&d->tree_mutex);
+	pthread_cond_destroy(&d->room_cond);
+	pthread_cond_destroy(&d->built_cond);
+	pthread_cond_destroy(&d->work_cond);
+	pthread_mutex_destroy(&d->mutex);
+	mem_free(MEM_BUFFERS, d->jobs);
+	free(d);
+}
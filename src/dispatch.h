@@ -0,0 +1,72 @@
+#ifndef __dispatch_h
+#define __dispatch_h
+
+/*
+ * Parallel table parsing, enabled with -o parse_threads=N. Sections of the
+ * EIT, SDT, NIT and AIT are handed by the packet thread to a pool of N
+ * workers, each of which builds the new version directory of its table off
+ * the tree. A single publisher thread links the results into the tree in the
+ * order their sections arrived, so the versions of a table are always
+ * published in order. Sections that a worker found to repeat the current
+ * version of their table are checked again by the publisher, since the
+ * sections published in between may have replaced that version. The DII,
+ * DSI and DDB sections of object carousels depend on each other and on the
+ * carousel state, so they are parsed whole by the publisher in the same
+ * order. All other tables, including the PAT and the PMT, are still parsed
+ * by the packet thread as soon as they arrive.
+ *
+ * The packet thread and the publisher take turns at changing the tree and
+ * priv->psi_tables with dispatch_lock(). The packet thread waits for the
+ * publisher if more than DISPATCH_MAX_PENDING sections are in flight.
+ */
+
+/* Maximum number of sections queued or being parsed at a time */
+#define DISPATCH_MAX_PENDING  1024
+
+/* Maximum number of worker threads */
+#define DISPATCH_MAX_THREADS  64
+
+struct dispatch;
+struct ts_header;
+struct buffer;
+
+/**
+ * Starts priv->options.parse_threads workers and the publisher.
+ * @return 0 on success or a negative errno value.
+ */
+int dispatch_init(struct demuxfs_data *priv);
+
+/**
+ * Queues a complete, CRC-checked section if its table is parsed off the
+ * packet thread.
+ * @return true if the section was queued, false if it must be parsed inline.
+ */
+bool dispatch_section(const struct ts_header *header, parse_function_t parse_function,
+		struct buffer *buffer, struct demuxfs_data *priv);
+
+/**
+ * Serializes the changes to the tree made by the packet thread and by the
+ * publisher. Does nothing unless parsing is dispatched. May be nested.
+ */
+void dispatch_lock(struct demuxfs_data *priv);
+void dispatch_unlock(struct demuxfs_data *priv);
+
+/**
+ * Tells if @table, filled in by psi_parse() and holding its hash key in its
+ * dentry, is the current version of a table that is not in priv->psi_tables yet.
+ */
+bool dispatch_table_is_new(struct psi_common_header *table, struct demuxfs_data *priv);
+
+/**
+ * Builds and publishes a section right away. Used by the parse functions of
+ * tables that come in two halves.
+ */
+int dispatch_parse_now(build_function_t build, publish_function_t publish, const struct ts_header *header,
+		const char *payload, uint32_t payload_len, struct demuxfs_data *priv);
+
+/**
+ * Publishes the sections still in flight and stops the threads.
+ */
+void dispatch_destroy(struct demuxfs_data *priv);
+
+#endif /* __dispatch_h */
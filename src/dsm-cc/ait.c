@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "fsutils.h"
 #include "xattr.h"
 #include "hash.h"
@@ -36,6 +37,8 @@
 #include "tables/psi.h"
 #include "dsm-cc/ait.h"
 #include "dsm-cc/descriptors/descriptors.h"
+#include "dispatch.h"
+#include "trace.h"
 
 /* AIT descriptor 0x00 */
 struct application_descriptor {
@@ -159,7 +162,10 @@ void ait_free(struct ait_table *ait)
 	free(ait);
 }
 
-static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
+/**
+ * Parses an AIT descriptor whose body, past the tag and length, is read from @bs.
+ */
+static void ait_parse_descriptor(uint8_t tag, struct bitstream *bs,
 		struct dentry *parent, struct demuxfs_data *priv)
 {
 	struct dentry *dentry;
@@ -167,20 +173,24 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 	switch (tag) {
 		case 0x00: /* Application descriptor */
 			{
-				uint8_t i;
+				struct bitstream profiles;
 				struct application_descriptor desc;
+				uint8_t flags;
 
 				dentry = CREATE_DIRECTORY(parent, "Application_Descriptor");
 
-				desc.application_profiles_length = payload[2];
-				for (i=3; i<desc.application_profiles_length+3; i+=5) {
+				desc.application_profiles_length = bitstream_read_u8(bs);
+				bitstream_sub(bs, desc.application_profiles_length, &profiles);
+				while (bitstream_remaining(&profiles)) {
 					struct dentry *prof_dentry;
 					struct app_profile *profile = &desc.app_profile;
 
-					profile->application_profile = CONVERT_TO_16(payload[i], payload[i+1]);
-					profile->version_major = payload[i+2];
-					profile->version_minor = payload[i+3];
-					profile->version_micro = payload[i+4];
+					profile->application_profile = bitstream_read_u16(&profiles);
+					profile->version_major = bitstream_read_u8(&profiles);
+					profile->version_minor = bitstream_read_u8(&profiles);
+					profile->version_micro = bitstream_read_u8(&profiles);
+					if (bitstream_error(&profiles))
+						break;
 
 					prof_dentry = CREATE_DIRECTORY(dentry, "Application_Profile_%02d", 
 						profile->application_profile);
@@ -189,9 +199,10 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 					CREATE_FILE_NUMBER(prof_dentry, profile, version_minor);
 					CREATE_FILE_NUMBER(prof_dentry, profile, version_micro);
 				}
-				desc.service_bound_flag = payload[i] >> 7;
-				desc._visibility = (payload[i] >> 5) & 0x03;
-				desc.application_priority = payload[i+1];
+				flags = bitstream_read_u8(bs);
+				desc.service_bound_flag = flags >> 7;
+				desc._visibility = (flags >> 5) & 0x03;
+				desc.application_priority = bitstream_read_u8(bs);
 
 				if (desc._visibility == 0x00)
 					desc.visibility = strdup("Not visible to users or other applications through API, except for logout information errors and such [0x00]");
@@ -213,24 +224,24 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 			{
 				struct application_name_descriptor desc;
 				struct dentry *app_dentry;
-				uint8_t i = 2, app_nr = 1;
+				const char *name;
+				uint8_t app_nr = 1;
 
 				dentry = CREATE_DIRECTORY(parent, "Application_Name_Descriptor");
-				while (i < len) {
+				while (bitstream_remaining(bs)) {
+					desc.iso_639_language_code = bitstream_read_u24(bs);
+					desc.application_name_length = bitstream_read_u8(bs);
+					name = bitstream_read_bytes(bs, desc.application_name_length);
+					if (! name)
+						break;
 					app_dentry = CREATE_DIRECTORY(dentry, "Application_Name_%02d", app_nr++); 
-
-					desc.iso_639_language_code = CONVERT_TO_24(payload[i],
-							payload[i+1], payload[i+2]) & 0x00ffffff;
-					desc.application_name_length = payload[i+3];
-					desc.application_name = strndup(&payload[i+4], desc.application_name_length+1);
-					desc.application_name[desc.application_name_length] = '\0';
+					desc.application_name = strndup(name, desc.application_name_length);
 
 					CREATE_FILE_NUMBER(app_dentry, &desc, iso_639_language_code);
 					CREATE_FILE_NUMBER(app_dentry, &desc, application_name_length);
 					CREATE_FILE_STRING(app_dentry, &desc, application_name, XATTR_FORMAT_STRING);
 					
 					free(desc.application_name);
-					i += 4 + desc.application_name_length;
 				}
 			}
 			break;
@@ -240,8 +251,8 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 				memset(&desc, 0, sizeof(desc));
 
 				dentry = CREATE_DIRECTORY(parent, "Transport_Protocol_Descriptor");
-				desc._protocol_id = CONVERT_TO_16(payload[2], payload[3]);
-				desc.transport_protocol_label = payload[4];
+				desc._protocol_id = bitstream_read_u16(bs);
+				desc.transport_protocol_label = bitstream_read_u8(bs);
 				switch (desc._protocol_id) {
 					case 0x0001: 
 						sprintf(desc.protocol_id, "Object carousel transport protocol [%#x]", desc._protocol_id);
@@ -261,75 +272,76 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 				}
 				CREATE_FILE_STRING(dentry, &desc, protocol_id, XATTR_FORMAT_STRING_AND_NUMBER);
 				CREATE_FILE_NUMBER(dentry, &desc, transport_protocol_label);
-				if (((int) len - 3) > 0) {
-					uint8_t i = 0;
-					uint8_t url_number = 1;
+				if (bitstream_remaining(bs)) {
+					uint8_t flags, url_number = 1;
 					struct dentry *subdir;
 
 					switch (desc._protocol_id) {
 						case 0x0001:
 						case 0x0004:
 							subdir = CREATE_DIRECTORY(dentry, "Remote_Connection");
-							desc.carousel.remote_connection = payload[5] & 0x01;
-							desc.carousel.reserved_future_use = (payload[5] >> 1) & 0x7f;
+							flags = bitstream_read_u8(bs);
+							desc.carousel.remote_connection = flags & 0x01;
+							desc.carousel.reserved_future_use = (flags >> 1) & 0x7f;
 							CREATE_FILE_NUMBER(subdir, &desc.carousel, remote_connection);
 
 							if (desc.carousel.remote_connection) {
-								desc.carousel.original_network_id = CONVERT_TO_16(payload[6], payload[7]);
-								desc.carousel.transport_stream_id = CONVERT_TO_16(payload[8], payload[9]);
-								desc.carousel.service_id = CONVERT_TO_16(payload[10], payload[11]);
+								desc.carousel.original_network_id = bitstream_read_u16(bs);
+								desc.carousel.transport_stream_id = bitstream_read_u16(bs);
+								desc.carousel.service_id = bitstream_read_u16(bs);
 								CREATE_FILE_NUMBER(subdir, &desc.carousel, original_network_id);
 								CREATE_FILE_NUMBER(subdir, &desc.carousel, transport_stream_id);
 								CREATE_FILE_NUMBER(subdir, &desc.carousel, service_id);
-								i = 6;
 							}
-							desc.carousel.component_tag = payload[6+i];
+							desc.carousel.component_tag = bitstream_read_u8(bs);
 							CREATE_FILE_NUMBER(subdir, &desc.carousel, component_tag);
 							break;
 						case 0x0002:
 							subdir = CREATE_DIRECTORY(dentry, "IP_Transport");
-							desc.ip.remote_connection = payload[5] & 0x01;
-							desc.ip.reserved_future_use = (payload[5] >> 1) & 0x7f;
+							flags = bitstream_read_u8(bs);
+							desc.ip.remote_connection = flags & 0x01;
+							desc.ip.reserved_future_use = (flags >> 1) & 0x7f;
 							CREATE_FILE_NUMBER(subdir, &desc.ip, remote_connection);
 
 							if (desc.ip.remote_connection) {
-								desc.ip.original_network_id = CONVERT_TO_16(payload[6], payload[7]);
-								desc.ip.transport_stream_id = CONVERT_TO_16(payload[8], payload[9]);
-								desc.ip.service_id = CONVERT_TO_16(payload[10], payload[11]);
+								desc.ip.original_network_id = bitstream_read_u16(bs);
+								desc.ip.transport_stream_id = bitstream_read_u16(bs);
+								desc.ip.service_id = bitstream_read_u16(bs);
 								CREATE_FILE_NUMBER(subdir, &desc.ip, original_network_id);
 								CREATE_FILE_NUMBER(subdir, &desc.ip, transport_stream_id);
 								CREATE_FILE_NUMBER(subdir, &desc.ip, service_id);
-								i = 6;
 							}
-							desc.ip.alignment_indicator = payload[6+i] & 0x01;
-							desc.ip.reserved = (payload[6+i] >> 1) & 0x7f;
+							flags = bitstream_read_u8(bs);
+							desc.ip.alignment_indicator = flags & 0x01;
+							desc.ip.reserved = (flags >> 1) & 0x7f;
 							CREATE_FILE_NUMBER(subdir, &desc.ip, alignment_indicator);
-							i += 7;
-							while (i < len) {
+							while (bitstream_remaining(bs)) {
 								char url_dirname[64];
 								struct dentry *url_dentry;
+								const char *url;
+
+								desc.ip.URL_length = bitstream_read_u8(bs);
+								url = bitstream_read_bytes(bs, desc.ip.URL_length);
+								if (! url)
+									break;
 
 								sprintf(url_dirname, "URL_%02d", url_number++);
 								url_dentry = CREATE_DIRECTORY(subdir, url_dirname);
-
-								desc.ip.URL_length = payload[i++];
 								CREATE_FILE_NUMBER(url_dentry, &desc.ip, URL_length);
 
 								if (desc.ip.URL_length) {
-									desc.ip.URL_byte = calloc(desc.ip.URL_length + 1, sizeof(char));
-									memcpy(desc.ip.URL_byte, &payload[i], desc.ip.URL_length);
+									desc.ip.URL_byte = strndup(url, desc.ip.URL_length);
 									CREATE_FILE_STRING(url_dentry, &desc.ip, URL_byte, XATTR_FORMAT_STRING);
 									free(desc.ip.URL_byte);
 								}
-								i += desc.ip.URL_length;
 							}
 							break;
 						default:
-							desc.selector_byte = malloc((len-3) * sizeof(char));
-							for (i=0; i<len-3; ++i)
-								desc.selector_byte[i] = payload[5+i];
-							CREATE_FILE_BIN(dentry, &desc, selector_byte, (len-3));
-							free(desc.selector_byte);
+							{
+								uint32_t selector_len = bitstream_remaining(bs);
+								desc.selector_byte = (char *) bitstream_read_bytes(bs, selector_len);
+								CREATE_FILE_BIN(dentry, &desc, selector_byte, selector_len);
+							}
 					}
 				}
 			}
@@ -338,24 +350,24 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 			if (priv->options.standard == SBTVD_STANDARD) {
 				/* Ginga-J application descriptor */
 				uint8_t param = 1;
-				uint8_t i = 2;
 				dentry = CREATE_DIRECTORY(parent, "Ginga-J_Application_Descriptor");
-				while (i < len) {
+				while (bitstream_remaining(bs)) {
 					struct dentry *param_dentry;
 					struct ginga_j_application_descriptor desc;
+					const char *parameter;
 
+					desc.parameter_length = bitstream_read_u8(bs);
+					parameter = bitstream_read_bytes(bs, desc.parameter_length);
+					if (! parameter)
+						break;
 					param_dentry = CREATE_DIRECTORY(dentry, "Parameter_%02d", param++);
-					desc.parameter_length = payload[i];
 					CREATE_FILE_NUMBER(param_dentry, &desc, parameter_length);
 
 					if (desc.parameter_length) {
-						desc.parameter = strndup(&payload[i+1], desc.parameter_length+1);
-						desc.parameter[desc.parameter_length] = '\0';
-
+						desc.parameter = strndup(parameter, desc.parameter_length);
 						CREATE_FILE_STRING(param_dentry, &desc, parameter, XATTR_FORMAT_STRING);
 						free(desc.parameter);
 					}
-					i += 2 + desc.parameter_length;
 				}
 			} else {
 				/* DVB-J application descriptor */
@@ -367,22 +379,24 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 			if (priv->options.standard == SBTVD_STANDARD) {
 				/* Ginga-J application location descriptor */
 				struct ginga_j_application_location_descriptor desc;
-				uint8_t i;
+				const char *base_directory, *classpath_extension, *initial_class;
+				uint32_t initial_class_len;
+
+				desc.base_directory_length = bitstream_read_u8(bs);
+				base_directory = bitstream_read_bytes(bs, desc.base_directory_length);
+				desc.classpath_extension_length = bitstream_read_u8(bs);
+				classpath_extension = bitstream_read_bytes(bs, desc.classpath_extension_length);
+				initial_class_len = bitstream_remaining(bs);
+				initial_class = bitstream_read_bytes(bs, initial_class_len);
+				if (! base_directory || ! classpath_extension) {
+					TS_WARNING("Ginga-J application location descriptor is truncated");
+					break;
+				}
 
 				dentry = CREATE_DIRECTORY(parent, "Ginga-J_Application_Location");
-
-				desc.base_directory_length = payload[2];
-				desc.base_directory = strndup(&payload[3], desc.base_directory_length+1);
-				desc.base_directory[desc.base_directory_length] = '\0';
-
-				i = 3 + desc.base_directory_length;
-				desc.classpath_extension_length = payload[i];
-				desc.classpath_extension = strndup(&payload[i+1], desc.classpath_extension_length+1);
-				desc.classpath_extension[desc.classpath_extension_length] = '\0';
-
-				i += 1 + desc.classpath_extension_length;
-				desc.initial_class = strndup(&payload[i], len-i+2);
-				desc.initial_class[len-i+2] = '\0';
+				desc.base_directory = strndup(base_directory, desc.base_directory_length);
+				desc.classpath_extension = strndup(classpath_extension, desc.classpath_extension_length);
+				desc.initial_class = strndup(initial_class, initial_class_len);
 
 				CREATE_FILE_NUMBER(dentry, &desc, base_directory_length);
 				CREATE_FILE_STRING(dentry, &desc, base_directory, XATTR_FORMAT_STRING);
@@ -401,17 +415,17 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 			break;
 		case 0x05: /* External application authorization descriptor */
 			{
-				uint8_t i = 2;
 				uint8_t app = 1;
 				dentry = CREATE_DIRECTORY(parent, "External_Application_Authorization_Descriptor");
-				while (i < len) {
+				while (bitstream_remaining(bs)) {
 					struct dentry *app_dentry;
 					struct external_application_authorization_descriptor desc;
 
-					desc.id.organization_id = CONVERT_TO_32(payload[i], payload[i+1], payload[i+2], payload[i+3]);
-					desc.id.application_id = CONVERT_TO_16(payload[i+4], payload[i+5]);
-					desc.application_priority = payload[i+6];
-					i += 7;
+					desc.id.organization_id = bitstream_read_u32(bs);
+					desc.id.application_id = bitstream_read_u16(bs);
+					desc.application_priority = bitstream_read_u8(bs);
+					if (bitstream_error(bs))
+						break;
 
 					app_dentry = CREATE_DIRECTORY(dentry, "Application_%02d", app++);
 					CREATE_FILE_NUMBER(app_dentry, &desc.id, organization_id);
@@ -475,19 +489,15 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 		case 0x0b: /* Application icons descriptor */
 			{
 				struct application_icons_descriptor desc;
-				uint8_t i;
 
 				dentry = CREATE_DIRECTORY(parent, "Application_Icons_Descriptor");
-				desc.icon_locator_length = payload[2];
+				desc.icon_locator_length = bitstream_read_u8(bs);
 				CREATE_FILE_NUMBER(dentry, &desc, icon_locator_length);
 
-				if (desc.icon_locator_length) {
-					desc.icon_locator = malloc(desc.icon_locator_length);
-					memcpy(desc.icon_locator, &payload[3], desc.icon_locator_length);
+				desc.icon_locator = (char *) bitstream_read_bytes(bs, desc.icon_locator_length);
+				if (desc.icon_locator && desc.icon_locator_length)
 					CREATE_FILE_BIN(dentry, &desc, icon_locator, desc.icon_locator_length);
-				}
-				i = 3 + desc.icon_locator_length;
-				desc._icon_flags = CONVERT_TO_16(payload[i], payload[i+1]);
+				desc._icon_flags = bitstream_read_u16(bs);
 				switch (desc._icon_flags) {
 					case 0x01: sprintf(desc.icon_flags, 
 							  "32x32 for presentation on squared pixel screens [%#x]", desc._icon_flags);
@@ -530,31 +540,34 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 			break;
 		case 0x0d: /* DII location descriptor */
 			{
-				uint8_t i = 3;
 				uint8_t label_number = 1;
 				struct prefetch_descriptor desc;
 
 				dentry = CREATE_DIRECTORY(parent, "DII_Location_Descriptor");
-				desc.transport_protocol_label = payload[2];
+				desc.transport_protocol_label = bitstream_read_u8(bs);
 				CREATE_FILE_NUMBER(dentry, &desc, transport_protocol_label);
 
-				while (i < len) {
+				while (bitstream_remaining(bs)) {
 					char label_name[32];
 					struct dentry *label_dentry;
+					const char *label;
+
+					desc.label_length = bitstream_read_u8(bs);
+					label = bitstream_read_bytes(bs, desc.label_length);
+					desc.prefetch_priority = bitstream_read_u8(bs);
+					if (bitstream_error(bs))
+						break;
 
 					sprintf(label_name, "Label_%02d", label_number++);
 					label_dentry = CREATE_DIRECTORY(dentry, label_name);
 
-					desc.label_length = payload[i++];
 					CREATE_FILE_NUMBER(label_dentry, &desc, label_length);
 					if (desc.label_length) {
-						desc.label = calloc(desc.label_length + 1, sizeof(char));
-						memcpy(desc.label, &payload[i], desc.label_length);
+						desc.label = strndup(label, desc.label_length);
 						CREATE_FILE_STRING(label_dentry, &desc, label, XATTR_FORMAT_STRING);
+						free(desc.label);
 					}
-					i += desc.label_length;
 
-					desc.prefetch_priority = payload[i++];
 					if (desc.prefetch_priority <= 0 || desc.prefetch_priority > 100)
 						TS_WARNING("prefetch_priority not in range 1..100 (%d)", desc.prefetch_priority);
 					CREATE_FILE_NUMBER(label_dentry, &desc, prefetch_priority);
@@ -594,7 +607,7 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 		case 0x11: /* IP signalling descriptor */
 			if (priv->options.standard == SBTVD_STANDARD) {
 				struct ip_signalling_descriptor desc;
-				desc.platform_id = CONVERT_TO_24(payload[2], payload[3], payload[4]);
+				desc.platform_id = bitstream_read_u24(bs);
 				dentry = CREATE_DIRECTORY(parent, "IP_Signalling_Descriptor");
 				CREATE_FILE_NUMBER(dentry, &desc, platform_id);
 			} else {
@@ -627,7 +640,7 @@ static void ait_parse_descriptor(uint8_t tag, uint8_t len, const char *payload,
 }
 
 static void ait_create_directory(const struct ts_header *header, struct ait_table *ait,
-		struct dentry **version_dentry, struct demuxfs_data *priv)
+		struct dentry *version_dentry, struct demuxfs_data *priv)
 {
 	struct dentry *dentry = fsutils_get_child(priv->root, "AIT");
 
@@ -641,16 +654,28 @@ static void ait_create_directory(const struct ts_header *header, struct ait_tabl
 		dentry = ait->dentry;
 	}
 
-	/* Create the versioned dir and update the Current symlink */
-	*version_dentry = fsutils_create_version_dir(dentry, ait->version_number);
+	/* Link the versioned dir and update the Current symlink */
+	fsutils_attach_version_dir(dentry, version_dentry);
+}
 
-	psi_populate((void **) &ait, *version_dentry);
+/**
+ * Consumes the descriptor at the current position of @bs.
+ * @return a pointer to its tag, or NULL if it runs past the end of @bs.
+ */
+static const char *ait_read_descriptor(struct bitstream *bs)
+{
+	const char *descriptor = bitstream_pointer(bs);
+
+	bitstream_skip(bs, 1);
+	if (! bitstream_read_bytes(bs, bitstream_read_u8(bs)))
+		return NULL;
+	return descriptor;
 }
 
-int ait_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
-		struct demuxfs_data *priv)
+int ait_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv)
 {
-	struct ait_table *current_ait = NULL;
+	TRACE_FUNCTION("parser");
 	struct ait_table *ait = (struct ait_table *) calloc(1, sizeof(struct ait_table));
 	assert(ait);
 	
@@ -666,81 +691,117 @@ int ait_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 	/* Set hash key and check if there's already one version of this table in the hash */
 	ait->dentry->inode = TS_PACKET_HASH_KEY(header, ait);
-	current_ait = hashtable_get(priv->psi_tables, ait->dentry->inode);
 	
 	/* Check whether we should keep processing this packet or not */
-	if (! ait->current_next_indicator || (current_ait && current_ait->version_number == ait->version_number)) {
+	if (! dispatch_table_is_new((struct psi_common_header *) ait, priv)) {
 		ait_free(ait);
 		return 0;
 	}
 
-	TS_INFO("AIT parser: pid=%#x, table_id=%#x, current_ait=%p, ait->version_number=%#x, len=%d", 
-			header->pid, ait->table_id, current_ait, ait->version_number, payload_len);
+	TS_INFO("AIT parser: pid=%#x, table_id=%#x, ait->version_number=%#x, len=%d", 
+			header->pid, ait->table_id, ait->version_number, payload_len);
+
+	/* Parse AIT specific bits into a versioned dir that is linked by ait_publish() */
+	struct dentry *version_dentry = fsutils_create_staging_dir(ait->version_number);
+	psi_populate((void **) &ait, version_dentry);
 
-	/* Parse AIT specific bits */
-	struct dentry *version_dentry = NULL;
-	ait_create_directory(header, ait, &version_dentry, priv);
+	/* The loops are bound by the CRC at the end of the section */
+	struct bitstream bs, loop_bs;
+	bitstream_init(&bs, payload, payload_len - 4);
+	bitstream_skip(&bs, 8);
 
-	ait->reserved_4 = payload[8] >> 4;
-	ait->common_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
+	uint16_t common_descriptors_length = bitstream_read_u16(&bs);
+	ait->reserved_4 = common_descriptors_length >> 12;
+	ait->common_descriptors_length = common_descriptors_length & 0x0fff;
 	CREATE_FILE_NUMBER(version_dentry, ait, common_descriptors_length);
 
-	uint16_t i;
-	uint32_t len = 0;
-	for (i=10; i<10+ait->common_descriptors_length; i+=len)
-		len = dsmcc_descriptors_parse(&payload[i], 1, version_dentry, priv);
+	bitstream_sub(&bs, ait->common_descriptors_length, &loop_bs);
+	while (bitstream_remaining(&loop_bs)) {
+		const char *descriptor = ait_read_descriptor(&loop_bs);
+		if (! descriptor)
+			break;
+		dsmcc_descriptors_parse(descriptor, 1, version_dentry, priv);
+	}
 
-	ait->reserved_5 = payload[i] >> 4;
-	ait->application_loop_length = CONVERT_TO_16(payload[i], payload[i+1]) & 0x0fff;
+	uint16_t application_loop_length = bitstream_read_u16(&bs);
+	ait->reserved_5 = application_loop_length >> 12;
+	ait->application_loop_length = application_loop_length & 0x0fff;
 	CREATE_FILE_NUMBER(version_dentry, ait, application_loop_length);
-	i += 2;
+	bitstream_sub(&bs, ait->application_loop_length, &loop_bs);
 
 	/* Count how many entries are in the application loop */
-	uint16_t n = i;
-	while (n < ait->application_loop_length) {
-		uint16_t application_descriptors_loop_len;
-		n += 7; // skip application_identifier() + application_control_code
-		application_descriptors_loop_len = CONVERT_TO_16(payload[n], payload[n+1]) & 0x0fff;
-		n += 2 + application_descriptors_loop_len;
+	struct bitstream count_bs = loop_bs;
+	while (bitstream_remaining(&count_bs)) {
+		bitstream_skip(&count_bs, 7); // skip application_identifier() + application_control_code
+		bitstream_skip(&count_bs, bitstream_read_u16(&count_bs) & 0x0fff);
 		ait->_ait_data_entries++;
 	}
 
 	/* Allocate and parse application entries */
 	if (ait->_ait_data_entries) {
-		uint16_t ait_index = 0;
 		ait->ait_data = calloc(ait->_ait_data_entries, sizeof(struct ait_data));
-		while (i < ait->application_loop_length) {
+		assert(ait->ait_data);
+		for (uint16_t ait_index=0; ait_index<ait->_ait_data_entries; ++ait_index) {
 			struct dentry *app_dentry;
-			struct ait_data *data = &ait->ait_data[ait_index++];
+			struct ait_data *data = &ait->ait_data[ait_index];
+			struct bitstream app_bs;
 
-			app_dentry = CREATE_DIRECTORY(version_dentry, "Application_%02d", ait_index);
+			app_dentry = CREATE_DIRECTORY(version_dentry, "Application_%02d", ait_index+1);
 
-			data->application_identifier.organization_id = CONVERT_TO_32(payload[i],
-				payload[i+1], payload[i+2], payload[i+3]);
-			data->application_identifier.application_id = CONVERT_TO_16(payload[i+4],
-				payload[i+5]);
-			data->application_control_code = payload[i+6];
-			data->application_descriptors_loop_length = CONVERT_TO_16(payload[i+7],
-				payload[i+8]) & 0x0fff;
+			data->application_identifier.organization_id = bitstream_read_u32(&loop_bs);
+			data->application_identifier.application_id = bitstream_read_u16(&loop_bs);
+			data->application_control_code = bitstream_read_u8(&loop_bs);
+			data->application_descriptors_loop_length = bitstream_read_u16(&loop_bs) & 0x0fff;
 
 			CREATE_FILE_NUMBER(app_dentry, &data->application_identifier, organization_id);
 			CREATE_FILE_NUMBER(app_dentry, &data->application_identifier, application_id);
 			CREATE_FILE_NUMBER(app_dentry, data, application_control_code);
 			CREATE_FILE_NUMBER(app_dentry, data, application_descriptors_loop_length);
 
-			i += 9;
-			n = 0;
-			while (n < data->application_descriptors_loop_length) {
-				uint8_t descriptor_tag = payload[i+n];
-				uint8_t descriptor_len = payload[i+n+1];
-				ait_parse_descriptor(descriptor_tag, descriptor_len, &payload[i+n], app_dentry, priv);
-				n += 2 + descriptor_len;
+			bitstream_sub(&loop_bs, data->application_descriptors_loop_length, &app_bs);
+			while (bitstream_remaining(&app_bs)) {
+				const char *descriptor = ait_read_descriptor(&app_bs);
+				struct bitstream descriptor_bs;
+				if (! descriptor)
+					break;
+				bitstream_init(&descriptor_bs, descriptor + 2, (uint8_t) descriptor[1]);
+				ait_parse_descriptor(descriptor[0], &descriptor_bs, app_dentry, priv);
 			}
-			i += n;
 		}
 	}
 
-	if (current_ait) {
+	if (bitstream_error(&bs) || bitstream_error(&loop_bs)) {
+		TS_WARNING("AIT of pid %#x runs past the end of the section (%d bytes)", header->pid, payload_len);
+		fsutils_dispose_tree(version_dentry);
+		ait_free(ait);
+		return -EBADMSG;
+	}
+	built->table = ait;
+	built->version_dentry = version_dentry;
+	return 0;
+}
+
+int ait_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("publish");
+	struct ait_table *current_ait, *ait = built->table;
+
+	/* A newer section may have been published while this one was being built */
+	if (! dispatch_table_is_new((struct psi_common_header *) ait, priv)) {
+		fsutils_dispose_tree(built->version_dentry);
+		ait_free(ait);
+		return 0;
+	}
+	current_ait = hashtable_get(priv->psi_tables, ait->dentry->inode);
+	ait_create_directory(header, ait, built->version_dentry, priv);
+
+	if (current_ait && current_ait->dentry->name && ! ait->dentry->name) {
+		/* The table being replaced owns the shared AIT directory: hand it over */
+		free(ait->dentry);
+		ait->dentry = current_ait->dentry;
+		current_ait->dentry = NULL;
+		hashtable_del(priv->psi_tables, ait->dentry->inode);
+	} else if (current_ait) {
 		fsutils_migrate_children(current_ait->dentry, ait->dentry);
 		hashtable_del(priv->psi_tables, current_ait->dentry->inode);
 	}
@@ -748,3 +809,9 @@ int ait_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 	return 0;
 }
+
+int ait_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return dispatch_parse_now(ait_build, ait_publish, header, payload, payload_len, priv);
+}
@@ -35,6 +35,9 @@ struct ait_table {
 
 int ait_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
+int ait_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv);
+int ait_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv);
 void ait_free(struct ait_table *ait);
 
 #endif /* __ait_h */
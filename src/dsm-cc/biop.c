@@ -28,23 +28,22 @@
  */
 #include "demuxfs.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "fsutils.h"
 #include "xattr.h"
 #include "biop.h"
 #include "iop.h"
 #include "ts.h"
 #include "debug.h"
+#include "trace.h"
 
+/* Object keys are read like biop_parse_object_location() does, so that both yield the same inode */
 static ino_t biop_get_sub_header_inode(struct biop_message_sub_header *sub_header)
 {
 	ino_t inode = 0;
 	if (sub_header)
-		inode = CONVERT_TO_32(
-			sub_header->object_key.object_key[0],
-			sub_header->object_key.object_key[1],
-			sub_header->object_key.object_key[2],
-			sub_header->object_key.object_key[3]
-		);
+		for (uint8_t i=0; i<sub_header->object_key.object_key_length && i<4; ++i)
+			inode = (inode << 8) | (sub_header->object_key.object_key[i] & 0xff);
 	return inode;
 }
 
@@ -319,6 +318,7 @@ static int biop_parse_directory_message(struct biop_directory_message *msg,
 				struct biop_profile_body *pb = binding->iop_ior->tagged_profiles[x].profile_body;
 				if (pb) {
 					binding->_inode = pb->object_location.object_key;
+					binding->_module_id = pb->object_location.module_id;
 					break;
 				}
 			}
@@ -527,37 +527,42 @@ void biop_free_module_info(struct biop_module_info *modinfo)
 		free(modinfo->user_info);
 }
 
-/* Returns how many bytes were parsed */
+/* Returns how many bytes were parsed, or -EBADMSG if they run past @len */
 int biop_parse_module_info(struct biop_module_info *modinfo, const char *buf, uint32_t len)
 {
-	int i, j = 0;
+	struct bitstream bs;
+	const char *user_info;
 
-	modinfo->module_timeout = CONVERT_TO_32(buf[j], buf[j+1], buf[j+2], buf[j+3]);
-	modinfo->block_timeout = CONVERT_TO_32(buf[j+4], buf[j+5], buf[j+6], buf[j+7]);
-	modinfo->min_block_time = CONVERT_TO_32(buf[j+8], buf[j+9], buf[j+10], buf[j+11]);
-	modinfo->taps_count = buf[j+12];
-	j += 13;
+	bitstream_init(&bs, buf, len);
+	modinfo->module_timeout = bitstream_read_u32(&bs);
+	modinfo->block_timeout = bitstream_read_u32(&bs);
+	modinfo->min_block_time = bitstream_read_u32(&bs);
+	modinfo->taps_count = bitstream_read_u8(&bs);
 
 	if (modinfo->taps_count) {
 		modinfo->taps = calloc(modinfo->taps_count, sizeof(struct biop_module_tap));
-		for (i=0; i<modinfo->taps_count; ++i) {
+		if (! modinfo->taps)
+			modinfo->taps_count = 0;
+		for (int i=0; i<modinfo->taps_count; ++i) {
 			struct biop_module_tap *tap = &modinfo->taps[i];
-			tap->tap_id = CONVERT_TO_16(buf[j], buf[j+1]);
-			tap->tap_use = CONVERT_TO_16(buf[j+2], buf[j+3]);
-			tap->association_tag = CONVERT_TO_16(buf[j+4], buf[j+5]);
-			tap->selector_length = buf[j+6];
-			j += 7;
+			tap->tap_id = bitstream_read_u16(&bs);
+			tap->tap_use = bitstream_read_u16(&bs);
+			tap->association_tag = bitstream_read_u16(&bs);
+			tap->selector_length = bitstream_read_u8(&bs);
+			bitstream_skip(&bs, tap->selector_length);
 		}
 	}
 
-	modinfo->user_info_length = buf[j];
+	modinfo->user_info_length = bitstream_read_u8(&bs);
+	user_info = bitstream_read_bytes(&bs, modinfo->user_info_length);
+	if (! user_info)
+		modinfo->user_info_length = 0;
 	if (modinfo->user_info_length) {
 		modinfo->user_info = calloc(modinfo->user_info_length, sizeof(char));
-		memcpy(modinfo->user_info, &buf[j+1], modinfo->user_info_length);
+		memcpy(modinfo->user_info, user_info, modinfo->user_info_length);
 	}
-	j += 1 + modinfo->user_info_length;
 
-	return j;
+	return bitstream_error(&bs) ? -EBADMSG : (int) bitstream_position(&bs);
 }
 
 /* Returns 0 on success, -1 on error */
@@ -741,6 +746,7 @@ void biop_reparent_orphaned_dentries(struct dentry *root, struct dentry *stepfat
 int biop_create_filesystem_dentries(struct dentry *parent, struct dentry *stepfather,
 	const char *buf, uint32_t len)
 {
+	TRACE_FUNCTION("publish");
 	struct biop_directory_message gateway_msg;
 	struct biop_message_header msg_header;
 	char object_kind[4];
@@ -791,3 +797,61 @@ int biop_create_filesystem_dentries(struct dentry *parent, struct dentry *stepfa
 
 	return 0;
 }
+
+/* Returns how many messages were found in the module */
+int biop_parse_module(const char *buf, uint32_t len, biop_object_callback_t callback, void *data)
+{
+	struct biop_message_header msg_header;
+	struct biop_object object;
+	uint32_t j = 0, count = 0;
+
+	while (j + 12 < len) {
+		uint32_t body = j + 12, kind_offset, end;
+
+		biop_parse_message_header(&msg_header, &buf[j], len-j);
+		end = body + msg_header.message_size;
+		if (msg_header.magic != 0x42494f50 || end > len || end < body)
+			break;
+		kind_offset = body + 1 + (buf[body] & 0xff) + 4;
+		if (kind_offset + 4 > end)
+			break;
+
+		memset(&object, 0, sizeof(object));
+		object.offset = j;
+		object.length = end - j;
+		object.kind = CONVERT_TO_32(buf[kind_offset], buf[kind_offset+1], buf[kind_offset+2], 0);
+
+		if (object.kind == BIOP_GATEWAY_MESSAGE || object.kind == BIOP_DIR_MESSAGE) {
+			struct biop_directory_message dir_msg;
+			memset(&dir_msg, 0, sizeof(dir_msg));
+			memcpy(&dir_msg.header, &msg_header, sizeof(msg_header));
+			biop_parse_directory_message(&dir_msg, &buf[body], end-body);
+			object.key = biop_get_sub_header_inode(&dir_msg.sub_header);
+			object.dir = &dir_msg;
+			callback(&object, data);
+			biop_free_directory_message(&dir_msg);
+		} else if (object.kind == BIOP_FILE_MESSAGE) {
+			struct biop_file_message file_msg;
+			memset(&file_msg, 0, sizeof(file_msg));
+			memcpy(&file_msg.header, &msg_header, sizeof(msg_header));
+			biop_parse_file_message(&file_msg, &buf[body], end-body);
+			object.key = biop_get_sub_header_inode(&file_msg.sub_header);
+			object.file = &file_msg;
+			if (file_msg.message_body.content_length > end-body ||
+				file_msg.message_body.contents + file_msg.message_body.content_length > &buf[end])
+				file_msg.message_body.content_length = 0;
+			callback(&object, data);
+			biop_free_file_message(&file_msg);
+		} else {
+			struct biop_message_sub_header sub_header;
+			memset(&sub_header, 0, sizeof(sub_header));
+			biop_parse_message_sub_header(&sub_header, &buf[body], end-body);
+			object.key = biop_get_sub_header_inode(&sub_header);
+			callback(&object, data);
+			biop_free_message_sub_header(&sub_header);
+		}
+		j = end;
+		count++;
+	}
+	return count;
+}
@@ -9,6 +9,7 @@ struct iop_tagged_profile;
  * http://www.interactivetvweb.org/tutorials/dtv_intro/dsmcc/object_carousel
  */
 
+#define BIOP_GATEWAY_MESSAGE      0x73726700 /* "srg" */
 #define BIOP_FILE_MESSAGE         0x66696C00 /* "fil" */
 #define BIOP_DIR_MESSAGE          0x64697200 /* "dir" */
 #define BIOP_STREAM_MESSAGE       0x73747200 /* "str" */
@@ -72,6 +73,7 @@ struct biop_binding {
 	char *_content_type;    /* Content (MIME) type */
 	uint64_t _timestamp;    /* Last modified time (UTC time) */
 	ino_t _inode;			/* Inode number (DemuxFS extension) */
+	uint16_t _module_id;	/* Module holding the object (DemuxFS extension) */
 };
 
 struct biop_directory_message {
@@ -146,6 +148,24 @@ struct biop_profile_body {
 	struct biop_connbinder connbinder;
 };
 
+/* A message found by biop_parse_module() */
+struct biop_object {
+	/* Position and size of the message in the module */
+	uint32_t offset;
+	uint32_t length;
+	/* Object key and kind (BIOP_*_MESSAGE) */
+	ino_t key;
+	uint32_t kind;
+	/* Parsed message, valid during the callback only. Set for directories and files. */
+	struct biop_directory_message *dir;
+	struct biop_file_message *file;
+};
+
+typedef void (*biop_object_callback_t)(struct biop_object *object, void *data);
+
+int biop_parse_module(const char *buf, uint32_t len,
+		biop_object_callback_t callback, void *data);
+
 int biop_create_filesystem_dentries(struct dentry *parent,
 		struct dentry *stepfather,
 		const char *buf, uint32_t len);
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "xattr.h"
+#include "hash.h"
+#include "list.h"
+#include "mem.h"
+#include "stats.h"
+#include "ts.h"
+#include "iop.h"
+#include "biop.h"
+#include "tables/psi.h"
+#include "dsm-cc/dsmcc.h"
+#include "dsm-cc/dii.h"
+#include "dsm-cc/carousel.h"
+#include "trace.h"
+
+/* Number of buckets of the object key index of each carousel */
+#define CAROUSEL_INDEX_SIZE  256
+
+/* Location of an object, learned from the directory that binds it and from its own message */
+struct carousel_object {
+	uint16_t module_id;
+	/* Position and size of the object's message in its module, once it has been parsed */
+	uint32_t offset;
+	uint32_t length;
+	bool has_offset;
+	/* Dentry of the object, once its parent directory has been listed */
+	struct dentry *dentry;
+	/* Set once the directory has been listed or the file contents have been received */
+	bool loaded;
+};
+
+struct carousel_module {
+	uint16_t module_id;
+	uint8_t version;
+	uint32_t size;
+	uint64_t timeout_ns;
+	/* Lookups waiting for this module */
+	int waiters;
+	/* Incremented whenever a range of the module has been parsed */
+	uint32_t loads;
+	/* Byte range wanted by the waiting lookups. Data is only allocated while somebody waits. */
+	uint32_t want_start;
+	uint32_t want_end;
+	uint32_t blocks_wanted;
+	uint32_t blocks_received;
+	uint8_t *received;
+	char *data;
+};
+
+struct carousel {
+	uint16_t pid;
+	uint16_t block_size;
+	uint16_t num_modules;
+	struct carousel_module *modules;
+	/* Object key -> struct carousel_object */
+	struct hash_table *objects;
+	/* Location of the service gateway, from the DSI */
+	bool has_gateway;
+	ino_t gateway_key;
+	uint16_t gateway_module;
+	/* The /DSM-CC/<application> directory, which is the service gateway */
+	struct dentry *root;
+	/* Incremented whenever the modules and objects are discarded */
+	uint32_t generation;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head list;
+};
+
+struct carousel_list {
+	pthread_mutex_t mutex;
+	struct list_head carousels;
+};
+
+static struct carousel *carousel_get(uint16_t pid, bool create, struct demuxfs_data *priv)
+{
+	struct carousel_list *cl = priv->carousels;
+	pthread_condattr_t attr;
+	struct carousel *c;
+
+	pthread_mutex_lock(&cl->mutex);
+	list_for_each_entry(c, &cl->carousels, list)
+		if (c->pid == pid)
+			goto out;
+	c = create ? calloc(1, sizeof(struct carousel)) : NULL;
+	if (c) {
+		c->pid = pid;
+		c->objects = hashtable_new(CAROUSEL_INDEX_SIZE);
+		hashtable_set_accounting(c->objects, MEM_CAROUSELS);
+		pthread_mutex_init(&c->mutex, NULL);
+		/* Lookups wait against the monotonic clock, as stats_now() does */
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&c->cond, &attr);
+		pthread_condattr_destroy(&attr);
+		list_add_tail(&c->list, &cl->carousels);
+	}
+out:
+	pthread_mutex_unlock(&cl->mutex);
+	return c;
+}
+
+/* Finds the carousel whose tree holds @dentry */
+static struct carousel *carousel_find(struct dentry *dentry, struct demuxfs_data *priv)
+{
+	struct carousel_list *cl = priv->carousels;
+	struct carousel *c, *found = NULL;
+
+	pthread_mutex_lock(&cl->mutex);
+	list_for_each_entry(c, &cl->carousels, list) {
+		for (struct dentry *d = dentry; d && c->root && ! found; d = d->parent)
+			if (d == c->root)
+				found = c;
+		if (found)
+			break;
+	}
+	pthread_mutex_unlock(&cl->mutex);
+	return found;
+}
+
+static struct carousel_module *carousel_get_module(struct carousel *c, uint16_t module_id)
+{
+	for (uint16_t i=0; i<c->num_modules; ++i)
+		if (c->modules[i].module_id == module_id)
+			return &c->modules[i];
+	return NULL;
+}
+
+static struct carousel_object *carousel_get_object(struct carousel *c, ino_t key, bool create)
+{
+	struct carousel_object *object = hashtable_get(c->objects, key);
+	if (! object && create) {
+		object = calloc(1, sizeof(struct carousel_object));
+		if (object)
+			hashtable_add(c->objects, key, object, free);
+	}
+	return object;
+}
+
+/* Stops collecting the blocks of a module */
+static void carousel_release_module(struct carousel_module *mod)
+{
+	mem_free(MEM_CAROUSELS, mod->data);
+	mem_free(MEM_CAROUSELS, mod->received);
+	mod->data = NULL;
+	mod->received = NULL;
+	mod->blocks_wanted = 0;
+	mod->blocks_received = 0;
+}
+
+static void carousel_add_gateway(struct carousel *c)
+{
+	struct carousel_object *object;
+
+	if (! c->has_gateway || ! c->root)
+		return;
+	object = carousel_get_object(c, c->gateway_key, true);
+	if (object) {
+		object->module_id = c->gateway_module;
+		object->dentry = c->root;
+		c->root->inode = c->gateway_key;
+	}
+}
+
+/* Discards the objects and the tree built from them. Lookups waiting on them give up. */
+static void carousel_reset(struct carousel *c)
+{
+	struct dentry *entry, *aux;
+
+	c->generation++;
+	for (uint16_t i=0; i<c->num_modules; ++i)
+		carousel_release_module(&c->modules[i]);
+	hashtable_destroy(c->objects, free);
+	c->objects = hashtable_new(CAROUSEL_INDEX_SIZE);
+	hashtable_set_accounting(c->objects, MEM_CAROUSELS);
+	if (c->root) {
+		list_for_each_entry_safe(entry, aux, &c->root->children, list)
+			fsutils_dispose_tree(entry);
+		c->root->size = 0;
+	}
+	carousel_add_gateway(c);
+	pthread_cond_broadcast(&c->cond);
+}
+
+static struct dentry *carousel_create_file(struct dentry *parent, const char *name, size_t size, ino_t inode)
+{
+	struct dentry *dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+	assert(dentry);
+
+	/* Contents are only allocated once the file message has been received */
+	dentry->name = strdup(name);
+	dentry->size = size;
+	dentry->inode = inode;
+	dentry->mode = S_IFREG | 0444;
+	dentry->obj_type = OBJ_TYPE_FILE;
+	dentry->format = XATTR_FORMAT_BIN;
+	CREATE_COMMON(parent, dentry);
+	return dentry;
+}
+
+static void carousel_create_children(struct carousel *c, struct dentry *parent,
+		struct biop_directory_message *msg)
+{
+	struct biop_directory_message_body *msg_body = &msg->message_body;
+
+	for (uint16_t i=0; i<msg_body->bindings_count; ++i) {
+		struct biop_binding *binding = &msg_body->bindings[i];
+		const char *name = binding->name.id_byte ? binding->name.id_byte : "";
+		struct carousel_object *object;
+		struct dentry *entry;
+
+		object = carousel_get_object(c, binding->_inode, true);
+		if (! object || object->dentry)
+			continue;
+		if (! object->has_offset)
+			object->module_id = binding->_module_id;
+
+		if (binding->name.kind_data == BIOP_FILE_MESSAGE)
+			entry = carousel_create_file(parent, name, binding->content_size, binding->_inode);
+		else
+			entry = CREATE_SIMPLE_DIRECTORY(parent, name, binding->_inode);
+		entry->atime = binding->_timestamp;
+		entry->ctime = binding->_timestamp;
+		entry->mtime = binding->_timestamp;
+		object->dentry = entry;
+	}
+}
+
+static void carousel_fill_file(struct dentry *dentry, struct biop_file_message *msg)
+{
+	uint32_t size = msg->message_body.content_length;
+
+	pthread_mutex_lock(&dentry->mutex);
+	free(dentry->contents);
+	dentry->contents = malloc(size ? size : 1);
+	if (size)
+		memcpy(dentry->contents, msg->message_body.contents, size);
+	dentry->parent->size += (ssize_t) size - dentry->size;
+	dentry->size = size;
+	pthread_mutex_unlock(&dentry->mutex);
+}
+
+struct carousel_load {
+	struct carousel *c;
+	struct carousel_module *mod;
+};
+
+static void carousel_load_object(struct biop_object *msg, void *data)
+{
+	struct carousel_load *load = (struct carousel_load *) data;
+	struct carousel_object *object = carousel_get_object(load->c, msg->key, true);
+
+	if (! object)
+		return;
+	object->module_id = load->mod->module_id;
+	object->offset = load->mod->want_start + msg->offset;
+	object->length = msg->length;
+	object->has_offset = true;
+	if (! object->dentry || object->loaded)
+		return;
+
+	if (msg->dir)
+		carousel_create_children(load->c, object->dentry, msg->dir);
+	else if (msg->file)
+		carousel_fill_file(object->dentry, msg->file);
+	object->loaded = true;
+}
+
+/* Parses the wanted range of a module and drops its blocks */
+static void carousel_load_module(struct carousel *c, struct carousel_module *mod)
+{
+	TRACE_FUNCTION("publish");
+	struct carousel_load load = { .c = c, .mod = mod };
+
+	dprintf("carousel %#x: parsing bytes %u-%u of module %d", c->pid,
+			mod->want_start, mod->want_end, mod->module_id);
+	biop_parse_module(&mod->data[mod->want_start], mod->want_end - mod->want_start,
+			carousel_load_object, &load);
+	mod->loads++;
+	carousel_release_module(mod);
+	pthread_cond_broadcast(&c->cond);
+}
+
+/* Counts the blocks in the wanted range of a module and how many of them were received */
+static void carousel_count_blocks(struct carousel *c, struct carousel_module *mod)
+{
+	uint32_t first = mod->want_start / c->block_size;
+	uint32_t last = (mod->want_end - 1) / c->block_size;
+
+	mod->blocks_wanted = last - first + 1;
+	mod->blocks_received = 0;
+	for (uint32_t b=first; b<=last; ++b)
+		if (mod->received[b / 8] & (1 << (b % 8)))
+			mod->blocks_received++;
+}
+
+/* Starts or widens the collection of the blocks that hold @object */
+static int carousel_want(struct carousel *c, struct carousel_module *mod, struct carousel_object *object)
+{
+	uint32_t num_blocks = (mod->size + c->block_size - 1) / c->block_size;
+	uint32_t start = 0, end = mod->size;
+
+	if (object->has_offset && object->offset < mod->size) {
+		start = object->offset;
+		end = object->length <= mod->size - start ? start + object->length : mod->size;
+	}
+	if (! mod->data) {
+		mod->data = mem_malloc(MEM_CAROUSELS, mod->size);
+		mod->received = mem_calloc(MEM_CAROUSELS, (num_blocks + 7) / 8, sizeof(uint8_t));
+		if (! mod->data || ! mod->received) {
+			carousel_release_module(mod);
+			return -ENOMEM;
+		}
+		mod->want_start = start;
+		mod->want_end = end;
+	} else {
+		mod->want_start = start < mod->want_start ? start : mod->want_start;
+		mod->want_end = end > mod->want_end ? end : mod->want_end;
+	}
+	carousel_count_blocks(c, mod);
+	if (mod->blocks_received == mod->blocks_wanted)
+		carousel_load_module(c, mod);
+	return 0;
+}
+
+static int carousel_wait(struct carousel *c, uint64_t deadline)
+{
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000ULL,
+		.tv_nsec = deadline % 1000000000ULL,
+	};
+	return pthread_cond_timedwait(&c->cond, &c->mutex, &ts);
+}
+
+int carousel_fetch(struct dentry *dentry, struct demuxfs_data *priv)
+{
+	struct carousel_module *mod = NULL;
+	struct carousel_object *object;
+	struct carousel *c;
+	uint32_t generation, loads = 0;
+	uint64_t deadline;
+	int ret = 0;
+
+	if (! priv->carousels || ! (c = carousel_find(dentry, priv)))
+		return 0;
+
+	pthread_mutex_lock(&c->mutex);
+	generation = c->generation;
+	deadline = stats_now() + CAROUSEL_DEFAULT_TIMEOUT * 1000000000ULL;
+	for (;;) {
+		if (c->generation != generation) {
+			/* A new DII version came in. Only the gateway survives it. */
+			mod = NULL;
+			if (dentry != c->root) {
+				ret = -ENOENT;
+				break;
+			}
+			generation = c->generation;
+		}
+
+		object = dentry != c->root || c->has_gateway ? hashtable_get(c->objects, dentry->inode) : NULL;
+		if (object && object->loaded)
+			break;
+		if (object && ! mod) {
+			/* The module is unknown until the DII that lists it comes in */
+			mod = carousel_get_module(c, object->module_id);
+			if (mod && ! mod->size) {
+				mod = NULL;
+				ret = -ENOENT;
+				break;
+			} else if (mod) {
+				/* The module may be parsed right away if its blocks are already here */
+				loads = mod->loads;
+				if ((ret = carousel_want(c, mod, object)) < 0) {
+					mod = NULL;
+					break;
+				}
+				mod->waiters++;
+				deadline = stats_now() + mod->timeout_ns;
+				continue;
+			}
+		} else if (mod && mod->loads != loads) {
+			/* The module has been parsed, but the object wasn't in it */
+			ret = -EIO;
+			break;
+		}
+		if (carousel_wait(c, deadline) == ETIMEDOUT) {
+			TS_WARNING("carousel %#x: timed out waiting for '%s'", c->pid, dentry->name);
+			ret = -ETIMEDOUT;
+			break;
+		}
+	}
+	if (mod && --mod->waiters == 0)
+		carousel_release_module(mod);
+	pthread_mutex_unlock(&c->mutex);
+	return ret;
+}
+
+struct dentry *carousel_lookup(const char *path, struct demuxfs_data *priv)
+{
+	struct dentry *dentry = priv->root, *child;
+	const char *start = path;
+	char name[NAME_MAX+1];
+	size_t len;
+
+	while (*start == '/')
+		start++;
+	while (*start) {
+		len = strchrnul(start, '/') - start;
+		if (len > NAME_MAX)
+			return NULL;
+		memcpy(name, start, len);
+		name[len] = '\0';
+
+		child = fsutils_get_child(dentry, name);
+		if (! child && carousel_fetch(dentry, priv) == 0)
+			/* The directory has just been listed */
+			child = fsutils_get_child(dentry, name);
+		if (! child)
+			return NULL;
+		dentry = child;
+		for (start += len; *start == '/'; start++)
+			;
+	}
+	return dentry;
+}
+
+void carousel_add_block(const struct ts_header *header, uint16_t module_id, uint8_t module_version,
+		uint16_t block_number, const char *data, uint16_t size, struct demuxfs_data *priv)
+{
+	struct carousel *c = carousel_get(header->pid, false, priv);
+	struct carousel_module *mod;
+	uint32_t offset;
+
+	if (! c)
+		return;
+
+	pthread_mutex_lock(&c->mutex);
+	mod = carousel_get_module(c, module_id);
+	if (! mod || ! mod->data || mod->version != module_version)
+		goto out;
+	offset = (uint32_t) block_number * c->block_size;
+	if (offset >= mod->size || (mod->received[block_number / 8] & (1 << (block_number % 8))))
+		goto out;
+	if (size > mod->size - offset)
+		size = mod->size - offset;
+
+	memcpy(&mod->data[offset], data, size);
+	mod->received[block_number / 8] |= 1 << (block_number % 8);
+	if (offset < mod->want_end && offset + c->block_size > mod->want_start)
+		mod->blocks_received++;
+	if (mod->blocks_received == mod->blocks_wanted)
+		carousel_load_module(c, mod);
+out:
+	pthread_mutex_unlock(&c->mutex);
+}
+
+void carousel_update_modules(const struct ts_header *header, struct dii_table *dii,
+		struct demuxfs_data *priv)
+{
+	struct carousel *c = carousel_get(header->pid, true, priv);
+	struct dentry *app_dentry = NULL;
+
+	if (! c)
+		return;
+
+	/* Applications whose names clash get the PID of their carousel appended */
+	if (! c->root) {
+		app_dentry = dii_create_application_dentry(priv);
+		if (carousel_find(app_dentry, priv))
+			app_dentry = CREATE_DIRECTORY(app_dentry->parent, "%s_%#04x", app_dentry->name, header->pid);
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	if (app_dentry)
+		c->root = app_dentry;
+	carousel_reset(c);
+	free(c->modules);
+	c->block_size = dii->block_size;
+	c->num_modules = dii->number_of_modules;
+	c->modules = calloc(c->num_modules, sizeof(struct carousel_module));
+	if (! c->modules)
+		c->num_modules = 0;
+	for (uint16_t i=0; i<c->num_modules; ++i) {
+		struct carousel_module *mod = &c->modules[i];
+		struct dii_module *dii_mod = &dii->modules[i];
+		mod->module_id = dii_mod->module_id;
+		mod->version = dii_mod->module_version;
+		mod->size = dii_mod->module_size;
+		/* module_timeout is given in microseconds */
+		if (dii_mod->module_info && dii_mod->module_info->module_timeout)
+			mod->timeout_ns = (uint64_t) dii_mod->module_info->module_timeout * 1000ULL;
+		else
+			mod->timeout_ns = CAROUSEL_DEFAULT_TIMEOUT * 1000000000ULL;
+	}
+	TS_INFO("carousel %#x: %d modules of download %#x, fetched on demand", header->pid,
+			c->num_modules, dii->download_id);
+	pthread_mutex_unlock(&c->mutex);
+}
+
+void carousel_set_gateway(const struct ts_header *header, struct iop_ior *ior,
+		struct demuxfs_data *priv)
+{
+	struct biop_profile_body *pb = NULL;
+	struct carousel *c;
+
+	for (uint32_t i=0; i<ior->tagged_profiles_count && ! pb; ++i)
+		pb = ior->tagged_profiles[i].profile_body;
+	if (! pb || ! (c = carousel_get(header->pid, true, priv)))
+		return;
+
+	pthread_mutex_lock(&c->mutex);
+	if (! c->has_gateway || c->gateway_key != pb->object_location.object_key ||
+		c->gateway_module != pb->object_location.module_id) {
+		c->has_gateway = true;
+		c->gateway_key = pb->object_location.object_key;
+		c->gateway_module = pb->object_location.module_id;
+		carousel_reset(c);
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
+
+int carousel_init(struct demuxfs_data *priv)
+{
+	struct carousel_list *cl = calloc(1, sizeof(struct carousel_list));
+	if (! cl)
+		return -ENOMEM;
+	pthread_mutex_init(&cl->mutex, NULL);
+	INIT_LIST_HEAD(&cl->carousels);
+	priv->carousels = cl;
+	return 0;
+}
+
+void carousel_destroy(struct demuxfs_data *priv)
+{
+	struct carousel_list *cl = priv->carousels;
+	struct carousel *c, *aux;
+
+	if (! cl)
+		return;
+	list_for_each_entry_safe(c, aux, &cl->carousels, list) {
+		for (uint16_t i=0; i<c->num_modules; ++i)
+			carousel_release_module(&c->modules[i]);
+		free(c->modules);
+		hashtable_destroy(c->objects, free);
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->mutex);
+		list_del(&c->list);
+		free(c);
+	}
+	pthread_mutex_destroy(&cl->mutex);
+	free(cl);
+	priv->carousels = NULL;
+}
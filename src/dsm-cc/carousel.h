@@ -0,0 +1,72 @@
+#ifndef __carousel_h
+#define __carousel_h
+
+/*
+ * On-demand object carousels, enabled with -o ondemand_carousels=1. Instead
+ * of keeping every DDB block under /DDB and building /DSM-CC once all modules
+ * have been received, DDB blocks are dropped unless a lookup is waiting for
+ * the object they carry.
+ *
+ * The DII tells which modules exist and the DSI tells where the service
+ * gateway is. Directory messages map the object keys of their bindings to the
+ * modules that hold them, and every message parsed adds its offset within its
+ * module to that index. Looking up a path under /DSM-CC/<application> fetches
+ * the modules of the directories along the way; opening a file or listing a
+ * directory fetches its own module. When the offset of an object is known,
+ * only the blocks that hold its message are collected.
+ */
+
+/* Seconds to wait for a module whose biopModuleInfo has no module_timeout */
+#define CAROUSEL_DEFAULT_TIMEOUT  30
+
+struct carousel;
+struct ts_header;
+struct dii_table;
+struct iop_ior;
+
+/**
+ * Enables on-demand carousels for the main parsing context.
+ * @return 0 on success or a negative errno value.
+ */
+int carousel_init(struct demuxfs_data *priv);
+
+/**
+ * Takes the list of modules of a new DII version, discarding the objects
+ * known from the previous one.
+ */
+void carousel_update_modules(const struct ts_header *header, struct dii_table *dii,
+		struct demuxfs_data *priv);
+
+/**
+ * Takes the location of the service gateway from the DSI.
+ */
+void carousel_set_gateway(const struct ts_header *header, struct iop_ior *ior,
+		struct demuxfs_data *priv);
+
+/**
+ * Hands a DDB block to the carousel, which keeps it only if a lookup waits for
+ * the part of the module it belongs to.
+ */
+void carousel_add_block(const struct ts_header *header, uint16_t module_id, uint8_t module_version,
+		uint16_t block_number, const char *data, uint16_t size, struct demuxfs_data *priv);
+
+/**
+ * Resolves @path, fetching the directories along the way if they are carousel
+ * objects that haven't been received yet.
+ * @return the dentry of @path or NULL if it doesn't exist.
+ */
+struct dentry *carousel_lookup(const char *path, struct demuxfs_data *priv);
+
+/**
+ * Waits until the contents of @dentry have been received, if it is a carousel
+ * object. Returns immediately for any other dentry.
+ * @return 0 on success or a negative errno value.
+ */
+int carousel_fetch(struct dentry *dentry, struct demuxfs_data *priv);
+
+/**
+ * Releases the carousel index. The trees are disposed with the root.
+ */
+void carousel_destroy(struct demuxfs_data *priv);
+
+#endif /* __carousel_h */
@@ -37,6 +37,8 @@
 #include "dsm-cc/dsmcc.h"
 #include "dsm-cc/ddb.h"
 #include "dsm-cc/dii.h"
+#include "dsm-cc/carousel.h"
+#include "trace.h"
 
 void ddb_free(struct ddb_table *ddb)
 {
@@ -98,6 +100,7 @@ static void ddb_create_directory(const struct ts_header *header, struct ddb_tabl
 int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	struct ddb_table *current_ddb = NULL;
 	struct ddb_table *ddb = (struct ddb_table *) calloc(1, sizeof(struct ddb_table));
 	assert(ddb);
@@ -152,6 +155,14 @@ int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		ddb_free(ddb);
 		return 0;
 	}
+	if (priv->carousels) {
+		/* Blocks are only kept for the modules that on-demand lookups wait for */
+		if (payload_len > (uint32_t) j+10)
+			carousel_add_block(header, ddb->module_id, ddb->module_version, ddb->block_number,
+					&payload[j+6], payload_len - (j+6) - 4, priv);
+		ddb_free(ddb);
+		return 0;
+	}
 	if (ddb_block_number_already_parsed(current_ddb, ddb->module_id, ddb->block_number)) {
 		ddb_free(ddb);
 		return 0;
@@ -178,11 +189,11 @@ int ddb_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	block_dentry->size = this_block_size;
 	block_dentry->mode = S_IFREG | 0444;
 	block_dentry->obj_type = OBJ_TYPE_FILE;
+	block_dentry->format = XATTR_FORMAT_BIN;
 	block_dentry->contents = malloc(this_block_size);
 	memcpy(block_dentry->contents, &payload[this_block_start], this_block_size);
 	asprintf(&block_dentry->name, "block_%02d.bin", ddb->block_number);
 	CREATE_COMMON(module_dir, block_dentry);
-	xattr_add(block_dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false);
 	
 	if (current_ddb)
 		ddb_free(ddb);
@@ -27,6 +27,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "demuxfs.h"
+#include "bitstream.h"
 #include "descriptors.h"
 #include "ts.h"
 
@@ -71,6 +72,14 @@ bool dsmcc_descriptor_is_parseable(struct dentry *dentry, uint8_t tag, int expec
 	}
 }
 
+bool dsmcc_descriptor_is_truncated(uint8_t tag, const struct bitstream *bs)
+{
+	if (! bitstream_error(bs))
+		return false;
+	TS_WARNING("Tag %#0x could not be parsed: descriptor is truncated", tag);
+	return true;
+}
+
 struct dsmcc_descriptor *dsmcc_descriptors_find(uint8_t tag, struct demuxfs_data *priv)
 {
 	struct dsmcc_descriptor *d = &priv->dsmcc_descriptors[tag];
@@ -1,6 +1,8 @@
 #ifndef __dsmcc_descriptors_h
 #define __dsmcc_descriptors_h
 
+struct bitstream;
+
 struct dsmcc_descriptor {
 	uint8_t tag;
 	char *name;
@@ -9,6 +11,7 @@ struct dsmcc_descriptor {
 
 /* Function prototypes */
 bool dsmcc_descriptor_is_parseable(struct dentry *dentry, uint8_t tag, int expected, int found);
+bool dsmcc_descriptor_is_truncated(uint8_t tag, const struct bitstream *bs);
 struct dsmcc_descriptor *dsmcc_descriptors_init(struct demuxfs_data *priv);
 void dsmcc_descriptors_destroy(struct dsmcc_descriptor *descriptor_list);
 struct dsmcc_descriptor *dsmcc_descriptors_find(uint8_t tag, struct demuxfs_data *priv);
@@ -31,6 +31,8 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct application_profile {
 	uint16_t application_profile;
@@ -41,7 +43,6 @@ struct application_profile {
 
 struct formatted_descriptor {
 	uint8_t application_profiles_length;
-	struct application_profile *profiles;
 	uint8_t service_bound_flag:1;
 	uint8_t visibility:2;
 	uint8_t reserved_future_use:5;
@@ -53,49 +54,54 @@ struct formatted_descriptor {
 /* APPLICATION_DESCRIPTOR parser */
 int dsmcc_descriptor_0x00_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	uint32_t count, i, n;
+	uint32_t n;
 	struct formatted_descriptor f;
-	struct dentry *subdir = CREATE_DIRECTORY(parent, "Application_Descriptor");
+	struct dentry *subdir;
+	struct bitstream bs, profiles;
+	const char *transport_protocol_label;
 
 	memset(&f, 0, sizeof(f));
+	bitstream_init(&bs, payload, len);
+	f.application_profiles_length = bitstream_read_u8(&bs);
+	bitstream_sub(&bs, f.application_profiles_length, &profiles);
+	f.service_bound_flag = bitstream_read_bits(&bs, 1);
+	f.visibility = bitstream_read_bits(&bs, 2);
+	f.reserved_future_use = bitstream_read_bits(&bs, 5);
+	f.application_priority = bitstream_read_u8(&bs);
+	f._transport_protocol_label_count = bitstream_remaining(&bs);
+	transport_protocol_label = bitstream_read_bytes(&bs, f._transport_protocol_label_count);
+	if (dsmcc_descriptor_is_truncated(0x00, &bs))
+		return -ENODATA;
 
-	f.application_profiles_length = payload[0];
+	subdir = CREATE_DIRECTORY(parent, "Application_Descriptor");
 	CREATE_FILE_NUMBER(subdir, &f, application_profiles_length);
 
-	count = f.application_profiles_length / 5;
-	if (count) {
-		f.profiles = malloc(sizeof(struct application_profile) * count);
-		if (! f.profiles)
-			return -ENOMEM;
-		for (i=0, n=0; n<count; ++n, i+=5) {
-			struct dentry *profile_dentry = CREATE_DIRECTORY(subdir, "Application_Profile_%02d", n+1);
-			f.profiles[n].application_profile = CONVERT_TO_16(payload[i+1], payload[i+2]);
-			f.profiles[n].version_major = payload[i+3];
-			f.profiles[n].version_minor = payload[i+4];
-			f.profiles[n].version_micro = payload[i+5];
-			CREATE_FILE_NUMBER(profile_dentry, &f.profiles[n], application_profile);
-			CREATE_FILE_NUMBER(profile_dentry, &f.profiles[n], version_major);
-			CREATE_FILE_NUMBER(profile_dentry, &f.profiles[n], version_minor);
-			CREATE_FILE_NUMBER(profile_dentry, &f.profiles[n], version_micro);
-		}
+	for (n=0; bitstream_remaining(&profiles); ++n) {
+		struct application_profile profile;
+		struct dentry *profile_dentry;
+
+		profile.application_profile = bitstream_read_u16(&profiles);
+		profile.version_major = bitstream_read_u8(&profiles);
+		profile.version_minor = bitstream_read_u8(&profiles);
+		profile.version_micro = bitstream_read_u8(&profiles);
+		if (bitstream_error(&profiles))
+			break;
+
+		profile_dentry = CREATE_DIRECTORY(subdir, "Application_Profile_%02d", n+1);
+		CREATE_FILE_NUMBER(profile_dentry, &profile, application_profile);
+		CREATE_FILE_NUMBER(profile_dentry, &profile, version_major);
+		CREATE_FILE_NUMBER(profile_dentry, &profile, version_minor);
+		CREATE_FILE_NUMBER(profile_dentry, &profile, version_micro);
 	}
-	i = f.application_profiles_length + 1;
-	f.service_bound_flag = payload[i] >> 7;
-	f.visibility = (payload[i] >> 5) & 0x03;
-	f.reserved_future_use = payload[i] & 0x1f;
-	f.application_priority = payload[i+1];
 	CREATE_FILE_NUMBER(subdir, &f, service_bound_flag);
 	CREATE_FILE_NUMBER(subdir, &f, visibility);
 	CREATE_FILE_NUMBER(subdir, &f, application_priority);
 
-	/* Allocate with an extra room for the null terminator */
-	count = (len - i+1) + 1;
-	f.transport_protocol_label = calloc(count, sizeof(char));
-	for (n=0; n<count-1; ++n)
-		f.transport_protocol_label[n] = payload[i+2+n];
-	f._transport_protocol_label_count = count;
+	f.transport_protocol_label = strndup(transport_protocol_label, f._transport_protocol_label_count);
 	CREATE_FILE_STRING(subdir, &f, transport_protocol_label, XATTR_FORMAT_STRING);
+	free(f.transport_protocol_label);
 
+	if (dsmcc_descriptor_is_truncated(0x00, &profiles))
+		return -ENODATA;
 	return 0;
 }
-
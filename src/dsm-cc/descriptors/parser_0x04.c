@@ -31,6 +31,8 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct formatted_descriptor {
 	uint8_t position;
@@ -40,10 +42,17 @@ struct formatted_descriptor {
 /* MODULE_LINK_DESCRIPTOR parser */
 int dsmcc_descriptor_0x04_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	struct dentry *subdir = CREATE_DIRECTORY(parent, "Module_Link_Descriptor");
+	struct dentry *subdir;
 	struct formatted_descriptor f;
-	f.position = payload[0];
-	f.module_id = CONVERT_TO_16(payload[1], payload[2]);
+	struct bitstream bs;
+
+	bitstream_init(&bs, payload, len);
+	f.position = bitstream_read_u8(&bs);
+	f.module_id = bitstream_read_u16(&bs);
+	if (dsmcc_descriptor_is_truncated(0x04, &bs))
+		return -ENODATA;
+
+	subdir = CREATE_DIRECTORY(parent, "Module_Link_Descriptor");
 	CREATE_FILE_NUMBER(subdir, &f, position);
 	CREATE_FILE_NUMBER(subdir, &f, module_id);
     return 0;
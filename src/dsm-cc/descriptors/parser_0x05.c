@@ -31,6 +31,8 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct formatted_descriptor {
 	uint32_t crc_32;
@@ -39,9 +41,16 @@ struct formatted_descriptor {
 /* CRC32_DESCRIPTOR parser */
 int dsmcc_descriptor_0x05_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	struct dentry *subdir = CREATE_DIRECTORY(parent, "CRC-32_Descriptor");
+	struct dentry *subdir;
 	struct formatted_descriptor f;
-	f.crc_32 = CONVERT_TO_32(payload[0], payload[1], payload[2], payload[3]);
+	struct bitstream bs;
+
+	bitstream_init(&bs, payload, len);
+	f.crc_32 = bitstream_read_u32(&bs);
+	if (dsmcc_descriptor_is_truncated(0x05, &bs))
+		return -ENODATA;
+
+	subdir = CREATE_DIRECTORY(parent, "CRC-32_Descriptor");
 	CREATE_FILE_NUMBER(subdir, &f, crc_32);
     return 0;
 }
@@ -30,6 +30,8 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct formatted_descriptor {
 	uint8_t location_tag;
@@ -38,9 +40,16 @@ struct formatted_descriptor {
 /* LOCATION_DESCRIPTOR parser */
 int dsmcc_descriptor_0x06_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	struct dentry *subdir = CREATE_DIRECTORY(parent, "Location_Descriptor");
+	struct dentry *subdir;
 	struct formatted_descriptor f;
-	f.location_tag = payload[0];
+	struct bitstream bs;
+
+	bitstream_init(&bs, payload, len);
+	f.location_tag = bitstream_read_u8(&bs);
+	if (dsmcc_descriptor_is_truncated(0x06, &bs))
+		return -ENODATA;
+
+	subdir = CREATE_DIRECTORY(parent, "Location_Descriptor");
 	CREATE_FILE_NUMBER(subdir, &f, location_tag);
     return 0;
 }
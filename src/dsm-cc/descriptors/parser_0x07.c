@@ -31,6 +31,8 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct formatted_descriptor {
 	uint32_t est_download_time;
@@ -39,9 +41,16 @@ struct formatted_descriptor {
 /* EST_DOWNLOAD_TIME_DESCRIPTOR parser */
 int dsmcc_descriptor_0x07_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	struct dentry *subdir = CREATE_DIRECTORY(parent, "Estimated_Download_Time_Descriptor");
+	struct dentry *subdir;
 	struct formatted_descriptor f;
-	f.est_download_time = CONVERT_TO_32(payload[0], payload[1], payload[2], payload[3]);
+	struct bitstream bs;
+
+	bitstream_init(&bs, payload, len);
+	f.est_download_time = bitstream_read_u32(&bs);
+	if (dsmcc_descriptor_is_truncated(0x07, &bs))
+		return -ENODATA;
+
+	subdir = CREATE_DIRECTORY(parent, "Estimated_Download_Time_Descriptor");
 	CREATE_FILE_NUMBER(subdir, &f, est_download_time);
     return 0;
 }
@@ -31,6 +31,8 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct formatted_descriptor {
 	uint8_t compression_type;
@@ -40,10 +42,17 @@ struct formatted_descriptor {
 /* COMPRESSION_TYPE_DESCRIPTOR parser */
 int dsmcc_descriptor_0xc2_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	struct dentry *subdir = CREATE_DIRECTORY(parent, "Compression_Type_Descriptor");
+	struct dentry *subdir;
 	struct formatted_descriptor f;
-	f.compression_type = payload[0];
-	f.original_size = CONVERT_TO_16(payload[1], payload[2]);
+	struct bitstream bs;
+
+	bitstream_init(&bs, payload, len);
+	f.compression_type = bitstream_read_u8(&bs);
+	f.original_size = bitstream_read_u32(&bs);
+	if (dsmcc_descriptor_is_truncated(0xc2, &bs))
+		return -ENODATA;
+
+	subdir = CREATE_DIRECTORY(parent, "Compression_Type_Descriptor");
 	CREATE_FILE_NUMBER(subdir, &f, compression_type);
 	CREATE_FILE_NUMBER(subdir, &f, original_size);
     return 0;
@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "fsutils.h"
 #include "xattr.h"
 #include "hash.h"
@@ -39,7 +40,9 @@
 #include "dsm-cc/dsmcc.h"
 #include "dsm-cc/dii.h"
 #include "dsm-cc/dsi.h"
+#include "dsm-cc/carousel.h"
 #include "dsm-cc/descriptors/descriptors.h"
+#include "trace.h"
 
 void dii_free(struct dii_table *dii)
 {
@@ -208,21 +211,14 @@ static bool dii_download_complete(const struct ts_header *header, struct dii_tab
 	return true;
 }
 
-int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii, 
-	struct demuxfs_data *priv)
+/**
+ * Creates the /DSM-CC/<application> directory, named after the application
+ * announced by the AIT when there is one.
+ */
+struct dentry *dii_create_application_dentry(struct demuxfs_data *priv)
 {
-	char buf[PATH_MAX], mod_dir[64], block_dir[64];
-	struct dentry *ddb_dentry, *dsmcc_dentry, *ait_dentry, *app_dentry = NULL;
-
-	dprintf("*** Creating filesystem for PID %#x ***", header->pid);
-	dii->_filesystem_created = true;
-	
-	snprintf(buf, sizeof(buf), "/%s/%#04x", FS_DDB_NAME, header->pid);
-	ddb_dentry = fsutils_get_dentry(priv->root, buf);
-	assert(ddb_dentry);
-
-	ddb_dentry = fsutils_get_current(ddb_dentry);
-	assert(ddb_dentry);
+	char buf[PATH_MAX];
+	struct dentry *dsmcc_dentry, *ait_dentry, *app_dentry = NULL;
 
 	dsmcc_dentry = CREATE_DIRECTORY(priv->root, FS_DSMCC_NAME);
 	assert(dsmcc_dentry);
@@ -251,6 +247,27 @@ int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii,
 	}
 	if (! app_dentry)
 		app_dentry = CREATE_DIRECTORY(dsmcc_dentry, FS_UNNAMED_APPLICATION_NAME);
+	return app_dentry;
+}
+
+int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii, 
+	struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("publish");
+	char buf[PATH_MAX], mod_dir[64], block_dir[64];
+	struct dentry *ddb_dentry, *app_dentry;
+
+	dprintf("*** Creating filesystem for PID %#x ***", header->pid);
+	dii->_filesystem_created = true;
+	
+	snprintf(buf, sizeof(buf), "/%s/%#04x", FS_DDB_NAME, header->pid);
+	ddb_dentry = fsutils_get_dentry(priv->root, buf);
+	assert(ddb_dentry);
+
+	ddb_dentry = fsutils_get_current(ddb_dentry);
+	assert(ddb_dentry);
+
+	app_dentry = dii_create_application_dentry(priv);
 
 	/* For each module, get all of its blocks and expose their virtual filesystem */
 	struct dentry stepfather_dentry;
@@ -299,6 +316,7 @@ int dii_create_filesystem(const struct ts_header *header, struct dii_table *dii,
 int dii_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	struct dii_table *dii, *current_dii = NULL;
 	
 	if (payload_len < 20) {
@@ -348,7 +366,9 @@ int dii_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	current_dii = hashtable_get(priv->psi_tables, dii->dentry->inode);
 	if (! dii->current_next_indicator || (current_dii && current_dii->version_number == dii->version_number)) {
 		dii_free(dii);
-		if (current_dii && !current_dii->_filesystem_created && dii_download_complete(header, current_dii, priv))
+		/* On-demand carousels build their tree as objects are looked up */
+		if (current_dii && !current_dii->_filesystem_created && ! priv->carousels &&
+			dii_download_complete(header, current_dii, priv))
 			dii_create_filesystem(header, current_dii, priv);
 		return 0;
 	}
@@ -356,13 +376,16 @@ int dii_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	TS_INFO("DII parser: pid=%#x, table_id=%#x, dii->version_number=%#x, transaction_nr=%#x", 
 			header->pid, dii->table_id, dii->version_number, msg_header->transaction_id & ~0x80000000);
 
-	/** Parse DII bits */
-	dii->download_id = CONVERT_TO_32(payload[j], payload[j+1], payload[j+2], payload[j+3]);
-	dii->block_size = CONVERT_TO_16(payload[j+4], payload[j+5]);
-	dii->window_size = payload[j+6];
-	dii->ack_period = payload[j+7];
-	dii->t_c_download_window = CONVERT_TO_32(payload[j+8], payload[j+9], payload[j+10], payload[j+11]);
-	dii->t_c_download_scenario = CONVERT_TO_32(payload[j+12], payload[j+13], payload[j+14], payload[j+15]);
+	/** Parse DII bits, bound by the CRC at the end of the section */
+	struct bitstream bs;
+	bitstream_init(&bs, payload, payload_len - 4);
+	bitstream_skip(&bs, j);
+	dii->download_id = bitstream_read_u32(&bs);
+	dii->block_size = bitstream_read_u16(&bs);
+	dii->window_size = bitstream_read_u8(&bs);
+	dii->ack_period = bitstream_read_u8(&bs);
+	dii->t_c_download_window = bitstream_read_u32(&bs);
+	dii->t_c_download_scenario = bitstream_read_u32(&bs);
 
 	if (dii->block_size == 0) {
 		dii_free(dii);
@@ -371,45 +394,55 @@ int dii_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 	/** DSM-CC Compatibility Descriptor */
 	struct dsmcc_compatibility_descriptor *cd = &dii->compatibility_descriptor;
-	j = dsmcc_parse_compatibility_descriptors(cd, payload, j+16);
+	dsmcc_parse_compatibility_descriptors(cd, &bs);
 	
 	/** DII bits */
-	dii->number_of_modules = CONVERT_TO_16(payload[j], payload[j+1]);
-	j += 2;
+	dii->number_of_modules = bitstream_read_u16(&bs);
 
 	if (dii->number_of_modules) {
 		dii->modules = calloc(dii->number_of_modules, sizeof(struct dii_module));
+		if (! dii->modules)
+			dii->number_of_modules = 0;
 		for (uint16_t i=0; i<dii->number_of_modules; ++i) {
 			struct dii_module *mod = &dii->modules[i];
-			mod->module_id = CONVERT_TO_16(payload[j], payload[j+1]);
-			mod->module_size = CONVERT_TO_32(payload[j+2], payload[j+3], payload[j+4], payload[j+5]);
-			mod->module_version = payload[j+6];
-			mod->module_info_length = payload[j+7];
-			j += 8;
-			if (mod->module_info_length) {
+			const char *module_info;
+
+			mod->module_id = bitstream_read_u16(&bs);
+			mod->module_size = bitstream_read_u32(&bs);
+			mod->module_version = bitstream_read_u8(&bs);
+			mod->module_info_length = bitstream_read_u8(&bs);
+			module_info = bitstream_read_bytes(&bs, mod->module_info_length);
+			if (module_info && mod->module_info_length) {
 				int parsed;
 				mod->module_info = calloc(1, sizeof(struct biop_module_info));
-				parsed = biop_parse_module_info(mod->module_info, &payload[j], mod->module_info_length);
+				parsed = biop_parse_module_info(mod->module_info, module_info, mod->module_info_length);
 				if (parsed !=  mod->module_info_length)
 					TS_WARNING("parsed %d bytes, but mod_info_len=%d", parsed, mod->module_info_length);
-				j += mod->module_info_length;
 			}
 		}
 	}
 	
-	dii->private_data_length = CONVERT_TO_16(payload[j], payload[j+1]);
-	if (dii->private_data_length) {
+	dii->private_data_length = bitstream_read_u16(&bs);
+	const char *private_data = bitstream_read_bytes(&bs, dii->private_data_length);
+	if (private_data && dii->private_data_length) {
 		dii->private_data_bytes = malloc(dii->private_data_length);
-		for (uint16_t i=0; i<dii->private_data_length; ++i)
-			dii->private_data_bytes[i] = payload[j+2+i];
+		memcpy(dii->private_data_bytes, private_data, dii->private_data_length);
+	}
+
+	if (bitstream_error(&bs)) {
+		TS_WARNING("DII of pid %#x runs past the end of the section (%d bytes)", header->pid, payload_len);
+		dii_free(dii);
+		return 0;
 	}
-	j += 2 + dii->private_data_length;
 
 	/* Create filesystem entries for this table */
 	struct dentry *version_dentry = NULL;
 	dii_create_directory(header, dii, &version_dentry, priv);
 	dii_create_dentries(version_dentry, dii, priv);
 
+	if (priv->carousels)
+		carousel_update_modules(header, dii, priv);
+
 	if (current_dii) {
 		fsutils_migrate_children(current_dii->dentry, dii->dentry);
 		hashtable_del(priv->psi_tables, current_dii->dentry->inode);
@@ -39,5 +39,6 @@ struct dii_table {
 int dii_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
 void dii_free(struct dii_table *dii);
+struct dentry *dii_create_application_dentry(struct demuxfs_data *priv);
 
 #endif /* __dii_h */
@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "fsutils.h"
 #include "xattr.h"
 #include "hash.h"
@@ -39,7 +40,9 @@
 #include "tables/psi.h"
 #include "dsm-cc/dsmcc.h"
 #include "dsm-cc/dsi.h"
+#include "dsm-cc/carousel.h"
 #include "dsm-cc/descriptors/descriptors.h"
+#include "trace.h"
 
 void dsi_free(struct dsi_table *dsi)
 {
@@ -49,9 +52,13 @@ void dsi_free(struct dsi_table *dsi)
 	/* Free DSM-CC message header */
 	dsmcc_free_message_header(&dsi->dsmcc_message_header);
 	if (dsi->group_info_indication) {
-		if (dsi->group_info_indication->dsi_group_info)
-			free(dsi->group_info_indication->dsi_group_info);
-		free(dsi->group_info_indication);
+		struct dsi_group_info_indication *gii = dsi->group_info_indication;
+		if (gii->dsi_group_info) {
+			for (uint16_t i=0; i<gii->number_of_groups; ++i)
+				dsmcc_free_compatibility_descriptors(&gii->dsi_group_info[i].group_compatibility);
+			free(gii->dsi_group_info);
+		}
+		free(gii);
 	}
 	if (dsi->service_gateway_info) {
 		iop_free_ior(dsi->service_gateway_info->iop_ior);
@@ -150,6 +157,7 @@ void dsi_create_dii_symlink(const struct ts_header *header, struct dsi_table *ds
 int dsi_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	struct dsi_table *dsi, *current_dsi = NULL;
 	
 	if (payload_len < 20) {
@@ -182,8 +190,8 @@ int dsi_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	 * added to the hash table, as the DSI can arrive in the same PID.
 	 *
 	 * For that reason we need to modify the inode number, and we
-	 * do that by setting the 1st bit from the 7th byte, which is not
-	 * used by the TS_PACKET_HASH_KEY macro.
+	 * do that by setting a bit of the table_id_extension, which is
+	 * not used by the TS_PACKET_HASH_KEY macro.
 	 * */ 
 	dsi->dentry->inode = TS_PACKET_HASH_KEY(header, dsi) | 0x1000000;
 
@@ -258,27 +266,38 @@ int dsi_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		j += 2;
 
 		if (gii->number_of_groups) {
+			struct bitstream bs;
 			uint16_t i;
+
+			/* The groups are bound by the CRC at the end of the section */
+			bitstream_init(&bs, payload, payload_len - 4);
+			bitstream_skip(&bs, j);
 			gii->dsi_group_info = calloc(gii->number_of_groups, sizeof(struct dsi_group_info));
 			for (i=0; i<gii->number_of_groups; ++i) {
 				struct dentry *group_dentry = CREATE_DIRECTORY(gii_dentry, "GroupInfo_%02d", i+1);
 				struct dsi_group_info *group_info = &gii->dsi_group_info[i];
-				int len;
+				int ret;
 
-				group_info->group_id = CONVERT_TO_32(payload[j], payload[j+1],
-						payload[j+2], payload[j+3]);
-				group_info->group_size = CONVERT_TO_32(payload[j+4], payload[j+5],
-						payload[j+6], payload[j+7]);
+				group_info->group_id = bitstream_read_u32(&bs);
+				group_info->group_size = bitstream_read_u32(&bs);
 				CREATE_FILE_NUMBER(group_dentry, group_info, group_id);
 				CREATE_FILE_NUMBER(group_dentry, group_info, group_size);
 
 				// GroupCompatibility()
-				len = dsmcc_parse_compatibility_descriptors(&group_info->group_compatibility,
-						&payload[j+8], j+8);
+				ret = dsmcc_parse_compatibility_descriptors(&group_info->group_compatibility, &bs);
 				dsmcc_create_compatibility_descriptor_dentries(&group_info->group_compatibility,
 						group_dentry);
-				j += 8 + len;
+
+				// GroupInfoBytes are not parsed
+				group_info->group_info_length = bitstream_read_u16(&bs);
+				bitstream_skip(&bs, group_info->group_info_length);
+				if (ret < 0 || bitstream_error(&bs)) {
+					TS_WARNING("GroupInfo_%02d runs past the end of the DSI", i+1);
+					break;
+				}
+				CREATE_FILE_NUMBER(group_dentry, group_info, group_info_length);
 			}
+			j = bitstream_position(&bs);
 		}
 
 		gii->private_data_length = CONVERT_TO_16(payload[j], payload[j+1]);
@@ -296,6 +315,8 @@ int dsi_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		dsi->service_gateway_info->iop_ior = ior;
 		j += iop_parse_ior(ior, &payload[j], payload_len-j);
 		iop_create_ior_dentries(sgi_dentry, ior);
+		if (priv->carousels)
+			carousel_set_gateway(header, ior, priv);
 
 		if (ior->tagged_profiles_count) {
 			/* Check if DSI transaction_id matches DII transaction_id and create a symlink accordingly */
@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "fsutils.h"
 #include "xattr.h"
 #include "hash.h"
@@ -38,6 +39,8 @@
 #include "dsm-cc/dii.h"
 #include "dsm-cc/ddb.h"
 #include "dsm-cc/ait.h"
+#include "dsm-cc/stream_event.h"
+#include "dsm-cc/mpe.h"
 
 #define DSMCC_FILL_HEADER_NAMES(hdr) \
 	if ((hdr)->_dsmcc_type == 0x03) \
@@ -117,62 +120,80 @@ void dsmcc_create_compatibility_descriptor_dentries(struct dsmcc_compatibility_d
 void dsmcc_free_compatibility_descriptors(struct dsmcc_compatibility_descriptor *cd)
 {
 	for (uint16_t n=0; n<cd->descriptor_count; ++n) {
-		if (cd->descriptors[n].sub_descriptors)
-			free(cd->descriptors[n].sub_descriptors);
 		for (uint8_t k=0; k<cd->descriptors[n].sub_descriptor_count; ++k) {
 			struct dsmcc_sub_descriptor *sub = &cd->descriptors[n].sub_descriptors[k];
 			if (sub->additional_information)
 				free(sub->additional_information);
 		}
+		if (cd->descriptors[n].sub_descriptors)
+			free(cd->descriptors[n].sub_descriptors);
 	}
 	if (cd->descriptors)
 		free(cd->descriptors);
 }
 
+/**
+ * Parses the compatibilityDescriptor() at the current position of @bs and
+ * skips past it.
+ * @return 0 on success or -EBADMSG if it runs past the end of @bs.
+ */
 int dsmcc_parse_compatibility_descriptors(struct dsmcc_compatibility_descriptor *cd,
-		const char *payload, int index)
+		struct bitstream *bs)
 {
-	int i = index;
+	struct bitstream cd_bs;
 
-	cd->compatibility_descriptor_length = CONVERT_TO_16(payload[i], payload[i+1]);
+	cd->compatibility_descriptor_length = bitstream_read_u16(bs);
+	bitstream_sub(bs, cd->compatibility_descriptor_length, &cd_bs);
 	if (cd->compatibility_descriptor_length < 2) {
 		cd->descriptor_count = 0;
-		return i + 2 + cd->compatibility_descriptor_length;
+		return bitstream_error(bs) ? -EBADMSG : 0;
 	}
 	
-	cd->descriptor_count = CONVERT_TO_16(payload[i+2], payload[i+3]);
-	i += 4;
+	cd->descriptor_count = bitstream_read_u16(&cd_bs);
 	if (cd->descriptor_count)
 		cd->descriptors = calloc(cd->descriptor_count, sizeof(struct dsmcc_descriptor_entry));
+	if (! cd->descriptors)
+		cd->descriptor_count = 0;
 	for (uint16_t n=0; n<cd->descriptor_count; ++n) {
-		cd->descriptors[n].descriptor_type = payload[i];
-		cd->descriptors[n].descriptor_length = payload[i+1];
-		cd->descriptors[n].specifier_type = payload[i+2];
-		cd->descriptors[n].specifier_data[0] = payload[i+3];
-		cd->descriptors[n].specifier_data[1] = payload[i+4];
-		cd->descriptors[n].specifier_data[2] = payload[i+5];
-		cd->descriptors[n].model = CONVERT_TO_16(payload[i+6], payload[i+7]);
-		cd->descriptors[n].version = CONVERT_TO_16(payload[i+8], payload[i+9]);
-		cd->descriptors[n].sub_descriptor_count = payload[i+10];
-		if (cd->descriptors[n].sub_descriptor_count)
-			cd->descriptors[n].sub_descriptors = calloc(cd->descriptors[n].sub_descriptor_count, 
+		struct dsmcc_descriptor_entry *entry = &cd->descriptors[n];
+		struct bitstream entry_bs;
+
+		entry->descriptor_type = bitstream_read_u8(&cd_bs);
+		entry->descriptor_length = bitstream_read_u8(&cd_bs);
+		bitstream_sub(&cd_bs, entry->descriptor_length, &entry_bs);
+		entry->specifier_type = bitstream_read_u8(&entry_bs);
+		entry->specifier_data[0] = bitstream_read_u8(&entry_bs);
+		entry->specifier_data[1] = bitstream_read_u8(&entry_bs);
+		entry->specifier_data[2] = bitstream_read_u8(&entry_bs);
+		entry->model = bitstream_read_u16(&entry_bs);
+		entry->version = bitstream_read_u16(&entry_bs);
+		entry->sub_descriptor_count = bitstream_read_u8(&entry_bs);
+		if (entry->sub_descriptor_count)
+			entry->sub_descriptors = calloc(entry->sub_descriptor_count, 
 					sizeof(struct dsmcc_sub_descriptor));
+		if (! entry->sub_descriptors)
+			entry->sub_descriptor_count = 0;
 		
-		i += 11;
-		for (uint8_t k=0; k<cd->descriptors[n].sub_descriptor_count; ++k) {
-			struct dsmcc_sub_descriptor *sub = &cd->descriptors[n].sub_descriptors[k];
-			sub->sub_descriptor_type = payload[i];
-			sub->sub_descriptor_length = payload[i+1];
-			i += 2;
-			if (sub->sub_descriptor_length)
+		for (uint8_t k=0; k<entry->sub_descriptor_count; ++k) {
+			struct dsmcc_sub_descriptor *sub = &entry->sub_descriptors[k];
+			const char *info;
+
+			sub->sub_descriptor_type = bitstream_read_u8(&entry_bs);
+			sub->sub_descriptor_length = bitstream_read_u8(&entry_bs);
+			info = bitstream_read_bytes(&entry_bs, sub->sub_descriptor_length);
+			if (! info) {
+				sub->sub_descriptor_length = 0;
+				break;
+			}
+			if (sub->sub_descriptor_length) {
 				sub->additional_information = malloc(sub->sub_descriptor_length);
-			for (uint8_t l=0; l<sub->sub_descriptor_length; ++l) {
-				sub->additional_information[l] = payload[i+2+l];
-				i++;
+				memcpy(sub->additional_information, info, sub->sub_descriptor_length);
 			}
 		}
+		if (bitstream_error(&entry_bs))
+			return -EBADMSG;
 	}
-	return i;
+	return bitstream_error(&cd_bs) || bitstream_error(bs) ? -EBADMSG : 0;
 }
 
 void dsmcc_free_message_header(struct dsmcc_message_header *msg_header)
@@ -246,6 +267,10 @@ int dsmcc_parse(const struct ts_header *header, const char *payload, uint32_t pa
 		return dii_parse(header, payload, payload_len, priv);
 	else if (table_id == TS_DDB_TABLE_ID)
 		return ddb_parse(header, payload, payload_len, priv);
+	else if (table_id == TS_STREAM_DESCRIPTORS_TABLE_ID)
+		return stream_event_parse(header, payload, payload_len, priv);
+	else if (table_id == TS_MPE_TABLE_ID)
+		return mpe_parse(header, payload, payload_len, priv);
 
 	return 0;
 }
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "byteops.h"
+#include "fsutils.h"
+#include "xattr.h"
+#include "list.h"
+#include "mem.h"
+#include "ts.h"
+#include "dsm-cc/mpe.h"
+#include "trace.h"
+
+#define PCAP_MAGIC            0xa1b2c3d4
+#define PCAP_SNAPLEN          65535
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define ETHERTYPE_IPV4        0x0800
+#define ETHERTYPE_IPV6        0x86dd
+
+/* AA AA 03 followed by the OUI and the EtherType */
+#define LLC_SNAP_HEADER_SIZE  8
+
+/* Readers check for an interrupted request this often while waiting for datagrams */
+#define MPE_READ_POLL_MS      500
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+static const struct pcap_file_header mpe_file_header = {
+	.magic = PCAP_MAGIC,
+	.version_major = 2,
+	.version_minor = 4,
+	.snaplen = PCAP_SNAPLEN,
+	.linktype = PCAP_LINKTYPE_ETHERNET,
+};
+
+struct mpe_capture {
+	uint16_t pid;
+	pthread_mutex_t mutex;
+	/* Signaled when records are added or the capture is going away */
+	pthread_cond_t cond;
+	bool stop;
+	int num_readers;
+	/* Ring of pcap records, allocated while the capture has readers */
+	char *ring;
+	/* Positions in the stream of records: the ring holds the bytes between tail and head */
+	uint64_t tail;
+	uint64_t head;
+	/* Datagram being reassembled from several sections */
+	char *datagram;
+	uint32_t datagram_len;
+	int next_section_number;
+	uint8_t mac[6];
+	bool llc_snap;
+	struct list_head list;
+};
+
+struct mpe_list {
+	pthread_mutex_t mutex;
+	struct list_head captures;
+};
+
+struct mpe_reader {
+	/* struct reader_handle always comes first */
+	struct reader_handle handle;
+	struct mpe_capture *capture;
+	/* Bytes of the pcap global header delivered so far */
+	size_t header_offset;
+	/* Position in the stream of records and bytes left of the record being read */
+	uint64_t pos;
+	uint32_t record_left;
+};
+
+static void mpe_ring_write(struct mpe_capture *c, uint64_t pos, const void *data, size_t len)
+{
+	size_t offset = pos % MPE_RING_SIZE;
+	size_t first = len < MPE_RING_SIZE - offset ? len : MPE_RING_SIZE - offset;
+
+	memcpy(&c->ring[offset], data, first);
+	memcpy(c->ring, (const char *) data + first, len - first);
+}
+
+static void mpe_ring_read(struct mpe_capture *c, uint64_t pos, void *data, size_t len)
+{
+	size_t offset = pos % MPE_RING_SIZE;
+	size_t first = len < MPE_RING_SIZE - offset ? len : MPE_RING_SIZE - offset;
+
+	memcpy(data, &c->ring[offset], first);
+	memcpy((char *) data + first, c->ring, len - first);
+}
+
+static uint32_t mpe_ring_record_size(struct mpe_capture *c, uint64_t pos)
+{
+	struct pcap_record_header rec;
+
+	mpe_ring_read(c, pos, &rec, sizeof(rec));
+	return sizeof(rec) + rec.incl_len;
+}
+
+static struct mpe_capture *mpe_get_capture(uint16_t pid, struct mpe_list *mpe)
+{
+	struct mpe_capture *c, *found = NULL;
+
+	pthread_mutex_lock(&mpe->mutex);
+	list_for_each_entry(c, &mpe->captures, list)
+		if (c->pid == pid) {
+			found = c;
+			break;
+		}
+	pthread_mutex_unlock(&mpe->mutex);
+	return found;
+}
+
+/**
+ * Adds a datagram to the ring of @c as an Ethernet frame addressed to
+ * c->mac, dropping the oldest records to make room for it.
+ */
+static void mpe_capture_datagram(struct mpe_capture *c, const char *data, uint32_t len)
+{
+	struct pcap_record_header rec;
+	uint8_t eth[14];
+	uint16_t ethertype;
+	struct timespec now;
+	uint32_t record_size;
+
+	if (c->llc_snap) {
+		if (len < LLC_SNAP_HEADER_SIZE)
+			return;
+		ethertype = CONVERT_TO_16(data[6], data[7]);
+		data += LLC_SNAP_HEADER_SIZE;
+		len -= LLC_SNAP_HEADER_SIZE;
+	} else if (len && ((uint8_t) data[0] >> 4) == 6) {
+		ethertype = ETHERTYPE_IPV6;
+	} else {
+		ethertype = ETHERTYPE_IPV4;
+	}
+
+	memcpy(&eth[0], c->mac, 6);
+	/* The source address is not carried by the section */
+	memset(&eth[6], 0, 6);
+	eth[12] = ethertype >> 8;
+	eth[13] = ethertype & 0xff;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec.ts_sec = now.tv_sec;
+	rec.ts_usec = now.tv_nsec / 1000;
+	rec.orig_len = sizeof(eth) + len;
+	rec.incl_len = rec.orig_len < PCAP_SNAPLEN ? rec.orig_len : PCAP_SNAPLEN;
+	record_size = sizeof(rec) + rec.incl_len;
+
+	while (c->head + record_size - c->tail > MPE_RING_SIZE)
+		c->tail += mpe_ring_record_size(c, c->tail);
+	mpe_ring_write(c, c->head, &rec, sizeof(rec));
+	mpe_ring_write(c, c->head + sizeof(rec), eth, sizeof(eth));
+	mpe_ring_write(c, c->head + sizeof(rec) + sizeof(eth), data, rec.incl_len - sizeof(eth));
+	c->head += record_size;
+	pthread_cond_broadcast(&c->cond);
+}
+
+int mpe_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("parser");
+	const uint8_t *p = (const uint8_t *) payload;
+	struct mpe_capture *c;
+	uint16_t section_length;
+	uint8_t section_number, last_section_number;
+	uint32_t len;
+
+	if (! priv->mpe || ! (c = mpe_get_capture(header->pid, priv->mpe)))
+		return 0;
+	if (! __atomic_load_n(&c->num_readers, __ATOMIC_RELAXED))
+		/* Nobody is reading the capture */
+		return 0;
+
+	section_length = CONVERT_TO_16(p[1], p[2]) & 0x0fff;
+	if (payload_len < 3 + section_length || section_length < 9 + 4) {
+		TS_WARNING("datagram section on pid %#x is truncated", header->pid);
+		return 0;
+	}
+	if (! (p[5] & 0x01))
+		/* Not applicable yet */
+		return 0;
+	if (p[5] & 0x3c) {
+		/* Scrambled payload */
+		c->next_section_number = -1;
+		return 0;
+	}
+	section_number = p[6];
+	last_section_number = p[7];
+	/* The datagram ends right before the CRC_32 or the checksum */
+	len = 3 + section_length - 4 - 12;
+
+	pthread_mutex_lock(&c->mutex);
+	if (! c->ring) {
+		pthread_mutex_unlock(&c->mutex);
+		return 0;
+	}
+	c->mac[0] = p[11];
+	c->mac[1] = p[10];
+	c->mac[2] = p[9];
+	c->mac[3] = p[8];
+	c->mac[4] = p[4];
+	c->mac[5] = p[3];
+	c->llc_snap = p[5] & 0x02;
+
+	if (section_number == 0 && last_section_number == 0) {
+		/* The common case: the datagram is copied straight from the section */
+		c->next_section_number = -1;
+		mpe_capture_datagram(c, &payload[12], len);
+	} else if (section_number == 0 || section_number == c->next_section_number) {
+		if (section_number == 0)
+			c->datagram_len = 0;
+		if (! c->datagram)
+			c->datagram = mem_malloc(MEM_CAPTURES, MPE_MAX_DATAGRAM_SIZE);
+		if (! c->datagram || c->datagram_len + len > MPE_MAX_DATAGRAM_SIZE) {
+			c->next_section_number = -1;
+		} else {
+			memcpy(&c->datagram[c->datagram_len], &payload[12], len);
+			c->datagram_len += len;
+			c->next_section_number = section_number + 1;
+			if (section_number == last_section_number) {
+				mpe_capture_datagram(c, c->datagram, c->datagram_len);
+				c->next_section_number = -1;
+			}
+		}
+	} else {
+		/* A section of this datagram was lost */
+		c->next_section_number = -1;
+	}
+	pthread_mutex_unlock(&c->mutex);
+	return 0;
+}
+
+struct dentry *mpe_create_capture(struct dentry *parent, uint16_t pid, struct demuxfs_data *priv)
+{
+	struct mpe_list *mpe = priv->mpe;
+	struct mpe_capture *c;
+	struct dentry *dentry;
+
+	if (! mpe)
+		return NULL;
+
+	c = mpe_get_capture(pid, mpe);
+	if (! c) {
+		c = (struct mpe_capture *) calloc(1, sizeof(struct mpe_capture));
+		if (! c)
+			return NULL;
+		c->pid = pid;
+		c->next_section_number = -1;
+		pthread_mutex_init(&c->mutex, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		pthread_mutex_lock(&mpe->mutex);
+		list_add_tail(&c->list, &mpe->captures);
+		pthread_mutex_unlock(&mpe->mutex);
+	}
+
+	dentry = CREATE_CAPTURE_FILE(parent, FS_MPE_CAPTURE_NAME, c);
+	return dentry;
+}
+
+struct mpe_reader *mpe_open(struct dentry *dentry, struct demuxfs_data *priv)
+{
+	struct capture_priv *capture_priv = (struct capture_priv *) dentry->priv;
+	struct mpe_capture *c = capture_priv ? capture_priv->capture : NULL;
+	struct mpe_reader *reader;
+
+	if (! c)
+		return NULL;
+	reader = (struct mpe_reader *) calloc(1, sizeof(struct mpe_reader));
+	if (! reader)
+		return NULL;
+	reader->handle.dentry = dentry;
+	reader->capture = c;
+
+	pthread_mutex_lock(&c->mutex);
+	if (! c->ring) {
+		c->ring = mem_malloc(MEM_CAPTURES, MPE_RING_SIZE);
+		if (! c->ring) {
+			pthread_mutex_unlock(&c->mutex);
+			free(reader);
+			return NULL;
+		}
+		c->head = c->tail = 0;
+	}
+	__atomic_add_fetch(&c->num_readers, 1, __ATOMIC_RELAXED);
+	reader->pos = c->head;
+	pthread_mutex_unlock(&c->mutex);
+	return reader;
+}
+
+ssize_t mpe_read(struct mpe_reader *reader, char *buf, size_t size, bool nonblock)
+{
+	struct mpe_capture *c = reader->capture;
+	size_t n, copied = 0;
+	struct timespec ts;
+	bool stopped;
+
+	if (reader->header_offset < sizeof(mpe_file_header)) {
+		n = sizeof(mpe_file_header) - reader->header_offset;
+		if (n > size)
+			n = size;
+		memcpy(buf, (const char *) &mpe_file_header + reader->header_offset, n);
+		reader->header_offset += n;
+		copied += n;
+	}
+
+	pthread_mutex_lock(&c->mutex);
+	while (copied < size) {
+		if (reader->pos < c->tail) {
+			/* The reader fell behind: the record cut short is completed with zeros */
+			n = size - copied < reader->record_left ? size - copied : reader->record_left;
+			memset(&buf[copied], 0, n);
+			copied += n;
+			reader->record_left -= n;
+			if (reader->record_left)
+				break;
+			reader->pos = c->tail;
+			continue;
+		}
+		if (reader->pos == c->head) {
+			if (copied || nonblock || c->stop)
+				break;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += MPE_READ_POLL_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&c->cond, &c->mutex, &ts);
+			if (fuse_interrupted()) {
+				pthread_mutex_unlock(&c->mutex);
+				return -EINTR;
+			}
+			continue;
+		}
+		if (! reader->record_left)
+			reader->record_left = mpe_ring_record_size(c, reader->pos);
+		/* Records are added whole, so the one being read is all in the ring */
+		n = size - copied < reader->record_left ? size - copied : reader->record_left;
+		mpe_ring_read(c, reader->pos, &buf[copied], n);
+		reader->pos += n;
+		reader->record_left -= n;
+		copied += n;
+	}
+	stopped = c->stop;
+	pthread_mutex_unlock(&c->mutex);
+
+	if (! copied && nonblock && ! stopped)
+		return -EAGAIN;
+	return copied;
+}
+
+void mpe_release(struct mpe_reader *reader)
+{
+	struct mpe_capture *c = reader->capture;
+
+	pthread_mutex_lock(&c->mutex);
+	if (__atomic_sub_fetch(&c->num_readers, 1, __ATOMIC_RELAXED) == 0) {
+		/* Nobody is left to read the ring */
+		mem_free(MEM_CAPTURES, c->ring);
+		mem_free(MEM_CAPTURES, c->datagram);
+		c->ring = NULL;
+		c->datagram = NULL;
+		c->datagram_len = 0;
+		c->next_section_number = -1;
+	}
+	pthread_mutex_unlock(&c->mutex);
+	free(reader);
+}
+
+int mpe_init(struct demuxfs_data *priv)
+{
+	struct mpe_list *mpe = calloc(1, sizeof(struct mpe_list));
+
+	if (! mpe)
+		return -ENOMEM;
+	pthread_mutex_init(&mpe->mutex, NULL);
+	INIT_LIST_HEAD(&mpe->captures);
+	priv->mpe = mpe;
+	return 0;
+}
+
+void mpe_destroy(struct demuxfs_data *priv)
+{
+	struct mpe_list *mpe = priv->mpe;
+	struct mpe_capture *c, *aux;
+
+	if (! mpe)
+		return;
+	list_for_each_entry_safe(c, aux, &mpe->captures, list) {
+		pthread_mutex_lock(&c->mutex);
+		c->stop = true;
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->mutex);
+	}
+	list_for_each_entry_safe(c, aux, &mpe->captures, list) {
+		list_del(&c->list);
+		mem_free(MEM_CAPTURES, c->ring);
+		mem_free(MEM_CAPTURES, c->datagram);
+		pthread_cond_destroy(&c->cond);
+		pthread_mutex_destroy(&c->mutex);
+		free(c);
+	}
+	pthread_mutex_destroy(&mpe->mutex);
+	free(mpe);
+	priv->mpe = NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef __mpe_h
+#define __mpe_h
+
+/*
+ * Multiprotocol encapsulation (ETSI EN 301 192). Streams listed under
+ * MPEStreams get an "IP.pcap" file in their PMT stream directory. The IP
+ * datagrams carried by the datagram sections (table_id 0x3e) of the stream
+ * are decapsulated, wrapped in an Ethernet header that holds the MAC address
+ * of the section, and written to it as pcap records.
+ *
+ * The file is live: each open file descriptor gets the pcap global header
+ * followed by the datagrams received from then on, and reads block until
+ * more datagrams arrive unless O_NONBLOCK is set. Records are kept in a ring
+ * shared by the readers, which is only allocated while the file is open.
+ * Readers that fall behind by more than the ring size lose the oldest records.
+ * Scrambled datagrams are skipped.
+ */
+
+#define FS_MPE_CAPTURE_NAME   "IP.pcap"
+
+/* Size of the ring of pcap records shared by the readers of a capture */
+#define MPE_RING_SIZE         (4 * 1024 * 1024)
+
+/* Largest datagram reassembled from several sections */
+#define MPE_MAX_DATAGRAM_SIZE 65536
+
+struct mpe_list;
+struct mpe_capture;
+struct mpe_reader;
+struct ts_header;
+
+/**
+ * Enables the MPE captures.
+ * @return 0 on success or a negative errno value.
+ */
+int mpe_init(struct demuxfs_data *priv);
+
+/**
+ * Creates the capture file of the MPE stream carried by @pid in @parent.
+ * @return the dentry of the capture file or NULL on error.
+ */
+struct dentry *mpe_create_capture(struct dentry *parent, uint16_t pid, struct demuxfs_data *priv);
+
+/**
+ * Parses a datagram section (table_id 0x3e).
+ */
+int mpe_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv);
+
+/**
+ * Opens a reader of the capture file @dentry, starting at the current end of the capture.
+ * @return the reader or NULL on error.
+ */
+struct mpe_reader *mpe_open(struct dentry *dentry, struct demuxfs_data *priv);
+
+/**
+ * Copies up to @size bytes of the capture into @buf, waiting for more
+ * datagrams unless @nonblock is set.
+ * @return the number of bytes copied or a negative errno value.
+ */
+ssize_t mpe_read(struct mpe_reader *reader, char *buf, size_t size, bool nonblock);
+
+/**
+ * Releases a reader returned by mpe_open().
+ */
+void mpe_release(struct mpe_reader *reader);
+
+/**
+ * Wakes up blocked readers and releases the captures. The capture files are
+ * disposed with the tree.
+ */
+void mpe_destroy(struct demuxfs_data *priv);
+
+#endif /* __mpe_h */
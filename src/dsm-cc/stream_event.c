@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "byteops.h"
+#include "list.h"
+#include "fifo.h"
+#include "stats.h"
+#include "ts.h"
+#include "tables/psi.h"
+#include "dsm-cc/stream_event.h"
+#include "trace.h"
+
+#define NPT_REFERENCE_DESCRIPTOR  0x17
+#define STREAM_EVENT_DESCRIPTOR   0x1a
+
+/* The STC and the NPT are 33-bit counters of a 90 kHz clock */
+#define STC_MASK  ((1ULL << 33) - 1)
+#define STC_HZ    90000ULL
+
+struct npt_reference {
+	bool valid;
+	uint8_t content_id;
+	uint64_t stc;
+	uint64_t npt;
+	int16_t scale_numerator;
+	uint16_t scale_denominator;
+};
+
+struct stream_event {
+	bool used;
+	uint16_t event_id;
+	/* table_id_extension of the section that carries the event */
+	uint16_t extension;
+	uint64_t npt;
+	/* Set once the NPT has been seen before eventNPT; unarmed events found due are stale */
+	bool armed;
+	bool triggered;
+	/* Cleared for the events of a section that is being parsed again */
+	bool seen;
+	uint8_t private_data_length;
+	char private_data[255];
+};
+
+struct stream_event_section {
+	uint16_t extension;
+	uint8_t version_number;
+};
+
+struct event_stream {
+	uint16_t pid;
+	uint16_t pcr_pid;
+	struct dentry *fifo;
+	/* Last PCR base received and the monotonic time at which it arrived */
+	bool has_pcr;
+	uint64_t stc;
+	uint64_t stc_ns;
+	struct npt_reference npt;
+	/* Versions of the sections parsed so far */
+	int num_sections;
+	struct stream_event_section sections[STREAM_EVENT_MAX_SECTIONS];
+	/* Scheduled events, pending or triggered */
+	int num_pending;
+	struct stream_event events[STREAM_EVENT_MAX_EVENTS];
+	struct list_head list;
+};
+
+struct stream_events {
+	pthread_mutex_t mutex;
+	/* Signaled when the trigger thread must look at the streams again */
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool stop;
+	/* PIDs that carry the PCR of a bound stream */
+	uint8_t pcr_pids[(TS_NULL_PID + 1) / 8];
+	struct list_head streams;
+};
+
+/* Returns a - b, taking the wrap around of 33-bit timestamps into account */
+static int64_t stc_diff(uint64_t a, uint64_t b)
+{
+	int64_t diff = (a - b) & STC_MASK;
+	return diff >= (1LL << 32) ? diff - (1LL << 33) : diff;
+}
+
+static uint64_t stream_event_read_33(const uint8_t *p)
+{
+	return ((uint64_t) (p[0] & 0x01) << 32) | CONVERT_TO_32(p[1], p[2], p[3], p[4]);
+}
+
+static struct event_stream *stream_event_get(uint16_t pid, struct stream_events *se)
+{
+	struct event_stream *s;
+
+	list_for_each_entry(s, &se->streams, list)
+		if (s->pid == pid)
+			return s;
+	return NULL;
+}
+
+/**
+ * Estimates the NPT at the monotonic time @now, extrapolating the last PCR for
+ * up to STREAM_EVENT_MAX_PCR_GAP_MS.
+ * @return false if the clock or the NPT reference of @s are not known yet.
+ */
+static bool stream_event_npt_at(struct event_stream *s, uint64_t now, int64_t *npt)
+{
+	uint64_t elapsed, stc;
+
+	if (! s->has_pcr || ! s->npt.valid || ! s->npt.scale_denominator)
+		return false;
+	elapsed = now > s->stc_ns ? now - s->stc_ns : 0;
+	if (elapsed > STREAM_EVENT_MAX_PCR_GAP_MS * 1000000ULL)
+		elapsed = STREAM_EVENT_MAX_PCR_GAP_MS * 1000000ULL;
+	stc = (s->stc + elapsed * STC_HZ / 1000000000ULL) & STC_MASK;
+	*npt = (int64_t) s->npt.npt +
+		stc_diff(stc, s->npt.stc) * s->npt.scale_numerator / s->npt.scale_denominator;
+	return true;
+}
+
+/**
+ * Tells the monotonic time at which the NPT of @s reaches @event_npt.
+ * @return false if the NPT is not running forward.
+ */
+static bool stream_event_trigger_time(struct event_stream *s, uint64_t event_npt, uint64_t *when)
+{
+	int64_t npt_delta, stc_delta;
+	uint64_t stc;
+
+	if (s->npt.scale_numerator <= 0)
+		return false;
+	npt_delta = (int64_t) event_npt - (int64_t) s->npt.npt;
+	stc_delta = (npt_delta * s->npt.scale_denominator + s->npt.scale_numerator - 1) / s->npt.scale_numerator;
+	stc = (s->npt.stc + stc_delta) & STC_MASK;
+	stc_delta = stc_diff(stc, s->stc);
+	if (stc_delta <= 0)
+		*when = s->stc_ns;
+	else
+		*when = s->stc_ns + ((uint64_t) stc_delta * 1000000000ULL + STC_HZ - 1) / STC_HZ;
+	return true;
+}
+
+/**
+ * Writes an event to the Events FIFO of @s, if anybody is reading it.
+ */
+static void stream_event_write(struct event_stream *s, uint16_t event_id, const uint64_t *npt,
+		const char *private_data, uint8_t private_data_length)
+{
+	struct fifo_priv *fifo_priv = s->fifo ? (struct fifo_priv *) s->fifo->priv : NULL;
+	char line[128 + 2 * 255], *p = line;
+
+	if (! fifo_priv || ! fifo_priv->fifo || ! fifo_is_open(fifo_priv->fifo))
+		return;
+	p += sprintf(p, "event_id=%u", event_id);
+	if (npt)
+		p += sprintf(p, " mode=scheduled npt=%" PRIu64, *npt);
+	else
+		p += sprintf(p, " mode=do_it_now");
+	p += sprintf(p, " private_data=");
+	for (uint8_t i=0; i<private_data_length; ++i)
+		p += sprintf(p, "%02x", (uint8_t) private_data[i]);
+	*p++ = '\n';
+	/* Lines are shorter than PIPE_BUF, so they reach the reader in a single piece */
+	fifo_append(fifo_priv->fifo, line, p - line);
+}
+
+/**
+ * Triggers the scheduled events of @s whose NPT has been reached.
+ * @return the monotonic time at which the next event is due, or UINT64_MAX
+ * if it can't be told before the next PCR arrives.
+ */
+static uint64_t stream_event_dispatch(struct event_stream *s, uint64_t now, struct demuxfs_data *priv)
+{
+	uint64_t when, deadline = UINT64_MAX;
+	int64_t npt;
+
+	if (! s->num_pending || ! stream_event_npt_at(s, now, &npt))
+		return deadline;
+
+	for (int i=0; i<STREAM_EVENT_MAX_EVENTS; ++i) {
+		struct stream_event *ev = &s->events[i];
+		if (! ev->used || ev->triggered)
+			continue;
+		if (npt < (int64_t) ev->npt) {
+			ev->armed = true;
+			/* Beyond the PCR gap the next PCR will tell when the event is due */
+			if (stream_event_trigger_time(s, ev->npt, &when) &&
+				when <= s->stc_ns + STREAM_EVENT_MAX_PCR_GAP_MS * 1000000ULL && when < deadline)
+				deadline = when;
+			continue;
+		}
+		if (ev->armed) {
+			stream_event_write(s, ev->event_id, &ev->npt, ev->private_data, ev->private_data_length);
+			if (priv->latency && stream_event_trigger_time(s, ev->npt, &when)) {
+				uint64_t written = stats_now();
+				histogram_record(&priv->latency->stream_event_trigger, written > when ? written - when : 0);
+			}
+			trace_instant("dsmcc", "stream_event", "event_id", ev->event_id);
+		}
+		ev->triggered = true;
+		s->num_pending--;
+	}
+	return deadline;
+}
+
+static void *stream_event_thread(void *data)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) data;
+	struct stream_events *se = priv->stream_events;
+	struct event_stream *s;
+	struct timespec ts;
+
+	pthread_mutex_lock(&se->mutex);
+	while (! se->stop) {
+		uint64_t now = stats_now(), deadline = UINT64_MAX;
+		list_for_each_entry(s, &se->streams, list) {
+			uint64_t when = stream_event_dispatch(s, now, priv);
+			if (when < deadline)
+				deadline = when;
+		}
+		if (deadline == UINT64_MAX) {
+			pthread_cond_wait(&se->cond, &se->mutex);
+		} else {
+			ts.tv_sec = deadline / 1000000000ULL;
+			ts.tv_nsec = deadline % 1000000000ULL;
+			pthread_cond_timedwait(&se->cond, &se->mutex, &ts);
+		}
+	}
+	pthread_mutex_unlock(&se->mutex);
+	return NULL;
+}
+
+/**
+ * Tells if @version_number is new for the section identified by @extension.
+ */
+static bool stream_event_new_version(struct event_stream *s, uint16_t extension, uint8_t version_number)
+{
+	struct stream_event_section *section;
+
+	for (int i=0; i<s->num_sections; ++i) {
+		section = &s->sections[i];
+		if (section->extension == extension) {
+			if (section->version_number == version_number)
+				return false;
+			section->version_number = version_number;
+			return true;
+		}
+	}
+	if (s->num_sections == STREAM_EVENT_MAX_SECTIONS) {
+		TS_WARNING("too many stream descriptor sections on pid %#x", s->pid);
+		return false;
+	}
+	section = &s->sections[s->num_sections++];
+	section->extension = extension;
+	section->version_number = version_number;
+	return true;
+}
+
+static void stream_event_parse_npt_reference(struct event_stream *s, const uint8_t *p, uint8_t len)
+{
+	if (len < 18) {
+		TS_WARNING("NPT reference descriptor is too short (%d bytes)", len);
+		return;
+	}
+	s->npt.content_id = p[0] & 0x7f;
+	s->npt.stc = stream_event_read_33(&p[1]);
+	s->npt.npt = stream_event_read_33(&p[9]);
+	s->npt.scale_numerator = (int16_t) CONVERT_TO_16(p[14], p[15]);
+	s->npt.scale_denominator = CONVERT_TO_16(p[16], p[17]);
+	s->npt.valid = true;
+}
+
+static void stream_event_schedule(struct event_stream *s, uint16_t extension, uint16_t event_id,
+		uint64_t event_npt, const uint8_t *private_data, uint8_t private_data_length, uint64_t now)
+{
+	struct stream_event *ev = NULL;
+	bool known;
+	int64_t npt;
+
+	for (int i=0; i<STREAM_EVENT_MAX_EVENTS; ++i) {
+		struct stream_event *e = &s->events[i];
+		if (e->used && e->extension == extension && e->event_id == event_id && e->npt == event_npt) {
+			/* Carried again by the new version of its section */
+			e->seen = true;
+			return;
+		}
+		if (! ev && ! e->used)
+			ev = e;
+	}
+	for (int i=0; i<STREAM_EVENT_MAX_EVENTS && ! ev; ++i)
+		if (s->events[i].triggered)
+			ev = &s->events[i];
+	if (! ev) {
+		TS_WARNING("too many pending stream events on pid %#x, dropping event %#x", s->pid, event_id);
+		return;
+	}
+
+	memset(ev, 0, sizeof(*ev));
+	ev->used = true;
+	ev->seen = true;
+	ev->event_id = event_id;
+	ev->extension = extension;
+	ev->npt = event_npt;
+	ev->private_data_length = private_data_length;
+	memcpy(ev->private_data, private_data, private_data_length);
+	known = stream_event_npt_at(s, now, &npt);
+	if (known && npt >= (int64_t) event_npt) {
+		/* Its time has passed already */
+		ev->triggered = true;
+	} else {
+		ev->armed = known;
+		s->num_pending++;
+	}
+}
+
+int stream_event_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("parser");
+	struct stream_events *se = priv->stream_events;
+	const uint8_t *p = (const uint8_t *) payload;
+	struct psi_common_header psi;
+	struct event_stream *s;
+	bool do_it_now;
+	uint32_t i, end;
+	uint64_t now;
+
+	if (! se)
+		return 0;
+	memset(&psi, 0, sizeof(psi));
+	if (psi_parse(&psi, payload, payload_len) < 0 || ! psi.current_next_indicator)
+		return 0;
+	end = 3 + psi.section_length - 4;
+	if (psi.section_length < 9 || end > payload_len) {
+		TS_WARNING("stream descriptor section on pid %#x is truncated", header->pid);
+		return 0;
+	}
+
+	/* Sections that carry a single "do it now" event have a table_id_extension starting with '00' */
+	do_it_now = (psi.identifier >> 14) == 0;
+	now = stats_now();
+
+	pthread_mutex_lock(&se->mutex);
+	s = stream_event_get(header->pid, se);
+	if (! s || ! stream_event_new_version(s, psi.identifier, psi.version_number)) {
+		pthread_mutex_unlock(&se->mutex);
+		return 0;
+	}
+	for (int k=0; k<STREAM_EVENT_MAX_EVENTS; ++k)
+		if (s->events[k].used && s->events[k].extension == psi.identifier)
+			s->events[k].seen = false;
+
+	for (i=8; i+2 <= end; i += 2 + p[i+1]) {
+		uint8_t tag = p[i], len = p[i+1];
+		const uint8_t *d = &p[i+2];
+
+		if (i + 2 + len > end) {
+			TS_WARNING("descriptor %#x overflows the stream descriptor section on pid %#x", tag, header->pid);
+			break;
+		}
+		if (tag == NPT_REFERENCE_DESCRIPTOR) {
+			stream_event_parse_npt_reference(s, d, len);
+		} else if (tag == STREAM_EVENT_DESCRIPTOR && len >= 10) {
+			uint16_t event_id = CONVERT_TO_16(d[0], d[1]);
+			uint64_t event_npt = stream_event_read_33(&d[5]);
+			if (do_it_now) {
+				stream_event_write(s, event_id, NULL, (const char *) &d[10], len - 10);
+				if (priv->latency && now > priv->latency->packet_ingest_ns)
+					histogram_record(&priv->latency->stream_event_trigger,
+						stats_now() - priv->latency->packet_ingest_ns);
+				trace_instant("dsmcc", "stream_event", "event_id", event_id);
+			} else {
+				stream_event_schedule(s, psi.identifier, event_id, event_npt, &d[10], len - 10, now);
+			}
+		}
+	}
+
+	/* Pending events that the new version no longer carries are cancelled */
+	for (int k=0; k<STREAM_EVENT_MAX_EVENTS; ++k) {
+		struct stream_event *ev = &s->events[k];
+		if (ev->used && ev->extension == psi.identifier && ! ev->seen) {
+			if (! ev->triggered)
+				s->num_pending--;
+			ev->used = false;
+		}
+	}
+
+	/* The NPT reference or the set of pending events may have changed */
+	pthread_cond_signal(&se->cond);
+	pthread_mutex_unlock(&se->mutex);
+	return 0;
+}
+
+void stream_event_record_pcr(uint16_t pid, uint64_t pcr, struct demuxfs_data *priv)
+{
+	struct stream_events *se = priv->stream_events;
+	struct event_stream *s;
+	bool wake = false;
+	uint64_t now;
+
+	if (! se || ! (__atomic_load_n(&se->pcr_pids[pid >> 3], __ATOMIC_RELAXED) & (1 << (pid & 7))))
+		return;
+
+	now = stats_now();
+	pthread_mutex_lock(&se->mutex);
+	list_for_each_entry(s, &se->streams, list) {
+		if (s->pcr_pid != pid)
+			continue;
+		s->stc = (pcr / 300) & STC_MASK;
+		s->stc_ns = now;
+		s->has_pcr = true;
+		if (s->num_pending)
+			wake = true;
+	}
+	if (wake)
+		pthread_cond_signal(&se->cond);
+	pthread_mutex_unlock(&se->mutex);
+}
+
+void stream_event_bind(uint16_t pid, uint16_t pcr_pid, struct dentry *fifo,
+		struct demuxfs_data *priv)
+{
+	struct stream_events *se = priv->stream_events;
+	struct event_stream *s;
+	uint16_t released_pid = TS_NULL_PID;
+	bool request = false;
+
+	if (! se)
+		return;
+
+	pthread_mutex_lock(&se->mutex);
+	s = stream_event_get(pid, se);
+	if (! s) {
+		s = (struct event_stream *) calloc(1, sizeof(struct event_stream));
+		if (! s) {
+			pthread_mutex_unlock(&se->mutex);
+			return;
+		}
+		s->pid = pid;
+		list_add_tail(&s->list, &se->streams);
+		request = true;
+	} else if (s->pcr_pid != pcr_pid) {
+		s->has_pcr = false;
+		released_pid = s->pcr_pid;
+		request = true;
+	}
+	s->pcr_pid = pcr_pid;
+	s->fifo = fifo;
+	/* Bits are never cleared: a stale one only costs a lookup per PCR */
+	__atomic_or_fetch(&se->pcr_pids[pcr_pid >> 3], 1 << (pcr_pid & 7), __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&se->mutex);
+
+	/* Each stream holds one request on the PID of its PCR */
+	if (request)
+		ts_request_pid(pcr_pid, priv);
+	if (released_pid != TS_NULL_PID)
+		ts_release_pid(released_pid, priv);
+}
+
+bool stream_event_wants_pid(uint16_t pid, struct demuxfs_data *priv)
+{
+	struct stream_events *se = priv->stream_events;
+	struct event_stream *s;
+	bool wanted = false;
+
+	if (! se)
+		return false;
+	pthread_mutex_lock(&se->mutex);
+	list_for_each_entry(s, &se->streams, list)
+		if (s->pcr_pid == pid)
+			wanted = true;
+	pthread_mutex_unlock(&se->mutex);
+	return wanted;
+}
+
+int stream_event_init(struct demuxfs_data *priv)
+{
+	struct stream_events *se = calloc(1, sizeof(struct stream_events));
+	pthread_condattr_t attr;
+
+	if (! se)
+		return -ENOMEM;
+	pthread_mutex_init(&se->mutex, NULL);
+	/* Deadlines are computed with stats_now(), which reads the monotonic clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&se->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	INIT_LIST_HEAD(&se->streams);
+
+	priv->stream_events = se;
+	if (pthread_create(&se->thread, NULL, stream_event_thread, priv) != 0) {
+		priv->stream_events = NULL;
+		pthread_cond_destroy(&se->cond);
+		pthread_mutex_destroy(&se->mutex);
+		free(se);
+		return -EAGAIN;
+	}
+	return 0;
+}
+
+void stream_event_destroy(struct demuxfs_data *priv)
+{
+	struct stream_events *se = priv->stream_events;
+	struct event_stream *s, *aux;
+
+	if (! se)
+		return;
+	pthread_mutex_lock(&se->mutex);
+	se->stop = true;
+	pthread_cond_signal(&se->cond);
+	pthread_mutex_unlock(&se->mutex);
+	pthread_join(se->thread, NULL);
+
+	list_for_each_entry_safe(s, aux, &se->streams, list) {
+		list_del(&s->list);
+		free(s);
+	}
+	pthread_cond_destroy(&se->cond);
+	pthread_mutex_destroy(&se->mutex);
+	free(se);
+	priv->stream_events = NULL;
+}
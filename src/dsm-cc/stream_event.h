@@ -0,0 +1,72 @@
+#ifndef __stream_event_h
+#define __stream_event_h
+
+/*
+ * DSM-CC stream events. Event message streams (stream types 0x0c and 0x0d)
+ * get an "Events" FIFO in their PMT stream directory. Each stream event is
+ * written to it as a single line once it triggers:
+ *
+ *   event_id=<id> mode=do_it_now private_data=<hex>
+ *   event_id=<id> mode=scheduled npt=<npt> private_data=<hex>
+ *
+ * "Do it now" events, carried by stream descriptor sections whose
+ * table_id_extension starts with '00', trigger as soon as a new version of
+ * their section is parsed. Scheduled events trigger when the Normal Play Time
+ * reaches their eventNPT. The NPT is derived from the last NPT reference
+ * descriptor and the PCR of the program, which is extrapolated with the
+ * monotonic clock between two PCRs so that events are not held back until the
+ * next PCR arrives. Scheduled events whose NPT has already passed when they
+ * are received are dropped.
+ *
+ * The delay between the trigger time and the write to the FIFO is exported
+ * under /Stats/latency/stream_event_trigger.
+ */
+
+#define FS_STREAM_EVENTS_FIFO_NAME   "Events"
+
+/* Maximum number of events remembered per stream, pending or triggered */
+#define STREAM_EVENT_MAX_EVENTS      64
+/* Maximum number of stream descriptor sections tracked per stream */
+#define STREAM_EVENT_MAX_SECTIONS    32
+/* The PCR is not extrapolated for more than this many ms past the last one received */
+#define STREAM_EVENT_MAX_PCR_GAP_MS  100
+
+struct stream_events;
+struct ts_header;
+
+/**
+ * Starts the thread that triggers the scheduled events.
+ * @return 0 on success or a negative errno value.
+ */
+int stream_event_init(struct demuxfs_data *priv);
+
+/**
+ * Delivers the events carried by @pid to @fifo, using the PCR carried by
+ * @pcr_pid as the clock of its NPT.
+ */
+void stream_event_bind(uint16_t pid, uint16_t pcr_pid, struct dentry *fifo,
+		struct demuxfs_data *priv);
+
+/**
+ * Tells if @pid carries the PCR of a stream bound to an events FIFO.
+ */
+bool stream_event_wants_pid(uint16_t pid, struct demuxfs_data *priv);
+
+/**
+ * Parses a stream descriptor section (table_id 0x3d).
+ */
+int stream_event_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv);
+
+/**
+ * Updates the clock of the streams whose PCR is carried by @pid.
+ */
+void stream_event_record_pcr(uint16_t pid, uint64_t pcr, struct demuxfs_data *priv);
+
+/**
+ * Stops the trigger thread and releases the streams. The FIFOs are disposed
+ * with the tree.
+ */
+void stream_event_destroy(struct demuxfs_data *priv);
+
+#endif /* __stream_event_h */
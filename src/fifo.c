@@ -29,6 +29,8 @@
 #include "demuxfs.h"
 #include "fifo.h"
 #include "ts.h"
+#include "trace.h"
+#include "mem.h"
 
 struct fifo {
 	pthread_mutex_t mutex;
@@ -39,7 +41,7 @@ struct fifo {
 
 struct fifo *fifo_init()
 {
-	struct fifo *fifo = (struct fifo *) calloc(1, sizeof(struct fifo));
+	struct fifo *fifo = (struct fifo *) mem_calloc(MEM_FIFOS, 1, sizeof(struct fifo));
 	if (fifo) {
 		pthread_mutex_init(&fifo->mutex, NULL);
 		fifo->flushed = true;
@@ -57,7 +59,7 @@ void fifo_destroy(struct fifo *fifo)
 			free(fifo->path);
 		if (fifo->fd > 0)
 			close(fifo->fd);
-		free(fifo);
+		mem_free(MEM_FIFOS, fifo);
 	}
 }
 
@@ -80,6 +82,7 @@ bool fifo_is_open(struct fifo *fifo)
 
 int fifo_set_path(struct fifo *fifo, char *path)
 {
+	free(fifo->path);
 	fifo->path = strdup(path);
 	return 0;
 }
@@ -91,8 +94,9 @@ const char *fifo_get_path(struct fifo *fifo)
 
 int fifo_append(struct fifo *fifo, const char *data, uint32_t size)
 {
+	uint64_t start = trace_begin();
 	int err, ret;
-	
+
 	do {
 		ret = write(fifo->fd, data, size);
 		err = ret < 0 ? errno : 0;
@@ -108,5 +112,6 @@ int fifo_append(struct fifo *fifo, const char *data, uint32_t size)
 		pthread_mutex_unlock(&fifo->mutex);
 	} while (err == EAGAIN);
 
+	trace_end("fifo", "fifo_write", start, "bytes", size);
 	return 0;
 }
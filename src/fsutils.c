@@ -31,6 +31,7 @@
 #include "buffer.h"
 #include "xattr.h"
 #include "fifo.h"
+#include "trace.h"
 
 static void _fsutils_dump_tree(struct dentry *dentry, int spaces);
 
@@ -151,6 +152,10 @@ void fsutils_dispose_node(struct dentry *dentry)
 				free(priv);
 				break;
 			}
+			case OBJ_TYPE_STATS:
+			case OBJ_TYPE_CAPTURE:
+				free(dentry->priv);
+				break;
 			case OBJ_TYPE_FIFO: {
 				struct fifo_priv *priv = dentry->priv;
 				if (priv->fifo)
@@ -176,8 +181,9 @@ void fsutils_dispose_node(struct dentry *dentry)
 	if (dentry->name)
 		free(dentry->name);
 	pthread_mutex_destroy(&dentry->mutex);
-	if (! list_poisoned(&dentry->list))
-		list_del(&dentry->list);
+	if (! list_poisoned(&dentry->list)) {
+		UNLINK_DENTRY(dentry);
+	}
 	free(dentry);
 }
 
@@ -220,8 +226,9 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target)
 				break;
 			}
 		if (! already_exists) {
-			list_del(&ptr_source->list);
-			list_add_tail(&ptr_source->list, &target->children);
+			UNLINK_DENTRY(ptr_source);
+			ptr_source->parent = target;
+			LINK_DENTRY(target, ptr_source);
 		} else if (S_ISDIR(ptr_target->mode) && S_ISDIR(ptr_source->mode))
 			fsutils_migrate_children(ptr_source, ptr_target);
 	}
@@ -333,17 +340,11 @@ struct dentry * fsutils_find_by_inode(struct dentry *root, ino_t inode)
 	return NULL;
 }
 
-struct dentry * fsutils_create_version_dir(struct dentry *parent, int version)
+/* Updates the 'Current' symlink if it exists or creates a new symlink if it doesn't */
+static void fsutils_set_current(struct dentry *parent, const char *version_dir)
 {
-	char version_dir[32];
-	struct dentry *child;
-	struct dentry *current;
+	struct dentry *current = fsutils_get_child(parent, FS_CURRENT_NAME);
 
-	snprintf(version_dir, sizeof(version_dir), "Version_%d", version);
-	child = CREATE_DIRECTORY(parent, version_dir);
-	
-	/* Update the 'Current' symlink if it exists or create a new symlink if it doesn't */
-	current = fsutils_get_child(parent, FS_CURRENT_NAME);
 	if (! current)
 		current = CREATE_SYMLINK(parent, FS_CURRENT_NAME, version_dir);
 	else {
@@ -352,10 +353,61 @@ struct dentry * fsutils_create_version_dir(struct dentry *parent, int version)
 		current->contents = strdup(version_dir);
 		pthread_mutex_unlock(&current->mutex);
 	}
+}
+
+struct dentry * fsutils_create_version_dir(struct dentry *parent, int version)
+{
+	TRACE_FUNCTION("publish");
+	char version_dir[32];
+	struct dentry *child;
 
+	snprintf(version_dir, sizeof(version_dir), "Version_%d", version);
+	child = CREATE_DIRECTORY(parent, version_dir);
+	fsutils_set_current(parent, version_dir);
 	return child;
 }
 
+/**
+ * Creates a version directory that is not linked anywhere yet, so that a table
+ * can be built into it off the tree. It is linked with fsutils_attach_version_dir().
+ * @version: version number of the table.
+ */
+struct dentry * fsutils_create_staging_dir(int version)
+{
+	struct dentry *dentry = (struct dentry *) calloc(1, sizeof(struct dentry));
+
+	assert(dentry);
+	asprintf(&dentry->name, "Version_%d", version);
+	dentry->mode = S_IFDIR | 0555;
+	dentry->obj_type = OBJ_TYPE_DIR;
+	INITIALIZE_DENTRY_UNLINKED(dentry);
+	/* Disposing it before it's attached unlinks it from nowhere */
+	INIT_LIST_HEAD(&dentry->list);
+	return dentry;
+}
+
+/**
+ * Links a directory created by fsutils_create_staging_dir() into @parent,
+ * replacing a previous directory of the same version, and points the
+ * 'Current' symlink to it.
+ * @parent: table directory
+ * @version_dentry: version directory
+ */
+void fsutils_attach_version_dir(struct dentry *parent, struct dentry *version_dentry)
+{
+	TRACE_FUNCTION("publish");
+	struct dentry *old = fsutils_get_child(parent, version_dentry->name);
+
+	if (old) {
+		parent->size -= old->size;
+		fsutils_dispose_tree(old);
+	}
+	parent->size += version_dentry->size;
+	version_dentry->parent = parent;
+	LINK_DENTRY(parent, version_dentry);
+	fsutils_set_current(parent, version_dentry->name);
+}
+
 struct dentry * fsutils_get_current(struct dentry *parent)
 {
 	struct dentry *target = NULL;
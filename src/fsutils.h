@@ -63,6 +63,8 @@ struct dentry *fsutils_find_by_inode(struct dentry *root, ino_t inode);
 struct dentry *fsutils_get_current(struct dentry *parent);
 struct dentry *fsutils_create_dentry(const char *path, mode_t mode);
 struct dentry *fsutils_create_version_dir(struct dentry *parent, int version);
+struct dentry *fsutils_create_staging_dir(int version);
+void fsutils_attach_version_dir(struct dentry *parent, struct dentry *version_dentry);
 void fsutils_dispose_tree(struct dentry *dentry);
 void fsutils_dispose_node(struct dentry *dentry);
 void fsutils_migrate_children(struct dentry *source, struct dentry *target);
@@ -73,12 +75,23 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 	INIT_LIST_HEAD(&(_dentry)->xattrs); \
 	pthread_mutex_init(&(_dentry)->mutex, NULL); \
 
+/* Links a dentry at the end of its parent's children. Children are kept sorted by offset. */
+#define LINK_DENTRY(_parent,_dentry) \
+	(_dentry)->offset = ++(_parent)->last_child_offset; \
+	list_add_tail(&(_dentry)->list, &((_parent)->children))
+
+/* Unlinks a dentry from its parent, invalidating the readdir cursors held on the parent */
+#define UNLINK_DENTRY(_dentry) \
+	if ((_dentry)->parent) \
+		__atomic_add_fetch(&(_dentry)->parent->unlink_count, 1, __ATOMIC_RELEASE); \
+	list_del(&(_dentry)->list)
+
 #define CREATE_COMMON(_parent,_dentry) \
 	INITIALIZE_DENTRY_UNLINKED(_dentry); \
 	if ((_dentry)->obj_type != OBJ_TYPE_FIFO) \
 		_parent->size += (_dentry)->size; \
 	(_dentry)->parent = _parent; \
-	list_add_tail(&(_dentry)->list, &((_parent)->children));
+	LINK_DENTRY(_parent,_dentry);
 
 #define UPDATE_COMMON(_dentry,_new_contents,_new_size) \
  	pthread_mutex_lock(&_dentry->mutex); \
@@ -99,11 +112,11 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 
 #define UPDATE_PARENT(_dentry,_parent) \
 	if (_dentry->parent != _parent) { \
-		list_del(&(_dentry)->list); \
+		UNLINK_DENTRY(_dentry); \
  		if ((_dentry)->obj_type != OBJ_TYPE_FIFO) \
  			_parent->size += (_dentry)->size; \
  		(_dentry)->parent = _parent; \
-		list_add_tail(&(_dentry)->list, &_parent->children); \
+		LINK_DENTRY(_parent,_dentry); \
 	}
 
 #define CREATE_FILE_BIN(parent,header,member,_size) \
@@ -120,7 +133,7 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 			_dentry->mode = S_IFREG | 0444; \
 	 		_dentry->obj_type = OBJ_TYPE_FILE; \
 			CREATE_COMMON((parent),_dentry); \
-			xattr_add(_dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false); \
+			_dentry->format = XATTR_FORMAT_BIN; \
 	 	} \
 	 	_dentry; \
 	})
@@ -145,7 +158,7 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 			_dentry->mode = S_IFREG | 0444; \
 	 		_dentry->obj_type = OBJ_TYPE_FILE; \
 			CREATE_COMMON((_parent),_dentry); \
-			xattr_add(_dentry, XATTR_FORMAT, XATTR_FORMAT_NUMBER, strlen(XATTR_FORMAT_NUMBER), false); \
+			_dentry->format = XATTR_FORMAT_NUMBER; \
 	 	} \
 	 	_dentry; \
 	})
@@ -163,7 +176,7 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 			_dentry->mode = S_IFREG | 0444; \
 	 		_dentry->obj_type = OBJ_TYPE_FILE; \
 			CREATE_COMMON((_parent),_dentry); \
-			xattr_add(_dentry, XATTR_FORMAT, fmt, strlen(fmt), false); \
+			_dentry->format = fmt; \
 	 	} \
 	 	_dentry; \
 	})
@@ -181,7 +194,7 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 			_dentry->mode = S_IFREG | 0444; \
 	 		_dentry->obj_type = OBJ_TYPE_FILE; \
 			CREATE_COMMON((_parent),_dentry); \
-			xattr_add(_dentry, XATTR_FORMAT, XATTR_FORMAT_BIN, strlen(XATTR_FORMAT_BIN), false); \
+			_dentry->format = XATTR_FORMAT_BIN; \
 	 	} else { \
 	 		UPDATE_NAME(_dentry,_name); \
 	 		UPDATE_PARENT(_dentry,_parent); \
@@ -222,6 +235,41 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 	 	_dentry; \
 	})
 
+#define CREATE_STATS_FILE(parent,fname,_generate,_data) \
+	({ \
+	 	struct dentry *_dentry = fsutils_get_child(parent, fname); \
+	 	if (! _dentry) { \
+	 		struct stats_priv *_priv = (struct stats_priv *) calloc(1, sizeof(struct stats_priv)); \
+	 		_priv->generate = _generate; \
+	 		_priv->data = _data; \
+			_dentry = (struct dentry *) calloc(1, sizeof(struct dentry)); \
+			_dentry->name = strdup(fname); \
+			_dentry->mode = S_IFREG | 0444; \
+	 		_dentry->obj_type = OBJ_TYPE_STATS; \
+	 		_dentry->priv = _priv; \
+			CREATE_COMMON((parent),_dentry); \
+			_dentry->format = XATTR_FORMAT_STRING; \
+	 	} \
+	 	_dentry; \
+	})
+
+#define CREATE_CAPTURE_FILE(parent,fname,_capture) \
+	({ \
+	 	struct dentry *_dentry = fsutils_get_child(parent, fname); \
+	 	if (! _dentry) { \
+	 		struct capture_priv *_priv = (struct capture_priv *) calloc(1, sizeof(struct capture_priv)); \
+	 		_priv->capture = _capture; \
+			_dentry = (struct dentry *) calloc(1, sizeof(struct dentry)); \
+			_dentry->name = strdup(fname); \
+			_dentry->mode = S_IFREG | 0444; \
+	 		_dentry->obj_type = OBJ_TYPE_CAPTURE; \
+	 		_dentry->priv = _priv; \
+			CREATE_COMMON((parent),_dentry); \
+			_dentry->format = XATTR_FORMAT_BIN; \
+	 	} \
+	 	_dentry; \
+	})
+
 #define CREATE_FIFO(parent,ftype,fname,priv) \
 	({ \
 	 	char _fifo_path[PATH_MAX]; \
@@ -262,11 +310,11 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 			CREATE_COMMON((_parent),_dentry); \
 	 	} else if (_dentry->parent != _parent) { \
 	 		/* Update parent */ \
-	 		list_del(&_dentry->list); \
+	 		UNLINK_DENTRY(_dentry); \
 	 		if ((_dentry)->obj_type != OBJ_TYPE_FIFO) \
 	 			_parent->size += (_dentry)->size; \
 	 		(_dentry)->parent = _parent; \
-	 		list_add_tail(&(_dentry)->list, &((_parent)->children)); \
+	 		LINK_DENTRY(_parent,_dentry); \
 	 	} \
 	 	_dentry; \
 	})
@@ -284,11 +332,11 @@ void fsutils_migrate_children(struct dentry *source, struct dentry *target);
 			CREATE_COMMON((_parent),_dentry); \
 	 	} else if (_dentry->parent != _parent) { \
 	 		/* Update parent */ \
-	 		list_del(&_dentry->list); \
+	 		UNLINK_DENTRY(_dentry); \
 	 		if ((_dentry)->obj_type != OBJ_TYPE_FIFO) \
 	 			_parent->size += (_dentry)->size; \
 	 		(_dentry)->parent = _parent; \
-	 		list_add_tail(&(_dentry)->list, &((_parent)->children)); \
+	 		LINK_DENTRY(_parent,_dentry); \
 	 	} \
 	 	_dentry; \
 	})
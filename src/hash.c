@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "hash.h"
+#include "mem.h"
 
 void hashtable_lock(struct hash_table *hash)
 {
@@ -39,11 +40,21 @@ void hashtable_unlock(struct hash_table *hash)
 	pthread_mutex_unlock(&hash->mutex);
 }
 
+/**
+ * Accounts the memory of the data added to the table to @subsystem. Only
+ * the data objects themselves are measured, not what they point to.
+ */
+void hashtable_set_accounting(struct hash_table *table, int subsystem)
+{
+	table->accounting = subsystem;
+}
+
 struct hash_table *hashtable_new(int size)
 {
 	struct hash_table *table = (struct hash_table *) calloc(1, sizeof(struct hash_table));
 	assert(table);
 	table->size = size;
+	table->accounting = MEM_NONE;
 	table->items = (struct hash_item **) calloc(size, sizeof(struct hash_item *));
 	assert(table->items);
 	pthread_mutex_init(&table->mutex, NULL);
@@ -57,6 +68,7 @@ void hashtable_destroy(struct hash_table *table, hashtable_free_function_t free_
 	for (i=0; i<table->size; ++i) {
 		struct hash_item *item = table->items[i];
 		if (item) {
+			mem_account_free(table->accounting, item->data);
 			if (item->free_function && item->data)
 				item->free_function(item->data);
 			else if (free_function && item->data)
@@ -69,62 +81,92 @@ void hashtable_destroy(struct hash_table *table, hashtable_free_function_t free_
 	free(table);
 }
 
-void hashtable_invalidate_contents(struct hash_table *table)
+/*
+ * Keys such as table identities keep most of their entropy in the upper bits,
+ * so they are mixed before being reduced to a slot.
+ */
+static inline int hashtable_index(struct hash_table *table, ino_t key)
 {
-	int i;
-	pthread_mutex_destroy(&table->mutex);
-	for (i=0; i<table->size; ++i) {
-		struct hash_item *item = table->items[i];
-		if (item) {
-			item->data = NULL;
-			table->items[i] = NULL;
+	uint64_t hash = (uint64_t) key;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash % table->size;
+}
+
+static struct hash_item **hashtable_lookup(struct hash_table *table, ino_t key)
+{
+	int index = hashtable_index(table, key);
+	struct hash_item *item;
+
+	while ((item = table->items[index])) {
+		if (item->key == key)
+			return &table->items[index];
+		index = (index+1) % table->size;
+	}
+	return NULL;
+}
+
+static void hashtable_grow(struct hash_table *table)
+{
+	struct hash_item **items = table->items;
+	int i, size = table->size;
+
+	table->size = size * 2;
+	table->items = (struct hash_item **) calloc(table->size, sizeof(struct hash_item *));
+	assert(table->items);
+	for (i=0; i<size; ++i) {
+		if (items[i]) {
+			int index = hashtable_index(table, items[i]->key);
+			while (table->items[index])
+				index = (index+1) % table->size;
+			table->items[index] = items[i];
 		}
 	}
+	free(items);
 }
 
 void *hashtable_get(struct hash_table *table, ino_t key)
 {
-	int index = key % table->size;
-	struct hash_item *item = table->items[index];
-	struct hash_item *start = item;
-	do {
-		if (! item)
-			return NULL;
-		else if (item->key == key)
-			return item->data;
-		else {
-			index = (index+1) % table->size;
-			item = table->items[index];
-		}
-	} while (item != start);
-	return NULL;
+	struct hash_item **slot = hashtable_lookup(table, key);
+	return slot ? (*slot)->data : NULL;
 }
 
 bool hashtable_add(struct hash_table *table, ino_t key, void *data, hashtable_free_function_t free_function)
 {
-	int index = key % table->size;
-	struct hash_item *item = table->items[index];
-	struct hash_item *start = item;
-	do {
-		if (item == NULL) {
-			item = (struct hash_item *) calloc(1, sizeof(struct hash_item));
-			item->key = key;
-			item->data = data;
-			item->free_function = free_function;
-			table->items[index] = item;
-			return true;
-		} else if (item->key == key) {
-			dprintf("overwriting previous contents (key=%#jx)", key);
-			item->key = key;
-			item->data = data;
-			item->free_function = free_function;
-			return true;
-		} else {
-			index = (index+1) % table->size;
-			item = table->items[index];
-		}
-	} while (item != start);
-	return false;
+	struct hash_item **slot = hashtable_lookup(table, key);
+	struct hash_item *item;
+	int index;
+
+	if (slot) {
+		item = *slot;
+		dprintf("overwriting previous contents (key=%#jx)", key);
+		mem_account_free(table->accounting, item->data);
+		mem_account_alloc(table->accounting, data);
+		item->data = data;
+		item->free_function = free_function;
+		table->generation++;
+		return true;
+	}
+
+	if ((table->count + 1) * 2 > table->size)
+		hashtable_grow(table);
+
+	item = (struct hash_item *) calloc(1, sizeof(struct hash_item));
+	if (! item)
+		return false;
+	item->key = key;
+	item->data = data;
+	item->free_function = free_function;
+
+	index = hashtable_index(table, key);
+	while (table->items[index])
+		index = (index+1) % table->size;
+	table->items[index] = item;
+	table->count++;
+	table->generation++;
+	mem_account_alloc(table->accounting, data);
+	return true;
 }
 
 void _hashtable_del_item(struct hash_item *item)
@@ -138,20 +180,38 @@ void _hashtable_del_item(struct hash_item *item)
 
 bool hashtable_del(struct hash_table *table, ino_t key)
 {
-	int index = key % table->size;
-	struct hash_item *item = table->items[index];
-	struct hash_item *start = item;
-	do {
-		if (! item) 
-			return true;
-		else if (item->key == key) {
-			_hashtable_del_item(item);
+	struct hash_item **slot = hashtable_lookup(table, key);
+	struct hash_item *item;
+	int hole, index;
+
+	if (! slot)
+		return true;
+	item = *slot;
+	*slot = NULL;
+	table->count--;
+	table->generation++;
+
+	/*
+	 * Move back the items that follow in the same cluster and that can't be
+	 * reached anymore from their home slot through the hole just left.
+	 */
+	hole = slot - table->items;
+	index = hole;
+	for (;;) {
+		int home;
+		index = (index+1) % table->size;
+		if (! table->items[index])
+			break;
+		home = hashtable_index(table, table->items[index]->key);
+		if ((index > hole && (home <= hole || home > index)) ||
+			(index < hole && (home <= hole && home > index))) {
+			table->items[hole] = table->items[index];
 			table->items[index] = NULL;
-			return true;
-		} else {
-			index = (index+1) % table->size;
-			item = table->items[index];
+			hole = index;
 		}
-	} while (item != start);
-	return false;
+	}
+
+	mem_account_free(table->accounting, item->data);
+	_hashtable_del_item(item);
+	return true;
 }
@@ -11,16 +11,22 @@ struct hash_item {
 
 struct hash_table {
 	int size;
+	/* Number of items. The table doubles in size when it becomes half full */
+	int count;
+	/* Incremented whenever an item is added or removed */
+	uint64_t generation;
+	/* Memory accounting subsystem of the items' data, or MEM_NONE */
+	int accounting;
 	pthread_mutex_t mutex;
 	struct hash_item **items;
 };
 
 struct hash_table *hashtable_new(int size);
 void hashtable_destroy(struct hash_table *table, hashtable_free_function_t free_function);
-void hashtable_invalidate_contents(struct hash_table *table);
 void *hashtable_get(struct hash_table *table, ino_t key);
 bool hashtable_add(struct hash_table *table, ino_t key, void *data, hashtable_free_function_t free_function);
 bool hashtable_del(struct hash_table *table, ino_t key);
+void hashtable_set_accounting(struct hash_table *table, int subsystem);
 void hashtable_lock(struct hash_table *hash);
 void hashtable_unlock(struct hash_table *hash);
 
@@ -0,0 +1,599 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "xattr.h"
+#include "hash.h"
+#include "buffer.h"
+#include "mem.h"
+#include "ts.h"
+#include "stats.h"
+#include "sections.h"
+#include "journal.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+ * Journal file layout, in host byte order: the magic string "DMXFSJ01"
+ * followed by records. A JOURNAL_SECTION record is followed by the section
+ * it describes. A JOURNAL_CHECKPOINT record is followed by @count
+ * JOURNAL_SECTION records holding every current section at that time, in
+ * replay order. Each mount starts with an empty checkpoint.
+ */
+#define JOURNAL_MAGIC "DMXFSJ01"
+
+enum journal_record_type {
+	JOURNAL_SECTION = 1,
+	JOURNAL_CHECKPOINT = 2,
+};
+
+struct journal_record {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t pid;
+	uint16_t length;
+	uint16_t pcr_pid;   /**< PID of the last PCR seen, TS_NULL_PID if none */
+	uint32_t count;     /**< Number of sections following a checkpoint */
+	uint64_t wall_ns;   /**< CLOCK_REALTIME */
+	uint64_t pcr;       /**< Last PCR seen, in 27MHz units */
+	int64_t tot;        /**< Last TOT time, in seconds since the Epoch, or 0 */
+} __attribute__((__packed__));
+
+struct journal_checkpoint {
+	uint64_t wall_ns;
+	int64_t tot;
+	off_t offset;
+	uint32_t count;
+};
+
+struct journal_view {
+	struct demuxfs_data *context;
+	/* Lookups and open handles using the view, which can't be disposed meanwhile */
+	unsigned int holds;
+};
+
+struct journal {
+	char *path;
+	FILE *fp;
+	int fd;
+	off_t size;
+	bool failed;
+	/* Protects the file, the store and the checkpoint index */
+	pthread_mutex_t mutex;
+	struct section_store *store;
+	struct journal_checkpoint *checkpoints;
+	size_t num_checkpoints;
+	size_t max_checkpoints;
+	uint64_t records;
+	uint32_t records_since_checkpoint;
+	uint64_t last_checkpoint_ns;
+	/* Stamps of the next record, only touched by the TS parser thread */
+	uint16_t pcr_pid;
+	uint64_t pcr;
+	int64_t tot;
+	/* Protects the list of views */
+	pthread_mutex_t views_mutex;
+	struct dentry *history;
+	/* The /History views, oldest first */
+	struct journal_view views[JOURNAL_MAX_VIEWS];
+	int num_views;
+};
+
+static uint64_t journal_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#define BCD_TO_INT(x) ((((x) >> 4) & 0x0f) * 10 + ((x) & 0x0f))
+
+/**
+ * Converts the MJD and BCD encoded time of a TOT to seconds since the Epoch.
+ */
+static int64_t journal_decode_tot(const char *section, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *) section;
+	uint16_t mjd;
+
+	if (len < 8)
+		return 0;
+	mjd = (p[3] << 8) | p[4];
+	return ((int64_t) mjd - 40587) * 86400 +
+		BCD_TO_INT(p[5]) * 3600 + BCD_TO_INT(p[6]) * 60 + BCD_TO_INT(p[7]);
+}
+
+static void journal_format_time(uint64_t wall_ns, char *buf, size_t size)
+{
+	time_t seconds = wall_ns / 1000000000ULL;
+	struct tm tm;
+
+	gmtime_r(&seconds, &tm);
+	strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+/**
+ * Parses an ISO 8601 UTC timestamp such as 2018-05-04T12:30:00Z. Fractions
+ * of a second are accepted and the trailing Z is optional.
+ */
+static int journal_parse_time(const char *name, uint64_t *wall_ns)
+{
+	uint64_t fraction_ns = 0, scale = 100000000;
+	const char *end;
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(name, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (! end)
+		return -EINVAL;
+	if (*end == '.')
+		for (++end; isdigit(*end); ++end, scale /= 10)
+			fraction_ns += (*end - '0') * scale;
+	if (*end == 'Z')
+		end++;
+	if (*end != '\0')
+		return -EINVAL;
+	*wall_ns = (uint64_t) timegm(&tm) * 1000000000ULL + fraction_ns;
+	return 0;
+}
+
+static int journal_write(struct journal *j, const void *data, size_t size)
+{
+	if (fwrite(data, 1, size, j->fp) != size) {
+		TS_WARNING("failed to write to journal %s, disabling it", j->path);
+		j->failed = true;
+		return -EIO;
+	}
+	j->size += size;
+	return 0;
+}
+
+static int journal_append_section(struct journal *j, uint16_t pid, const char *section, uint16_t len,
+		uint64_t now)
+{
+	struct journal_record record;
+	int ret;
+
+	memset(&record, 0, sizeof(record));
+	record.type = JOURNAL_SECTION;
+	record.pid = pid;
+	record.length = len;
+	record.pcr_pid = j->pcr_pid;
+	record.wall_ns = now;
+	record.pcr = j->pcr;
+	record.tot = j->tot;
+	ret = journal_write(j, &record, sizeof(record));
+	return ret < 0 ? ret : journal_write(j, section, len);
+}
+
+static int journal_add_checkpoint(struct journal *j, const struct journal_record *record, off_t offset)
+{
+	if (j->num_checkpoints == j->max_checkpoints) {
+		size_t max = j->max_checkpoints ? j->max_checkpoints * 2 : 64;
+		struct journal_checkpoint *checkpoints = realloc(j->checkpoints, max * sizeof(*checkpoints));
+		if (! checkpoints)
+			return -ENOMEM;
+		j->checkpoints = checkpoints;
+		j->max_checkpoints = max;
+	}
+	j->checkpoints[j->num_checkpoints].wall_ns = record->wall_ns;
+	j->checkpoints[j->num_checkpoints].tot = record->tot;
+	j->checkpoints[j->num_checkpoints].offset = offset;
+	j->checkpoints[j->num_checkpoints].count = record->count;
+	j->num_checkpoints++;
+	return 0;
+}
+
+/**
+ * Writes every section of the store after a checkpoint record, so that views
+ * can be rebuilt without reading what came before it.
+ */
+static int journal_checkpoint(struct journal *j, uint64_t now)
+{
+	struct journal_record record;
+	struct stored_section *entry;
+	off_t offset = j->size;
+	int ret;
+
+	memset(&record, 0, sizeof(record));
+	record.type = JOURNAL_CHECKPOINT;
+	record.pcr_pid = j->pcr_pid;
+	record.count = j->store->count;
+	record.wall_ns = now;
+	record.pcr = j->pcr;
+	record.tot = j->tot;
+	ret = journal_write(j, &record, sizeof(record));
+	list_for_each_entry(entry, &j->store->list, list) {
+		if (ret < 0)
+			break;
+		ret = journal_append_section(j, entry->pid, entry->data, entry->length, now);
+	}
+	if (ret == 0 && fflush(j->fp) != 0)
+		ret = -errno;
+	if (ret < 0)
+		return ret;
+
+	j->records_since_checkpoint = 0;
+	j->last_checkpoint_ns = now;
+	return journal_add_checkpoint(j, &record, offset);
+}
+
+void journal_record(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv)
+{
+	struct journal *j = priv->journal;
+	uint8_t table_id = section[0];
+	struct stored_section *entry;
+	uint64_t now;
+	ino_t key;
+
+	if (! j || j->failed)
+		return;
+	if (table_id == TS_TOT_TABLE_ID) {
+		/* Changes with every section; it only stamps the records */
+		j->tot = journal_decode_tot(section, len);
+		return;
+	}
+	if (table_id >= 0x3a && table_id <= 0x3f)
+		/* DSM-CC messages and data blocks are too bulky to be journaled */
+		return;
+	if (! section_store_key(pid, section, len, &key))
+		return;
+
+	/* The store is only changed by the TS parser thread, so no locking is needed to read it */
+	entry = section_store_get(j->store, key);
+	if (entry && stored_section_equals(entry, section, len))
+		return;
+
+	pthread_mutex_lock(&j->mutex);
+	if (! section_store_put(j->store, key, pid, section, len))
+		dprintf("journal store is full, section (pid=%#x, table_id=%#x) will be missing from checkpoints",
+			pid, table_id);
+	now = journal_now();
+	if (journal_append_section(j, pid, section, len, now) == 0) {
+		j->records++;
+		j->records_since_checkpoint++;
+		if (j->records_since_checkpoint >= JOURNAL_CHECKPOINT_RECORDS &&
+			j->records_since_checkpoint >= j->store->count)
+			journal_checkpoint(j, now);
+		else if (now - j->last_checkpoint_ns >= JOURNAL_CHECKPOINT_INTERVAL * 1000000000ULL)
+			journal_checkpoint(j, now);
+	}
+	pthread_mutex_unlock(&j->mutex);
+}
+
+void journal_record_pcr(uint16_t pid, uint64_t pcr, struct demuxfs_data *priv)
+{
+	struct journal *j = priv->journal;
+
+	if (j) {
+		j->pcr_pid = pid;
+		j->pcr = pcr;
+	}
+}
+
+/**
+ * Rebuilds the tree as it was at @wall_ns by replaying the journal from the
+ * last checkpoint written before that time.
+ * @return the parsing context of the view or NULL if the journal doesn't
+ * cover @wall_ns.
+ */
+static struct demuxfs_data *journal_view_new(struct journal *j, const char *name, uint64_t wall_ns,
+		struct demuxfs_data *priv)
+{
+	struct demuxfs_data *context;
+	struct journal_record record;
+	off_t offset, start, end;
+	size_t lo, hi;
+	char *section;
+
+	pthread_mutex_lock(&j->mutex);
+	for (lo=0, hi=j->num_checkpoints; lo < hi; ) {
+		size_t mid = (lo + hi) / 2;
+		if (j->checkpoints[mid].wall_ns <= wall_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || fflush(j->fp) != 0) {
+		pthread_mutex_unlock(&j->mutex);
+		return NULL;
+	}
+	start = j->checkpoints[lo-1].offset;
+	end = j->size;
+	pthread_mutex_unlock(&j->mutex);
+
+	section = malloc(UINT16_MAX);
+	context = section ? ts_context_new(name, MEM_JOURNAL, priv) : NULL;
+	if (! context) {
+		free(section);
+		return NULL;
+	}
+
+	for (offset=start; offset + (off_t) sizeof(record) <= end; ) {
+		if (pread(j->fd, &record, sizeof(record), offset) != sizeof(record))
+			break;
+		if (record.type == JOURNAL_CHECKPOINT) {
+			if (offset != start)
+				break;
+			offset += sizeof(record);
+			continue;
+		}
+		if (record.type != JOURNAL_SECTION || record.wall_ns > wall_ns)
+			break;
+		if (pread(j->fd, section, record.length, offset + sizeof(record)) != record.length)
+			break;
+		ts_parse_section(record.pid, section, record.length, context);
+		offset += sizeof(record) + record.length;
+	}
+	free(section);
+	return context;
+}
+
+/**
+ * Adds @context to the views, disposing the oldest view not in use if there
+ * is no room for it. Called with the views mutex held.
+ * @return the new view or NULL if every view is in use.
+ */
+static struct journal_view *journal_add_view(struct journal *j, struct demuxfs_data *context)
+{
+	int i;
+
+	if (j->num_views == JOURNAL_MAX_VIEWS) {
+		for (i=0; i<j->num_views && j->views[i].holds; ++i)
+			;
+		if (i == j->num_views)
+			return NULL;
+		ts_context_destroy(j->views[i].context);
+		memmove(&j->views[i], &j->views[i+1], (j->num_views - i - 1) * sizeof(j->views[0]));
+		j->num_views--;
+	}
+	context->root->parent = j->history;
+	LINK_DENTRY(j->history, context->root);
+	j->views[j->num_views].context = context;
+	j->views[j->num_views].holds = 0;
+	return &j->views[j->num_views++];
+}
+
+/* Returns the view whose root is @root. Called with the views mutex held. */
+static struct journal_view *journal_get_view(struct journal *j, struct dentry *root)
+{
+	int i;
+
+	for (i=0; i<j->num_views; ++i)
+		if (j->views[i].context->root == root)
+			return &j->views[i];
+	return NULL;
+}
+
+struct dentry *journal_lookup(const char *path, struct demuxfs_data *priv)
+{
+	const char *prefix = "/" FS_HISTORY_NAME "/";
+	struct journal *j = priv->journal;
+	struct demuxfs_data *context;
+	struct journal_view *view;
+	struct dentry *dentry = NULL;
+	char name[NAME_MAX+1];
+	const char *start, *end;
+	uint64_t wall_ns;
+	size_t len;
+
+	if (! j || strncmp(path, prefix, strlen(prefix)))
+		return NULL;
+	start = path + strlen(prefix);
+	end = strchr(start, '/');
+	len = end ? (size_t) (end - start) : strlen(start);
+	if (len == 0 || len > NAME_MAX)
+		return NULL;
+	memcpy(name, start, len);
+	name[len] = '\0';
+	if (journal_parse_time(name, &wall_ns) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&j->views_mutex);
+	view = journal_get_view(j, fsutils_get_child(j->history, name));
+	if (! view && (context = journal_view_new(j, name, wall_ns, priv))) {
+		view = journal_add_view(j, context);
+		if (! view)
+			ts_context_destroy(context);
+	}
+	/* The view can't be disposed while the path is resolved and the dentry is used */
+	if (view && (dentry = fsutils_get_dentry(priv->root, path)))
+		view->holds++;
+	pthread_mutex_unlock(&j->views_mutex);
+
+	return dentry;
+}
+
+void journal_put(struct dentry *dentry, struct demuxfs_data *priv)
+{
+	struct journal *j = priv->journal;
+	struct journal_view *view;
+	struct dentry *root;
+
+	if (! j)
+		return;
+	/* Views are rooted at the children of /History */
+	for (root=dentry; root->parent && root->parent != j->history; root=root->parent)
+		;
+	if (root->parent != j->history)
+		return;
+
+	pthread_mutex_lock(&j->views_mutex);
+	view = journal_get_view(j, root);
+	if (view && view->holds)
+		view->holds--;
+	pthread_mutex_unlock(&j->views_mutex);
+}
+
+static char *journal_generate_checkpoints(void *data, struct demuxfs_data *priv)
+{
+	struct journal *j = (struct journal *) data;
+	char wall[64], tot[64];
+	char *buf = NULL;
+	size_t i, size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+
+	pthread_mutex_lock(&j->mutex);
+	fprintf(fp, "file: %s\n"
+		"size: %jd\n"
+		"records: %" PRIu64 "\n"
+		"sections: %u\n"
+		"checkpoints: %zu\n",
+		j->path, (intmax_t) j->size, j->records, j->store->count, j->num_checkpoints);
+	if (j->num_checkpoints)
+		fprintf(fp, "\n%-22s %-22s %12s %8s\n", "time", "tot", "offset", "sections");
+	for (i=0; i<j->num_checkpoints; ++i) {
+		struct journal_checkpoint *checkpoint = &j->checkpoints[i];
+		journal_format_time(checkpoint->wall_ns, wall, sizeof(wall));
+		if (checkpoint->tot)
+			journal_format_time(checkpoint->tot * 1000000000ULL, tot, sizeof(tot));
+		else
+			strcpy(tot, "-");
+		fprintf(fp, "%-22s %-22s %12jd %8u\n", wall, tot, (intmax_t) checkpoint->offset, checkpoint->count);
+	}
+	pthread_mutex_unlock(&j->mutex);
+	fclose(fp);
+	return buf;
+}
+
+/**
+ * Indexes the checkpoints of an existing journal and drops a record that
+ * was cut short, or writes the header of a new one.
+ */
+static int journal_open(struct journal *j)
+{
+	struct journal_record record;
+	char magic[sizeof(JOURNAL_MAGIC)-1];
+	off_t offset = sizeof(magic);
+	struct stat st;
+	int fd;
+
+	fd = open(j->path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -errno;
+	}
+	if (st.st_size == 0) {
+		if (write(fd, JOURNAL_MAGIC, sizeof(magic)) != sizeof(magic)) {
+			close(fd);
+			return -EIO;
+		}
+		st.st_size = sizeof(magic);
+	} else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || memcmp(magic, JOURNAL_MAGIC, sizeof(magic))) {
+		TS_WARNING("%s is not a section journal", j->path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	while (pread(fd, &record, sizeof(record), offset) == sizeof(record)) {
+		off_t next = offset + sizeof(record) + (record.type == JOURNAL_SECTION ? record.length : 0);
+		if ((record.type != JOURNAL_SECTION && record.type != JOURNAL_CHECKPOINT) || next > st.st_size)
+			break;
+		if (record.type == JOURNAL_CHECKPOINT && journal_add_checkpoint(j, &record, offset) < 0)
+			break;
+		offset = next;
+	}
+	if (offset < st.st_size && ftruncate(fd, offset) < 0) {
+		close(fd);
+		return -errno;
+	}
+	close(fd);
+
+	j->size = offset;
+	j->fp = fopen(j->path, "a");
+	j->fd = open(j->path, O_RDONLY);
+	if (! j->fp || j->fd < 0)
+		return -errno;
+	return 0;
+}
+
+int journal_init(struct demuxfs_data *priv)
+{
+	struct journal *j;
+	int ret;
+
+	if (! priv->options.journal)
+		return 0;
+
+	j = (struct journal *) calloc(1, sizeof(struct journal));
+	if (! j)
+		return -ENOMEM;
+	j->path = strdup(priv->options.journal);
+	j->fd = -1;
+	j->pcr_pid = TS_NULL_PID;
+	j->store = section_store_new(JOURNAL_MAX_SECTIONS, MEM_JOURNAL);
+	pthread_mutex_init(&j->mutex, NULL);
+	pthread_mutex_init(&j->views_mutex, NULL);
+
+	ret = journal_open(j);
+	if (ret == 0)
+		/* Views of this session start from an empty tree */
+		ret = journal_checkpoint(j, journal_now());
+	if (ret < 0) {
+		TS_WARNING("failed to open journal %s: %s", j->path, strerror(-ret));
+		priv->journal = j;
+		journal_destroy(priv);
+		return ret;
+	}
+
+	j->history = CREATE_DIRECTORY(priv->root, FS_HISTORY_NAME);
+	CREATE_STATS_FILE(j->history, FS_HISTORY_CHECKPOINTS_NAME, journal_generate_checkpoints, j);
+	priv->journal = j;
+	return 0;
+}
+
+void journal_destroy(struct demuxfs_data *priv)
+{
+	struct journal *j = priv->journal;
+	int i;
+
+	if (! j)
+		return;
+	priv->journal = NULL;
+	for (i=0; i<j->num_views; ++i)
+		ts_context_destroy(j->views[i].context);
+	if (j->fp)
+		fclose(j->fp);
+	if (j->fd >= 0)
+		close(j->fd);
+	section_store_destroy(j->store);
+	pthread_mutex_destroy(&j->mutex);
+	pthread_mutex_destroy(&j->views_mutex);
+	free(j->checkpoints);
+	free(j->path);
+	free(j);
+}
@@ -0,0 +1,70 @@
+#ifndef __journal_h
+#define __journal_h
+
+/*
+ * Section journal, enabled with -o journal=NAME. Every new section of a
+ * PSI/SI table is appended to TMPDIR/NAME.journal, stamped with the wall
+ * clock, the last PCR and the last TOT. Checkpoints holding the complete set
+ * of current sections are written every so often and indexed in memory.
+ *
+ * Looking up /History/<ISO-timestamp> replays the journal from the last
+ * checkpoint before that time into a private parsing context whose root is
+ * the /History/<ISO-timestamp> directory, recreating the tree as it was then.
+ * Only a few views are kept at a time; older ones are disposed as new ones
+ * are created, unless they are in use.
+ */
+
+#define FS_HISTORY_NAME              "History"
+#define FS_HISTORY_CHECKPOINTS_NAME  "checkpoints"
+
+/* A checkpoint is written after this many seconds with new records... */
+#define JOURNAL_CHECKPOINT_INTERVAL  600
+/* ...or once there are more new records than sections in the last checkpoint */
+#define JOURNAL_CHECKPOINT_RECORDS   1024
+
+/* Maximum number of sections held by the journal's view of the current state */
+#define JOURNAL_MAX_SECTIONS         65536
+
+/* Maximum number of /History views alive at a time */
+#define JOURNAL_MAX_VIEWS            4
+
+struct journal;
+
+/**
+ * Opens the journal at priv->options.journal, indexes the checkpoints
+ * of previous sessions and creates the /History directory.
+ * @return 0 on success or a negative errno value.
+ */
+int journal_init(struct demuxfs_data *priv);
+
+/**
+ * Appends a CRC-checked section to the journal if it differs from the last
+ * section recorded with the same key.
+ */
+void journal_record(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv);
+
+/**
+ * Remembers the last PCR seen on the stream, which stamps the next records.
+ */
+void journal_record_pcr(uint16_t pid, uint64_t pcr, struct demuxfs_data *priv);
+
+/**
+ * Resolves @path, creating the /History view it refers to if needed. The
+ * view is held until the dentry is handed back to journal_put().
+ * @return the dentry of @path or NULL if it doesn't exist or if every view
+ * is in use and none can make room for a new one.
+ */
+struct dentry *journal_lookup(const char *path, struct demuxfs_data *priv);
+
+/**
+ * Releases the /History view held by journal_lookup() for @dentry. Dentries
+ * outside /History views are ignored.
+ */
+void journal_put(struct dentry *dentry, struct demuxfs_data *priv);
+
+/**
+ * Disposes the /History views and closes the journal.
+ */
+void journal_destroy(struct demuxfs_data *priv);
+
+#endif /* __journal_h */
@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "log.h"
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+
+/* Number of entries in each per-thread ring. Must be a power of two. */
+#define LOG_RING_SIZE     512
+#define LOG_MESSAGE_SIZE  496
+
+/* How long the background thread sleeps when there's nothing to drain */
+#define LOG_DRAIN_INTERVAL_MS 20
+
+struct log_entry {
+	const struct log_site *site;
+	uint32_t suppressed;
+	char message[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * Single-producer, single-consumer ring. The owning thread is the only one
+ * to advance @head and the background thread is the only one to advance
+ * @tail, so no locks are needed to queue or drain messages.
+ */
+struct log_ring {
+	uint32_t head;
+	uint32_t tail;
+	bool orphaned;              /**< The owning thread has exited */
+	struct log_ring *next;
+	struct log_entry entries[LOG_RING_SIZE];
+};
+
+volatile int log_level = LOG_LEVEL_DEBUG;
+
+static uint32_t log_rate_limit = LOG_DEFAULT_RATE_LIMIT;
+static struct log_statistics log_stats;
+
+static __thread struct log_ring *thread_ring;
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_key_once = PTHREAD_ONCE_INIT;
+
+/* List of rings, protected by rings_mutex. Only changes when threads come and go. */
+static struct log_ring *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t drain_thread;
+static bool drain_running;
+static bool drain_stop;
+
+static void log_ring_release(void *data)
+{
+	struct log_ring *ring = (struct log_ring *) data;
+	__atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void log_create_key(void)
+{
+	pthread_key_create(&thread_ring_key, log_ring_release);
+}
+
+static struct log_ring *log_get_thread_ring(void)
+{
+	if (thread_ring)
+		return thread_ring;
+
+	struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+	if (! ring)
+		return NULL;
+	pthread_once(&thread_ring_key_once, log_create_key);
+	pthread_setspecific(thread_ring_key, ring);
+
+	pthread_mutex_lock(&rings_mutex);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_mutex);
+
+	thread_ring = ring;
+	return ring;
+}
+
+/* Longest line written, the message plus its location */
+#define LOG_LINE_SIZE     (LOG_MESSAGE_SIZE + 256)
+
+/**
+ * Formats a message and its location into @buf, cutting it short if needed.
+ * @return the length of the line, which always ends with a newline.
+ */
+static size_t log_format(char *buf, size_t size, const struct log_site *site, const char *message,
+		uint32_t suppressed)
+{
+	int len;
+
+	if (suppressed)
+		len = snprintf(buf, size, "%s" colorGray " [%u similar messages suppressed] (%s:%s:%d)" colorNormal "\n",
+			message, suppressed, site->file, site->function, site->line);
+	else
+		len = snprintf(buf, size, "%s" colorGray " (%s:%s:%d)" colorNormal "\n",
+			message, site->file, site->function, site->line);
+	if (len < 0)
+		len = 0;
+	if ((size_t) len >= size) {
+		len = size - 1;
+		buf[len - 1] = '\n';
+	}
+	return len;
+}
+
+static void log_print(FILE *fp, const struct log_site *site, const char *message, uint32_t suppressed)
+{
+	char line[LOG_LINE_SIZE];
+	size_t len = log_format(line, sizeof(line), site, message, suppressed);
+
+	fwrite(line, 1, len, fp);
+}
+
+/**
+ * Per-site rate limiting. Sites may be shared amongst threads, so the
+ * counters are updated atomically; races on the window boundary only
+ * affect the accuracy of the limit.
+ * @return false if the message must be suppressed.
+ */
+static bool log_rate_limit_check(struct log_site *site, uint32_t *suppressed)
+{
+	struct timespec now;
+	uint32_t second, limit = __atomic_load_n(&log_rate_limit, __ATOMIC_RELAXED);
+
+	*suppressed = 0;
+	if (limit == 0)
+		return true;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	second = (uint32_t) now.tv_sec;
+	if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != second) {
+		__atomic_store_n(&site->window, second, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+		*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > limit) {
+		__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&log_stats.suppressed, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	return true;
+}
+
+void log_write(struct log_site *site, enum log_level level, const char *fmt, ...)
+{
+	struct log_ring *ring;
+	struct log_entry *entry;
+	uint32_t head, tail, suppressed;
+	va_list ap;
+
+	if (! log_rate_limit_check(site, &suppressed))
+		return;
+
+	ring = __atomic_load_n(&drain_running, __ATOMIC_ACQUIRE) ? log_get_thread_ring() : NULL;
+	if (! ring) {
+		char message[LOG_MESSAGE_SIZE];
+		va_start(ap, fmt);
+		vsnprintf(message, sizeof(message), fmt, ap);
+		va_end(ap);
+		log_print(stderr, site, message, suppressed);
+		return;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= LOG_RING_SIZE) {
+		__atomic_add_fetch(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+	entry->site = site;
+	entry->suppressed = suppressed;
+	va_start(ap, fmt);
+	vsnprintf(entry->message, sizeof(entry->message), fmt, ap);
+	va_end(ap);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Messages drained from the rings are batched here and written to stderr
+ * with a single fwrite() per drain. stderr itself is left unbuffered, as
+ * other code still writes to it directly. Only the drain thread uses it.
+ */
+static char drain_buffer[64 * 1024];
+static size_t drain_len;
+
+static void log_drain_flush(void)
+{
+	if (drain_len) {
+		fwrite(drain_buffer, 1, drain_len, stderr);
+		drain_len = 0;
+	}
+}
+
+static void log_drain_append(const struct log_entry *entry)
+{
+	if (sizeof(drain_buffer) - drain_len < LOG_LINE_SIZE)
+		log_drain_flush();
+	drain_len += log_format(&drain_buffer[drain_len], LOG_LINE_SIZE, entry->site,
+			entry->message, entry->suppressed);
+}
+
+/**
+ * Writes all queued messages to stderr and frees the rings of threads
+ * that have exited.
+ * @return number of messages written.
+ */
+static int log_drain(void)
+{
+	struct log_ring *ring, *prev = NULL, *next;
+	int count = 0;
+
+	pthread_mutex_lock(&rings_mutex);
+	for (ring = rings; ring; ring = next) {
+		bool orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = ring->tail;
+
+		next = ring->next;
+		for (; tail != head; ++tail, ++count) {
+			struct log_entry *entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+			log_drain_append(entry);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (orphaned) {
+			if (prev)
+				prev->next = next;
+			else
+				rings = next;
+			free(ring);
+		} else
+			prev = ring;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+
+	log_drain_flush();
+	return count;
+}
+
+static void *log_drain_thread(void *data)
+{
+	struct timespec interval = { 0, LOG_DRAIN_INTERVAL_MS * 1000 * 1000 };
+
+	while (! __atomic_load_n(&drain_stop, __ATOMIC_ACQUIRE))
+		if (log_drain() == 0)
+			nanosleep(&interval, NULL);
+	log_drain();
+	return NULL;
+}
+
+static void log_signal_handler(int signum)
+{
+	if (signum == SIGUSR1 && log_level < LOG_LEVEL_DEBUG)
+		log_level++;
+	else if (signum == SIGUSR2 && log_level > LOG_LEVEL_ERROR)
+		log_level--;
+}
+
+int log_init(void)
+{
+	struct sigaction sa;
+
+	if (drain_running)
+		return 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = log_signal_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	drain_stop = false;
+	if (pthread_create(&drain_thread, NULL, log_drain_thread, NULL) != 0)
+		return -1;
+	__atomic_store_n(&drain_running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_shutdown(void)
+{
+	struct log_statistics stats;
+
+	if (! drain_running)
+		return;
+
+	__atomic_store_n(&drain_running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&drain_stop, true, __ATOMIC_RELEASE);
+	pthread_join(drain_thread, NULL);
+
+	log_get_statistics(&stats);
+	if (stats.suppressed || stats.dropped)
+		fprintf(stderr, "Log statistics: %" PRIu64 " messages suppressed by the rate limiter, "
+				"%" PRIu64 " dropped due to full log rings\n", stats.suppressed, stats.dropped);
+}
+
+void log_set_level(enum log_level level)
+{
+	log_level = level;
+}
+
+void log_set_rate_limit(uint32_t messages_per_second)
+{
+	__atomic_store_n(&log_rate_limit, messages_per_second, __ATOMIC_RELAXED);
+}
+
+void log_get_statistics(struct log_statistics *stats)
+{
+	stats->suppressed = __atomic_load_n(&log_stats.suppressed, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&log_stats.dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+#ifndef __log_h
+#define __log_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum log_level {
+	LOG_LEVEL_ERROR   = 0,
+	LOG_LEVEL_WARNING = 1,
+	LOG_LEVEL_INFO    = 2,
+	LOG_LEVEL_DEBUG   = 3,
+};
+
+/* Default number of messages a single call site may log per second */
+#define LOG_DEFAULT_RATE_LIMIT 20
+
+/**
+ * Each call site has its own rate limiting state, which is allocated
+ * statically by the log_message() macro.
+ */
+struct log_site {
+	const char *file;
+	const char *function;
+	int line;
+	uint32_t window;        /**< Second in which the messages below were counted */
+	uint32_t count;         /**< Messages logged during the current window */
+	uint32_t suppressed;    /**< Messages suppressed and not yet reported */
+};
+
+struct log_statistics {
+	uint64_t suppressed;    /**< Messages discarded by the rate limiter */
+	uint64_t dropped;       /**< Messages discarded because a log ring was full */
+};
+
+/* Current verbosity. Adjustable at runtime with SIGUSR1 (more) and SIGUSR2 (less). */
+extern volatile int log_level;
+
+#define log_message(level, x...) do { \
+		static struct log_site __log_site = { __FILE__, __FUNCTION__, __LINE__, 0, 0, 0 }; \
+		if ((level) <= log_level) \
+			log_write(&__log_site, level, x); \
+	} while(0)
+
+/**
+ * Queues a message in the calling thread's log ring. Messages are written
+ * synchronously to stderr if the background thread isn't running.
+ */
+void log_write(struct log_site *site, enum log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/**
+ * Starts the background thread that drains the log rings to stderr.
+ */
+int log_init(void);
+
+/**
+ * Drains all pending messages and stops the background thread. Subsequent
+ * messages are written synchronously.
+ */
+void log_shutdown(void);
+
+void log_set_level(enum log_level level);
+void log_set_rate_limit(uint32_t messages_per_second);
+void log_get_statistics(struct log_statistics *stats);
+
+#endif /* __log_h */
@@ -35,42 +35,119 @@
 #include "ts.h"
 #include "backend.h"
 #include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
+#include "mem.h"
+#include "warmstart.h"
+#include "journal.h"
+#include "scan.h"
+#include "dispatch.h"
+#include "dsm-cc/carousel.h"
+#include "dsm-cc/stream_event.h"
+#include "dsm-cc/mpe.h"
+#include "tables/pes.h"
 #include "tables/descriptors/descriptors.h"
 #include "dsm-cc/descriptors/descriptors.h"
 
 /* Defined in demuxfs.c */
 extern struct fuse_operations demuxfs_ops;
 
+/* Number of packets covered by each "packet_batch" trace event */
+#define TRACE_BATCH_PACKETS 1024
+
 /* Globals */
 static bool main_thread_stopped;
 
 /**
- * ts_parser_thread: consumes transport stream packets from the input and processes them.
- * @userdata: private data
+ * ts_parser_feed: reads packets from the input and parses them into @target,
+ * which is either @priv or the parsing context of a multiplex being scanned.
+ * @return the number of packets read or a negative errno value.
  */
-void * ts_parser_thread(void *userdata)
+static int ts_parser_feed(struct demuxfs_data *priv, struct demuxfs_data *target)
 {
-	struct demuxfs_data *priv = (struct demuxfs_data *) userdata;
 	struct ts_header header;
 	void *payload = NULL;
 	int ret;
-    
-	while (priv->backend->keep_alive(priv) && !main_thread_stopped) {
-		ret = priv->backend->read(priv);
+
+	if (priv->backend->read_batch) {
+		const uint8_t *packets;
+		ret = priv->backend->read_batch(priv, &packets, TS_BATCH_PACKETS);
 		if (ret < 0) {
 			if (ret != -ENODATA)
 				dprintf("read error");
-			break;
+			return ret;
 		}
-		ret = priv->backend->process(&header, &payload, priv);
-		if (ret < 0)
-			continue;
-		ret = ts_parse_packet(&header, payload, priv);
+		if (priv->latency)
+			priv->latency->packet_ingest_ns = stats_now();
+		int num_packets = ret;
+		ret = ts_parse_batch(packets, num_packets, target);
 		if (ret < 0 && ret != -ENOBUFS) {
 			dprintf("Error processing packet: %s", strerror(-ret));
+			return ret;
+		}
+		return num_packets;
+	}
+
+	ret = priv->backend->read(priv);
+	if (ret < 0) {
+		if (ret != -ENODATA)
+			dprintf("read error");
+		return ret;
+	}
+	ret = priv->backend->process(&header, &payload, priv);
+	if (ret < 0)
+		return 0;
+	ret = ts_parse_packet(&header, payload, target);
+	if (ret < 0 && ret != -ENOBUFS) {
+		dprintf("Error processing packet: %s", strerror(-ret));
+		return ret;
+	}
+	return 1;
+}
+
+/**
+ * ts_parser_thread: consumes transport stream packets from the input and processes them.
+ * @userdata: private data
+ */
+void * ts_parser_thread(void *userdata)
+{
+	struct demuxfs_data *priv = (struct demuxfs_data *) userdata;
+	struct demuxfs_data *target = priv;
+	uint64_t batch_start, next_filter_update = 0;
+	int ret, batch_packets = 0;
+
+	trace_set_thread_name("ts_parser");
+	batch_start = trace_begin();
+	if (priv->scan)
+		target = scan_next(priv);
+	while (target && !main_thread_stopped) {
+		if (! priv->backend->keep_alive(priv))
+			ret = -ENODATA;
+		else {
+			if (priv->backend->set_pid_filter && stats_now() >= next_filter_update) {
+				/* PES PIDs are only delivered while somebody reads from their FIFOs */
+				pes_update_filters(priv);
+				next_filter_update = stats_now() + PES_FILTER_UPDATE_INTERVAL * 1000000000ULL;
+			}
+			ret = ts_parser_feed(priv, target);
+		}
+		if (priv->scan) {
+			/* Move on to the next source once the tables are complete or the input ends */
+			if (ret < 0 || scan_multiplex_done(priv))
+				target = scan_next(priv);
+		} else if (ret < 0)
 			break;
+		if (ret <= 0)
+			continue;
+
+		batch_packets += ret;
+		if (batch_packets >= TRACE_BATCH_PACKETS) {
+			trace_end("backend", "packet_batch", batch_start, "packets", batch_packets);
+			batch_start = trace_begin();
+			batch_packets = 0;
 		}
 	}
+	trace_end("backend", "packet_batch", batch_start, "packets", batch_packets);
 	pthread_exit(NULL);
 }
 
@@ -97,6 +174,17 @@ void demuxfs_destroy(void *data)
 
 	main_thread_stopped = true;
 	pthread_join(priv->ts_parser_id, NULL);
+	dispatch_destroy(priv);
+
+	if (priv->stats.continuity_errors || priv->stats.crc_errors || priv->stats.transport_lost ||
+		priv->stats.transport_reordered || priv->stats.transport_duplicates)
+		fprintf(stderr, "Stream statistics: %" PRIu64 " continuity errors, %" PRIu64 " CRC errors, "
+				"%" PRIu64 " lost, %" PRIu64 " reordered and %" PRIu64 " duplicate datagrams\n",
+				priv->stats.continuity_errors, priv->stats.crc_errors, priv->stats.transport_lost,
+				priv->stats.transport_reordered, priv->stats.transport_duplicates);
+	if (priv->stats.transport_max_interarrival_ns)
+		fprintf(stderr, "Largest datagram inter-arrival time: %" PRIu64 " us\n",
+				priv->stats.transport_max_interarrival_ns / 1000);
 
 	descriptors_destroy(priv->ts_descriptors);
 	dsmcc_descriptors_destroy(priv->dsmcc_descriptors);
@@ -105,7 +193,17 @@ void demuxfs_destroy(void *data)
 	hashtable_destroy(priv->pes_tables, NULL);
 	hashtable_destroy(priv->psi_tables, (hashtable_free_function_t) free);
 	hashtable_destroy(priv->packet_buffer, (hashtable_free_function_t) buffer_destroy);
+	journal_destroy(priv);
+	scan_destroy(priv);
+	carousel_destroy(priv);
+	stream_event_destroy(priv);
+	mpe_destroy(priv);
+	free(priv->pid_requests);
 	fsutils_dispose_tree(priv->root);
+	warmstart_destroy(priv);
+	stats_latency_destroy(priv->latency);
+	trace_shutdown();
+	log_shutdown();
 }
 
 /**
@@ -119,6 +217,7 @@ void * demuxfs_init(struct fuse_conn_info *conn)
 	avcodec_register_all();
 #endif
 	priv->psi_tables = hashtable_new(DEMUXFS_MAX_PIDS);
+	hashtable_set_accounting(priv->psi_tables, MEM_TABLES);
 	priv->pes_tables = hashtable_new(DEMUXFS_MAX_PIDS);
 	priv->psi_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
 	priv->pes_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
@@ -126,6 +225,20 @@ void * demuxfs_init(struct fuse_conn_info *conn)
 	priv->ts_descriptors = descriptors_init(priv);
 	priv->dsmcc_descriptors = dsmcc_descriptors_init(priv);
 	priv->root = create_rootfs("/", priv);
+	priv->latency = stats_latency_new();
+	stats_create_dentries(priv);
+	if (priv->options.ondemand_carousels)
+		carousel_init(priv);
+	stream_event_init(priv);
+	mpe_init(priv);
+	/* Populates the tree from the previous session before the first packet is parsed */
+	warmstart_init(priv);
+	journal_init(priv);
+	scan_init(priv);
+	dispatch_init(priv);
+	/* Started here rather than in main() so that it survives FUSE's daemonization */
+	log_init();
+	trace_start();
 	pthread_create(&priv->ts_parser_id, NULL, ts_parser_thread, priv);
 
 	return priv;
@@ -144,6 +257,16 @@ static struct fuse_opt demuxfs_options[] = {
 	DEMUXFS_OPT("standard=%s",  opt_standard, 0),
 	DEMUXFS_OPT("tmpdir=%s",    opt_tmpdir, 0),
 	DEMUXFS_OPT("report=%s",    opt_report, 0),
+	DEMUXFS_OPT("loglevel=%s",  opt_loglevel, 0),
+	DEMUXFS_OPT("lograte=%d",   opt_lograte, 0),
+	DEMUXFS_OPT("trace=%s",     opt_trace, 0),
+	DEMUXFS_OPT("warmstart=%s", opt_warmstart, 0),
+	DEMUXFS_OPT("warmstart_carousels=%d", opt_warmstart_carousels, 0),
+	DEMUXFS_OPT("ondemand_carousels=%d", opt_ondemand_carousels, 0),
+	DEMUXFS_OPT("journal=%s",   opt_journal, 0),
+	DEMUXFS_OPT("scan=%s",      opt_scan, 0),
+	DEMUXFS_OPT("scan_timeout=%d", opt_scan_timeout, 0),
+	DEMUXFS_OPT("parse_threads=%d", opt_parse_threads, 0),
 	FUSE_OPT_KEY("-h",          KEY_HELP),
 	FUSE_OPT_KEY("--help",      KEY_HELP),
 	FUSE_OPT_END
@@ -156,8 +279,25 @@ static void demuxfs_usage(struct demuxfs_data *priv)
 			"    -o parse_pes=1|0       parse PES packets (default: 0)\n"
 			"    -o standard=TYPE       transmission type: SBTVD, ISDB, DVB or ATSC (default: SBTVD)\n"
 			"    -o tmpdir=DIR          temporary directory in which to store DSM-CC files (default: %s)\n"
-			"    -o report=MASK         colon-separated list of errors to report: NONE,CRC,CONTINUITY or ALL (default: NONE)\n",
-			FS_DEFAULT_TMPDIR);
+			"    -o report=MASK         colon-separated list of errors to report: NONE,CRC,CONTINUITY or ALL (default: NONE)\n"
+			"    -o loglevel=LEVEL      log verbosity: ERROR, WARNING, INFO or DEBUG (default: DEBUG)\n"
+			"                           SIGUSR1 and SIGUSR2 raise and lower the verbosity at runtime\n"
+			"    -o lograte=COUNT       maximum messages per second logged by each call site, 0 means unlimited (default: %d)\n"
+			"    -o trace=FILE          write a timeline of the demux pipeline to FILE, in Perfetto format if FILE\n"
+			"                           ends in .pftrace or in Chrome JSON format otherwise\n"
+			"    -o warmstart=NAME      keep a snapshot of the PSI/SI tables in TMPDIR/NAME.warmstart and use it to\n"
+			"                           populate the tree on the next mount\n"
+			"    -o warmstart_carousels=1|0  include the DSM-CC carousel modules in the snapshot (default: 0)\n"
+			"    -o ondemand_carousels=1|0  only receive the DSM-CC carousel modules that hold the objects looked up\n"
+			"                           under /DSM-CC, instead of keeping every block under /DDB (default: 0)\n"
+			"    -o journal=NAME        journal new table sections to TMPDIR/NAME.journal and show the tree as it\n"
+			"                           was at any past time under /History/<YYYY-MM-DDTHH:MM:SSZ>\n"
+			"    -o scan=LIST           scan the comma-separated frequencies (or files, with filesrc) in LIST and\n"
+			"                           list the services found under /Scan\n"
+			"    -o scan_timeout=SECS   time to wait for the tables of each multiplex (default: %d)\n"
+			"    -o parse_threads=N     parse the EIT, SDT, NIT and AIT on N threads instead of the packet thread\n"
+			"                           (default: 0)\n",
+			FS_DEFAULT_TMPDIR, LOG_DEFAULT_RATE_LIMIT, SCAN_DEFAULT_TIMEOUT);
 	backend_print_usage();
 }
 
@@ -180,6 +320,23 @@ static int demuxfs_parse_options(void *priv, const char *arg, int key, struct fu
 	return 1;
 }
 
+/**
+ * Builds the path of the file TMPDIR/@name.@option for options that take a
+ * file name relative to tmpdir.
+ */
+static char *demuxfs_tmpdir_path(const char *option, const char *name, struct demuxfs_data *priv)
+{
+	char *path = NULL;
+
+	if (! *name || strchr(name, '/')) {
+		fprintf(stderr, "Invalid value '%s' for '-o %s'\n", name, option);
+		return NULL;
+	}
+	if (asprintf(&path, "%s/%s.%s", priv->options.tmpdir, name, option) < 0)
+		return NULL;
+	return path;
+}
+
 int main(int argc, char **argv)
 {
 	struct demuxfs_data *priv = (struct demuxfs_data *) calloc(1, sizeof(struct demuxfs_data));
@@ -187,6 +344,7 @@ int main(int argc, char **argv)
 
 	/* Parse command line options */
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	priv->opt_lograte = LOG_DEFAULT_RATE_LIMIT;
 	int ret = fuse_opt_parse(&args, priv, demuxfs_options, demuxfs_parse_options);
 	if (ret < 0)
 		goto out_free;
@@ -243,8 +401,66 @@ int main(int argc, char **argv)
 		free(opt_copy);
 	}
 
+	if (priv->opt_loglevel) {
+		if (! strcasecmp(priv->opt_loglevel, "ERROR"))
+			log_set_level(LOG_LEVEL_ERROR);
+		else if (! strcasecmp(priv->opt_loglevel, "WARNING"))
+			log_set_level(LOG_LEVEL_WARNING);
+		else if (! strcasecmp(priv->opt_loglevel, "INFO"))
+			log_set_level(LOG_LEVEL_INFO);
+		else if (! strcasecmp(priv->opt_loglevel, "DEBUG"))
+			log_set_level(LOG_LEVEL_DEBUG);
+		else {
+			fprintf(stderr, "Invalid value '%s' for '-o loglevel'\n", priv->opt_loglevel);
+			ret = 1;
+			goto out_free;
+		}
+	}
+	log_set_rate_limit(priv->opt_lograte > 0 ? priv->opt_lograte : 0);
+
+	/* The trace file is opened before FUSE changes the working directory */
+	if (priv->opt_trace && trace_open(priv->opt_trace) < 0) {
+		ret = 1;
+		goto out_free;
+	}
+
 	priv->options.tmpdir = strdup(priv->opt_tmpdir ? priv->opt_tmpdir : FS_DEFAULT_TMPDIR);
 	priv->options.parse_pes = priv->opt_parse_pes;
+	priv->options.ondemand_carousels = priv->opt_ondemand_carousels;
+	priv->options.parse_threads = priv->opt_parse_threads > 0 ? priv->opt_parse_threads : 0;
+	if (priv->opt_warmstart) {
+		priv->options.warmstart = demuxfs_tmpdir_path("warmstart", priv->opt_warmstart, priv);
+		if (! priv->options.warmstart) {
+			ret = 1;
+			goto out_free;
+		}
+		priv->options.warmstart_carousels = priv->opt_warmstart_carousels;
+	}
+	if (priv->opt_journal) {
+		priv->options.journal = demuxfs_tmpdir_path("journal", priv->opt_journal, priv);
+		if (! priv->options.journal) {
+			ret = 1;
+			goto out_free;
+		}
+	}
+
+	if (priv->opt_scan) {
+		/* Files are resolved now, as FUSE changes the working directory */
+		char *list = strdup(priv->opt_scan), *saveptr = NULL;
+		for (char *source = strtok_r(list, ",", &saveptr); source; source = strtok_r(NULL, ",", &saveptr)) {
+			char *path = access(source, F_OK) == 0 ? realpath(source, NULL) : NULL;
+			priv->options.scan_sources = realloc(priv->options.scan_sources,
+					(priv->options.num_scan_sources + 1) * sizeof(char *));
+			priv->options.scan_sources[priv->options.num_scan_sources++] = path ? path : strdup(source);
+		}
+		free(list);
+		if (! priv->options.num_scan_sources) {
+			fprintf(stderr, "Invalid value '%s' for '-o scan'\n", priv->opt_scan);
+			ret = 1;
+			goto out_free;
+		}
+		priv->options.scan_timeout = priv->opt_scan_timeout > 0 ? priv->opt_scan_timeout : SCAN_DEFAULT_TIMEOUT;
+	}
 
 	/* Load the chosen backend */
 	void *backend_handle = NULL;
@@ -260,7 +476,8 @@ int main(int argc, char **argv)
 	if (ret < 0)
 		goto out_unload;
 
-	if (priv->options.frequency) {
+	/* The scan mode tunes to each of its sources in turn */
+	if (priv->options.frequency && ! priv->options.scan_sources) {
 		ret = priv->backend->set_frequency(priv->options.frequency, priv);
 		if (ret < 0) {
 			fprintf(stderr, "Failed to set frequency: %s\n", strerror(-ret));
@@ -288,6 +505,13 @@ out_free:
 			free(priv->mount_point);
 		if (priv->options.tmpdir)
 			free(priv->options.tmpdir);
+		if (priv->options.warmstart)
+			free(priv->options.warmstart);
+		if (priv->options.journal)
+			free(priv->options.journal);
+		for (int i=0; i<priv->options.num_scan_sources; ++i)
+			free(priv->options.scan_sources[i]);
+		free(priv->options.scan_sources);
 		free(priv);
 	}
 
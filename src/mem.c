@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "mem.h"
+#include <malloc.h>
+
+static struct mem_usage mem_counters[MEM_SUBSYSTEMS];
+
+static const char *mem_subsystem_names[MEM_SUBSYSTEMS] = {
+	[MEM_TABLES]    = "tables",
+	[MEM_BUFFERS]   = "buffers",
+	[MEM_FIFOS]     = "fifos",
+	[MEM_STATS]     = "stats",
+	[MEM_WARMSTART] = "warmstart",
+	[MEM_JOURNAL]   = "journal",
+	[MEM_CAROUSELS] = "carousels",
+	[MEM_CAPTURES]  = "captures",
+};
+
+void mem_account_alloc(enum mem_subsystem subsystem, const void *ptr)
+{
+	if (! ptr || subsystem < 0 || subsystem >= MEM_SUBSYSTEMS)
+		return;
+	__atomic_add_fetch(&mem_counters[subsystem].bytes, malloc_usable_size((void *) ptr), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&mem_counters[subsystem].objects, 1, __ATOMIC_RELAXED);
+}
+
+void mem_account_free(enum mem_subsystem subsystem, const void *ptr)
+{
+	if (! ptr || subsystem < 0 || subsystem >= MEM_SUBSYSTEMS)
+		return;
+	__atomic_sub_fetch(&mem_counters[subsystem].bytes, malloc_usable_size((void *) ptr), __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&mem_counters[subsystem].objects, 1, __ATOMIC_RELAXED);
+}
+
+void *mem_malloc(enum mem_subsystem subsystem, size_t size)
+{
+	void *ptr = malloc(size);
+	mem_account_alloc(subsystem, ptr);
+	return ptr;
+}
+
+void *mem_calloc(enum mem_subsystem subsystem, size_t nmemb, size_t size)
+{
+	void *ptr = calloc(nmemb, size);
+	mem_account_alloc(subsystem, ptr);
+	return ptr;
+}
+
+void *mem_realloc(enum mem_subsystem subsystem, void *ptr, size_t size)
+{
+	size_t old_size = ptr ? malloc_usable_size(ptr) : 0;
+	void *new_ptr = realloc(ptr, size);
+
+	if (new_ptr && subsystem >= 0 && subsystem < MEM_SUBSYSTEMS) {
+		__atomic_add_fetch(&mem_counters[subsystem].bytes,
+			(int64_t) malloc_usable_size(new_ptr) - (int64_t) old_size, __ATOMIC_RELAXED);
+		if (! ptr)
+			__atomic_add_fetch(&mem_counters[subsystem].objects, 1, __ATOMIC_RELAXED);
+	}
+	return new_ptr;
+}
+
+void mem_free(enum mem_subsystem subsystem, void *ptr)
+{
+	mem_account_free(subsystem, ptr);
+	free(ptr);
+}
+
+void mem_get_usage(enum mem_subsystem subsystem, struct mem_usage *usage)
+{
+	usage->bytes = __atomic_load_n(&mem_counters[subsystem].bytes, __ATOMIC_RELAXED);
+	usage->objects = __atomic_load_n(&mem_counters[subsystem].objects, __ATOMIC_RELAXED);
+}
+
+const char *mem_subsystem_name(enum mem_subsystem subsystem)
+{
+	return mem_subsystem_names[subsystem];
+}
+
+static size_t mem_dentry_size(struct dentry *dentry)
+{
+	struct xattr *xattr;
+	size_t size = malloc_usable_size(dentry);
+
+	if (dentry->name)
+		size += malloc_usable_size(dentry->name);
+	if (dentry->contents)
+		size += malloc_usable_size(dentry->contents);
+	if (dentry->priv)
+		size += malloc_usable_size(dentry->priv);
+	list_for_each_entry(xattr, &dentry->xattrs, list)
+		size += malloc_usable_size(xattr) + malloc_usable_size(xattr->name) + malloc_usable_size(xattr->value);
+	return size;
+}
+
+void mem_tree_usage(struct dentry *dentry, struct mem_usage *usage)
+{
+	struct dentry *child;
+
+	usage->bytes += mem_dentry_size(dentry);
+	usage->objects++;
+	list_for_each_entry(child, &dentry->children, list)
+		mem_tree_usage(child, usage);
+}
+
+void mem_get_total_usage(struct demuxfs_data *priv, struct mem_usage *total, struct mem_usage *tree)
+{
+	int i;
+
+	memset(tree, 0, sizeof(*tree));
+	mem_tree_usage(priv->root, tree);
+	*total = *tree;
+	for (i=0; i<MEM_SUBSYSTEMS; ++i) {
+		struct mem_usage usage;
+		mem_get_usage(i, &usage);
+		total->bytes += usage.bytes;
+		total->objects += usage.objects;
+	}
+}
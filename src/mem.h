@@ -0,0 +1,50 @@
+#ifndef __mem_h
+#define __mem_h
+
+/*
+ * Memory accounting. Objects owned by the subsystems below are tagged when
+ * they're allocated and released. The filesystem tree is not tagged, as
+ * dentry contents are replaced from too many places; its usage is measured
+ * by walking the tree instead (see mem_tree_usage()).
+ */
+enum mem_subsystem {
+	MEM_TABLES,     /* PSI/SI and DSM-CC table structures held by the PSI tables hash */
+	MEM_BUFFERS,    /* Section and PES reassembly buffers */
+	MEM_FIFOS,      /* FIFO handles */
+	MEM_STATS,      /* Latency histograms */
+	MEM_WARMSTART,  /* Sections kept for the warm start snapshot */
+	MEM_JOURNAL,    /* Sections kept for the journal checkpoints and /History views */
+	MEM_CAROUSELS,  /* Object index and module blocks of the on-demand carousels */
+	MEM_CAPTURES,   /* Record rings and datagram reassembly of the MPE captures */
+	MEM_SUBSYSTEMS,
+	MEM_NONE = -1,
+};
+
+struct mem_usage {
+	int64_t bytes;
+	int64_t objects;
+};
+
+void mem_account_alloc(enum mem_subsystem subsystem, const void *ptr);
+void mem_account_free(enum mem_subsystem subsystem, const void *ptr);
+
+void *mem_malloc(enum mem_subsystem subsystem, size_t size);
+void *mem_calloc(enum mem_subsystem subsystem, size_t nmemb, size_t size);
+void *mem_realloc(enum mem_subsystem subsystem, void *ptr, size_t size);
+void mem_free(enum mem_subsystem subsystem, void *ptr);
+
+void mem_get_usage(enum mem_subsystem subsystem, struct mem_usage *usage);
+const char *mem_subsystem_name(enum mem_subsystem subsystem);
+
+/**
+ * Adds the memory used by @dentry and all of its descendants to @usage.
+ * Objects are counted in dentries.
+ */
+void mem_tree_usage(struct dentry *dentry, struct mem_usage *usage);
+
+/**
+ * Total memory accounted for, including the filesystem tree.
+ */
+void mem_get_total_usage(struct demuxfs_data *priv, struct mem_usage *total, struct mem_usage *tree);
+
+#endif /* __mem_h */
@@ -1,6 +1,8 @@
 #ifndef __priv_h
 #define __priv_h
 
+struct demuxfs_data;
+
 struct fifo_priv {
 	struct fifo *fifo;
 };
@@ -18,4 +20,15 @@ struct snapshot_priv {
 	struct snapshot_context *snapshot_ctx;
 };
 
+struct stats_priv {
+	/* Generates the file contents when the file is opened. Returns a malloc'ed string. */
+	char *(*generate)(void *data, struct demuxfs_data *priv);
+	void *data;
+};
+
+struct capture_priv {
+	/* Owned by the subsystem that feeds the capture */
+	struct mpe_capture *capture;
+};
+
 #endif /* __priv_h */
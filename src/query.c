@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "stats.h"
+#include "query.h"
+#include <fnmatch.h>
+
+struct query_context {
+	struct demuxfs_query *query;
+	struct demuxfs_data *priv;
+	const char *pattern;
+	int fnmatch_flags;
+	/* Matches or paths to skip before the first entry */
+	uint32_t skip;
+	/* Matches or paths consumed so far, including the skipped ones */
+	uint32_t index;
+	size_t used;
+};
+
+static uint8_t query_type(struct dentry *dentry)
+{
+	if (S_ISLNK(dentry->mode))
+		return DEMUXFS_QUERY_SYMLINK;
+	else if (S_ISDIR(dentry->mode))
+		return DEMUXFS_QUERY_DIRECTORY;
+	else if ((dentry->obj_type & OBJ_TYPE_FIFO) || S_ISFIFO(dentry->mode))
+		return DEMUXFS_QUERY_FIFO;
+	return DEMUXFS_QUERY_FILE;
+}
+
+/**
+ * Appends an entry for @dentry, or a DEMUXFS_QUERY_MISSING one if it's NULL.
+ * A value that doesn't fit is only truncated when the reply is empty, so that
+ * the caller gets it whole on the next call otherwise.
+ * @return false if the entry didn't fit.
+ */
+static bool query_add_entry(struct query_context *ctx, const char *name, size_t name_length,
+		struct dentry *dentry)
+{
+	struct demuxfs_query *query = ctx->query;
+	struct demuxfs_query_entry entry;
+	size_t avail = sizeof(query->data) - ctx->used;
+	char *out = &query->data[ctx->used];
+	bool has_value;
+	size_t size;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.type = dentry ? query_type(dentry) : DEMUXFS_QUERY_MISSING;
+	entry.name_length = name_length;
+	if (sizeof(entry) + name_length > avail)
+		return false;
+
+	has_value = entry.type == DEMUXFS_QUERY_SYMLINK ||
+		(entry.type == DEMUXFS_QUERY_FILE && ! DEMUXFS_IS_SNAPSHOT(dentry));
+	if (has_value && DEMUXFS_IS_STATS(dentry))
+		stats_update_file(dentry, ctx->priv);
+
+	if (has_value)
+		pthread_mutex_lock(&dentry->mutex);
+	if (entry.type == DEMUXFS_QUERY_SYMLINK)
+		entry.value_length = dentry->contents ? strlen(dentry->contents) : 0;
+	else if (has_value && dentry->contents && dentry->size != 0xffffff)
+		entry.value_length = dentry->size;
+	if (DEMUXFS_QUERY_ENTRY_SIZE(&entry) > avail) {
+		if (query->count) {
+			if (has_value)
+				pthread_mutex_unlock(&dentry->mutex);
+			return false;
+		}
+		entry.value_length = avail - sizeof(entry) - name_length;
+		entry.flags |= DEMUXFS_QUERY_TRUNCATED;
+	}
+	size = DEMUXFS_QUERY_ENTRY_SIZE(&entry);
+	memcpy(out, &entry, sizeof(entry));
+	memcpy(out + sizeof(entry), name, name_length);
+	if (entry.value_length)
+		memcpy(out + sizeof(entry) + name_length, dentry->contents, entry.value_length);
+	if (has_value)
+		pthread_mutex_unlock(&dentry->mutex);
+	memset(out + sizeof(entry) + name_length + entry.value_length, 0,
+		size - sizeof(entry) - name_length - entry.value_length);
+
+	ctx->used += size;
+	query->count++;
+	return true;
+}
+
+/**
+ * Visits the descendants of @dir in depth-first order. Symlinks are not
+ * followed.
+ * @return false if the reply buffer is full.
+ */
+static bool query_walk(struct query_context *ctx, struct dentry *dir, char *path, size_t path_length)
+{
+	struct dentry *child;
+
+	list_for_each_entry(child, &dir->children, list) {
+		size_t name_length = strlen(child->name);
+		size_t length = path_length + (path_length ? 1 : 0) + name_length;
+
+		if (length >= PATH_MAX)
+			continue;
+		if (path_length)
+			path[path_length] = '/';
+		memcpy(&path[length - name_length], child->name, name_length + 1);
+
+		if (fnmatch(ctx->pattern, path, ctx->fnmatch_flags) == 0) {
+			if (ctx->index >= ctx->skip && ! query_add_entry(ctx, path, length, child))
+				return false;
+			ctx->index++;
+		}
+		if (S_ISDIR(child->mode) && ! query_walk(ctx, child, path, length))
+			return false;
+		path[path_length] = '\0';
+	}
+	return true;
+}
+
+static bool query_paths(struct query_context *ctx, struct dentry *dir, const char *paths, size_t length)
+{
+	char path[PATH_MAX+1];
+	const char *name, *end;
+
+	for (name=paths; name < paths + length; name=end+1) {
+		size_t name_length;
+
+		end = memchr(name, '\0', paths + length - name);
+		if (! end)
+			end = paths + length;
+		name_length = end - name;
+		if (ctx->index++ < ctx->skip)
+			continue;
+
+		if (name_length >= PATH_MAX) {
+			if (! query_add_entry(ctx, name, 0, NULL))
+				goto full;
+			continue;
+		}
+		/* fsutils_get_dentry() resolves absolute paths */
+		path[0] = '/';
+		memcpy(&path[1], name, name_length);
+		path[name_length+1] = '\0';
+		if (! query_add_entry(ctx, name, name_length, name_length ? fsutils_get_dentry(dir, path) : dir))
+			goto full;
+	}
+	return true;
+full:
+	ctx->index--;
+	return false;
+}
+
+int query_execute(struct dentry *dir, struct demuxfs_query *query, struct demuxfs_data *priv)
+{
+	struct query_context ctx;
+	char *request;
+	bool complete;
+
+	if (query->length > sizeof(query->data))
+		return -EINVAL;
+	if (! (query->flags & DEMUXFS_QUERY_GLOB) == ! (query->flags & DEMUXFS_QUERY_PATHS))
+		return -EINVAL;
+
+	/* The reply overwrites the request */
+	request = malloc(query->length + 1);
+	if (! request)
+		return -ENOMEM;
+	memcpy(request, query->data, query->length);
+	request[query->length] = '\0';
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.query = query;
+	ctx.priv = priv;
+	ctx.skip = query->offset;
+	query->count = 0;
+
+	if (query->flags & DEMUXFS_QUERY_GLOB) {
+		char path[PATH_MAX];
+		path[0] = '\0';
+		ctx.pattern = request;
+		ctx.fnmatch_flags = (query->flags & DEMUXFS_QUERY_PATHNAME) ? FNM_PATHNAME : 0;
+		complete = query_walk(&ctx, dir, path, 0);
+	} else
+		complete = query_paths(&ctx, dir, request, query->length);
+
+	free(request);
+	query->offset = ctx.index;
+	query->length = ctx.used;
+	if (complete)
+		query->flags &= ~DEMUXFS_QUERY_MORE;
+	else
+		query->flags |= DEMUXFS_QUERY_MORE;
+	return 0;
+}
@@ -0,0 +1,72 @@
+#ifndef __query_h
+#define __query_h
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * Bulk query interface. DEMUXFS_IOC_QUERY, issued on an open directory,
+ * returns the type and contents of many of its descendants in one call:
+ * either all that match a glob pattern or the ones named in a list of
+ * relative paths. When the reply buffer fills up, the remaining entries are
+ * returned by calling again with the offset set by the previous call.
+ *
+ * This header is self-contained so that clients can include it.
+ */
+
+#define DEMUXFS_QUERY_DATA_SIZE 16000
+
+/* Request flags */
+#define DEMUXFS_QUERY_GLOB      0x01  /* data holds a fnmatch(3) pattern matched against relative paths */
+#define DEMUXFS_QUERY_PATHS     0x02  /* data holds a list of NUL-terminated relative paths */
+#define DEMUXFS_QUERY_PATHNAME  0x04  /* wildcards don't match '/' in glob patterns */
+
+/* Reply flags */
+#define DEMUXFS_QUERY_MORE      0x100 /* not all entries fit; call again with the returned offset */
+
+struct demuxfs_query {
+	uint32_t flags;
+	uint32_t offset;    /**< in: matches or paths to skip; out: offset for the next call */
+	uint32_t count;     /**< out: number of entries in data */
+	uint32_t length;    /**< in: bytes of pattern or paths in data; out: bytes of entries in data */
+	char data[DEMUXFS_QUERY_DATA_SIZE];
+};
+
+enum demuxfs_query_type {
+	DEMUXFS_QUERY_MISSING,
+	DEMUXFS_QUERY_DIRECTORY,
+	DEMUXFS_QUERY_FILE,
+	DEMUXFS_QUERY_SYMLINK,
+	DEMUXFS_QUERY_FIFO,
+};
+
+/* Entry flags */
+#define DEMUXFS_QUERY_TRUNCATED 0x01  /* the value didn't fit in an empty reply buffer */
+
+/**
+ * Reply entry. Each entry is followed by its relative path and its value (the
+ * contents of a file or the target of a symlink), neither NUL-terminated, and
+ * padded to a multiple of 4 bytes.
+ */
+struct demuxfs_query_entry {
+	uint16_t name_length;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t value_length;
+};
+
+#define DEMUXFS_QUERY_ENTRY_SIZE(entry) \
+	((sizeof(struct demuxfs_query_entry) + (entry)->name_length + (entry)->value_length + 3) & ~3U)
+
+#define DEMUXFS_IOC_QUERY _IOWR('D', 0x01, struct demuxfs_query)
+
+struct dentry;
+struct demuxfs_data;
+
+/**
+ * Runs @query on the descendants of @dir, replacing its data with the reply.
+ * @return 0 on success or a negative errno value.
+ */
+int query_execute(struct dentry *dir, struct demuxfs_query *query, struct demuxfs_data *priv);
+
+#endif /* __query_h */
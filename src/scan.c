@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "xattr.h"
+#include "byteops.h"
+#include "backend.h"
+#include "mem.h"
+#include "ts.h"
+#include "stats.h"
+#include "scan.h"
+#include <libgen.h>
+
+enum scan_status {
+	SCAN_PENDING,
+	SCAN_RUNNING,
+	SCAN_COMPLETE,
+	SCAN_TIMEOUT,
+	SCAN_INCOMPLETE,    /**< The input ended before the tables were complete */
+	SCAN_TUNE_FAILED,
+};
+
+static const char *scan_status_names[] = {
+	[SCAN_PENDING]     = "pending",
+	[SCAN_RUNNING]     = "scanning",
+	[SCAN_COMPLETE]    = "complete",
+	[SCAN_TIMEOUT]     = "timeout",
+	[SCAN_INCOMPLETE]  = "incomplete",
+	[SCAN_TUNE_FAILED] = "tune-failed",
+};
+
+/* Sections received so far of a sub-table */
+struct scan_table {
+	uint16_t pid;
+	uint8_t table_id;
+	uint16_t extension;
+	uint8_t version_number;
+	uint8_t last_section_number;
+	uint8_t sections[32];   /**< Bitmap of the section numbers received */
+	bool complete;
+};
+
+struct scan_program {
+	uint16_t program_number;
+	uint16_t pid;
+};
+
+struct scan_channel {
+	uint16_t service_id;
+	uint8_t service_type;
+	char provider[256];
+	char name[256];
+};
+
+struct scan_multiplex {
+	char *source;
+	struct demuxfs_data *context;
+	enum scan_status status;
+	uint16_t transport_stream_id;
+	uint16_t original_network_id;
+	uint16_t nit_pid;
+	/* Programs announced by the PAT, whose PMT PIDs are requested from the backend */
+	struct scan_program *programs;
+	int num_programs;
+	struct scan_table *tables;
+	int num_tables;
+	/* Services described by the actual SDT */
+	struct scan_channel *channels;
+	int num_channels;
+	/* When tuning started, when the input was ready and when each set of tables was complete */
+	uint64_t start_ns;
+	uint64_t tuned_ns;
+	uint64_t pat_ns;
+	uint64_t pmt_ns;
+	uint64_t sdt_ns;
+	uint64_t nit_ns;
+	uint64_t done_ns;
+};
+
+struct scan {
+	pthread_mutex_t mutex;
+	struct demuxfs_data *priv;
+	struct dentry *dir;
+	struct scan_multiplex *multiplexes;
+	int num_multiplexes;
+	/* Index of the multiplex being scanned */
+	int current;
+	uint64_t timeout_ns;
+};
+
+static struct scan_table *scan_find_table(struct scan_multiplex *mux, uint16_t pid, uint8_t table_id,
+		int extension)
+{
+	for (int i=0; i<mux->num_tables; ++i) {
+		struct scan_table *table = &mux->tables[i];
+		if (table->pid == pid && table->table_id == table_id &&
+			(extension < 0 || table->extension == extension))
+			return table;
+	}
+	return NULL;
+}
+
+static struct scan_table *scan_add_table(struct scan_multiplex *mux, uint16_t pid, uint8_t table_id,
+		uint16_t extension)
+{
+	struct scan_table *tables, *table = scan_find_table(mux, pid, table_id, extension);
+
+	if (table)
+		return table;
+	tables = realloc(mux->tables, (mux->num_tables + 1) * sizeof(struct scan_table));
+	if (! tables)
+		return NULL;
+	mux->tables = tables;
+	table = &mux->tables[mux->num_tables++];
+	memset(table, 0, sizeof(*table));
+	table->pid = pid;
+	table->table_id = table_id;
+	table->extension = extension;
+	return table;
+}
+
+static bool scan_table_complete(struct scan_multiplex *mux, uint16_t pid, uint8_t table_id, int extension)
+{
+	struct scan_table *table = scan_find_table(mux, pid, table_id, extension);
+	return table && table->complete;
+}
+
+static void scan_add_program(struct scan_multiplex *mux, uint16_t program_number, uint16_t pid,
+		struct scan *s)
+{
+	struct scan_program *programs;
+
+	for (int i=0; i<mux->num_programs; ++i)
+		if (mux->programs[i].program_number == program_number)
+			return;
+	programs = realloc(mux->programs, (mux->num_programs + 1) * sizeof(struct scan_program));
+	if (! programs)
+		return;
+	mux->programs = programs;
+	mux->programs[mux->num_programs].program_number = program_number;
+	mux->programs[mux->num_programs].pid = pid;
+	mux->num_programs++;
+	ts_request_pid(pid, s->priv);
+}
+
+static struct scan_channel *scan_get_channel(struct scan_multiplex *mux, uint16_t service_id, bool create)
+{
+	struct scan_channel *channels;
+
+	for (int i=0; i<mux->num_channels; ++i)
+		if (mux->channels[i].service_id == service_id)
+			return &mux->channels[i];
+	if (! create)
+		return NULL;
+	channels = realloc(mux->channels, (mux->num_channels + 1) * sizeof(struct scan_channel));
+	if (! channels)
+		return NULL;
+	mux->channels = channels;
+	memset(&mux->channels[mux->num_channels], 0, sizeof(struct scan_channel));
+	mux->channels[mux->num_channels].service_id = service_id;
+	return &mux->channels[mux->num_channels++];
+}
+
+static void scan_parse_pat(struct scan_multiplex *mux, const char *section, uint32_t len, struct scan *s)
+{
+	for (uint32_t i=8; i+4 <= len-4; i+=4) {
+		uint16_t program_number = CONVERT_TO_16(section[i], section[i+1]);
+		uint16_t pid = CONVERT_TO_16(section[i+2], section[i+3]) & 0x1fff;
+		if (program_number != 0)
+			scan_add_program(mux, program_number, pid, s);
+		else if (pid != mux->nit_pid) {
+			if (mux->nit_pid != TS_NIT_PID)
+				ts_release_pid(mux->nit_pid, s->priv);
+			mux->nit_pid = pid;
+			if (pid != TS_NIT_PID)
+				ts_request_pid(pid, s->priv);
+		}
+	}
+}
+
+/* Picks the names of the services from their service descriptors */
+static void scan_parse_sdt(struct scan_multiplex *mux, const char *section, uint32_t len)
+{
+	const uint8_t *p = (const uint8_t *) section;
+
+	mux->original_network_id = CONVERT_TO_16(p[8], p[9]);
+	for (uint32_t i=11; i+5 <= len-4; ) {
+		uint16_t service_id = CONVERT_TO_16(p[i], p[i+1]);
+		uint16_t loop_length = CONVERT_TO_16(p[i+3], p[i+4]) & 0x0fff;
+		uint32_t end = i + 5 + loop_length;
+		struct scan_channel *channel = scan_get_channel(mux, service_id, true);
+
+		if (end > len-4)
+			break;
+		for (uint32_t n=i+5; channel && n+2 <= end && n+2+p[n+1] <= end; n += 2+p[n+1]) {
+			const uint8_t *d = &p[n];
+			uint8_t provider_length, name_length;
+			/* service_descriptor */
+			if (d[0] != 0x48 || d[1] < 3)
+				continue;
+			provider_length = d[3];
+			if (4 + provider_length >= 2 + d[1])
+				continue;
+			name_length = d[4 + provider_length];
+			if (5 + provider_length + name_length > 2 + d[1])
+				continue;
+			channel->service_type = d[2];
+			memcpy(channel->provider, &d[4], provider_length);
+			channel->provider[provider_length] = '\0';
+			memcpy(channel->name, &d[5 + provider_length], name_length);
+			channel->name[name_length] = '\0';
+		}
+		i = end;
+	}
+}
+
+/* Checks which sets of tables are complete. Called with the scan mutex held. */
+static void scan_update_status(struct scan_multiplex *mux)
+{
+	uint64_t now = stats_now();
+	bool pmts_complete = true;
+
+	if (! mux->pat_ns && scan_table_complete(mux, TS_PAT_PID, TS_PAT_TABLE_ID, -1))
+		mux->pat_ns = now;
+	if (! mux->pat_ns)
+		return;
+
+	for (int i=0; i<mux->num_programs && pmts_complete; ++i)
+		pmts_complete = scan_table_complete(mux, mux->programs[i].pid, TS_PMT_TABLE_ID,
+				mux->programs[i].program_number);
+	if (! mux->pmt_ns && pmts_complete)
+		mux->pmt_ns = now;
+	if (! mux->sdt_ns && scan_table_complete(mux, TS_SDT_PID, TS_SDT_TABLE_ID, mux->transport_stream_id))
+		mux->sdt_ns = now;
+	if (! mux->nit_ns && scan_table_complete(mux, mux->nit_pid, TS_NIT_TABLE_ID, -1))
+		mux->nit_ns = now;
+
+	if (mux->pmt_ns && mux->sdt_ns && mux->nit_ns) {
+		mux->status = SCAN_COMPLETE;
+		mux->done_ns = now;
+	}
+}
+
+void scan_record(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv)
+{
+	struct scan *s = priv->scan;
+	struct scan_multiplex *mux;
+	struct scan_table *table;
+	uint8_t table_id = section[0];
+	uint8_t version_number, section_number, last_section_number;
+	uint16_t extension;
+
+	/* Only current sections with the long syntax are counted */
+	if (len < 12 || ! (section[1] & 0x80) || ! (section[5] & 0x01))
+		return;
+	if (! ((pid == TS_PAT_PID && table_id == TS_PAT_TABLE_ID) || table_id == TS_PMT_TABLE_ID ||
+		(pid == TS_SDT_PID && table_id == TS_SDT_TABLE_ID) || table_id == TS_NIT_TABLE_ID))
+		return;
+	extension = CONVERT_TO_16(section[3], section[4]);
+	version_number = (section[5] >> 1) & 0x1f;
+	section_number = section[6];
+	last_section_number = section[7];
+
+	pthread_mutex_lock(&s->mutex);
+	if (s->current < 0 || s->current >= s->num_multiplexes)
+		goto out;
+	mux = &s->multiplexes[s->current];
+	if (mux->status != SCAN_RUNNING || mux->context != priv)
+		goto out;
+	if (table_id == TS_NIT_TABLE_ID && pid != mux->nit_pid)
+		goto out;
+
+	table = scan_add_table(mux, pid, table_id, extension);
+	if (! table)
+		goto out;
+	if (table->version_number != version_number || table->last_section_number != last_section_number) {
+		memset(table->sections, 0, sizeof(table->sections));
+		table->version_number = version_number;
+		table->last_section_number = last_section_number;
+		table->complete = false;
+	}
+	if (table->sections[section_number / 8] & (1 << (section_number % 8)))
+		goto out;
+	table->sections[section_number / 8] |= 1 << (section_number % 8);
+
+	if (table_id == TS_PAT_TABLE_ID) {
+		mux->transport_stream_id = extension;
+		scan_parse_pat(mux, section, len, s);
+	} else if (table_id == TS_SDT_TABLE_ID && extension == mux->transport_stream_id)
+		scan_parse_sdt(mux, section, len);
+
+	table->complete = true;
+	for (int i=0; i<=table->last_section_number && table->complete; ++i)
+		table->complete = table->sections[i / 8] & (1 << (i % 8));
+	if (table->complete)
+		scan_update_status(mux);
+out:
+	pthread_mutex_unlock(&s->mutex);
+}
+
+bool scan_multiplex_done(struct demuxfs_data *priv)
+{
+	struct scan *s = priv->scan;
+	struct scan_multiplex *mux;
+	bool done;
+
+	pthread_mutex_lock(&s->mutex);
+	mux = &s->multiplexes[s->current];
+	if (mux->status == SCAN_RUNNING && stats_now() - mux->tuned_ns > s->timeout_ns) {
+		mux->status = SCAN_TIMEOUT;
+		mux->done_ns = stats_now();
+	}
+	done = mux->status != SCAN_RUNNING;
+	pthread_mutex_unlock(&s->mutex);
+	return done;
+}
+
+static int scan_tune(const char *source, struct demuxfs_data *priv)
+{
+	unsigned long frequency;
+	char *end;
+
+	if (priv->backend->set_source)
+		return priv->backend->set_source(source, priv);
+	frequency = strtoul(source, &end, 10);
+	if (*end || ! frequency)
+		return -EINVAL;
+	return priv->backend->set_frequency(frequency, priv);
+}
+
+/* Releases the PIDs requested for the multiplex and reports how long it took */
+static void scan_finish(struct scan_multiplex *mux, struct scan *s)
+{
+	pthread_mutex_lock(&s->mutex);
+	if (mux->status == SCAN_RUNNING) {
+		mux->status = SCAN_INCOMPLETE;
+		mux->done_ns = stats_now();
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	for (int i=0; i<mux->num_programs; ++i)
+		ts_release_pid(mux->programs[i].pid, s->priv);
+	if (mux->nit_pid != TS_NIT_PID)
+		ts_release_pid(mux->nit_pid, s->priv);
+
+	TS_INFO("scan: %s: %s, %d services in %" PRIu64 " ms", mux->source, scan_status_names[mux->status],
+			mux->num_programs, (mux->done_ns - mux->start_ns) / 1000000);
+}
+
+struct demuxfs_data *scan_next(struct demuxfs_data *priv)
+{
+	struct scan *s = priv->scan;
+	struct scan_multiplex *mux;
+	struct demuxfs_data *context;
+	char name[NAME_MAX+1], source[PATH_MAX];
+	int ret;
+
+	if (s->current >= 0 && s->current < s->num_multiplexes)
+		scan_finish(&s->multiplexes[s->current], s);
+
+	while (++s->current < s->num_multiplexes) {
+		mux = &s->multiplexes[s->current];
+		mux->start_ns = stats_now();
+		ret = scan_tune(mux->source, priv);
+		if (ret < 0) {
+			TS_WARNING("scan: cannot tune to %s: %s", mux->source, strerror(-ret));
+			pthread_mutex_lock(&s->mutex);
+			mux->status = SCAN_TUNE_FAILED;
+			mux->done_ns = stats_now();
+			pthread_mutex_unlock(&s->mutex);
+			continue;
+		}
+
+		/* Files are named after their basename, frequencies are kept as given */
+		snprintf(source, sizeof(source), "%s", mux->source);
+		snprintf(name, sizeof(name), "%s", basename(source));
+		if (fsutils_get_child(s->dir, name))
+			snprintf(name, sizeof(name), "%d", s->current + 1);
+		context = ts_context_new(name, MEM_TABLES, priv);
+		if (! context) {
+			mux->status = SCAN_TUNE_FAILED;
+			continue;
+		}
+		context->scan = s;
+		context->root->parent = s->dir;
+		LINK_DENTRY(s->dir, context->root);
+
+		pthread_mutex_lock(&s->mutex);
+		mux->context = context;
+		mux->nit_pid = TS_NIT_PID;
+		mux->tuned_ns = stats_now();
+		mux->status = SCAN_RUNNING;
+		pthread_mutex_unlock(&s->mutex);
+		return context;
+	}
+	TS_INFO("scan: finished scanning %d sources", s->num_multiplexes);
+	return NULL;
+}
+
+static char *scan_format_ms(uint64_t from_ns, uint64_t to_ns, char *buf, size_t size)
+{
+	if (from_ns && to_ns)
+		snprintf(buf, size, "%" PRIu64, (to_ns - from_ns) / 1000000);
+	else
+		snprintf(buf, size, "-");
+	return buf;
+}
+
+static char *scan_generate_timings(void *data, struct demuxfs_data *priv)
+{
+	struct scan *s = (struct scan *) data;
+	char tune[32], pat[32], pmt[32], sdt[32], nit[32], total[32];
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+
+	pthread_mutex_lock(&s->mutex);
+	fprintf(fp, "%-24s %-11s %8s %8s %8s %8s %8s %8s %8s\n", "source", "status",
+			"tune_ms", "pat_ms", "pmt_ms", "sdt_ms", "nit_ms", "total_ms", "sections");
+	for (int i=0; i<s->num_multiplexes; ++i) {
+		struct scan_multiplex *mux = &s->multiplexes[i];
+		int sections = 0;
+		for (int t=0; t<mux->num_tables; ++t)
+			for (int n=0; n<=mux->tables[t].last_section_number; ++n)
+				sections += (mux->tables[t].sections[n / 8] >> (n % 8)) & 1;
+		fprintf(fp, "%-24s %-11s %8s %8s %8s %8s %8s %8s %8d\n", mux->source, scan_status_names[mux->status],
+				scan_format_ms(mux->start_ns, mux->tuned_ns, tune, sizeof(tune)),
+				scan_format_ms(mux->tuned_ns, mux->pat_ns, pat, sizeof(pat)),
+				scan_format_ms(mux->tuned_ns, mux->pmt_ns, pmt, sizeof(pmt)),
+				scan_format_ms(mux->tuned_ns, mux->sdt_ns, sdt, sizeof(sdt)),
+				scan_format_ms(mux->tuned_ns, mux->nit_ns, nit, sizeof(nit)),
+				scan_format_ms(mux->start_ns, mux->done_ns, total, sizeof(total)),
+				sections);
+	}
+	pthread_mutex_unlock(&s->mutex);
+	fclose(fp);
+	return buf;
+}
+
+static char *scan_generate_channels(void *data, struct demuxfs_data *priv)
+{
+	struct scan *s = (struct scan *) data;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+
+	/* Tab separated, as names may contain spaces */
+	pthread_mutex_lock(&s->mutex);
+	fprintf(fp, "source\ttransport_stream_id\toriginal_network_id\tservice_id\tpmt_pid\tservice_type\tprovider\tname\n");
+	for (int i=0; i<s->num_multiplexes; ++i) {
+		struct scan_multiplex *mux = &s->multiplexes[i];
+		for (int p=0; p<mux->num_programs; ++p) {
+			struct scan_channel *channel = scan_get_channel(mux, mux->programs[p].program_number, false);
+			fprintf(fp, "%s\t%#06x\t%#06x\t%#06x\t%#06x\t%#04x\t%s\t%s\n", mux->source,
+					mux->transport_stream_id, mux->original_network_id,
+					mux->programs[p].program_number, mux->programs[p].pid,
+					channel ? channel->service_type : 0,
+					channel ? channel->provider : "",
+					channel ? channel->name : "");
+		}
+	}
+	pthread_mutex_unlock(&s->mutex);
+	fclose(fp);
+	return buf;
+}
+
+int scan_init(struct demuxfs_data *priv)
+{
+	struct scan *s;
+
+	if (! priv->options.scan_sources)
+		return 0;
+
+	s = (struct scan *) calloc(1, sizeof(struct scan));
+	if (! s)
+		return -ENOMEM;
+	s->multiplexes = (struct scan_multiplex *) calloc(priv->options.num_scan_sources,
+			sizeof(struct scan_multiplex));
+	if (! s->multiplexes) {
+		free(s);
+		return -ENOMEM;
+	}
+	for (int i=0; i<priv->options.num_scan_sources; ++i)
+		s->multiplexes[i].source = priv->options.scan_sources[i];
+	s->num_multiplexes = priv->options.num_scan_sources;
+	s->current = -1;
+	s->timeout_ns = (uint64_t) priv->options.scan_timeout * 1000000000ULL;
+	s->priv = priv;
+	pthread_mutex_init(&s->mutex, NULL);
+
+	s->dir = CREATE_DIRECTORY(priv->root, FS_SCAN_NAME);
+	CREATE_STATS_FILE(s->dir, FS_SCAN_CHANNELS_NAME, scan_generate_channels, s);
+	CREATE_STATS_FILE(s->dir, FS_SCAN_TIMINGS_NAME, scan_generate_timings, s);
+	priv->scan = s;
+	return 0;
+}
+
+void scan_destroy(struct demuxfs_data *priv)
+{
+	struct scan *s = priv->scan;
+
+	if (! s)
+		return;
+	priv->scan = NULL;
+	for (int i=0; i<s->num_multiplexes; ++i) {
+		struct scan_multiplex *mux = &s->multiplexes[i];
+		if (mux->context)
+			ts_context_destroy(mux->context);
+		free(mux->programs);
+		free(mux->tables);
+		free(mux->channels);
+	}
+	pthread_mutex_destroy(&s->mutex);
+	free(s->multiplexes);
+	free(s);
+}
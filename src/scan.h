@@ -0,0 +1,53 @@
+#ifndef __scan_h
+#define __scan_h
+
+/*
+ * Scan mode, enabled with -o scan=LIST. Each source in LIST, either a
+ * frequency handed to the backend's set_frequency() or a file handed to its
+ * set_source(), is parsed into its own tree under /Scan/<source>. The scan
+ * moves on to the next source as soon as the PAT, every PMT it announces,
+ * the actual SDT and the actual NIT have been received in full, or once
+ * -o scan_timeout seconds have elapsed since the frontend locked.
+ *
+ * /Scan/channels lists the services found on every multiplex and
+ * /Scan/timings tells how long each step of the scan took.
+ */
+
+#define FS_SCAN_NAME            "Scan"
+#define FS_SCAN_CHANNELS_NAME   "channels"
+#define FS_SCAN_TIMINGS_NAME    "timings"
+
+/* Seconds to wait for the tables of a multiplex before giving up on it */
+#define SCAN_DEFAULT_TIMEOUT    10
+
+struct scan;
+
+/**
+ * Creates the /Scan directory for the sources in priv->options.scan_sources.
+ * @return 0 on success or a negative errno value.
+ */
+int scan_init(struct demuxfs_data *priv);
+
+/**
+ * Wraps up the multiplex being scanned, if any, and tunes to the next source.
+ * @return the parsing context into which the packets of the new multiplex go,
+ * or NULL once all sources have been scanned.
+ */
+struct demuxfs_data *scan_next(struct demuxfs_data *priv);
+
+/**
+ * Tells if the multiplex being scanned has all its tables or has timed out.
+ */
+bool scan_multiplex_done(struct demuxfs_data *priv);
+
+/**
+ * Records a CRC-checked section of the multiplex being scanned.
+ */
+void scan_record(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv);
+
+/**
+ * Disposes the /Scan trees.
+ */
+void scan_destroy(struct demuxfs_data *priv);
+
+#endif /* __scan_h */
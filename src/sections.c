@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "byteops.h"
+#include "hash.h"
+#include "ts.h"
+#include "sections.h"
+
+bool section_store_key(uint16_t pid, const char *section, uint32_t len, ino_t *key)
+{
+	uint8_t table_id = section[0];
+	uint16_t table_id_extension = 0, number = 0;
+
+	if (len < 3)
+		return false;
+
+	if (section[1] & 0x80) {
+		if (len < 8)
+			return false;
+		/* current_next_indicator */
+		if ((section[5] & 0x01) == 0)
+			return false;
+		table_id_extension = CONVERT_TO_16(section[3], section[4]);
+		number = (uint8_t) section[6];
+	}
+
+	if (table_id == TS_DDB_TABLE_ID) {
+		uint8_t adaptation_length = len > 17 ? section[17] : 0;
+		uint32_t offset = 20 + adaptation_length + 4;
+		if (len < offset + 2 + 4)
+			return false;
+		number = CONVERT_TO_16(section[offset], section[offset+1]);
+	}
+
+	*key = TS_TABLE_IDENTITY(pid, table_id, table_id_extension, number);
+	return true;
+}
+
+struct section_store *section_store_new(int max_sections, int subsystem)
+{
+	struct section_store *store = (struct section_store *) calloc(1, sizeof(struct section_store));
+	if (! store)
+		return NULL;
+	store->sections = hashtable_new(max_sections);
+	hashtable_set_accounting(store->sections, subsystem);
+	INIT_LIST_HEAD(&store->list);
+	return store;
+}
+
+void section_store_destroy(struct section_store *store)
+{
+	if (! store)
+		return;
+	hashtable_destroy(store->sections, (hashtable_free_function_t) free);
+	free(store);
+}
+
+struct stored_section *section_store_get(struct section_store *store, ino_t key)
+{
+	return (struct stored_section *) hashtable_get(store->sections, key);
+}
+
+struct stored_section *section_store_put(struct section_store *store, ino_t key, uint16_t pid,
+		const char *section, uint32_t len)
+{
+	struct stored_section *entry, *old = section_store_get(store, key);
+
+	entry = (struct stored_section *) malloc(sizeof(*entry) + len);
+	if (! entry)
+		return NULL;
+	entry->key = key;
+	entry->pid = pid;
+	entry->length = len;
+	entry->flags = 0;
+	memcpy(entry->data, section, len);
+
+	/* Deleting first keeps hashtable_add() from complaining about the overwrite */
+	if (old)
+		hashtable_del(store->sections, key);
+	if (! hashtable_add(store->sections, key, entry, NULL)) {
+		free(entry);
+		return NULL;
+	}
+	if (old) {
+		list_replace(&old->list, &entry->list);
+		free(old);
+	} else {
+		list_add_tail(&entry->list, &store->list);
+		store->count++;
+	}
+	return entry;
+}
@@ -0,0 +1,55 @@
+#ifndef __sections_h
+#define __sections_h
+
+/*
+ * Store of raw, CRC-checked PSI/SI sections keyed by PID, table_id,
+ * table_id_extension and section number. Entries are kept in the order in
+ * which their keys first appeared, so walking the store feeds the PAT to the
+ * parsers before the PMTs it announces. Replacing a section keeps its place.
+ */
+
+struct stored_section {
+	struct list_head list;
+	ino_t key;
+	uint16_t pid;
+	uint16_t length;
+	/* Free for the owner of the store; cleared when the section is replaced */
+	uint8_t flags;
+	char data[];
+};
+
+struct section_store {
+	struct hash_table *sections;
+	struct list_head list;
+	uint32_t count;
+};
+
+/**
+ * Computes the key of a section. The full blockNumber of DDB sections is
+ * used in place of their section_number, which only holds its low byte.
+ * @return false if the section has no key, as in "next" sections.
+ */
+bool section_store_key(uint16_t pid, const char *section, uint32_t len, ino_t *key);
+
+/**
+ * Creates a store that holds up to @max_sections, whose memory is accounted
+ * to @subsystem.
+ */
+struct section_store *section_store_new(int max_sections, int subsystem);
+void section_store_destroy(struct section_store *store);
+
+struct stored_section *section_store_get(struct section_store *store, ino_t key);
+
+/**
+ * Stores a copy of @section under @key, replacing any previous copy.
+ * @return the new entry or NULL if the store is full.
+ */
+struct stored_section *section_store_put(struct section_store *store, ino_t key, uint16_t pid,
+		const char *section, uint32_t len);
+
+static inline bool stored_section_equals(const struct stored_section *entry, const char *section, uint32_t len)
+{
+	return entry->length == len && memcmp(entry->data, section, len) == 0;
+}
+
+#endif /* __sections_h */
@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "fsutils.h"
+#include "xattr.h"
+#include "stats.h"
+#include "mem.h"
+
+static unsigned int histogram_bucket_index(uint64_t value)
+{
+	unsigned int msb, mantissa;
+
+	if (value < HISTOGRAM_LINEAR_BUCKETS)
+		return value;
+	msb = 63 - __builtin_clzll(value);
+	mantissa = (value >> (msb - HISTOGRAM_MANTISSA_BITS)) & ((1 << HISTOGRAM_MANTISSA_BITS) - 1);
+	return HISTOGRAM_LINEAR_BUCKETS +
+		(msb - HISTOGRAM_MANTISSA_BITS - 1) * (1 << HISTOGRAM_MANTISSA_BITS) + mantissa;
+}
+
+/* Largest value that falls into the given bucket */
+static uint64_t histogram_bucket_limit(unsigned int index)
+{
+	unsigned int msb, mantissa, shift;
+	uint64_t low;
+
+	if (index < HISTOGRAM_LINEAR_BUCKETS)
+		return index;
+	index -= HISTOGRAM_LINEAR_BUCKETS;
+	msb = index / (1 << HISTOGRAM_MANTISSA_BITS) + HISTOGRAM_MANTISSA_BITS + 1;
+	mantissa = index % (1 << HISTOGRAM_MANTISSA_BITS);
+	shift = msb - HISTOGRAM_MANTISSA_BITS;
+	low = ((uint64_t) (1 << HISTOGRAM_MANTISSA_BITS) + mantissa) << shift;
+	return low + (1ULL << shift) - 1;
+}
+
+/**
+ * Records a value. Histograms are written by the TS parser thread and read by
+ * FUSE threads, hence the atomic updates.
+ */
+void histogram_record(struct histogram *h, uint64_t value)
+{
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&h->buckets[histogram_bucket_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	while (value > max && ! __atomic_compare_exchange_n(&h->max, &max, value, false,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/**
+ * Returns the value below which @percentile percent of the samples fall,
+ * rounded up to the upper limit of its bucket.
+ */
+uint64_t histogram_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	if (count == 0)
+		return 0;
+	target = (uint64_t) (percentile / 100.0 * count + 0.5);
+	if (target == 0)
+		target = 1;
+	for (i=0; i<HISTOGRAM_BUCKETS; ++i) {
+		seen += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			uint64_t limit = histogram_bucket_limit(i);
+			return limit < max ? limit : max;
+		}
+	}
+	return max;
+}
+
+#define NS_TO_US(ns) ((double) (ns) / 1000.0)
+
+/**
+ * Formats a histogram as a percentile summary followed by the non-empty
+ * buckets. All values are reported in microseconds.
+ */
+char *histogram_format(const struct histogram *h)
+{
+	uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+	uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	char *buf = NULL;
+	size_t size = 0;
+	unsigned int i;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+	fprintf(fp, "count: %" PRIu64 "\n", count);
+	fprintf(fp, "mean_us: %.3f\n", count ? NS_TO_US(sum) / count : 0.0);
+	fprintf(fp, "max_us: %.3f\n", NS_TO_US(__atomic_load_n(&h->max, __ATOMIC_RELAXED)));
+	fprintf(fp, "p50_us: %.3f\n", NS_TO_US(histogram_percentile(h, 50.0)));
+	fprintf(fp, "p90_us: %.3f\n", NS_TO_US(histogram_percentile(h, 90.0)));
+	fprintf(fp, "p99_us: %.3f\n", NS_TO_US(histogram_percentile(h, 99.0)));
+	fprintf(fp, "p99.9_us: %.3f\n", NS_TO_US(histogram_percentile(h, 99.9)));
+	fprintf(fp, "buckets (upper_limit_us count):\n");
+	for (i=0; i<HISTOGRAM_BUCKETS; ++i) {
+		uint64_t n = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if (n)
+			fprintf(fp, "%.3f %" PRIu64 "\n", NS_TO_US(histogram_bucket_limit(i)), n);
+	}
+	fclose(fp);
+	return buf;
+}
+
+struct latency_stats *stats_latency_new(void)
+{
+	return (struct latency_stats *) mem_calloc(MEM_STATS, 1, sizeof(struct latency_stats));
+}
+
+void stats_latency_destroy(struct latency_stats *latency)
+{
+	int i;
+
+	if (! latency)
+		return;
+	for (i=0; i<256; ++i)
+		if (latency->version_publish_by_table[i])
+			mem_free(MEM_STATS, latency->version_publish_by_table[i]);
+	mem_free(MEM_STATS, latency);
+}
+
+/* File generators */
+
+static char *stats_generate_histogram(void *data, struct demuxfs_data *priv)
+{
+	return histogram_format((struct histogram *) data);
+}
+
+static void stats_summary_line(FILE *fp, const char *name, const struct histogram *h)
+{
+	fprintf(fp, "%-28s %10" PRIu64 " %12.3f %12.3f %12.3f %12.3f %12.3f\n", name,
+		__atomic_load_n(&h->count, __ATOMIC_RELAXED),
+		NS_TO_US(histogram_percentile(h, 50.0)),
+		NS_TO_US(histogram_percentile(h, 90.0)),
+		NS_TO_US(histogram_percentile(h, 99.0)),
+		NS_TO_US(histogram_percentile(h, 99.9)),
+		NS_TO_US(__atomic_load_n(&h->max, __ATOMIC_RELAXED)));
+}
+
+static char *stats_generate_summary(void *data, struct demuxfs_data *priv)
+{
+	struct latency_stats *latency = (struct latency_stats *) data;
+	char name[64], *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int i;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+	fprintf(fp, "%-28s %10s %12s %12s %12s %12s %12s\n", "stage", "count",
+		"p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+	stats_summary_line(fp, "section_reassembly", &latency->section_reassembly);
+	stats_summary_line(fp, "table_parse", &latency->table_parse);
+	stats_summary_line(fp, "version_publish", &latency->version_publish);
+	for (i=0; i<256; ++i) {
+		struct histogram *h = __atomic_load_n(&latency->version_publish_by_table[i], __ATOMIC_ACQUIRE);
+		if (h) {
+			snprintf(name, sizeof(name), "version_publish_%#04x", i);
+			stats_summary_line(fp, name, h);
+		}
+	}
+	stats_summary_line(fp, "pes_fifo_write", &latency->pes_fifo_write);
+	stats_summary_line(fp, "stream_event_trigger", &latency->stream_event_trigger);
+	fclose(fp);
+	return buf;
+}
+
+static char *stats_generate_stream(void *data, struct demuxfs_data *priv)
+{
+	struct ts_statistics *stats = &priv->stats;
+	char *buf = NULL;
+
+	asprintf(&buf,
+		"continuity_errors: %" PRIu64 "\n"
+		"crc_errors: %" PRIu64 "\n"
+		"transport_lost: %" PRIu64 "\n"
+		"transport_reordered: %" PRIu64 "\n"
+		"transport_duplicates: %" PRIu64 "\n"
+		"transport_max_interarrival_us: %.3f\n",
+		stats->continuity_errors, stats->crc_errors, stats->transport_lost,
+		stats->transport_reordered, stats->transport_duplicates,
+		NS_TO_US(stats->transport_max_interarrival_ns));
+	return buf;
+}
+
+static char *stats_generate_log(void *data, struct demuxfs_data *priv)
+{
+	struct log_statistics stats;
+	char *buf = NULL;
+
+	log_get_statistics(&stats);
+	asprintf(&buf, "level: %d\nsuppressed: %" PRIu64 "\ndropped: %" PRIu64 "\n",
+		log_level, stats.suppressed, stats.dropped);
+	return buf;
+}
+
+static char *stats_generate_memory(void *data, struct demuxfs_data *priv)
+{
+	struct mem_usage usage, total, tree;
+	struct dentry *child;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int i;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+
+	mem_get_total_usage(priv, &total, &tree);
+	fprintf(fp, "%-24s %14s %10s\n", "subsystem", "bytes", "objects");
+	fprintf(fp, "%-24s %14" PRId64 " %10" PRId64 "\n", "tree", tree.bytes, tree.objects);
+	for (i=0; i<MEM_SUBSYSTEMS; ++i) {
+		mem_get_usage(i, &usage);
+		fprintf(fp, "%-24s %14" PRId64 " %10" PRId64 "\n", mem_subsystem_name(i), usage.bytes, usage.objects);
+	}
+	fprintf(fp, "%-24s %14" PRId64 " %10" PRId64 "\n", "total", total.bytes, total.objects);
+
+	fprintf(fp, "\n%-24s %14s %10s\n", "directory", "bytes", "dentries");
+	list_for_each_entry(child, &priv->root->children, list) {
+		char name[PATH_MAX];
+		memset(&usage, 0, sizeof(usage));
+		mem_tree_usage(child, &usage);
+		snprintf(name, sizeof(name), "/%s", child->name);
+		fprintf(fp, "%-24s %14" PRId64 " %10" PRId64 "\n", name, usage.bytes, usage.objects);
+	}
+	fclose(fp);
+	return buf;
+}
+
+static struct dentry *stats_get_latency_dir(struct demuxfs_data *priv)
+{
+	struct dentry *stats_dentry = CREATE_DIRECTORY(priv->root, FS_STATS_NAME);
+	return CREATE_DIRECTORY(stats_dentry, FS_STATS_LATENCY_NAME);
+}
+
+/**
+ * Records the time it took for a new version of table @table_id to be
+ * published, counting from the arrival of its first packet.
+ */
+void stats_record_publish(uint8_t table_id, uint64_t latency_ns, struct demuxfs_data *priv)
+{
+	struct latency_stats *latency = priv->latency;
+	struct histogram *h;
+
+	if (! latency)
+		return;
+
+	histogram_record(&latency->version_publish, latency_ns);
+
+	h = latency->version_publish_by_table[table_id];
+	if (! h) {
+		char fname[64];
+		h = (struct histogram *) mem_calloc(MEM_STATS, 1, sizeof(struct histogram));
+		if (! h)
+			return;
+		snprintf(fname, sizeof(fname), "version_publish_%#04x", table_id);
+		CREATE_STATS_FILE(stats_get_latency_dir(priv), fname, stats_generate_histogram, h);
+		__atomic_store_n(&latency->version_publish_by_table[table_id], h, __ATOMIC_RELEASE);
+	}
+	histogram_record(h, latency_ns);
+}
+
+void stats_create_dentries(struct demuxfs_data *priv)
+{
+	struct dentry *stats_dentry = CREATE_DIRECTORY(priv->root, FS_STATS_NAME);
+
+	CREATE_STATS_FILE(stats_dentry, "stream", stats_generate_stream, NULL);
+	CREATE_STATS_FILE(stats_dentry, "log", stats_generate_log, NULL);
+	CREATE_STATS_FILE(stats_dentry, "memory", stats_generate_memory, NULL);
+
+	if (priv->latency) {
+		struct latency_stats *latency = priv->latency;
+		struct dentry *latency_dentry = stats_get_latency_dir(priv);
+		CREATE_STATS_FILE(latency_dentry, "summary", stats_generate_summary, latency);
+		CREATE_STATS_FILE(latency_dentry, "section_reassembly", stats_generate_histogram,
+			&latency->section_reassembly);
+		CREATE_STATS_FILE(latency_dentry, "table_parse", stats_generate_histogram,
+			&latency->table_parse);
+		CREATE_STATS_FILE(latency_dentry, "version_publish", stats_generate_histogram,
+			&latency->version_publish);
+		CREATE_STATS_FILE(latency_dentry, "pes_fifo_write", stats_generate_histogram,
+			&latency->pes_fifo_write);
+		CREATE_STATS_FILE(latency_dentry, "stream_event_trigger", stats_generate_histogram,
+			&latency->stream_event_trigger);
+	}
+}
+
+int stats_update_file(struct dentry *dentry, struct demuxfs_data *priv)
+{
+	struct stats_priv *stats_priv = (struct stats_priv *) dentry->priv;
+	char *contents;
+
+	if (! stats_priv || ! stats_priv->generate)
+		return -EINVAL;
+	contents = stats_priv->generate(stats_priv->data, priv);
+	if (! contents)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&dentry->mutex);
+	free(dentry->contents);
+	dentry->contents = contents;
+	dentry->parent->size -= dentry->size;
+	dentry->size = strlen(contents);
+	dentry->parent->size += dentry->size;
+	pthread_mutex_unlock(&dentry->mutex);
+	return 0;
+}
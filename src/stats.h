@@ -0,0 +1,72 @@
+#ifndef __stats_h
+#define __stats_h
+
+#include <time.h>
+
+#define FS_STATS_NAME          "Stats"
+#define FS_STATS_LATENCY_NAME  "latency"
+
+/*
+ * Log-linear histogram: values below 32 have exact buckets, larger values
+ * are grouped in 16 sub-buckets per power of two, which bounds the error
+ * of any reported value to 6.25%.
+ */
+#define HISTOGRAM_MANTISSA_BITS 4
+#define HISTOGRAM_LINEAR_BUCKETS (1 << (HISTOGRAM_MANTISSA_BITS + 1))
+#define HISTOGRAM_BUCKETS \
+	(HISTOGRAM_LINEAR_BUCKETS + (64 - HISTOGRAM_MANTISSA_BITS - 1) * (1 << HISTOGRAM_MANTISSA_BITS))
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Latencies, in nanoseconds, of each stage between the arrival of a TS
+ * packet and the moment its contents become visible on the filesystem.
+ */
+struct latency_stats {
+	/* CLOCK_MONOTONIC timestamp of the packet being parsed */
+	uint64_t packet_ingest_ns;
+	/* Arrival of the first packet of a section -> section complete */
+	struct histogram section_reassembly;
+	/* Section complete -> table parser returned */
+	struct histogram table_parse;
+	/* Arrival of the first packet of a section -> new table version published */
+	struct histogram version_publish;
+	/* Same as above, broken down by table_id. Allocated on demand. */
+	struct histogram *version_publish_by_table[256];
+	/* Arrival of a PES packet -> data written to the FIFO */
+	struct histogram pes_fifo_write;
+	/* Trigger time of a DSM-CC stream event -> event written to its FIFO */
+	struct histogram stream_event_trigger;
+};
+
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void histogram_record(struct histogram *h, uint64_t value);
+uint64_t histogram_percentile(const struct histogram *h, double percentile);
+char *histogram_format(const struct histogram *h);
+
+struct latency_stats *stats_latency_new(void);
+void stats_latency_destroy(struct latency_stats *latency);
+void stats_record_publish(uint8_t table_id, uint64_t latency_ns, struct demuxfs_data *priv);
+
+/**
+ * Creates the /Stats directory tree.
+ */
+void stats_create_dentries(struct demuxfs_data *priv);
+
+/**
+ * Regenerates the contents of a /Stats file. Called when the file is opened.
+ */
+int stats_update_file(struct dentry *dentry, struct demuxfs_data *priv);
+
+#endif /* __stats_h */
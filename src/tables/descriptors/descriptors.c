@@ -27,33 +27,47 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "demuxfs.h"
+#include "bitstream.h"
 #include "descriptors.h"
 #include "ts.h"
 
-uint32_t descriptors_parse(const char *payload, uint8_t num_descriptors, 
+/**
+ * Parses up to @num_descriptors descriptors out of the @len bytes at @payload.
+ * A descriptor whose length runs past them is cut down to the bytes left.
+ * @return number of bytes consumed.
+ */
+uint32_t descriptors_parse(const char *payload, uint32_t len, uint16_t num_descriptors, 
 		struct dentry *parent, struct demuxfs_data *priv)
 {
 	int ret;
-	uint8_t n;
-	uint32_t offset = 0;
-	for (n=0; n<num_descriptors; ++n) {
-		uint8_t descriptor_tag = payload[offset];
-		uint8_t descriptor_length = payload[offset+1];
+	uint16_t n;
+	struct bitstream bs;
+
+	bitstream_init(&bs, payload, len);
+	for (n=0; n<num_descriptors && bitstream_remaining(&bs) >= 2; ++n) {
+		const char *descriptor = bitstream_pointer(&bs);
+		uint8_t descriptor_tag = bitstream_read_u8(&bs);
+		uint32_t descriptor_length = bitstream_read_u8(&bs);
+		if (descriptor_length > bitstream_remaining(&bs)) {
+			TS_WARNING("Descriptor tag %#04x is truncated: %u bytes expected, %u found", 
+					descriptor_tag, descriptor_length, bitstream_remaining(&bs));
+			descriptor_length = bitstream_remaining(&bs);
+		}
+		bitstream_skip(&bs, descriptor_length);
+
 		struct descriptor *d = descriptors_find(descriptor_tag, priv);
 		if (! d) {
 			TS_WARNING("Invalid descriptor tag %#04x", descriptor_tag);
-			offset += 2 + descriptor_length;
 			continue;
 		}
 		TS_VERBOSE("Parsing descriptor %#04x-%s (#%d/%d)", 
 				descriptor_tag, d->name, n+1, num_descriptors);
-		ret = d->parser(&payload[offset], descriptor_length, parent, priv);
+		ret = d->parser(descriptor, descriptor_length, parent, priv);
 		if (ret < 0)
 			TS_WARNING("Error parsing descriptor tag %#x: %s", descriptor_tag, 
 					strerror(-ret));
-		offset += 2 + descriptor_length;
 	}
-	return offset;
+	return bitstream_position(&bs);
 }
 
 bool descriptor_is_parseable(struct dentry *dentry, uint8_t tag, int expected, int found)
@@ -67,14 +81,24 @@ bool descriptor_is_parseable(struct dentry *dentry, uint8_t tag, int expected, i
 	return true;
 }
 
+bool descriptor_is_truncated(uint8_t tag, const struct bitstream *bs)
+{
+	if (! bitstream_error(bs))
+		return false;
+	TS_WARNING("Tag %#0x: descriptor is truncated", tag);
+	return true;
+}
+
 int descriptors_count(const char *payload, uint16_t info_length)
 {
 	int num = 0, len = (int) info_length;
 	const char *p = payload;
 	while (len > 0) {
-		int count = len >= 2 ? p[1] + 2 : -1;
+		int count = len >= 2 ? (uint8_t) p[1] + 2 : -1;
 		if (count < 0)
 			return 0;
+		if (count > len)
+			break;
 		len -= count;
 		p += count;
 		num++;
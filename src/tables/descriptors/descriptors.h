@@ -3,6 +3,8 @@
 
 #define DESCRIPTOR_COMES_FROM_PMT(p) (p->shared_data ? true : false)
 
+struct bitstream;
+
 struct descriptor {
 	uint8_t tag;
 	char *name;
@@ -11,11 +13,12 @@ struct descriptor {
 
 /* Function prototypes */
 bool descriptor_is_parseable(struct dentry *dentry, uint8_t tag, int expected, int found);
+bool descriptor_is_truncated(uint8_t tag, const struct bitstream *bs);
 struct descriptor *descriptors_init(struct demuxfs_data *priv);
 void descriptors_destroy(struct descriptor *descriptor_list);
 struct descriptor *descriptors_find(uint8_t tag, struct demuxfs_data *priv);
 int descriptors_count(const char *payload, uint16_t program_information_length);
-uint32_t descriptors_parse(const char *payload, uint8_t num_descriptors, 
+uint32_t descriptors_parse(const char *payload, uint32_t len, uint16_t num_descriptors, 
 		struct dentry *parent, struct demuxfs_data *priv);
 
 /* Descriptor parsers */
@@ -31,6 +31,7 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -43,12 +44,20 @@ int descriptor_0x13_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs;
+	uint32_t private_data_len;
 
 	if (! descriptor_is_parseable(parent, payload[0], 6, len))
 		return -ENODATA;
 
+	bitstream_init(&bs, &payload[2], len);
+	f.carousel_id = bitstream_read_u32(&bs);
+	private_data_len = bitstream_remaining(&bs);
+	f.private_data = (char *) bitstream_read_bytes(&bs, private_data_len);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Carousel_Identifier");
-	f.carousel_id = CONVERT_TO_32(payload[2], payload[3], payload[4], payload[5]);
 	CREATE_FILE_NUMBER(dentry, &f, carousel_id);
 
 	/* 
@@ -56,13 +65,8 @@ int descriptor_0x13_parser(const char *payload, int len, struct dentry *parent,
 	 * See Table B.36 on page 505 of MHP Specification 1.1.3.
 	 */
 
-	if (len > 6) {
-		size_t file_size = len-6;
-		f.private_data = malloc(file_size * sizeof(char));
-		memcpy(f.private_data, &payload[6], file_size);
-		CREATE_FILE_BIN(dentry, &f, private_data, file_size);
-		free(f.private_data);
-	}
+	if (private_data_len)
+		CREATE_FILE_BIN(dentry, &f, private_data, private_data_len);
 
     return 0;
 }
@@ -31,6 +31,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -46,57 +47,46 @@ struct formatted_descriptor {
 /* ASSOCIATION_TAG_DESCRIPTOR parser */
 int descriptor_0x14_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	uint8_t i, offset;
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs;
+	const char *selector_byte = NULL, *private_data_byte;
+	uint32_t private_data_len;
 
 	if (! descriptor_is_parseable(parent, payload[0], 5, len))
 		return -ENODATA;
 
-	dentry = CREATE_DIRECTORY(parent, "Association_Tag_Descriptor");
+	memset(&f, 0, sizeof(f));
+	bitstream_init(&bs, &payload[2], len);
+	f.association_tag = bitstream_read_u16(&bs);
+	f.use = bitstream_read_u16(&bs);
+	f.selector_length = bitstream_read_u8(&bs);
+	if (f.use == 0x0000) {
+		f.transaction_id = bitstream_read_u32(&bs);
+		f.timeout = bitstream_read_u32(&bs);
+	} else if (f.use != 0x0001) {
+		selector_byte = bitstream_read_bytes(&bs, f.selector_length);
+	}
+	private_data_len = bitstream_remaining(&bs);
+	private_data_byte = bitstream_read_bytes(&bs, private_data_len);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
 
-	f.association_tag = CONVERT_TO_16(payload[2], payload[3]);
-	f.use = CONVERT_TO_16(payload[4], payload[5]);
+	dentry = CREATE_DIRECTORY(parent, "Association_Tag_Descriptor");
 	CREATE_FILE_NUMBER(dentry, &f, association_tag);
 	CREATE_FILE_NUMBER(dentry, &f, use);
+	CREATE_FILE_NUMBER(dentry, &f, selector_length);
 
 	if (f.use == 0x0000) {
-		if (len < 13) {
-			TS_WARNING("cannot parse descriptor %#x: contents smaller than 13 bytes (%d)", 0x14, len);
-			return -1;
-		}
-		f.selector_length = payload[6];
-		f.transaction_id = CONVERT_TO_32(payload[7], payload[8], payload[9], payload[10]);
-		f.timeout = CONVERT_TO_32(payload[11], payload[12], payload[13], payload[14]);
-		CREATE_FILE_NUMBER(dentry, &f, selector_length);
 		CREATE_FILE_NUMBER(dentry, &f, transaction_id);
 		CREATE_FILE_NUMBER(dentry, &f, timeout);
-		offset = 15;
-	} else if (f.use == 0x0001) {
-		f.selector_length = payload[6];
-		CREATE_FILE_NUMBER(dentry, &f, selector_length);
-		offset = 7;
-	} else {
-		f.selector_length = payload[6];
-		if (len < 5 + f.selector_length) {
-			TS_WARNING("cannot parse descriptor %#x: contents smaller than %d bytes (%d)",
-					0x14, 5 + f.selector_length, len);
-			return -1;
-		}
-		for (i=0; i<f.selector_length; ++i)
-			f.selector_byte[i] = payload[7+i];
-		f.selector_byte[i] = '\0';
-		CREATE_FILE_NUMBER(dentry, &f, selector_length);
+	} else if (selector_byte) {
+		memcpy(f.selector_byte, selector_byte, f.selector_length);
 		CREATE_FILE_STRING(dentry, &f, selector_byte, XATTR_FORMAT_STRING);
-		offset = 6 + i;
 	}
 
-	memset(f.private_data_byte, 0, sizeof(f.private_data_byte));
-	for (i=offset; i<len; ++i)
-		f.private_data_byte[i-offset] = payload[i];
-	f.private_data_byte[i-offset] = '\0';
+	memcpy(f.private_data_byte, private_data_byte, private_data_len);
 	CREATE_FILE_STRING(dentry, &f, private_data_byte, XATTR_FORMAT_STRING);
 
     return 0;
 }
-
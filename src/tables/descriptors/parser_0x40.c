@@ -30,6 +30,8 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct formatted_descriptor {
 	char *network_name;
@@ -40,11 +42,14 @@ int descriptor_0x40_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry;
 	struct formatted_descriptor fd;
-	uint16_t i;
+	struct bitstream bs;
+	const char *network_name;
 
-	fd.network_name = (char *) calloc(len-1, sizeof(char));
-	for (i=2; i<len; ++i)
-		fd.network_name[i-2] = payload[i];
+	bitstream_init(&bs, &payload[2], len);
+	network_name = bitstream_read_bytes(&bs, len);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+	fd.network_name = strndup(network_name, len);
 
 	dentry = CREATE_DIRECTORY(parent, "Network_Name_Descriptor");
 	CREATE_FILE_STRING(dentry, &fd, network_name, XATTR_FORMAT_STRING);
@@ -34,6 +34,7 @@
 #include "tables/psi.h"
 #include "tables/pat.h"
 #include "services.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -44,28 +45,34 @@ struct formatted_descriptor {
 /* SERVICE_LIST_DESCRIPTOR parser */
 int descriptor_0x41_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	uint8_t i;
+	int n;
 	struct dentry *dentry, *subdir;
 	struct formatted_descriptor f;
+	struct bitstream bs;
 	
 	if (! descriptor_is_parseable(parent, payload[0], 3, len))
 		return -ENODATA;
 	
 	dentry = CREATE_DIRECTORY(parent, "Service_List_Descriptor");
 
-	for (i=2; i<len; i+=3) {
+	bitstream_init(&bs, &payload[2], len);
+	for (n=0; bitstream_remaining(&bs); ++n) {
 		uint8_t service_type;
-		f.service_id = CONVERT_TO_16(payload[i], payload[i+1]);
-		service_type = payload[i+2];
+		f.service_id = bitstream_read_u16(&bs);
+		service_type = bitstream_read_u8(&bs);
+		if (bitstream_error(&bs))
+			break;
 		sprintf(f.service_type, "%s [%#x]", service_type_to_string(service_type), service_type);
 		
-		subdir = CREATE_DIRECTORY(dentry, "Service_%02d", ((i-2)/3)+1);
+		subdir = CREATE_DIRECTORY(dentry, "Service_%02d", n+1);
 		CREATE_FILE_NUMBER(subdir, &f, service_id);
 		CREATE_FILE_STRING(subdir, &f, service_type, XATTR_FORMAT_STRING_AND_NUMBER);
 		
 		if (! pat_announces_service(f.service_id, priv))
 			TS_WARNING("service_id %#x not declared by the PAT", f.service_id);
 	}
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
     return 0;
 }
 
@@ -31,6 +31,7 @@
 #include "xattr.h"
 #include "ts.h"
 #include "services.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -47,30 +48,34 @@ int descriptor_0x48_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct formatted_descriptor f;
 	struct dentry *dentry;
-	int i, j;
+	struct bitstream bs;
+	const char *service_provider_name, *service_name;
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
 	memset(&f, 0, sizeof(f));
+	bitstream_init(&bs, &payload[2], len);
+	f._service_type = bitstream_read_u8(&bs);
+	f.service_provider_name_length = bitstream_read_u8(&bs);
+	service_provider_name = bitstream_read_bytes(&bs, f.service_provider_name_length);
+	f.service_name_length = bitstream_read_u8(&bs);
+	service_name = bitstream_read_bytes(&bs, f.service_name_length);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Service_Descriptor");
 
-	f._service_type = payload[2];
 	sprintf(f.service_type, "%s [%#x]", service_type_to_string(f._service_type), f._service_type);
 	CREATE_FILE_STRING(dentry, &f, service_type, XATTR_FORMAT_STRING_AND_NUMBER);
 
-	f.service_provider_name_length = payload[3];
-	for (i=0; i<f.service_provider_name_length; ++i)
-		f.service_provider_name[i] = payload[4+i];
+	memcpy(f.service_provider_name, service_provider_name, f.service_provider_name_length);
 	CREATE_FILE_NUMBER(dentry, &f, service_provider_name_length);
 	CREATE_FILE_STRING(dentry, &f, service_provider_name, XATTR_FORMAT_STRING);
 
-	f.service_name_length = payload[4+i];
-	for (j=0; j<f.service_name_length; ++j)
-		f.service_name[j] = payload[5+i+j];
+	memcpy(f.service_name, service_name, f.service_name_length);
 	CREATE_FILE_NUMBER(dentry, &f, service_name_length);
 	CREATE_FILE_STRING(dentry, &f, service_name, XATTR_FORMAT_STRING);
 
     return 0;
 }
-
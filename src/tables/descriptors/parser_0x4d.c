@@ -30,6 +30,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -45,44 +46,40 @@ int descriptor_0x4d_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct formatted_descriptor f;
 	struct dentry *dentry;
-	int i;
+	struct bitstream bs;
+	const char *language_code, *event_name, *text;
 	
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
 	memset(&f, 0, sizeof(f));
+	bitstream_init(&bs, &payload[2], len);
+	language_code = bitstream_read_bytes(&bs, 3);
+	f.event_name_length = bitstream_read_u8(&bs);
+	event_name = bitstream_read_bytes(&bs, f.event_name_length);
+	f.text_length = bitstream_read_u8(&bs);
+	text = bitstream_read_bytes(&bs, f.text_length);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Short_Event_Descriptor");
 
-	memcpy(f.language_code, &payload[2], 3);
+	memcpy(f.language_code, language_code, 3);
 	CREATE_FILE_STRING(dentry, &f, language_code, XATTR_FORMAT_STRING);
-	len -= 3;
 
-	f.event_name_length = payload[5];
 	CREATE_FILE_NUMBER(dentry, &f, event_name_length);
-	len--;
-	i = 6;
-
-	if (len > 0 && f.event_name_length) {
-		f.event_name = strndup(&payload[6], f.event_name_length);
+	if (f.event_name_length) {
+		f.event_name = strndup(event_name, f.event_name_length);
 		CREATE_FILE_STRING(dentry, &f, event_name, XATTR_FORMAT_STRING);
-		len -= f.event_name_length;
-		i += f.event_name_length;
 		free(f.event_name);
 	}
 
-	f.text_length = payload[i];
 	CREATE_FILE_NUMBER(dentry, &f, text_length);
-	len--;
-	i++;
-
-	if (len > 0 && f.text_length) {
-		f.text = strndup(&payload[i], f.text_length);
+	if (f.text_length) {
+		f.text = strndup(text, f.text_length);
 		CREATE_FILE_STRING(dentry, &f, text, XATTR_FORMAT_STRING);
-		len -= f.text_length;
-		i += f.text_length;
 		free(f.text);
 	}
 
     return 0;
 }
-
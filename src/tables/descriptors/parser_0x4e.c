@@ -30,6 +30,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 #include "debug.h"
 
@@ -51,69 +52,70 @@ int descriptor_0x4e_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct formatted_descriptor f;
 	struct dentry *dentry, *subdir;
-	int i;
+	struct bitstream bs, items;
+	const char *language_code, *item_description = NULL, *item = NULL, *text;
 	
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
 	memset(&f, 0, sizeof(f));
+	bitstream_init(&bs, &payload[2], len);
+	f.descriptor_number = bitstream_read_bits(&bs, 4);
+	f.last_descriptor_number = bitstream_read_bits(&bs, 4);
+	language_code = bitstream_read_bytes(&bs, 3);
+	f.length_items = bitstream_read_u8(&bs);
+	bitstream_sub(&bs, f.length_items, &items);
+	if (bitstream_remaining(&items)) {
+		/* Only the first item of the loop is exported */
+		f.item_description_length = bitstream_read_u8(&items);
+		item_description = bitstream_read_bytes(&items, f.item_description_length);
+		f.item_length = bitstream_read_u8(&items);
+		item = bitstream_read_bytes(&items, f.item_length);
+	}
+	f.text_length = bitstream_read_u8(&bs);
+	text = bitstream_read_bytes(&bs, f.text_length);
+	if (descriptor_is_truncated(payload[0], &items) || descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Extended_Event_Descriptor");
 
 	/* Descriptor and Last Descriptor numbers */
-	f.descriptor_number = (payload[2] >> 4) & 0x0f;
-	f.last_descriptor_number = payload[2] & 0x0f;
-
 	subdir = CREATE_DIRECTORY(dentry, "Descriptor_%02d", f.descriptor_number);
 	CREATE_FILE_NUMBER(subdir, &f, descriptor_number);
 	CREATE_FILE_NUMBER(subdir, &f, last_descriptor_number);
-	i = 3;
 
 	/* Language code */
-	memcpy(f.language_code, &payload[i], 3);
+	memcpy(f.language_code, language_code, 3);
 	CREATE_FILE_STRING(subdir, &f, language_code, XATTR_FORMAT_STRING);
-	len -= 3, i += 3;
 
 	/* Length items */
-	f.length_items = payload[i];
 	CREATE_FILE_NUMBER(subdir, &f, length_items);
-	len--, i++;
 
-	/* Item description */
-	f.item_description_length = payload[i];
-	CREATE_FILE_NUMBER(subdir, &f, item_description_length);
-	len--, i++;
+	if (item_description) {
+		/* Item description */
+		CREATE_FILE_NUMBER(subdir, &f, item_description_length);
+		if (f.item_description_length) {
+			f.item_description = strndup(item_description, f.item_description_length);
+			CREATE_FILE_STRING(subdir, &f, item_description, XATTR_FORMAT_STRING);
+			free(f.item_description);
+		}
 
-	if (f.item_description_length) {
-		f.item_description = strndup(&payload[i], f.item_description_length);
-		CREATE_FILE_STRING(subdir, &f, item_description, XATTR_FORMAT_STRING);
-		len -= f.item_description_length, i += f.item_description_length;
-		free(f.item_description);
-	}
-	
-	/* Item */
-	f.item_length = payload[i];
-	CREATE_FILE_NUMBER(subdir, &f, item_length);
-	len--, i++;
-
-	if (len > 0 && f.item_length) {
-		f.item = strndup(&payload[i], f.item_length);
-		CREATE_FILE_STRING(subdir, &f, item, XATTR_FORMAT_STRING);
-		len -= f.item_length, i += f.item_length;
-		free(f.item);
+		/* Item */
+		CREATE_FILE_NUMBER(subdir, &f, item_length);
+		if (f.item_length) {
+			f.item = strndup(item, f.item_length);
+			CREATE_FILE_STRING(subdir, &f, item, XATTR_FORMAT_STRING);
+			free(f.item);
+		}
 	}
 
 	/* Text */
-	f.text_length = payload[i];
 	CREATE_FILE_NUMBER(subdir, &f, text_length);
-	len--, i++;
-
-	if (len > 0 && f.text_length) {
-		f.text = strndup(&payload[i], f.text_length);
+	if (f.text_length) {
+		f.text = strndup(text, f.text_length);
 		CREATE_FILE_STRING(subdir, &f, text, XATTR_FORMAT_STRING);
-		len -= f.text_length, i += f.text_length;
 		free(f.text);
 	}
 
     return 0;
 }
-
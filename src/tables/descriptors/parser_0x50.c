@@ -31,6 +31,7 @@
 #include "xattr.h"
 #include "ts.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -48,16 +49,25 @@ int descriptor_0x50_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs;
+	const char *language_code, *text;
+	uint32_t text_len;
 
 	if (! descriptor_is_parseable(parent, payload[0], 6, len))
 		return -ENODATA;
 
 	memset(&f, 0, sizeof(f));
-	f.reserved       = (payload[2] >> 4) & 0x0f;
-	f.stream_content = (payload[2] & 0x0f);
-	f.component_type =  payload[3];
-	f.component_tag  =  payload[4];
-	memcpy(&f.ISO_639_language_code, &payload[5], 3);
+	bitstream_init(&bs, &payload[2], len);
+	f.reserved       = bitstream_read_bits(&bs, 4);
+	f.stream_content = bitstream_read_bits(&bs, 4);
+	f.component_type = bitstream_read_u8(&bs);
+	f.component_tag  = bitstream_read_u8(&bs);
+	language_code    = bitstream_read_bytes(&bs, 3);
+	text_len         = bitstream_remaining(&bs);
+	text             = bitstream_read_bytes(&bs, text_len);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+	memcpy(&f.ISO_639_language_code, language_code, 3);
 
 	dentry = CREATE_DIRECTORY(parent, "Component_Descriptor");
 	CREATE_FILE_NUMBER(dentry, &f, stream_content);
@@ -86,6 +96,9 @@ int descriptor_0x50_parser(const char *payload, int len, struct dentry *parent,
 		int r_index = ((f.component_type >> 4) & 0x0f) == 0 ? 0 :
 					  ((f.component_type >> 4) & 0x0f) - 0x0a + 1;
 
+		if (r_index < 0 || r_index >= sizeof(resolutions)/sizeof(resolutions[0]))
+			resolution = 0;
+
 		switch (resolution) {
 			case 0x01:
 				asprintf(&f.component_description, "%s %s, 4:3 aspect ratio", 
@@ -167,8 +180,8 @@ int descriptor_0x50_parser(const char *payload, int len, struct dentry *parent,
 		free(f.component_description);
 	}
 
-	if (len > 8) {
-		f.text = strndup(&payload[7], len-8);
+	if (text_len) {
+		f.text = strndup(text, text_len);
 		CREATE_FILE_STRING(dentry, &f, text, XATTR_FORMAT_STRING);
 		free(f.text);
 	}
@@ -30,6 +30,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -326,24 +327,28 @@ static int format_subgenre_other(uint8_t genre_id, uint8_t subgenre_id, char **s
 /* CONTENT_DESCRIPTOR parser */
 int descriptor_0x54_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	int i = 2, index = 0;
+	int index = 0;
+	struct bitstream bs;
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
-	while (len) {
-		struct dentry *dentry = CREATE_DIRECTORY(parent, "Content_Descriptor_%02d", index++);
+	bitstream_init(&bs, &payload[2], len);
+	while (bitstream_remaining(&bs)) {
+		struct dentry *dentry;
 		struct formatted_descriptor f;
 		char *genre = NULL, *subgenre = NULL;
 
 		memset(&f, 0, sizeof(f));
 
-		f._content_nibble_level_1 = (payload[i] >> 4) & 0x0f;
-		f._content_nibble_level_2 = payload[i] & 0x0f;
-		f.user_nibble = (payload[i+1] >> 4) & 0x0f;
-		f.user_nibble_unused = payload[i+1] & 0x0f;
-		i += 2;
-		len -= 2;
+		f._content_nibble_level_1 = bitstream_read_bits(&bs, 4);
+		f._content_nibble_level_2 = bitstream_read_bits(&bs, 4);
+		f.user_nibble = bitstream_read_bits(&bs, 4);
+		f.user_nibble_unused = bitstream_read_bits(&bs, 4);
+		if (bitstream_error(&bs))
+			break;
+
+		dentry = CREATE_DIRECTORY(parent, "Content_Descriptor_%02d", index++);
 		
 		if (priv->options.standard == ISDB_STANDARD) {
 			format_genre_isdb(f._content_nibble_level_1, &genre);
@@ -371,6 +376,8 @@ int descriptor_0x54_parser(const char *payload, int len, struct dentry *parent,
 		if (subgenre)
 			free(subgenre);
 	}
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
     return 0;
 }
 
@@ -30,6 +30,8 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
+#include "descriptors.h"
 
 struct parental_rating_descriptor {
 	char country_code[16];
@@ -39,20 +41,27 @@ struct parental_rating_descriptor {
 /* PARENTAL_RATING_DESCRIPTOR parser */
 int descriptor_0x55_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	int i, n, num_entries = (len-2) / 4;
+	struct bitstream bs;
+	int n;
 
-	for (i=2, n=0; n<num_entries; ++n) {
-		struct dentry *subdir = CREATE_DIRECTORY(parent, "Parental_Rating_Descriptor_%d", n+1);
+	bitstream_init(&bs, &payload[2], len);
+	for (n=0; bitstream_remaining(&bs); ++n) {
+		struct dentry *subdir;
 		struct parental_rating_descriptor p;
+		const uint8_t *country_code = (const uint8_t *) bitstream_read_bytes(&bs, 3);
 		memset(&p, 0, sizeof(p));
+		p.rating = bitstream_read_u8(&bs);
+		if (bitstream_error(&bs))
+			break;
+
+		subdir = CREATE_DIRECTORY(parent, "Parental_Rating_Descriptor_%d", n+1);
 		sprintf(p.country_code, "%c%c%c [0x%x%x%x]", 
-				payload[i], payload[i+1], payload[i+2],
-				payload[i], payload[i+1], payload[i+2]);
-		p.rating = payload[i+3];
+				country_code[0], country_code[1], country_code[2],
+				country_code[0], country_code[1], country_code[2]);
 		CREATE_FILE_STRING(subdir, &p, country_code, XATTR_FORMAT_STRING_AND_NUMBER);
 		CREATE_FILE_NUMBER(subdir, &p, rating);
-		i += 4;
 	}
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
     return 0;
 }
-
@@ -32,6 +32,7 @@
 #include "ts.h"
 #include "tables/psi.h"
 #include "tables/pmt.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct aac_descriptor {
@@ -46,9 +47,10 @@ struct aac_descriptor {
 /* AAC_AUDIO_DESCRIPTOR parser */
 int descriptor_0x7c_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	struct dentry *dentry = CREATE_DIRECTORY(parent, "AAC_Audio_Descriptor");
+	struct dentry *dentry;
 	struct aac_descriptor d;
-	int offset;
+	struct bitstream bs;
+	uint32_t infolen;
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
@@ -56,10 +58,18 @@ int descriptor_0x7c_parser(const char *payload, int len, struct dentry *parent,
 	if (! DESCRIPTOR_COMES_FROM_PMT(priv))
 		TS_WARNING("AAC_Audio_Descriptor found outside the PMT");
 
-	d._profile_and_level = payload[2];
-	d.aac_type_flag = (payload[3] >> 7) & 0x01;
-	d.reserved = payload[3] & 0x7f;
-	offset = 4;
+	bitstream_init(&bs, &payload[2], len);
+	d._profile_and_level = bitstream_read_u8(&bs);
+	d.aac_type_flag = bitstream_read_bits(&bs, 1);
+	d.reserved = bitstream_read_bits(&bs, 7);
+	if (d.aac_type_flag)
+		d.aac_type = bitstream_read_u8(&bs);
+	infolen = bitstream_remaining(&bs);
+	d.additional_info = (char *) bitstream_read_bytes(&bs, infolen);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
+	dentry = CREATE_DIRECTORY(parent, "AAC_Audio_Descriptor");
 
 	switch (d._profile_and_level) {
 		case 0x00 ... 0x0e: 
@@ -259,26 +269,11 @@ int descriptor_0x7c_parser(const char *payload, int len, struct dentry *parent,
 	}
 	CREATE_FILE_NUMBER(dentry, &d, aac_type_flag);
 
-	if (d.aac_type_flag) {
-		if (len < 5) {
-			TS_WARNING("aac_type_flag is set but descriptor contains only %d bytes", len);
-			return -ENODATA;
-		}
-		d.aac_type = payload[offset++];
+	if (d.aac_type_flag)
 		CREATE_FILE_NUMBER(dentry, &d, aac_type);
-	}
 
-	if (offset < len) {
-		int infolen = len-offset;
-		d.additional_info = malloc(sizeof(char) * infolen);
-		if (! d.additional_info) {
-			perror("malloc");
-			return -ENOMEM;
-		}
-		memcpy(d.additional_info, &payload[offset], infolen);
+	if (infolen)
 		CREATE_FILE_BIN(dentry, &d, additional_info, infolen);
-		free(d.additional_info);
-	}
 
     return 0;
 }
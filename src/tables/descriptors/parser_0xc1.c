@@ -30,6 +30,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct component {
@@ -116,89 +117,93 @@ int descriptor_0xc1_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry, *subdir;
 	struct formatted_descriptor f;
-	int i;
+	struct bitstream bs, components;
+	uint8_t flags;
 
 	if (! descriptor_is_parseable(parent, payload[0], 3, len))
 		return -ENODATA;
 
+	bitstream_init(&bs, &payload[2], len);
+	flags = bitstream_read_u8(&bs);
+	f.maximum_bitrate_flag = (flags >> 5) & 0x01;
+	f.component_control_flag = (flags >> 4) & 0x01;
+	if (f.maximum_bitrate_flag)
+		f.maximum_bitrate = bitstream_read_u8(&bs);
+	if (f.component_control_flag) {
+		f.component_control_length = bitstream_read_u8(&bs);
+		bitstream_sub(&bs, f.component_control_length, &components);
+	}
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Digital_Copy_Control_Descriptor");
 
-	f._digital_recording_control_data = (payload[2] >> 6) & 0x03;
+	f._digital_recording_control_data = (flags >> 6) & 0x03;
 	interpret_digital_recording_control_data(f.digital_recording_control_data, 
 		sizeof(f.digital_recording_control_data), f._digital_recording_control_data);
 	CREATE_FILE_STRING(dentry, &f, digital_recording_control_data, XATTR_FORMAT_STRING_AND_NUMBER);
 
-	f.maximum_bitrate_flag = (payload[2] >> 5) & 0x01;
 	CREATE_FILE_NUMBER(dentry, &f, maximum_bitrate_flag);
-
-	f.component_control_flag = (payload[2] >> 4) & 0x01;
 	CREATE_FILE_NUMBER(dentry, &f, component_control_flag);
 
-	f._copy_control_type = (payload[2] >> 2) & 0x03;
+	f._copy_control_type = (flags >> 2) & 0x03;
 	interpret_copy_control_type(f.copy_control_type, sizeof(f.copy_control_type), f._copy_control_type);
 	CREATE_FILE_STRING(dentry, &f, copy_control_type, XATTR_FORMAT_STRING_AND_NUMBER);
 
 	if (f.copy_control_type != 0x00) {
-		f.u.APS_control_data = payload[2] & 0x03;
+		f.u.APS_control_data = flags & 0x03;
 		interpret_aps_control_data(f.APS_control_data, sizeof(f.APS_control_data), f.u.APS_control_data);
 		CREATE_FILE_STRING(dentry, &f, APS_control_data, XATTR_FORMAT_STRING_AND_NUMBER);
 	} else
-		f.u.reserved_future_use = payload[2] & 0x03;
-	if (f.maximum_bitrate_flag) {
-		if (len < 4) {
-			TS_WARNING("Not enough data");
-			return -ENODATA;
-		}
-		f.maximum_bitrate = payload[3];
+		f.u.reserved_future_use = flags & 0x03;
+	if (f.maximum_bitrate_flag)
 		CREATE_FILE_NUMBER(dentry, &f, maximum_bitrate);
-	}
-	i = 3 + f.maximum_bitrate_flag;
 
 	if (f.component_control_flag) {
-		int component_id = 0, loop_len;
+		int component_id = 0;
 		struct component *comp = &f.c;
 
-		f.component_control_length = payload[i++];
-		loop_len = f.component_control_length;
 		CREATE_FILE_NUMBER(dentry, &f, component_control_length);
 
-		while (loop_len > 0) {
-			subdir = CREATE_DIRECTORY(dentry, "Component_%02d", component_id++);
+		while (bitstream_remaining(&components)) {
+			comp->component_tag = bitstream_read_u8(&components);
+			flags = bitstream_read_u8(&components);
+			comp->maximum_bitrate_flag = (flags >> 5) & 0x01;
+			if (comp->maximum_bitrate_flag)
+				comp->maximum_bitrate = bitstream_read_u8(&components);
+			if (bitstream_error(&components))
+				break;
 
-			comp->component_tag = payload[i];
+			subdir = CREATE_DIRECTORY(dentry, "Component_%02d", component_id++);
 			CREATE_FILE_NUMBER(subdir, comp, component_tag);
 
-			comp->_digital_recording_control_data = (payload[i+1] >> 6) & 0x03;
+			comp->_digital_recording_control_data = (flags >> 6) & 0x03;
 			interpret_digital_recording_control_data(comp->digital_recording_control_data, 
 					sizeof(comp->digital_recording_control_data), comp->_digital_recording_control_data);
 			CREATE_FILE_STRING(subdir, comp, digital_recording_control_data, XATTR_FORMAT_STRING_AND_NUMBER);
 
-			comp->maximum_bitrate_flag = (payload[i+1] >> 5) & 0x01;
 			CREATE_FILE_NUMBER(subdir, comp, maximum_bitrate_flag);
 
-			comp->reserved_future_use = (payload[i+1] >> 4) & 0x01;
+			comp->reserved_future_use = (flags >> 4) & 0x01;
 
-			comp->_copy_control_type = (payload[i+1] >> 2) & 0x03;
+			comp->_copy_control_type = (flags >> 2) & 0x03;
 			interpret_copy_control_type(comp->copy_control_type, sizeof(comp->copy_control_type), 
 					comp->_copy_control_type);
 			CREATE_FILE_STRING(subdir, comp, copy_control_type, XATTR_FORMAT_STRING_AND_NUMBER);
 
 			if (comp->copy_control_type != 0x00) {
-				comp->u.APS_control_data = payload[i+1] & 0x03;
+				comp->u.APS_control_data = flags & 0x03;
 				interpret_aps_control_data(comp->APS_control_data, sizeof(comp->APS_control_data), 
 						comp->u.APS_control_data);
 				CREATE_FILE_STRING(subdir, comp, APS_control_data, XATTR_FORMAT_STRING_AND_NUMBER);
 			} else
-				comp->u.reserved_future_use = payload[i+1] & 0x03;
-			if (comp->maximum_bitrate_flag) {
-				comp->maximum_bitrate = payload[i+2];
-				CREATE_FILE_NUMBER(subdir, &f, maximum_bitrate);
-			}
-			i += 2 + comp->maximum_bitrate_flag;
-			loop_len -= 2 + comp->maximum_bitrate_flag;
+				comp->u.reserved_future_use = flags & 0x03;
+			if (comp->maximum_bitrate_flag)
+				CREATE_FILE_NUMBER(subdir, comp, maximum_bitrate);
 		}
+		if (descriptor_is_truncated(payload[0], &components))
+			return -ENODATA;
 	}
 
     return 0;
 }
-
@@ -33,6 +33,7 @@
 #include "ts.h"
 #include "tables/psi.h"
 #include "tables/pat.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct transmission_type_data {
@@ -52,50 +53,58 @@ struct formatted_descriptor {
 int descriptor_0xcd_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
 	struct formatted_descriptor f;
-	uint8_t offset, i, j;
+	struct dentry *dentry;
+	struct bitstream bs;
+	const char *ts_name;
+	uint8_t i, j;
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 	
-	f.remote_control_key_id = payload[2];
-	f.length_of_ts_name = payload[3] >> 2;
-	f.transmission_type_count = payload[3] & 0x03;
+	bitstream_init(&bs, &payload[2], len);
+	f.remote_control_key_id = bitstream_read_u8(&bs);
+	f.length_of_ts_name = bitstream_read_bits(&bs, 6);
+	f.transmission_type_count = bitstream_read_bits(&bs, 2);
+	ts_name = bitstream_read_bytes(&bs, f.length_of_ts_name);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
 	
-	for (i=0; i<f.length_of_ts_name; ++i)
-		f.ts_name[i] = payload[4+i];
-	f.ts_name[i] = '\0';
+	memcpy(f.ts_name, ts_name, f.length_of_ts_name);
+	f.ts_name[f.length_of_ts_name] = '\0';
 	
-	struct dentry *dentry = CREATE_DIRECTORY(parent, "Transmission_Information_Descriptor");
+	dentry = CREATE_DIRECTORY(parent, "Transmission_Information_Descriptor");
 	CREATE_FILE_NUMBER(dentry, &f, remote_control_key_id);
 	CREATE_FILE_NUMBER(dentry, &f, length_of_ts_name);
 	CREATE_FILE_NUMBER(dentry, &f, transmission_type_count);
 	CREATE_FILE_STRING(dentry, &f, ts_name, XATTR_FORMAT_STRING);
 
-	offset = 4 + f.length_of_ts_name;
 	for (i=0; i<f.transmission_type_count; ++i) {
 		struct transmission_type_data t;
 		struct dentry *subdir, *service;
 		
-		subdir = CREATE_DIRECTORY(dentry, "Transmission_%02d", i+1);
+		t.transmission_type_info = bitstream_read_u8(&bs);
+		t.num_of_service = bitstream_read_u8(&bs);
+		if (bitstream_error(&bs))
+			break;
 
-		t.transmission_type_info = payload[offset];
-		t.num_of_service = payload[offset+1];
-		offset += 2;
+		subdir = CREATE_DIRECTORY(dentry, "Transmission_%02d", i+1);
 		CREATE_FILE_NUMBER(subdir, &t, transmission_type_info);
 		CREATE_FILE_NUMBER(subdir, &t, num_of_service);
 
 		for (j=0; j<t.num_of_service; j++) {
-			t.service_id = CONVERT_TO_16(payload[offset], payload[offset+1]);
-			offset += 2;
+			t.service_id = bitstream_read_u16(&bs);
+			if (bitstream_error(&bs))
+				break;
 
-			service = CREATE_DIRECTORY(subdir, "Service_%02d", (j/2)+1);
+			service = CREATE_DIRECTORY(subdir, "Service_%02d", j+1);
 			CREATE_FILE_NUMBER(service, &t, service_id);
 
 			if (! pat_announces_service(t.service_id, priv))
 				TS_WARNING("service_id %#x not declared by the PAT", t.service_id);
 		}
 	}
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
 
     return 0;
 }
-
@@ -31,6 +31,7 @@
 #include "byteops.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct segmentation_mode_0x01 {
@@ -47,8 +48,7 @@ struct segmentation_mode_0x02_to_0x05 {
 };
 
 struct segmentation_mode_other {
-	/* XXX: is 512 big enough? */
-	char reserved_bytes[512];
+	char reserved_bytes[256];
 };
 
 struct formatted_descriptor {
@@ -62,51 +62,53 @@ int descriptor_0xd0_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs, info;
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
+	bitstream_init(&bs, &payload[2], len);
+	f.segmentation_mode = bitstream_read_u8(&bs) & 0x0f;
+	f.segmentation_info_length = bitstream_read_u8(&bs);
+	bitstream_sub(&bs, f.segmentation_info_length, &info);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Basic_Local_Event_Descriptor");
-	f.segmentation_mode = payload[2] & 0x0f;
-	f.segmentation_info_length = payload[3];
 	CREATE_FILE_NUMBER(dentry, &f, segmentation_mode);
 	CREATE_FILE_NUMBER(dentry, &f, segmentation_info_length);
 	if (f.segmentation_mode == 0x00) {
 		/* Empty */
 	} else if (f.segmentation_mode == 0x01) {
 		struct segmentation_mode_0x01 sm;
-		if (! descriptor_is_parseable(parent, payload[0], 14, len)) {
+		sm.start_time_ntp = bitstream_read_u40(&info);
+		sm.end_time_ntp = bitstream_read_u40(&info);
+		if (descriptor_is_truncated(payload[0], &info)) {
 			/* Can't continue to parse */
 			return -ENODATA;
 		}
-		sm.start_time_ntp = CONVERT_TO_40(payload[4], payload[5], payload[6], payload[7], payload[8]);
-		sm.end_time_ntp = CONVERT_TO_40(payload[9], payload[10], payload[11], payload[12], payload[13]);
 		CREATE_FILE_NUMBER(dentry, &sm, start_time_ntp);
 		CREATE_FILE_NUMBER(dentry, &sm, end_time_ntp);
 	} else if (f.segmentation_mode >= 0x02 && f.segmentation_mode <= 0x05) {
 		struct segmentation_mode_0x02_to_0x05 sm;
-		if (! descriptor_is_parseable(parent, payload[0], 10, len)) {
+		sm.start_time = bitstream_read_u24(&info);
+		sm.duration = bitstream_read_u24(&info);
+		if (descriptor_is_truncated(payload[0], &info)) {
 			/* Can't continue to parse */
 			return -ENODATA;
 		}
-		sm.start_time = CONVERT_TO_24(payload[4], payload[5], payload[6]);
-		sm.duration = CONVERT_TO_24(payload[7], payload[8], payload[9]);
 		CREATE_FILE_NUMBER(dentry, &sm, start_time);
 		CREATE_FILE_NUMBER(dentry, &sm, duration);
-		if (len >= 14) {
-			sm.start_time_extension = CONVERT_TO_16(payload[10], payload[11]) >> 4;
-			sm.duration_extension = CONVERT_TO_16(payload[12], payload[13]) >> 4;
+		if (bitstream_remaining(&info) >= 4) {
+			sm.start_time_extension = bitstream_read_u16(&info) >> 4;
+			sm.duration_extension = bitstream_read_u16(&info) >> 4;
 			CREATE_FILE_NUMBER(dentry, &sm, start_time_extension);
 			CREATE_FILE_NUMBER(dentry, &sm, duration_extension);
 		}
 	} else {
-		uint32_t n_bytes = len-5;
+		uint32_t n_bytes = bitstream_remaining(&info);
 		struct segmentation_mode_other sm;
-		if (n_bytes > sizeof(sm.reserved_bytes)) {
-			dprintf("Truncating reserved_bytes array");
-			n_bytes = sizeof(sm.reserved_bytes);
-		}
-		memcpy(sm.reserved_bytes, &payload[4], n_bytes);
+		memcpy(sm.reserved_bytes, bitstream_read_bytes(&info, n_bytes), n_bytes);
 		CREATE_FILE_BIN(dentry, &sm, reserved_bytes, n_bytes);
 	}
 	/* 
@@ -115,4 +117,3 @@ int descriptor_0xd0_parser(const char *payload, int len, struct dentry *parent,
 	 */
 	return 0;
 }
-
@@ -31,6 +31,7 @@
 #include "xattr.h"
 #include "ts.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 
@@ -40,8 +41,9 @@ struct formatted_descriptor {
 	uint8_t _transmission_mode;
 	char guard_interval[16];
 	char transmission_mode[32];
-	uint8_t _frequency;
-	char frequency[256];
+	uint16_t _frequency;
+	/* Up to 126 entries of "\n0xffff" */
+	char frequency[1024];
 };
 
 /* TERRESTRIAL_DELIVERY_SYSTEM_DESCRIPTOR parser */
@@ -50,16 +52,18 @@ int descriptor_0xfa_parser(const char *payload, int len, struct dentry *parent,
 	int i;
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs;
 	const char *guard_interval[] = { "1/32", "1/16", "1/8", "1/4" };
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
-	f.area_code = ((payload[2] << 8) | payload[3]) >> 4;
-	f._guard_interval = (payload[3] >> 2) & 0x03;
+	bitstream_init(&bs, &payload[2], len);
+	f.area_code = bitstream_read_bits(&bs, 12);
+	f._guard_interval = bitstream_read_bits(&bs, 2);
+	f._transmission_mode = bitstream_read_bits(&bs, 2);
 	sprintf(f.guard_interval, "%s [%#x]", guard_interval[f._guard_interval], f._guard_interval);
 	
-	f._transmission_mode = payload[3] & 0x03;
 	if (f._transmission_mode == 0 || f._transmission_mode == 1 || f._transmission_mode == 2)
 		sprintf(f.transmission_mode, "Mode %d [%#x]", f._transmission_mode+1, f._transmission_mode);
 	else
@@ -71,13 +75,17 @@ int descriptor_0xfa_parser(const char *payload, int len, struct dentry *parent,
 	CREATE_FILE_STRING(dentry, &f, transmission_mode, XATTR_FORMAT_STRING_AND_NUMBER);
 	
 	memset(f.frequency, 0, sizeof(f.frequency));
-	for (i=0; i<len-2; i+=2) {
+	for (i=0; bitstream_remaining(&bs); ++i) {
 		char buf[16];
-		f._frequency = CONVERT_TO_16(payload[4+i], payload[4+i+1]);
+		f._frequency = bitstream_read_u16(&bs);
+		if (bitstream_error(&bs))
+			break;
 		sprintf(buf, "%s%#x", i == 0 ? "" : "\n", f._frequency);
 		strcat(f.frequency, buf);
 	}
 	CREATE_FILE_STRING(dentry, &f, frequency, XATTR_FORMAT_NUMBER_ARRAY);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
 
     return 0;
 }
@@ -33,6 +33,7 @@
 #include "ts.h"
 #include "tables/psi.h"
 #include "tables/pat.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -42,23 +43,29 @@ struct formatted_descriptor {
 /* PARTIAL_RECEPTION_DESCRIPTOR parser */
 int descriptor_0xfb_parser(const char *payload, int len, struct dentry *parent, struct demuxfs_data *priv)
 {
-	uint8_t i;
+	int n;
 	struct dentry *dentry, *subdir;
+	struct bitstream bs;
 
 	if (! descriptor_is_parseable(parent, payload[0], 2, len))
 		return -ENODATA;
 
 	dentry = CREATE_DIRECTORY(parent, "Partial_Reception_Descriptor");
-	for (i=2; i<len; i+=2) {
+	bitstream_init(&bs, &payload[2], len);
+	for (n=0; bitstream_remaining(&bs); ++n) {
 		struct formatted_descriptor f;
-		f.service_id = CONVERT_TO_16(payload[i], payload[i+1]);
+		f.service_id = bitstream_read_u16(&bs);
+		if (bitstream_error(&bs))
+			break;
 
-		subdir = CREATE_DIRECTORY(dentry, "Service_%02d", ((i-2)/2)+1);
+		subdir = CREATE_DIRECTORY(dentry, "Service_%02d", n+1);
 		CREATE_FILE_NUMBER(subdir, &f, service_id);
 
 		if (! pat_announces_service(f.service_id, priv))
 			TS_WARNING("service_id %#x not declared by the PAT", f.service_id);
 	}
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
     return 0;
 }
 
@@ -31,6 +31,7 @@
 #include "xattr.h"
 #include "ts.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -45,21 +46,26 @@ int descriptor_0xfd_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs;
 	bool is_caption = false;
 
 	if (! descriptor_is_parseable(parent, payload[0], 4, len))
 		return -ENODATA;
 
+	bitstream_init(&bs, &payload[2], len);
+	f.data_component_id = bitstream_read_u16(&bs);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "Data_Component_Descriptor");
-	f.data_component_id = CONVERT_TO_16(payload[2], payload[3]);
 	if (f.data_component_id == 0x08 || f.data_component_id == 0x12)
 		is_caption = true;
 	CREATE_FILE_NUMBER(dentry, &f, data_component_id);
 
-	if (len > 4) {
-		f.dmf = (payload[4] >> 4) & 0x0f;
-		f.reserved = (payload[4] >> 2) & 0x03;
-		f.timing = payload[4] & 0x03;
+	if (bitstream_remaining(&bs)) {
+		f.dmf = bitstream_read_bits(&bs, 4);
+		f.reserved = bitstream_read_bits(&bs, 2);
+		f.timing = bitstream_read_bits(&bs, 2);
 		CREATE_FILE_NUMBER(dentry, &f, dmf);
 		CREATE_FILE_NUMBER(dentry, &f, timing);
 		if (is_caption && f.dmf != 0x03)
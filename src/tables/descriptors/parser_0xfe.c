@@ -30,6 +30,7 @@
 #include "fsutils.h"
 #include "xattr.h"
 #include "ts.h"
+#include "bitstream.h"
 #include "descriptors.h"
 
 struct formatted_descriptor {
@@ -45,15 +46,25 @@ int descriptor_0xfe_parser(const char *payload, int len, struct dentry *parent,
 {
 	struct dentry *dentry;
 	struct formatted_descriptor f;
+	struct bitstream bs;
 	uint16_t bflag, bid;
-	int i;
+	const char *info;
+	uint32_t info_len;
 	
 	if (! descriptor_is_parseable(parent, payload[0], 2, len))
 		return -ENODATA;
 
+	bitstream_init(&bs, &payload[2], len);
+	bflag = bitstream_read_bits(&bs, 2);
+	bid = bitstream_read_bits(&bs, 6);
+	f.additional_broadcasting_identification = bitstream_read_u8(&bs);
+	info_len = bitstream_remaining(&bs);
+	info = bitstream_read_bytes(&bs, info_len);
+	if (descriptor_is_truncated(payload[0], &bs))
+		return -ENODATA;
+
 	dentry = CREATE_DIRECTORY(parent, "System_Management_Descriptor");
 
-	bflag = (payload[2] >> 6);
 	if (bflag == 0)
 		sprintf(f.broadcasting_flag, "Broadcasting [%#x]", bflag);
 	else if (bflag == 1 || bflag == 2)
@@ -61,7 +72,6 @@ int descriptor_0xfe_parser(const char *payload, int len, struct dentry *parent,
 	else
 		sprintf(f.broadcasting_flag, "Reserved [%#x]", bflag);
 
-	bid = payload[2] & 0x3f;
 	if (priv->options.standard == SBTVD_STANDARD) {
 		if (bid == 0 || bid >= 7)
 			sprintf(f.broadcasting_identifier, "Undefined [%#x]", bid);
@@ -85,12 +95,9 @@ int descriptor_0xfe_parser(const char *payload, int len, struct dentry *parent,
 		else
 			sprintf(f.broadcasting_identifier, "Unknown [%#x]", bid);
 	}
-	f.additional_broadcasting_identification = payload[3];
 
-	len -= 2;
-	for (i=0; i<len; ++i)
-		f.additional_identification_information[i] = payload[4+i];
-	f.additional_identification_information[i] = '\0';
+	memcpy(f.additional_identification_information, info, info_len);
+	f.additional_identification_information[info_len] = '\0';
 
 	CREATE_FILE_STRING(dentry, &f, broadcasting_flag, XATTR_FORMAT_STRING_AND_NUMBER);
 	CREATE_FILE_STRING(dentry, &f, broadcasting_identifier, XATTR_FORMAT_STRING_AND_NUMBER);
@@ -32,9 +32,12 @@
 #include "hash.h"
 #include "ts.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "tables/psi.h"
 #include "tables/eit.h"
 #include "descriptors.h"
+#include "dispatch.h"
+#include "trace.h"
 
 void eit_free(struct eit_table *eit)
 {
@@ -80,11 +83,10 @@ static time_t eit_convert_from_mjd_time(uint64_t mjd_time)
 }
 
 static void eit_create_directory(const struct ts_header *header, struct eit_table *eit, 
-	struct dentry **version_dentry, struct demuxfs_data *priv)
+	struct dentry *version_dentry, struct demuxfs_data *priv)
 {
 	/* Create a directory named "EIT" at the root filesystem if it doesn't exist yet */
-	struct dentry *eit_dir, *eit_pid_dir;
-	char *pid_name;
+	struct dentry *eit_dir, *eit_pid_dir, *service_dir, *table_dir;
 
 	if (header->pid == 0x12)
 		eit_dir = CREATE_DIRECTORY(priv->root, FS_H_EIT_NAME);
@@ -97,29 +99,24 @@ static void eit_create_directory(const struct ts_header *header, struct eit_tabl
 		eit_dir = CREATE_DIRECTORY(priv->root, "EIT");
 	}
 
-	/* Create a directory named "<eit_pid>" and populate it with files */
-	asprintf(&pid_name, "%#04x", header->pid);
-	eit_pid_dir = fsutils_get_child(eit_dir, pid_name);
-	if (eit_pid_dir) {
-		free(pid_name);
-		INITIALIZE_DENTRY_UNLINKED(eit->dentry);
-	} else {
-		eit->dentry->name = pid_name;
-		eit->dentry->mode = S_IFDIR | 0555;
-		CREATE_COMMON(eit_dir, eit->dentry);
-		eit_pid_dir = eit->dentry;
-	}
-	
-	/* Create the versioned dir and update the Current symlink */
-	*version_dentry = fsutils_create_version_dir(eit_pid_dir, eit->version_number);
+	/* Each service, table_id and section of a PID is a separate table */
+	eit_pid_dir = CREATE_DIRECTORY(eit_dir, "%#04x", header->pid);
+	service_dir = CREATE_DIRECTORY(eit_pid_dir, "%#06x", eit->identifier);
+	table_dir = CREATE_DIRECTORY(service_dir, "%#04x", eit->table_id);
 
-	psi_populate((void **) &eit, eit_pid_dir);
+	/* Create a directory named "Section_<section_number>" and populate it with files */
+	asprintf(&eit->dentry->name, "Section_%02d", eit->section_number);
+	eit->dentry->mode = S_IFDIR | 0555;
+	CREATE_COMMON(table_dir, eit->dentry);
+	
+	/* Link the versioned dir and update the Current symlink */
+	fsutils_attach_version_dir(eit->dentry, version_dentry);
 }
 
-int eit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
-		struct demuxfs_data *priv)
+int eit_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv)
 {
-	struct eit_table *current_eit = NULL;
+	TRACE_FUNCTION("parser");
 	struct eit_table *eit = (struct eit_table *) calloc(1, sizeof(struct eit_table));
 	assert(eit);
 	
@@ -134,49 +131,60 @@ int eit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	}
 
 	/* Set hash key and check if there's already one version of this table in the hash. */
-	eit->dentry->inode = TS_PACKET_HASH_KEY(header, eit);
-	current_eit = hashtable_get(priv->psi_tables, eit->dentry->inode);
+	eit->dentry->inode = TS_TABLE_IDENTITY(header->pid, eit->table_id, eit->identifier, eit->section_number);
 
 	/* Check whether we should keep processing this packet or not */
-	if (! eit->current_next_indicator || (current_eit && current_eit->version_number == eit->version_number)) {
+	if (! dispatch_table_is_new((struct psi_common_header *) eit, priv)) {
 		eit_free(eit);
 		return 0;
 	}
 
-	TS_INFO("EIT parser: pid=%#x, table_id=%#x, current_eit=%p, eit->version_number=%#x, len=%d", 
-			header->pid, eit->table_id, current_eit, eit->version_number, payload_len);
+	TS_INFO("EIT parser: pid=%#x, table_id=%#x, service_id=%#x, section_number=%d, eit->version_number=%#x, len=%d", 
+			header->pid, eit->table_id, eit->identifier, eit->section_number, eit->version_number, payload_len);
+
+	/* Parse EIT specific bits into a versioned dir that is linked by eit_publish() */
+	struct dentry *version_dentry = fsutils_create_staging_dir(eit->version_number);
+	psi_populate((void **) &eit, version_dentry);
 
-	/* Parse EIT specific bits */
-	struct dentry *version_dentry;
-	eit_create_directory(header, eit, &version_dentry, priv);
+	/* The event loop is bound by the CRC at the end of the section */
+	struct bitstream bs;
+	bitstream_init(&bs, payload, payload_len - 4);
+	bitstream_skip(&bs, 8);
 
-	eit->transport_stream_id = CONVERT_TO_16(payload[8], payload[9]);
-	eit->original_network_id = CONVERT_TO_16(payload[10], payload[11]);
-	eit->segment_last_section_number = payload[12];
-	eit->last_table_id = payload[13];
+	eit->transport_stream_id = bitstream_read_u16(&bs);
+	eit->original_network_id = bitstream_read_u16(&bs);
+	eit->segment_last_section_number = bitstream_read_u8(&bs);
+	eit->last_table_id = bitstream_read_u8(&bs);
 	CREATE_FILE_NUMBER(version_dentry, eit, transport_stream_id);
 	CREATE_FILE_NUMBER(version_dentry, eit, original_network_id);
 	CREATE_FILE_NUMBER(version_dentry, eit, segment_last_section_number);
 	CREATE_FILE_NUMBER(version_dentry, eit, last_table_id);
 
-	struct eit_event *this_event;
-	eit->eit_event = calloc(1, sizeof(struct eit_event));
-	this_event = eit->eit_event;
-
-	int event_nr = 1, i = 14;
-	/* Include extra 4 bytes needed by the CRC32 */
-	while ((i + 4) < payload_len) {
+	struct eit_event *last_event = NULL;
+	int event_nr = 1;
+	while (bitstream_remaining(&bs)) {
 		char event_dirname[32];
 		struct dentry *event_dentry;
-		struct eit_event *next_event = NULL;
-		
-		this_event->event_id = CONVERT_TO_16(payload[i], payload[i+1]);
-		this_event->start_time = CONVERT_TO_40(payload[i+2], payload[i+3], payload[i+4], payload[i+5], payload[i+6]);
-		this_event->duration = CONVERT_TO_24(payload[i+7], payload[i+8], payload[i+9]);
-		this_event->running_status = (payload[i+10] >> 5) & 0x03;
-		this_event->free_ca_mode = (payload[i+10] >> 4) & 0x01;
-		this_event->descriptors_loop_length = CONVERT_TO_16(payload[i+10], payload[i+11]) & 0x0fff;
-		i += 12;
+		struct eit_event *this_event;
+		struct bitstream descriptors_bs;
+
+		this_event = calloc(1, sizeof(struct eit_event));
+		assert(this_event);
+		if (last_event)
+			last_event->next = this_event;
+		else
+			eit->eit_event = this_event;
+		last_event = this_event;
+
+		this_event->event_id = bitstream_read_u16(&bs);
+		this_event->start_time = bitstream_read_u40(&bs);
+		this_event->duration = bitstream_read_u24(&bs);
+		this_event->running_status = bitstream_read_bits(&bs, 3);
+		this_event->free_ca_mode = bitstream_read_bits(&bs, 1);
+		this_event->descriptors_loop_length = bitstream_read_bits(&bs, 12);
+		bitstream_sub(&bs, this_event->descriptors_loop_length, &descriptors_bs);
+		if (bitstream_error(&bs))
+			break;
 
 		/* TODO: unused */
 		eit_convert_from_mjd_time(this_event->start_time);
@@ -190,20 +198,35 @@ int eit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		CREATE_FILE_NUMBER(event_dentry, this_event, free_ca_mode);
 		CREATE_FILE_NUMBER(event_dentry, this_event, descriptors_loop_length);
 
-		int loop_length = this_event->descriptors_loop_length;
-		while (loop_length > 0) {
-			uint32_t desc_length = descriptors_parse(&payload[i], 1, event_dentry, priv);
-			loop_length -= desc_length;
-			i += desc_length;
-		}
-
-		if (i < payload_len) {
-			next_event = calloc(1, sizeof(struct eit_event));
-			this_event->next = next_event;
-			this_event = next_event;
-		} else
-			this_event->next = NULL;
+		descriptors_parse(bitstream_pointer(&descriptors_bs), bitstream_remaining(&descriptors_bs),
+				descriptors_count(bitstream_pointer(&descriptors_bs), bitstream_remaining(&descriptors_bs)),
+				event_dentry, priv);
+	}
+
+	if (bitstream_error(&bs)) {
+		TS_WARNING("EIT of pid %#x runs past the end of the section (%d bytes)", header->pid, payload_len);
+		fsutils_dispose_tree(version_dentry);
+		eit_free(eit);
+		return -EBADMSG;
 	}
+	built->table = eit;
+	built->version_dentry = version_dentry;
+	return 0;
+}
+
+int eit_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("publish");
+	struct eit_table *current_eit, *eit = built->table;
+
+	/* A newer section may have been published while this one was being built */
+	if (! dispatch_table_is_new((struct psi_common_header *) eit, priv)) {
+		fsutils_dispose_tree(built->version_dentry);
+		eit_free(eit);
+		return 0;
+	}
+	current_eit = hashtable_get(priv->psi_tables, eit->dentry->inode);
+	eit_create_directory(header, eit, built->version_dentry, priv);
 
 	if (current_eit) {
 		fsutils_migrate_children(current_eit->dentry, eit->dentry);
@@ -213,3 +236,9 @@ int eit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	hashtable_add(priv->psi_tables, eit->dentry->inode, eit, (hashtable_free_function_t) eit_free);
 	return 0;
 }
+
+int eit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return dispatch_parse_now(eit_build, eit_publish, header, payload, payload_len, priv);
+}
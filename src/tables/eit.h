@@ -32,6 +32,9 @@ typedef struct eit_table {
 
 int eit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
+int eit_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv);
+int eit_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv);
 void eit_free(struct eit_table *eit);
 
 #endif /* __eit_h */
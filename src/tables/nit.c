@@ -32,9 +32,12 @@
 #include "hash.h"
 #include "ts.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "descriptors.h"
 #include "tables/psi.h"
 #include "tables/nit.h"
+#include "dispatch.h"
+#include "trace.h"
 
 void nit_free(struct nit_table *nit)
 {
@@ -48,7 +51,7 @@ void nit_free(struct nit_table *nit)
 	free(nit);
 }
 
-static void nit_create_directory(struct nit_table *nit, struct dentry **version_dentry,
+static void nit_create_directory(struct nit_table *nit, struct dentry *version_dentry,
 		struct demuxfs_data *priv)
 {
 	/* Create a directory named "NIT" and populate it with files */
@@ -56,15 +59,14 @@ static void nit_create_directory(struct nit_table *nit, struct dentry **version_
 	nit->dentry->mode = S_IFDIR | 0555;
 	CREATE_COMMON(priv->root, nit->dentry);
 
-	/* Create the versioned dir and update the Current symlink */
-	*version_dentry = fsutils_create_version_dir(nit->dentry, nit->version_number);
-	psi_populate((void **) &nit, *version_dentry);
+	/* Link the versioned dir and update the Current symlink */
+	fsutils_attach_version_dir(nit->dentry, version_dentry);
 }
 
-int nit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
-		struct demuxfs_data *priv)
+int nit_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv)
 {
-	struct nit_table *current_nit = NULL;
+	TRACE_FUNCTION("parser");
 	struct nit_table *nit = (struct nit_table *) calloc(1, sizeof(struct nit_table));
 	assert(nit);
 
@@ -80,43 +82,54 @@ int nit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 	/* Set hash key and check if there's already one version of this table in the hash */
 	nit->dentry->inode = TS_PACKET_HASH_KEY(header, nit);
-	current_nit = hashtable_get(priv->psi_tables, nit->dentry->inode);
 
 	/* Check whether we should keep processing this packet or not */
-	if (! nit->current_next_indicator || (current_nit && current_nit->version_number == nit->version_number)) {
+	if (! dispatch_table_is_new((struct psi_common_header *) nit, priv)) {
 		nit_free(nit);
 		return 0;
 	}
 	
-	TS_INFO("NIT parser: pid=%#x, table_id=%#x, current_nit=%p, nit->version_number=%#x, len=%d", 
-			header->pid, nit->table_id, current_nit, nit->version_number, payload_len);
+	TS_INFO("NIT parser: pid=%#x, table_id=%#x, nit->version_number=%#x, len=%d", 
+			header->pid, nit->table_id, nit->version_number, payload_len);
 
-	/* TODO: check payload boundaries */
+	/* Parse NIT specific bits into a versioned dir that is linked by nit_publish() */
+	struct dentry *version_dentry = fsutils_create_staging_dir(nit->version_number);
+	psi_populate((void **) &nit, version_dentry);
 
-	/* Parse NIT specific bits */
-	struct dentry *version_dentry;
-	nit->reserved_4 = payload[8] >> 4;
-	nit->network_descriptors_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
-	nit->num_descriptors = descriptors_count(&payload[10], nit->network_descriptors_length);
-	nit_create_directory(nit, &version_dentry, priv);
+	/* The loops are bound by the CRC at the end of the section */
+	struct bitstream bs, loop_bs;
+	bitstream_init(&bs, payload, payload_len - 4);
+	bitstream_skip(&bs, 8);
 
-	descriptors_parse(&payload[10], nit->num_descriptors, version_dentry, priv);
+	nit->reserved_4 = bitstream_read_bits(&bs, 4);
+	nit->network_descriptors_length = bitstream_read_bits(&bs, 12);
+	bitstream_sub(&bs, nit->network_descriptors_length, &loop_bs);
+	nit->num_descriptors = descriptors_count(bitstream_pointer(&loop_bs), bitstream_remaining(&loop_bs));
+	descriptors_parse(bitstream_pointer(&loop_bs), bitstream_remaining(&loop_bs), nit->num_descriptors,
+			version_dentry, priv);
 
-	uint8_t offset = 10 + nit->network_descriptors_length;
-	nit->reserved_5 = payload[offset] >> 4;
-	nit->transport_stream_loop_length = CONVERT_TO_16(payload[offset], payload[offset+1]) & 0x0fff;
-	offset += 2;
+	nit->reserved_5 = bitstream_read_bits(&bs, 4);
+	nit->transport_stream_loop_length = bitstream_read_bits(&bs, 12);
+	bitstream_sub(&bs, nit->transport_stream_loop_length, &loop_bs);
 
 	struct dentry *ts_dentry = CREATE_DIRECTORY(version_dentry, "Transport_Stream_Information");
-	uint16_t i = 0, info_index = 0;
-	while (i < nit->transport_stream_loop_length) {
-		struct dentry *info_dentry = CREATE_DIRECTORY(ts_dentry, "%02d", ++info_index);
+	uint16_t info_index = 0;
+	while (bitstream_remaining(&loop_bs)) {
+		struct dentry *info_dentry;
 		struct nit_ts_data ts_data;
-		ts_data.transport_stream_id = CONVERT_TO_16(payload[offset], payload[offset+1]);
-		ts_data.original_network_id = CONVERT_TO_16(payload[offset+2], payload[offset+3]);
-		ts_data.reserved_future_use = payload[offset+4] >> 4;
-		ts_data.transport_descriptors_length = CONVERT_TO_16(payload[offset+4], payload[offset+5]) & 0x0fff;
-		ts_data.num_descriptors = descriptors_count(&payload[offset+6], ts_data.transport_descriptors_length);
+		struct bitstream descriptors_bs;
+
+		ts_data.transport_stream_id = bitstream_read_u16(&loop_bs);
+		ts_data.original_network_id = bitstream_read_u16(&loop_bs);
+		ts_data.reserved_future_use = bitstream_read_bits(&loop_bs, 4);
+		ts_data.transport_descriptors_length = bitstream_read_bits(&loop_bs, 12);
+		bitstream_sub(&loop_bs, ts_data.transport_descriptors_length, &descriptors_bs);
+		if (bitstream_error(&loop_bs))
+			break;
+		ts_data.num_descriptors = descriptors_count(bitstream_pointer(&descriptors_bs),
+				bitstream_remaining(&descriptors_bs));
+
+		info_dentry = CREATE_DIRECTORY(ts_dentry, "%02d", ++info_index);
 		CREATE_FILE_NUMBER(info_dentry, &ts_data, transport_stream_id);
 		CREATE_FILE_NUMBER(info_dentry, &ts_data, original_network_id);
 		CREATE_FILE_NUMBER(info_dentry, &ts_data, transport_descriptors_length);
@@ -125,10 +138,34 @@ int nit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 			TS_WARNING("NIT: original_network_id(%#x) != network_id(%#x)", 
 					ts_data.original_network_id, nit->identifier);
 
-		descriptors_parse(&payload[offset+6], ts_data.num_descriptors, info_dentry, priv);
-		i += 6 + ts_data.transport_descriptors_length;
-		offset += 6 + ts_data.transport_descriptors_length;
+		descriptors_parse(bitstream_pointer(&descriptors_bs), bitstream_remaining(&descriptors_bs),
+				ts_data.num_descriptors, info_dentry, priv);
+	}
+
+	if (bitstream_error(&bs) || bitstream_error(&loop_bs)) {
+		TS_WARNING("NIT of pid %#x runs past the end of the section (%d bytes)", header->pid, payload_len);
+		fsutils_dispose_tree(version_dentry);
+		nit_free(nit);
+		return -EBADMSG;
+	}
+	built->table = nit;
+	built->version_dentry = version_dentry;
+	return 0;
+}
+
+int nit_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("publish");
+	struct nit_table *current_nit, *nit = built->table;
+
+	/* A newer section may have been published while this one was being built */
+	if (! dispatch_table_is_new((struct psi_common_header *) nit, priv)) {
+		fsutils_dispose_tree(built->version_dentry);
+		nit_free(nit);
+		return 0;
 	}
+	current_nit = hashtable_get(priv->psi_tables, nit->dentry->inode);
+	nit_create_directory(nit, built->version_dentry, priv);
 
 	if (current_nit) {
 		fsutils_migrate_children(current_nit->dentry, nit->dentry);
@@ -138,3 +175,9 @@ int nit_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 	return 0;
 }
+
+int nit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return dispatch_parse_now(nit_build, nit_publish, header, payload, payload_len, priv);
+}
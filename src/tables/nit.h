@@ -32,6 +32,9 @@ typedef struct nit_table {
 
 int nit_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
+int nit_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv);
+int nit_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv);
 void nit_free(struct nit_table *nit);
 
 #endif /* __nit_h */
@@ -35,6 +35,7 @@
 #include "tables/pat.h"
 #include "tables/pmt.h"
 #include "tables/nit.h"
+#include "trace.h"
 
 void pat_free(struct pat_table *pat)
 {
@@ -90,13 +91,17 @@ static void pat_populate(struct pat_table *pat, struct dentry *parent,
 		if (program_number == 0) {
 			snprintf(target, sizeof(target), "../../../%s/%s",
 				FS_NIT_NAME, FS_CURRENT_NAME);
-			if (! existing_parser)
+			if (! existing_parser) {
 				hashtable_add(priv->psi_parsers, pid, nit_parse, NULL);
+				ts_request_pid(pid, priv);
+			}
 		} else {
 			snprintf(target, sizeof(target), "../../../%s/%#04x/%s",
 				FS_PMT_NAME, pid, FS_CURRENT_NAME);
-			if (! existing_parser)
+			if (! existing_parser) {
 				hashtable_add(priv->psi_parsers, pid, pmt_parse, NULL);
+				ts_request_pid(pid, priv);
+			}
 		}
 		CREATE_SYMLINK(dentry, name, target);
 	}
@@ -121,6 +126,7 @@ static void pat_create_directory(struct pat_table *pat, struct demuxfs_data *pri
 int pat_parse(const struct ts_header *header, const char *payload, uint32_t payload_len, 
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	struct pat_table *current_pat = NULL;
 	struct pat_table *pat = (struct pat_table *) calloc(1, sizeof(struct pat_table));
 	assert(pat);
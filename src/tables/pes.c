@@ -29,6 +29,7 @@
 #include "demuxfs.h"
 #include "fsutils.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "buffer.h"
 #include "fifo.h"
 #include "hash.h"
@@ -38,8 +39,7 @@
 #include "dsm-cc/dsmcc.h"
 #include "dsm-cc/dii.h"
 #include "dsm-cc/ddb.h"
-
-static const char *pes_parse_audio_video_payload(const char *, uint32_t, uint32_t *);
+#include "dsm-cc/stream_event.h"
 
 struct pes_header {
 	int      stream_id;
@@ -76,31 +76,80 @@ int pes_identify_stream_id(uint8_t stream_id)
 	}
 }
 
-static struct dentry *pes_get_dentry(const struct ts_header *header, 
-		const char *fifo_name, struct demuxfs_data *priv)
+void pes_bind_sink(uint16_t pid, uint16_t pmt_pid, uint8_t stream_type, struct dentry *pes_fifo,
+		struct dentry *es_fifo, struct demuxfs_data *priv)
 {
-	struct dentry *slink, *dentry = NULL;
-	char pathname[PATH_MAX];
-	ino_t key = header->pid << 1 | (strcmp(fifo_name, FS_ES_FIFO_NAME) == 0 ? 0 : 1);
-
-	dentry = hashtable_get(priv->pes_tables, key);
-	if (! dentry) {
-		sprintf(pathname, "/%s/%#x", FS_STREAMS_NAME, header->pid);
-		slink = fsutils_get_dentry(priv->root, pathname);
-		if (! slink) {
-			dprintf("couldn't get a dentry for '%s'", pathname);
-			return NULL;
-		}
+	struct pes_sink *sink = hashtable_get(priv->pes_tables, pid);
+	if (! sink) {
+		sink = (struct pes_sink *) calloc(1, sizeof(struct pes_sink));
+		if (! sink)
+			return;
+		hashtable_add(priv->pes_tables, pid, sink, free);
+	}
+	sink->pmt_pid = pmt_pid;
+	sink->stream_type = stream_type;
+	sink->pes_fifo = pes_fifo;
+	sink->es_fifo = es_fifo;
+}
 
-		sprintf(pathname, "%s/%s", slink->contents, fifo_name);
-		dentry = fsutils_get_dentry(priv->root, pathname);
-		if (! dentry) {
-			dprintf("couldn't get a dentry for '%s'", pathname);
-			return NULL;
-		}
-		hashtable_add(priv->pes_tables, key, dentry, NULL);
+static void pes_move_fifo(struct dentry *dentry, struct dentry *subdir, struct demuxfs_data *priv)
+{
+	struct fifo_priv *priv_data = (struct fifo_priv *) dentry->priv;
+	char path[PATH_MAX];
+
+	if (dentry->parent == subdir)
+		return;
+	UNLINK_DENTRY(dentry);
+	dentry->parent = subdir;
+	LINK_DENTRY(subdir, dentry);
+	/* The writer reopens the FIFO through its new path once its reader goes */
+	fifo_set_path(priv_data->fifo, fsutils_realpath(dentry, path, sizeof(path), priv));
+}
+
+struct pes_sink *pes_reuse_sink(uint16_t pid, uint16_t pmt_pid, uint8_t stream_type,
+		struct dentry *subdir, struct demuxfs_data *priv)
+{
+	struct pes_sink *sink = hashtable_get(priv->pes_tables, pid);
+	if (! sink || sink->pmt_pid != pmt_pid || sink->stream_type != stream_type)
+		return NULL;
+	pes_move_fifo(sink->pes_fifo, subdir, priv);
+	if (sink->es_fifo)
+		pes_move_fifo(sink->es_fifo, subdir, priv);
+	return sink;
+}
+
+void pes_unbind_sink(uint16_t pid, uint16_t pmt_pid, struct demuxfs_data *priv)
+{
+	struct pes_sink *sink = hashtable_get(priv->pes_tables, pid);
+	if (sink && sink->pmt_pid == pmt_pid) {
+		if (sink->filtered)
+			ts_release_pid(pid, priv);
+		hashtable_del(priv->pes_tables, pid);
+	}
+}
+
+static bool pes_fifo_has_reader(struct dentry *dentry)
+{
+	struct fifo_priv *priv_data = dentry ? (struct fifo_priv *) dentry->priv : NULL;
+	return priv_data && priv_data->fifo && fifo_is_open(priv_data->fifo);
+}
+
+void pes_update_filters(struct demuxfs_data *priv)
+{
+	for (uint16_t pid=0; pid<TS_NULL_PID; ++pid) {
+		struct pes_sink *sink = hashtable_get(priv->pes_tables, pid);
+		if (! sink)
+			continue;
+		/* A reader that has gone is noticed by the next write to its FIFO */
+		bool wanted = pes_fifo_has_reader(sink->pes_fifo) || pes_fifo_has_reader(sink->es_fifo) ||
+			/* Stream events are clocked by the PCR carried by this PID */
+			stream_event_wants_pid(pid, priv);
+		if (wanted && ! sink->filtered)
+			ts_request_pid(pid, priv);
+		else if (! wanted && sink->filtered)
+			ts_release_pid(pid, priv);
+		sink->filtered = wanted;
 	}
-	return dentry;
 }
 
 static int pes_append_to_fifo(struct dentry *dentry, bool pusi,
@@ -147,6 +196,7 @@ static int pes_append_to_fifo(struct dentry *dentry, bool pusi,
 int pes_parse_audio(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	struct pes_sink *sink = hashtable_get(priv->pes_tables, header->pid);
 	struct dentry *es_dentry, *pes_dentry;
 	struct av_fifo_priv *priv_data;
 	bool is_audio = true;
@@ -160,7 +210,7 @@ int pes_parse_audio(const struct ts_header *header, const char *payload, uint32_
 		const char *data = payload;
 		uint32_t data_len = payload_len - 4;
 
-		es_dentry = pes_get_dentry(header, FS_ES_FIFO_NAME, priv);
+		es_dentry = sink ? sink->es_fifo : NULL;
 		if (! es_dentry) {
 			TS_WARNING("failed to get ES dentry");
 			return -ENOENT;
@@ -195,7 +245,7 @@ int pes_parse_audio(const struct ts_header *header, const char *payload, uint32_
 				data, data_len, is_audio ? ES_AUDIO_STREAM : ES_OTHER_STREAM);
 	}
 
-	pes_dentry = pes_get_dentry(header, FS_PES_FIFO_NAME, priv);
+	pes_dentry = sink ? sink->pes_fifo : NULL;
 	if (! pes_dentry) {
 		dprintf("dentry = NULL");
 		return -ENOENT;
@@ -207,6 +257,7 @@ int pes_parse_audio(const struct ts_header *header, const char *payload, uint32_
 int pes_parse_video(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	struct pes_sink *sink = hashtable_get(priv->pes_tables, header->pid);
 	struct dentry *es_dentry, *pes_dentry;
 	struct av_fifo_priv *priv_data;
 	bool is_video = false;
@@ -220,7 +271,7 @@ int pes_parse_video(const struct ts_header *header, const char *payload, uint32_
 		const char *data = payload;
 		uint32_t data_len = payload_len - 4;
 
-		es_dentry = pes_get_dentry(header, FS_ES_FIFO_NAME, priv);
+		es_dentry = sink ? sink->es_fifo : NULL;
 		if (! es_dentry) {
 			TS_WARNING("failed to get ES dentry");
 			return -ENOENT;
@@ -288,7 +339,7 @@ int pes_parse_video(const struct ts_header *header, const char *payload, uint32_
 				data, data_len, is_video ? ES_VIDEO_STREAM : ES_OTHER_STREAM);
 	}
 
-	pes_dentry = pes_get_dentry(header, FS_PES_FIFO_NAME, priv);
+	pes_dentry = sink ? sink->pes_fifo : NULL;
 	if (! pes_dentry) {
 		dprintf("dentry = NULL");
 		return -ENOENT;
@@ -297,10 +348,21 @@ int pes_parse_video(const struct ts_header *header, const char *payload, uint32_
 		payload, payload_len, ES_OTHER_STREAM);
 }
 
-static const char *pes_parse_audio_video_payload(const char *payload, uint32_t payload_len,
-		uint32_t *data_len)
+static __attribute__((cold, noinline)) const char *pes_malformed_header(uint32_t payload_len)
+{
+	TS_ERROR("Malformed PES header, payload_len=%d. Unbound stream?", payload_len);
+	return NULL;
+}
+
+/**
+ * Reads the PES header of @payload up to the PES extension, leaving @bs at
+ * the PES packet data bytes and @header at the PES extension, if any.
+ * @return the flags byte of the header.
+ */
+static inline uint8_t pes_read_header(const char *payload, uint32_t payload_len,
+		struct bitstream *bs, struct bitstream *header)
 {
-	/* Initialize 'n' right before the flags byte:
+	/* Skip right to the flags byte:
 	 *
 	 * packet_start_code_prefix  24
 	 * stream_id                  8
@@ -312,7 +374,8 @@ static const char *pes_parse_audio_video_payload(const char *payload, uint32_t p
 	 * data_alignment_indicator   1
 	 * copyright                  1
 	 * original_or_copy           1 */
-	int n = 7;
+	bitstream_init(bs, payload, payload_len);
+	bitstream_skip(bs, 7);
 
 	/* PTS_DTS_flags              2
 	 * ESCR_flag                  1
@@ -320,155 +383,157 @@ static const char *pes_parse_audio_video_payload(const char *payload, uint32_t p
 	 * DSM_trick_mode_flag        1
 	 * additional_copy_info_flag  1
 	 * PES_CRC_flag               1
-	 * PES_extension_flag         1 */
-	uint8_t pts_dts_flags = (payload[n] & 0xc0) >> 6;
-	uint8_t escr_flag = (payload[n] & 0x20) >> 5;
-	uint8_t es_rate_flag = (payload[n] & 0x10) >> 4;
-	uint8_t dsm_trick_mode_flag = (payload[n] & 0x08) >> 3;
-	uint8_t additional_copy_info_flag = (payload[n] & 0x04) >> 2;
-	uint8_t pes_crc_flag = (payload[n] & 0x02) >> 1;
-	uint8_t pes_extension_flag = (payload[n] & 0x01);
-	n++;
-
-	/* n == 8 */
-	//uint8_t pes_header_data_length = payload[n];
-	n++;
-
-	if (pts_dts_flags == 0x2) {
-		/* '0010'                 4
-		 * PTS[32..30]            3
-		 * marker_bit             1
-		 * PTS[29..15]           15
-		 * marker_bit             1
-		 * PTS[14..0]            15
-		 * marker_bit             1 */
-		n += 5;
-	} else if (pts_dts_flags == 0x3) {
-		/* '0010'                 4
-		 * PTS[32..30]            3
-		 * marker_bit             1
-		 * PTS[29..15]           15
-		 * marker_bit             1
-		 * PTS[14..0]            15
-		 * marker_bit             1
-		 *
-		 * '0001'                 4
-		 * DTS[32..30]            3
-		 * marker_bit             1
-		 * DTS[29..15]           15
-		 * marker_bit             1
-		 * DTS[14..0]            15
-		 * marker_bit             1 */
-		n += 10;
-	}
-	if (escr_flag) {
-		/* reserved               2
-		 * ESCR_base[32..30]      3
-		 * marker_bit             1
-		 * ESCR_base[29..15]     15
-		 * marker_bit             1
-		 * ESCR_base[14..0]      15
-		 * marker_bit             1
-		 * ESCR_extension         9
-		 * marker_bit             1 */
-		n += 6;
-	}
-	if (es_rate_flag) {
-		/* marker_bit             1
-		 * ES_rate               22
-		 * marker_bit             1 */
-		n += 3;
+	 * PES_extension_flag         1
+	 * PES_header_data_length     8 */
+	uint16_t flags_and_length = bitstream_read_u16(bs);
+	uint8_t flags = flags_and_length >> 8;
+
+	/* The optional fields and stuffing bytes are PES_header_data_length bytes
+	 * long and the data bytes follow them */
+	uint8_t pes_header_data_length = flags_and_length & 0xff;
+	bitstream_sub(bs, pes_header_data_length, header);
+
+	/* The optional fields are not parsed, so the ones that are present are
+	 * skipped at once:
+	 *
+	 * PTS_DTS_flags == '10' (5 bytes):
+	 *   '0010'                 4
+	 *   PTS[32..30]            3
+	 *   marker_bit             1
+	 *   PTS[29..15]           15
+	 *   marker_bit             1
+	 *   PTS[14..0]            15
+	 *   marker_bit             1
+	 * PTS_DTS_flags == '11' (10 bytes):
+	 *   '0011', PTS as above, then
+	 *   '0001'                 4
+	 *   DTS[32..30]            3
+	 *   marker_bit             1
+	 *   DTS[29..15]           15
+	 *   marker_bit             1
+	 *   DTS[14..0]            15
+	 *   marker_bit             1
+	 * ESCR_flag (6 bytes):
+	 *   reserved               2
+	 *   ESCR_base[32..30]      3
+	 *   marker_bit             1
+	 *   ESCR_base[29..15]     15
+	 *   marker_bit             1
+	 *   ESCR_base[14..0]      15
+	 *   marker_bit             1
+	 *   ESCR_extension         9
+	 *   marker_bit             1
+	 * ES_rate_flag (3 bytes):
+	 *   marker_bit             1
+	 *   ES_rate               22
+	 *   marker_bit             1
+	 * DSM_trick_mode_flag (1 byte):
+	 *   trick_mode_control     3
+	 *   field_id, intra_slice_refresh and frequency_truncation,
+	 *   rep_cntrl, or field_id and reserved   5
+	 * additional_copy_info_flag (1 byte):
+	 *   marker_bit             1
+	 *   additional_copy_info   7
+	 * PES_CRC_flag (2 bytes):
+	 *   previous_PES_packet_CRC 16 */
+	static const uint8_t pts_dts_escr_es_rate_length[16] = {
+		/* PTS_DTS_flags '00' and '01' */
+		0, 3, 6, 9, 0, 3, 6, 9,
+		/* PTS_DTS_flags '10' */
+		5, 8, 11, 14,
+		/* PTS_DTS_flags '11' */
+		10, 13, 16, 19,
+	};
+	static const uint8_t trick_mode_copy_info_crc_length[16] = {
+		/* PES_extension_flag is parsed apart */
+		0, 0, 2, 2, 1, 1, 3, 3,
+		1, 1, 3, 3, 2, 2, 4, 4,
+	};
+	bitstream_skip(header, pts_dts_escr_es_rate_length[flags >> 4] +
+			trick_mode_copy_info_crc_length[flags & 0x0f]);
+	return flags;
+}
+
+/**
+ * Finds the PES packet data bytes once the header has been read.
+ */
+static inline const char *pes_data(const struct bitstream *bs, const struct bitstream *header,
+		uint32_t payload_len, uint32_t *data_len)
+{
+	/* Stuffing bytes fill the rest of the header. @header also carries the
+	 * errors of @bs, which isn't read past the header. */
+	if (bitstream_error(header))
+		return pes_malformed_header(payload_len);
+
+	/* PES packet data bytes */
+	*data_len = bitstream_remaining(bs);
+	return bitstream_pointer(bs);
+}
+
+/**
+ * Parses a PES header that carries a PES extension, which few streams do,
+ * out of the way of the common path of pes_parse_audio_video_payload().
+ */
+static __attribute__((noinline)) const char *pes_parse_extended_header(const char *payload,
+		uint32_t payload_len, uint32_t *data_len)
+{
+	struct bitstream bs, header;
+
+	pes_read_header(payload, payload_len, &bs, &header);
+
+	/* PES extension */
+	uint8_t extension_flags = bitstream_read_u8(&header);
+	uint8_t pes_private_data_flag = (extension_flags & 0x80) >> 7;
+	uint8_t pack_header_field_flag = (extension_flags & 0x40) >> 6;
+	uint8_t program_packet_sequence_counter_flag = (extension_flags & 0x20) >> 5;
+	uint8_t p_std_buffer_flag = (extension_flags & 0x10) >> 4;
+	//uint8_t reserved = (extension_flags & 0x0c) >> 2;
+	uint8_t pes_extension_flag_2 = (extension_flags & 0x3);
+
+	if (pes_private_data_flag) {
+		/* PES_private_data */
+		bitstream_skip(&header, 16);
 	}
-	if (dsm_trick_mode_flag) {
-		uint8_t trick_mode_control = (payload[n] & 0xe) >> 1; /* 3 bits */
-		if (trick_mode_control == TRICK_MODE_FAST_FORWARD) {
-			/* field_id             2
-			 * intra_slice_refresh  1
-			 * frequency_truncation 2 */
-			n++;
-		} else if (trick_mode_control == TRICK_MODE_SLOW_MOTION) {
-			/* rep_cntrl            5 */
-			n++;
-		} else if (trick_mode_control == TRICK_MODE_FREEZE_FRAME) {
-			/* field_id             2
-			 * reserved             3 */
-			n++;
-		} else if (trick_mode_control == TRICK_MODE_FAST_REVERSE) {
-			/* field_id             2
-			 * intra_slice_refresh  1
-			 * frequency_truncation 2 */
-			n++;
-		} else if (trick_mode_control == TRICK_MODE_SLOW_REVERSE) {
-			/* rep_cntrl            5 */
-			n++;
-		} else {
-			/* reserved             5 */
-			n++;
-		}
+	if (pack_header_field_flag) {
+		uint8_t pack_field_length = bitstream_read_u8(&header);
+		/* pack_header(); */
+		bitstream_skip(&header, pack_field_length);
 	}
-	if (additional_copy_info_flag) {
-		/* marker_bit             1
-		 * additional_copy_info   7 */
-		n += 1;
+	if (program_packet_sequence_counter_flag) {
+		/* marker_bit                      1
+		 * program_packet_sequence_counter 7
+		 * marker_bit                      1
+		 * MPEG1_MPEG2_identifier          1
+		 * original_stuff_length           6 */
+		bitstream_skip(&header, 2);
 	}
-	if (pes_crc_flag) {
-		/* previous_pes_packet_crc */
-		n += 2;
+	if (p_std_buffer_flag) {
+		/* '01'                2
+		 * P-SDT_buffer_scale  1
+		 * P-SDT_buffer_size  13 */
+		bitstream_skip(&header, 2);
 	}
-	if (pes_extension_flag) {
-		uint8_t pes_private_data_flag = (payload[n] & 0x80) >> 7;
-		uint8_t pack_header_field_flag = (payload[n] & 0x40) >> 6;
-		uint8_t program_packet_sequence_counter_flag = (payload[n] & 0x20) >> 5;
-		uint8_t p_std_buffer_flag = (payload[n] & 0x10) >> 4;
-		//uint8_t reserved = (payload[n] & 0x0c) >> 2;
-		uint8_t pes_extension_flag_2 = (payload[n] & 0x3);
-		n++;
-
-		if (pes_private_data_flag) {
-			/* PES_private_data */
-			n += 16;
-		}
-		if (pack_header_field_flag) {
-			uint8_t pack_field_length = payload[n];
-			/* pack_header(); */
-			n += pack_field_length;
-		}
-		if (program_packet_sequence_counter_flag) {
-			/* marker_bit                      1
-			 * program_packet_sequence_counter 7
-			 * marker_bit                      1
-			 * MPEG1_MPEG2_identifier          1
-			 * original_stuff_length           6 */
-			n += 2;
-		}
-		if (p_std_buffer_flag) {
-			/* '01'                2
-			 * P-SDT_buffer_scale  1
-			 * P-SDT_buffer_size  13 */
-			n += 2;
-		}
-		if (pes_extension_flag_2) {
-			/* marker_bit                 1
-			 * PES_extension_field_length 7
-			 * for (i=0; i<PES_extension_field_length; i++)
-			 *   reserved                 8 */
-			uint8_t pes_extension_field_length = payload[n] & 0x7f;
-			n += 1 + pes_extension_field_length;
-		}
+	if (pes_extension_flag_2) {
+		/* marker_bit                 1
+		 * PES_extension_field_length 7
+		 * for (i=0; i<PES_extension_field_length; i++)
+		 *   reserved                 8 */
+		uint8_t pes_extension_field_length = bitstream_read_u8(&header) & 0x7f;
+		bitstream_skip(&header, pes_extension_field_length);
 	}
+	return pes_data(&bs, &header, payload_len, data_len);
+}
 
-	/* Stuffing bytes */
-	while (payload[n] == 0xff)
-		n++;
-
-	/* PES packet data bytes */
-	if (n > payload_len) {
-		TS_ERROR("PES packet offset(%d) > payload_len(%d). Unbound stream?", n, payload_len);
-		return NULL;
-	}
+const char *pes_parse_audio_video_payload(const char *payload, uint32_t payload_len,
+		uint32_t *data_len)
+{
+	struct bitstream bs, header;
+	uint8_t flags = pes_read_header(payload, payload_len, &bs, &header);
 
-	*data_len = payload_len - n;
-	return &payload[n];
+	/* PES_extension_flag */
+	if (__builtin_expect(flags & 0x01, 0))
+		return pes_parse_extended_header(payload, payload_len, data_len);
+	return pes_data(&bs, &header, payload_len, data_len);
 }
 
 int pes_parse_other(const struct ts_header *header, const char *payload, uint32_t payload_len,
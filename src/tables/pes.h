@@ -57,7 +57,60 @@ enum {
 	ES_OTHER_STREAM
 };
 
+/**
+ * FIFOs fed by the packets of a PES PID, bound when the PMT that lists the
+ * PID is parsed. Stored in priv->pes_tables, keyed by PID.
+ */
+struct pes_sink {
+	/* PID of the PMT that bound this PID */
+	uint16_t pmt_pid;
+	/* Stream type the PMT declared for this PID */
+	uint8_t stream_type;
+	struct dentry *pes_fifo;
+	/* NULL unless PES parsing is enabled */
+	struct dentry *es_fifo;
+	/* True while the backend has been asked to deliver this PID */
+	bool filtered;
+};
+
+/* Interval, in seconds, between two checks for new readers of the FIFOs */
+#define PES_FILTER_UPDATE_INTERVAL 1
+
+/**
+ * Binds @pid to the FIFOs of its stream directory in the PMT at @pmt_pid.
+ */
+void pes_bind_sink(uint16_t pid, uint16_t pmt_pid, uint8_t stream_type, struct dentry *pes_fifo,
+		struct dentry *es_fifo, struct demuxfs_data *priv);
+
+/**
+ * Moves the FIFOs @pid is bound to into @subdir, the stream directory of a new
+ * version of the PMT at @pmt_pid, so that their readers keep being fed.
+ *
+ * Returns the sink on success or NULL if @pid is not bound to a stream of the
+ * same type in that PMT, in which case new FIFOs must be bound.
+ */
+struct pes_sink *pes_reuse_sink(uint16_t pid, uint16_t pmt_pid, uint8_t stream_type,
+		struct dentry *subdir, struct demuxfs_data *priv);
+
+/**
+ * Drops the binding of @pid unless a PMT other than @pmt_pid owns it.
+ */
+void pes_unbind_sink(uint16_t pid, uint16_t pmt_pid, struct demuxfs_data *priv);
+
+/**
+ * Asks the backend for the PIDs whose FIFOs have gained a reader and releases
+ * the ones whose readers have gone. Called periodically by the TS parser thread.
+ */
+void pes_update_filters(struct demuxfs_data *priv);
+
 int pes_identify_stream_id(uint8_t stream_id);
+
+/**
+ * Skips the PES header and optional fields of an audio or video PES packet.
+ * Returns a pointer to the elementary stream data and its length in @data_len.
+ */
+const char *pes_parse_audio_video_payload(const char *payload, uint32_t payload_len,
+		uint32_t *data_len);
 int pes_parse_audio(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
 int pes_parse_video(const struct ts_header *header, const char *payload, uint32_t payload_len,
@@ -33,6 +33,7 @@
 #include "fifo.h"
 #include "ts.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "snapshot.h"
 #include "descriptors.h"
 #include "stream_type.h"
@@ -41,6 +42,9 @@
 #include "tables/pmt.h"
 #include "tables/pes.h"
 #include "dsm-cc/dsmcc.h"
+#include "dsm-cc/stream_event.h"
+#include "dsm-cc/mpe.h"
+#include "trace.h"
 
 struct formatted_descriptor {
 	char *stream_type_identifier;
@@ -64,6 +68,7 @@ void pmt_free(struct pmt_table *pmt)
 
 	/* Free the pmt table structure */
 	pmt->dentry = NULL;
+	free(pmt->programs);
 	free(pmt);
 }
 
@@ -74,18 +79,42 @@ static void pmt_populate(struct pmt_table *pmt, struct dentry *parent,
 	CREATE_FILE_NUMBER(parent, pmt, program_information_length);
 }
 
-static void pmt_populate_stream_dir(struct pmt_stream *stream, const char *descriptor_info,
-		struct dentry *version_dentry, struct dentry **subdir, struct demuxfs_data *priv)
+/* Looks up the component_tag of the STREAM_IDENTIFIER_DESCRIPTOR in an ES_info loop */
+static bool pmt_find_component_tag(const char *es_info, uint16_t es_info_length, uint8_t *component_tag)
 {
-	uint8_t tag = descriptor_info ? descriptor_info[0] : 0;
-	uint8_t component_tag = descriptor_info ? descriptor_info[2] : 0;
+	struct bitstream bs;
+
+	bitstream_init(&bs, es_info, es_info_length);
+	while (bitstream_remaining(&bs) && ! bitstream_error(&bs)) {
+		uint8_t tag = bitstream_read_u8(&bs);
+		uint8_t length = bitstream_read_u8(&bs);
+		const char *body = bitstream_read_bytes(&bs, length);
+		if (body && tag == 0x52 && length >= 1) {
+			*component_tag = body[0];
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Creates the directory of an elementary stream and binds its consumers. The
+ * directory is chosen once for the whole ES_info loop, so all of the stream's
+ * descriptors, FIFOs and symlinks end up in the same place.
+ */
+static void pmt_populate_stream_dir(uint16_t pmt_pid, uint16_t pcr_pid, struct pmt_stream *stream,
+		const char *es_info, struct dentry *version_dentry, struct dentry **subdir,
+		struct demuxfs_data *priv)
+{
+	uint8_t component_tag = 0;
+	bool has_component_tag = pmt_find_component_tag(es_info, stream->es_information_length, &component_tag);
 	bool is_primary = false, is_secondary = false;
 	struct dentry *parent = NULL;
 	const char *streams_name = FS_RESERVED_STREAMS_NAME;
 	char dirname[16], stream_type[256], es_path[PATH_MAX], *es;
 
 	// STREAM_IDENTIFIER_DESCRIPTOR
-	if (tag == 0x52) {
+	if (has_component_tag) {
 		bool is_reserved = false;
 		if (component_is_video(component_tag, &is_primary))
 			streams_name = component_is_one_seg(component_tag) ? FS_ONE_SEG_VIDEO_STREAMS_NAME : FS_VIDEO_STREAMS_NAME;
@@ -138,11 +167,20 @@ static void pmt_populate_stream_dir(struct pmt_stream *stream, const char *descr
 	es = fsutils_path_walk((*subdir), es_path, sizeof(es_path));
 	if (es) {
 		struct dentry *streams_dir = CREATE_DIRECTORY(priv->root, FS_STREAMS_NAME);
+		struct dentry *slink = fsutils_get_child(streams_dir, dirname);
 		if (es > es_path + 2) {
 			*(--es) = '.';
 			*(--es) = '.';
 		}
-		CREATE_SYMLINK(streams_dir, dirname, es);
+		if (! slink)
+			CREATE_SYMLINK(streams_dir, dirname, es);
+		else if (strcmp(slink->contents, es)) {
+			/* Point to the stream directory of the new PMT version */
+			pthread_mutex_lock(&slink->mutex);
+			free(slink->contents);
+			slink->contents = strdup(es);
+			pthread_mutex_unlock(&slink->mutex);
+		}
 	}
 
 	/* Create a FIFO which will contain this stream's PES contents */
@@ -151,18 +189,36 @@ static void pmt_populate_stream_dir(struct pmt_stream *stream, const char *descr
 		int obj_type = stream_type_is_video(stream->stream_type_identifier) ? 
 			OBJ_TYPE_VIDEO_FIFO : OBJ_TYPE_AUDIO_FIFO;
 
-		CREATE_FIFO((*subdir), obj_type, FS_PES_FIFO_NAME, priv);
+		/* A stream listed unchanged by a new PMT version keeps its FIFOs and their readers */
+		struct pes_sink *sink = pes_reuse_sink(stream->elementary_stream_pid, pmt_pid,
+				stream->stream_type_identifier, *subdir, priv);
+		struct dentry *pes_dentry = sink ? sink->pes_fifo : CREATE_FIFO((*subdir), obj_type, FS_PES_FIFO_NAME, priv);
+		struct dentry *es_dentry = sink ? sink->es_fifo : NULL;
 
 		if (priv->options.parse_pes) {
 			/* Create a FIFO which will contain this stream's ES contents */
-			struct dentry *es_dentry = CREATE_FIFO((*subdir), obj_type, FS_ES_FIFO_NAME, priv);
+			if (! es_dentry)
+				es_dentry = CREATE_FIFO((*subdir), obj_type, FS_ES_FIFO_NAME, priv);
 #ifdef USE_FFMPEG
 			if (stream_type_is_video(stream->stream_type_identifier))
 				/* Create a file named snapshot.ppm */
 				CREATE_SNAPSHOT_FILE((*subdir), FS_VIDEO_SNAPSHOT_NAME, es_dentry, priv);
 #endif
 		}
+
+		/* Feed these FIFOs with the packets of this PID */
+		if (! sink)
+			pes_bind_sink(stream->elementary_stream_pid, pmt_pid, stream->stream_type_identifier,
+					pes_dentry, es_dentry, priv);
 	}
+	if (stream_type_is_event_message(stream->stream_type_identifier)) {
+		/* Create a FIFO which will deliver the stream events as they trigger */
+		struct dentry *events_dentry = CREATE_FIFO((*subdir), OBJ_TYPE_FIFO, FS_STREAM_EVENTS_FIFO_NAME, priv);
+		stream_event_bind(stream->elementary_stream_pid, pcr_pid, events_dentry, priv);
+	}
+	if (stream_type_is_mpe(stream->stream_type_identifier))
+		/* Create a file from which the IP datagrams of this stream are read in pcap format */
+		mpe_create_capture((*subdir), stream->elementary_stream_pid, priv);
 	if (stream_type_is_data_carousel(stream->stream_type_identifier) ||
 		stream_type_is_object_carousel(stream->stream_type_identifier)) {
 		char target[PATH_MAX];
@@ -189,8 +245,10 @@ static void pmt_populate_stream_dir(struct pmt_stream *stream, const char *descr
 		stream_type_is_mpe(stream->stream_type_identifier) ||
 		stream_type_is_object_carousel(stream->stream_type_identifier)) {
 		/* Assign this PID to the DSM-CC parser */
-		if (! hashtable_get(priv->psi_parsers, stream->elementary_stream_pid))
+		if (! hashtable_get(priv->psi_parsers, stream->elementary_stream_pid)) {
 			hashtable_add(priv->psi_parsers, stream->elementary_stream_pid, dsmcc_parse, NULL);
+			ts_request_pid(stream->elementary_stream_pid, priv);
+		}
 	} else if (stream_type_is_audio(stream->stream_type_identifier)) {
 		/* Assign this to the PES audio parser */
 		if (! hashtable_get(priv->pes_parsers, stream->elementary_stream_pid))
@@ -204,7 +262,20 @@ static void pmt_populate_stream_dir(struct pmt_stream *stream, const char *descr
 		TS_INFO("Will parse pid %#x / stream_type %#x using a generic PES parser", 
 				stream->elementary_stream_pid, stream->stream_type_identifier);
 		hashtable_add(priv->psi_parsers, stream->elementary_stream_pid, pes_parse_other, NULL);
+		ts_request_pid(stream->elementary_stream_pid, priv);
+	}
+}
+
+/* Tells if the stream at @pid in @pmt feeds a pair of FIFOs */
+static bool pmt_binds_pid(struct pmt_table *pmt, uint16_t pid)
+{
+	for (uint16_t i=0; i<pmt->num_programs; ++i) {
+		struct pmt_program *program = &pmt->programs[i];
+		if (program->elementary_pid == pid)
+			return stream_type_is_audio(program->stream_type) ||
+				stream_type_is_video(program->stream_type);
 	}
+	return false;
 }
 
 static void pmt_create_directory(const struct ts_header *header, struct pmt_table *pmt, 
@@ -228,6 +299,7 @@ static void pmt_create_directory(const struct ts_header *header, struct pmt_tabl
 int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	struct pmt_table *current_pmt = NULL;
 	struct pmt_table *pmt = (struct pmt_table *) calloc(1, sizeof(struct pmt_table));
 	assert(pmt);
@@ -256,54 +328,77 @@ int pmt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	TS_INFO("PMT parser: pid=%#x, table_id=%#x, current_pmt=%p, pmt->version_number=%#x, len=%d", 
 			header->pid, pmt->table_id, current_pmt, pmt->version_number, payload_len);
 
-	/* Parse PMT specific bits */
+	/* Parse PMT specific bits. The loops are bound by the CRC at the end of the section. */
 	struct dentry *version_dentry;
-	pmt->reserved_4 = payload[8] >> 5;
-	pmt->pcr_pid = CONVERT_TO_16(payload[8], payload[9]) & 0x1fff;
-	pmt->reserved_5 = payload[10] >> 4;
-	pmt->program_information_length = CONVERT_TO_16(payload[10], payload[11]) & 0x0fff;
-	pmt->num_descriptors = descriptors_count(&payload[12], pmt->program_information_length);
+	struct bitstream bs, loop_bs;
+	bitstream_init(&bs, payload, payload_len - 4);
+	bitstream_skip(&bs, 8);
+
+	pmt->reserved_4 = bitstream_read_bits(&bs, 3);
+	pmt->pcr_pid = bitstream_read_bits(&bs, 13);
+	pmt->reserved_5 = bitstream_read_bits(&bs, 4);
+	pmt->program_information_length = bitstream_read_bits(&bs, 12);
+	bitstream_sub(&bs, pmt->program_information_length, &loop_bs);
+	if (bitstream_error(&bs)) {
+		TS_WARNING("PMT of pid %#x runs past the end of the section (%d bytes)", header->pid, payload_len);
+		pmt_free(pmt);
+		return 0;
+	}
+	pmt->num_descriptors = descriptors_count(bitstream_pointer(&loop_bs), bitstream_remaining(&loop_bs));
+
 	pmt_create_directory(header, pmt, &version_dentry, priv);
 
-	uint32_t descriptors_len = descriptors_parse(&payload[12], pmt->num_descriptors, 
+	descriptors_parse(bitstream_pointer(&loop_bs), bitstream_remaining(&loop_bs), pmt->num_descriptors,
 			version_dentry, priv);
 
-	uint32_t offset = 12 + descriptors_len;
 	pmt->num_programs = 0;
-	while (offset < 3 + pmt->section_length - sizeof(pmt->crc)) {
+	while (bitstream_remaining(&bs)) {
 		struct pmt_stream stream;
-		stream.stream_type_identifier = payload[offset];
-		stream.reserved_1 = (payload[offset+1] >> 5) & 0x7;
-		stream.elementary_stream_pid = CONVERT_TO_16(payload[offset+1], payload[offset+2]) & 0x1fff;
-		stream.reserved_2 = (payload[offset+3] >> 4) & 0x0f; 
-		stream.es_information_length = CONVERT_TO_16(payload[offset+3], payload[offset+4]) & 0x0fff;
-
-		uint32_t es_i = 0;
-		if (! stream.es_information_length) {
-				struct dentry *subdir = NULL;
-				pmt_populate_stream_dir(&stream, NULL, version_dentry, &subdir, priv);
-		} else {
-			while (es_i < stream.es_information_length) {
-				struct dentry *subdir = NULL;
-				const char *descriptor_info = &payload[offset+5+es_i];
-				pmt_populate_stream_dir(&stream, descriptor_info, version_dentry, &subdir, priv);
-
-				priv->shared_data = (void *) &stream;
-				es_i += descriptors_parse(descriptor_info, 1, subdir, priv);
-				priv->shared_data = NULL;
-			}
+		stream.stream_type_identifier = bitstream_read_u8(&bs);
+		stream.reserved_1 = bitstream_read_bits(&bs, 3);
+		stream.elementary_stream_pid = bitstream_read_bits(&bs, 13);
+		stream.reserved_2 = bitstream_read_bits(&bs, 4);
+		stream.es_information_length = bitstream_read_bits(&bs, 12);
+		bitstream_sub(&bs, stream.es_information_length, &loop_bs);
+		if (bitstream_error(&bs)) {
+			TS_WARNING("PMT of pid %#x: ES_info of pid %#x runs past the end of the section", 
+					header->pid, stream.elementary_stream_pid);
+			break;
 		}
 
-		offset += 5 + stream.es_information_length;
+		struct pmt_program *program;
+		pmt->programs = realloc(pmt->programs, (pmt->num_programs + 1) * sizeof(struct pmt_program));
+		assert(pmt->programs);
+		program = &pmt->programs[pmt->num_programs];
+		program->stream_type = stream.stream_type_identifier;
+		program->elementary_pid = stream.elementary_stream_pid;
+		program->es_info_length = stream.es_information_length;
+
+		struct dentry *subdir = NULL;
+		const char *es_info = bitstream_pointer(&loop_bs);
+		pmt_populate_stream_dir(header->pid, pmt->pcr_pid, &stream, es_info, version_dentry, &subdir, priv);
+
+		priv->shared_data = (void *) &stream;
+		descriptors_parse(es_info, stream.es_information_length,
+				descriptors_count(es_info, stream.es_information_length), subdir, priv);
+		priv->shared_data = NULL;
+
 		pmt->num_programs++;
 	}
-	offset = 12 + pmt->program_information_length;
 
 	if (current_pmt) {
+		/*
+		 * Streams still listed by the new version have been bound to its FIFOs
+		 * already, or have had theirs moved into it. Keeping their sinks keeps
+		 * their hardware filters in place.
+		 */
+		for (uint16_t i=0; i<current_pmt->num_programs; ++i) {
+			uint16_t pid = current_pmt->programs[i].elementary_pid;
+			if (! pmt_binds_pid(pmt, pid))
+				pes_unbind_sink(pid, header->pid, priv);
+		}
 		fsutils_migrate_children(current_pmt->dentry, pmt->dentry);
 		hashtable_del(priv->psi_tables, current_pmt->dentry->inode);
-		/* Invalidate all items from the PES hash table */
-		hashtable_invalidate_contents(priv->pes_tables);
 	}
 	hashtable_add(priv->psi_tables, pmt->dentry->inode, pmt, (hashtable_free_function_t) pmt_free);
 
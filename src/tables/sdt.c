@@ -28,6 +28,7 @@
  */
 #include "demuxfs.h"
 #include "byteops.h"
+#include "bitstream.h"
 #include "fsutils.h"
 #include "xattr.h"
 #include "hash.h"
@@ -40,6 +41,8 @@
 #include "tables/sdt.h"
 #include "tables/pes.h"
 #include "tables/pat.h"
+#include "dispatch.h"
+#include "trace.h"
 
 static void sdt_check_header(struct sdt_table *sdt)
 {
@@ -64,24 +67,22 @@ void sdt_free(struct sdt_table *sdt)
 }
 
 static void sdt_create_directory(const struct ts_header *header, struct sdt_table *sdt, 
-		struct dentry **version_dentry, struct demuxfs_data *priv)
+		struct dentry *version_dentry, struct demuxfs_data *priv)
 {
 	/* Create a directory named "SDT" at the root filesystem */
 	sdt->dentry->name = strdup(FS_SDT_NAME);
 	sdt->dentry->mode = S_IFDIR | 0555;
 	CREATE_COMMON(priv->root, sdt->dentry);
 
-	/* Create the versioned dir and update the Current symlink */
-	*version_dentry = fsutils_create_version_dir(sdt->dentry, sdt->version_number);
-
-	psi_populate((void **) &sdt, *version_dentry);
-	//sdt_populate(sdt, *version_dentry, priv);
+	/* Link the versioned dir and update the Current symlink */
+	fsutils_attach_version_dir(sdt->dentry, version_dentry);
+	//sdt_populate(sdt, version_dentry, priv);
 }
 
-int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
-		struct demuxfs_data *priv)
+int sdt_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv)
 {
-	struct sdt_table *current_sdt = NULL;
+	TRACE_FUNCTION("parser");
 	struct sdt_table *sdt = (struct sdt_table *) calloc(1, sizeof(struct sdt_table));
 	assert(sdt);
 	
@@ -98,50 +99,56 @@ int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	
 	/* Set hash key and check if there's already one version of this table in the hash */
 	sdt->dentry->inode = TS_PACKET_HASH_KEY(header, sdt);
-	current_sdt = hashtable_get(priv->psi_tables, sdt->dentry->inode);
 	
 	/* Check whether we should keep processing this packet or not */
-	if (! sdt->current_next_indicator || (current_sdt && current_sdt->version_number == sdt->version_number)) {
+	if (! dispatch_table_is_new((struct psi_common_header *) sdt, priv)) {
 		sdt_free(sdt);
 		return 0;
 	}
 	
-	TS_INFO("SDT parser: pid=%#x, table_id=%#x, current_sdt=%p, sdt->version_number=%#x, len=%d", 
-			header->pid, sdt->table_id, current_sdt, sdt->version_number, payload_len);
+	TS_INFO("SDT parser: pid=%#x, table_id=%#x, sdt->version_number=%#x, len=%d", 
+			header->pid, sdt->table_id, sdt->version_number, payload_len);
+
+	/* Parse SDT specific bits into a versioned dir that is linked by sdt_publish() */
+	struct dentry *version_dentry = fsutils_create_staging_dir(sdt->version_number);
+	psi_populate((void **) &sdt, version_dentry);
 
-	/* Parse SDT specific bits */
-	struct dentry *version_dentry = NULL;
-	sdt_create_directory(header, sdt, &version_dentry, priv);
+	/* The service loop is bound by the CRC at the end of the section */
+	struct bitstream bs;
+	bitstream_init(&bs, payload, payload_len - 4);
+	bitstream_skip(&bs, 8);
 
-	sdt->original_network_id = CONVERT_TO_16(payload[8], payload[9]);
-	sdt->reserved_future_use = payload[10];
+	sdt->original_network_id = bitstream_read_u16(&bs);
+	sdt->reserved_future_use = bitstream_read_u8(&bs);
 	CREATE_FILE_NUMBER(version_dentry, sdt, original_network_id);
 	
-	uint32_t crc;
-	uint32_t j, i = 11;
-	while (i < payload_len-sizeof(crc)) {
-		uint16_t descriptor_loop_length = CONVERT_TO_16(payload[i+3], payload[i+4]) & 0x0FFF;
-		i += 5 + descriptor_loop_length;
-		if (i > payload_len - 4) {
-			TS_WARNING("descriptor_loop_length exceeds table size");
-			sdt_free(sdt);
-			return -EINVAL;
-		}
+	/* Count how many entries are in the service loop */
+	struct bitstream count_bs = bs;
+	while (bitstream_remaining(&count_bs)) {
+		bitstream_skip(&count_bs, 3); // skip service_id + EIT flags
+		bitstream_skip(&count_bs, bitstream_read_u16(&count_bs) & 0x0fff);
 		sdt->_number_of_services++;
 	}
+	if (bitstream_error(&count_bs)) {
+		TS_WARNING("descriptor_loop_length exceeds table size");
+		fsutils_dispose_tree(version_dentry);
+		sdt_free(sdt);
+		return -EINVAL;
+	}
 
 	sdt->_services = calloc(sdt->_number_of_services, sizeof(struct sdt_service_info));
-	for (j=0, i=11; j < sdt->_number_of_services; ++j) {
+	for (uint32_t j=0; j < sdt->_number_of_services; ++j) {
 		struct sdt_service_info *si = &sdt->_services[j];
 		struct dentry *service_dentry = CREATE_DIRECTORY(version_dentry, "Service_%02d", j+1);
-
-		si->service_id = CONVERT_TO_16(payload[i], payload[i+1]);
-		si->reserved_future_use = (payload[i+2] >> 2) & 0x3f;
-		si->eit_schedule_flag = (payload[i+2] >> 1) & 0x01;
-		si->eit_present_following_flag = payload[i+2] & 0x01;
-		si->running_status = (payload[i+3] >> 5) & 0x07;
-		si->free_ca_mode = (payload[i+3] >> 4) & 0x01;
-		si->descriptors_loop_length = CONVERT_TO_16(payload[i+3], payload[i+4]) & 0x0fff;
+		struct bitstream descriptors_bs;
+
+		si->service_id = bitstream_read_u16(&bs);
+		si->reserved_future_use = bitstream_read_bits(&bs, 6);
+		si->eit_schedule_flag = bitstream_read_bits(&bs, 1);
+		si->eit_present_following_flag = bitstream_read_bits(&bs, 1);
+		si->running_status = bitstream_read_bits(&bs, 3);
+		si->free_ca_mode = bitstream_read_bits(&bs, 1);
+		si->descriptors_loop_length = bitstream_read_bits(&bs, 12);
 		CREATE_FILE_NUMBER(service_dentry, si, service_id);
 		CREATE_FILE_NUMBER(service_dentry, si, eit_schedule_flag);
 		CREATE_FILE_NUMBER(service_dentry, si, eit_present_following_flag);
@@ -149,17 +156,35 @@ int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 		CREATE_FILE_NUMBER(service_dentry, si, free_ca_mode);
 		CREATE_FILE_NUMBER(service_dentry, si, descriptors_loop_length);
 
-		if (! pat_announces_service(si->service_id, priv))
-			TS_WARNING("service_id %#x not declared by the PAT", si->service_id);
+		bitstream_sub(&bs, si->descriptors_loop_length, &descriptors_bs);
+		descriptors_parse(bitstream_pointer(&descriptors_bs), bitstream_remaining(&descriptors_bs),
+				descriptors_count(bitstream_pointer(&descriptors_bs), bitstream_remaining(&descriptors_bs)),
+				service_dentry, priv);
+	}
+	built->table = sdt;
+	built->version_dentry = version_dentry;
+	return 0;
+}
+
+int sdt_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv)
+{
+	TRACE_FUNCTION("publish");
+	struct sdt_table *current_sdt, *sdt = built->table;
+	uint32_t j;
 
-		uint32_t n = 0;
-		while (n < si->descriptors_loop_length) {
-			uint8_t descriptor_length = payload[i+5+n+1];
-			descriptors_parse(&payload[i+5+n], 1, service_dentry, priv);
-			n += 2 + descriptor_length;
-		}
-		i += 5 + si->descriptors_loop_length;
+	/* A newer section may have been published while this one was being built */
+	if (! dispatch_table_is_new((struct psi_common_header *) sdt, priv)) {
+		fsutils_dispose_tree(built->version_dentry);
+		sdt_free(sdt);
+		return 0;
 	}
+	current_sdt = hashtable_get(priv->psi_tables, sdt->dentry->inode);
+	sdt_create_directory(header, sdt, built->version_dentry, priv);
+
+	/* The PAT may change while the SDT is being built, so it is checked on publication */
+	for (j=0; j < sdt->_number_of_services; ++j)
+		if (! pat_announces_service(sdt->_services[j].service_id, priv))
+			TS_WARNING("service_id %#x not declared by the PAT", sdt->_services[j].service_id);
 
 	if (current_sdt) {
 		fsutils_migrate_children(current_sdt->dentry, sdt->dentry);
@@ -169,3 +194,9 @@ int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 	return 0;
 }
+
+int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct demuxfs_data *priv)
+{
+	return dispatch_parse_now(sdt_build, sdt_publish, header, payload, payload_len, priv);
+}
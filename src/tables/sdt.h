@@ -30,6 +30,9 @@ struct sdt_table {
 
 int sdt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv);
+int sdt_build(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv);
+int sdt_publish(const struct ts_header *header, struct built_table *built, struct demuxfs_data *priv);
 void sdt_free(struct sdt_table *sdt);
 
 #endif /* __sdt_h */
@@ -40,6 +40,7 @@
 #include "tables/sdtt.h"
 #include "tables/pes.h"
 #include "tables/pat.h"
+#include "trace.h"
 
 struct sdtt_text_info {
 	char download_level[32];
@@ -70,13 +71,14 @@ void sdtt_free(struct sdtt_table *sdtt)
 static void sdtt_create_directory(const struct ts_header *header, struct sdtt_table *sdtt, 
 		struct dentry **version_dentry, struct demuxfs_data *priv)
 {
-	/* Create a directory named "SDTT" at the root filesystem if it doesn't exist yet */
+	/* Create directories named "SDTT" and "<sdtt_pid>" if they don't exist yet */
 	struct dentry *sdtt_dir = CREATE_DIRECTORY(priv->root, FS_SDTT_NAME);
+	struct dentry *sdtt_pid_dir = CREATE_DIRECTORY(sdtt_dir, "%#04x", header->pid);
 
-	/* Create a directory named "<sdtt_pid>" and populate it with files */
-	asprintf(&sdtt->dentry->name, "%#04x", header->pid);
+	/* Create a directory named "<maker_id><model_id>" and populate it with files */
+	asprintf(&sdtt->dentry->name, "%#06x", sdtt->identifier);
 	sdtt->dentry->mode = S_IFDIR | 0555;
-	CREATE_COMMON(sdtt_dir, sdtt->dentry);
+	CREATE_COMMON(sdtt_pid_dir, sdtt->dentry);
 	
 	/* Create the versioned dir and update the Current symlink */
 	*version_dentry = fsutils_create_version_dir(sdtt->dentry, sdtt->version_number);
@@ -88,6 +90,7 @@ static void sdtt_create_directory(const struct ts_header *header, struct sdtt_ta
 int sdtt_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	struct sdtt_table *current_sdtt = NULL;
 	struct sdtt_table *sdtt = (struct sdtt_table *) calloc(1, sizeof(struct sdtt_table));
 	assert(sdtt);
@@ -104,7 +107,7 @@ int sdtt_parse(const struct ts_header *header, const char *payload, uint32_t pay
 	sdtt_check_header(sdtt);
 	
 	/* Set hash key and check if there's already one version of this table in the hash */
-	sdtt->dentry->inode = TS_PACKET_HASH_KEY(header, sdtt);
+	sdtt->dentry->inode = TS_TABLE_IDENTITY(header->pid, sdtt->table_id, sdtt->identifier, 0);
 	current_sdtt = hashtable_get(priv->psi_tables, sdtt->dentry->inode);
 	
 	/* Check whether we should keep processing this packet or not */
@@ -209,7 +212,7 @@ int sdtt_parse(const struct ts_header *header, const char *payload, uint32_t pay
 
 		index = index+8+(c->_sched_entries*8);
 		c->_num_descriptors = descriptors_count(&payload[index], c->_descriptors_length);
-		descriptors_parse(&payload[index], c->_num_descriptors, subdir, priv);
+		descriptors_parse(&payload[index], c->_descriptors_length, c->_num_descriptors, subdir, priv);
 	}
 
 	if (current_sdtt) {
@@ -40,6 +40,7 @@
 #include "tables/tot.h"
 #include "tables/pes.h"
 #include "tables/pat.h"
+#include "trace.h"
 
 void tot_free(struct tot_table *tot)
 {
@@ -146,7 +147,9 @@ static void tot_create_directory(const struct ts_header *header, struct tot_tabl
 int tot_parse(const struct ts_header *header, const char *payload, uint32_t payload_len,
 		struct demuxfs_data *priv)
 {
+	TRACE_FUNCTION("parser");
 	int num_descriptors;
+	uint32_t descriptors_len;
 	struct tot_table *current_tot = NULL;
 	struct tot_table *tot = (struct tot_table *) calloc(1, sizeof(struct tot_table));
 	assert(tot);
@@ -165,7 +168,11 @@ int tot_parse(const struct ts_header *header, const char *payload, uint32_t payl
 	tot->_utc3_time = CONVERT_TO_40(payload[3], payload[4], payload[5], payload[6], payload[7]) & 0xffffffffff;
 	tot->reserved_4 = payload[8] >> 4;
 	tot->descriptors_loop_length = CONVERT_TO_16(payload[8], payload[9]) & 0x0fff;
-	num_descriptors = descriptors_count(&payload[10], tot->descriptors_loop_length);
+	/* The descriptor loop is bound by the CRC at the end of the section */
+	descriptors_len = tot->descriptors_loop_length;
+	if (10 + descriptors_len + 4 > payload_len)
+		descriptors_len = payload_len > 14 ? payload_len - 14 : 0;
+	num_descriptors = descriptors_count(&payload[10], descriptors_len);
 
 	/* Set hash key and check if there's already one version of this table in the hash */
 	tot->dentry->inode = TS_PACKET_HASH_KEY(header, tot);
@@ -182,12 +189,12 @@ int tot_parse(const struct ts_header *header, const char *payload, uint32_t payl
 
 		tot = current_tot;
 		tot_create_ut3c_time(tot);
-		descriptors_parse(&payload[10], num_descriptors, tot->dentry, priv);
+		descriptors_parse(&payload[10], descriptors_len, num_descriptors, tot->dentry, priv);
 	} else {
         TS_INFO("TOT parser: pid=%#x, table_id=%#x, current_tot=%p, len=%d", 
                 header->pid, tot->table_id, current_tot, payload_len);
 		tot_create_directory(header, tot, priv);
-		descriptors_parse(&payload[10], num_descriptors, tot->dentry, priv);
+		descriptors_parse(&payload[10], descriptors_len, num_descriptors, tot->dentry, priv);
 		hashtable_add(priv->psi_tables, tot->dentry->inode, tot, (hashtable_free_function_t) tot_free);
 	}
 	
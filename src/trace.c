@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "trace.h"
+#include <time.h>
+#include <sys/syscall.h>
+
+/* Number of events in each per-thread ring. Must be a power of two. */
+#define TRACE_RING_SIZE 4096
+
+/* How long the background thread sleeps when there's nothing to write */
+#define TRACE_DRAIN_INTERVAL_MS 20
+
+/* Perfetto's BUILTIN_CLOCK_MONOTONIC, which is what stats_now() reads */
+#define PERFETTO_CLOCK_MONOTONIC 3
+
+enum trace_format {
+	TRACE_FORMAT_JSON,
+	TRACE_FORMAT_PERFETTO,
+};
+
+struct trace_event {
+	const char *category;
+	const char *name;
+	const char *arg_name;
+	int64_t arg_value;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	char phase;
+};
+
+/**
+ * Single-producer, single-consumer ring, following the same protocol as the
+ * log rings: only the owning thread advances @head and only the writer
+ * thread advances @tail.
+ */
+struct trace_ring {
+	uint32_t head;
+	uint32_t tail;
+	bool orphaned;              /**< The owning thread has exited */
+	bool described;             /**< The thread has been announced in the trace file */
+	pid_t tid;
+	char thread_name[32];
+	struct trace_ring *next;
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+bool trace_enabled;
+
+static FILE *trace_fp;
+static enum trace_format trace_format;
+static bool trace_first_event = true;
+static uint64_t trace_dropped;
+static char trace_section_names[256][16];
+
+static __thread struct trace_ring *thread_ring;
+static pthread_key_t thread_ring_key;
+static pthread_once_t thread_ring_key_once = PTHREAD_ONCE_INIT;
+
+/* List of rings, protected by rings_mutex */
+static struct trace_ring *rings;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t writer_thread;
+static bool writer_stop;
+
+static void trace_ring_release(void *data)
+{
+	struct trace_ring *ring = (struct trace_ring *) data;
+	__atomic_store_n(&ring->orphaned, true, __ATOMIC_RELEASE);
+}
+
+static void trace_create_key(void)
+{
+	pthread_key_create(&thread_ring_key, trace_ring_release);
+}
+
+static struct trace_ring *trace_get_thread_ring(void)
+{
+	if (thread_ring)
+		return thread_ring;
+
+	struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+	if (! ring)
+		return NULL;
+	ring->tid = syscall(SYS_gettid);
+	snprintf(ring->thread_name, sizeof(ring->thread_name), "thread-%d", ring->tid);
+	pthread_once(&thread_ring_key_once, trace_create_key);
+	pthread_setspecific(thread_ring_key, ring);
+
+	pthread_mutex_lock(&rings_mutex);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_mutex);
+
+	thread_ring = ring;
+	return ring;
+}
+
+void trace_write(char phase, const char *category, const char *name,
+		uint64_t start_ns, uint64_t end_ns, const char *arg_name, int64_t arg_value)
+{
+	struct trace_ring *ring;
+	struct trace_event *event;
+	uint32_t head, tail;
+
+	if (! __atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+		return;
+	ring = trace_get_thread_ring();
+	if (! ring)
+		return;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= TRACE_RING_SIZE) {
+		__atomic_add_fetch(&trace_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+	event->phase = phase;
+	event->category = category;
+	event->name = name;
+	event->arg_name = arg_name;
+	event->arg_value = arg_value;
+	event->start_ns = start_ns;
+	event->end_ns = end_ns;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_set_thread_name(const char *name)
+{
+	struct trace_ring *ring;
+
+	if (! __atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE))
+		return;
+	ring = trace_get_thread_ring();
+	if (ring && ! __atomic_load_n(&ring->described, __ATOMIC_ACQUIRE))
+		snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", name);
+}
+
+const char *trace_section_name(uint8_t table_id)
+{
+	return trace_section_names[table_id];
+}
+
+/* Chrome JSON output */
+
+static void trace_json_separator(void)
+{
+	if (! trace_first_event)
+		fputs(",\n", trace_fp);
+	trace_first_event = false;
+}
+
+static void trace_json_describe(const struct trace_ring *ring)
+{
+	trace_json_separator();
+	fprintf(trace_fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s\"}}", getpid(), ring->tid, ring->thread_name);
+}
+
+static void trace_json_event(const struct trace_ring *ring, const struct trace_event *event)
+{
+	trace_json_separator();
+	fprintf(trace_fp, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,",
+			event->name, event->category, event->phase, event->start_ns / 1000.0);
+	if (event->phase == 'X')
+		fprintf(trace_fp, "\"dur\":%.3f,", (event->end_ns - event->start_ns) / 1000.0);
+	else
+		fputs("\"s\":\"t\",", trace_fp);
+	fprintf(trace_fp, "\"pid\":%d,\"tid\":%d", getpid(), ring->tid);
+	if (event->arg_name)
+		fprintf(trace_fp, ",\"args\":{\"%s\":%" PRId64 "}", event->arg_name, event->arg_value);
+	fputc('}', trace_fp);
+}
+
+/* Perfetto protobuf output, see perfetto/trace/trace_packet.proto */
+
+#define PB_VARINT  0
+#define PB_BYTES   2
+
+struct pb_buffer {
+	uint8_t data[512];
+	size_t len;
+};
+
+static size_t pb_varint_size(uint64_t value)
+{
+	size_t size = 1;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+/* Fields that do not fit are dropped whole so that the message stays well-formed */
+static bool pb_fits(const struct pb_buffer *pb, size_t size)
+{
+	return size <= sizeof(pb->data) - pb->len;
+}
+
+static void pb_varint(struct pb_buffer *pb, uint64_t value)
+{
+	while (value >= 0x80) {
+		pb->data[pb->len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	pb->data[pb->len++] = value;
+}
+
+static void pb_uint(struct pb_buffer *pb, uint32_t field, uint64_t value)
+{
+	uint32_t tag = (field << 3) | PB_VARINT;
+
+	if (! pb_fits(pb, pb_varint_size(tag) + pb_varint_size(value)))
+		return;
+	pb_varint(pb, tag);
+	pb_varint(pb, value);
+}
+
+static void pb_bytes(struct pb_buffer *pb, uint32_t field, const void *data, size_t len)
+{
+	uint32_t tag = (field << 3) | PB_BYTES;
+
+	if (! pb_fits(pb, pb_varint_size(tag) + pb_varint_size(len) + len))
+		return;
+	pb_varint(pb, tag);
+	pb_varint(pb, len);
+	memcpy(&pb->data[pb->len], data, len);
+	pb->len += len;
+}
+
+static void pb_string(struct pb_buffer *pb, uint32_t field, const char *str)
+{
+	pb_bytes(pb, field, str, strlen(str));
+}
+
+/* Wraps a TracePacket into the top-level Trace message and writes it out */
+static void trace_perfetto_packet(const struct pb_buffer *packet)
+{
+	struct pb_buffer header = { .len = 0 };
+	pb_varint(&header, (1 << 3) | PB_BYTES);
+	pb_varint(&header, packet->len);
+	fwrite(header.data, 1, header.len, trace_fp);
+	fwrite(packet->data, 1, packet->len, trace_fp);
+}
+
+static uint64_t trace_perfetto_sequence(const struct trace_ring *ring)
+{
+	return (uint64_t) ring->tid + 1;
+}
+
+static void trace_perfetto_describe(const struct trace_ring *ring)
+{
+	struct pb_buffer thread = { .len = 0 }, track = { .len = 0 }, packet = { .len = 0 };
+
+	pb_uint(&thread, 1, getpid());                  /* ThreadDescriptor.pid */
+	pb_uint(&thread, 2, ring->tid);                 /* ThreadDescriptor.tid */
+	pb_string(&thread, 5, ring->thread_name);       /* ThreadDescriptor.thread_name */
+
+	pb_uint(&track, 1, ring->tid);                  /* TrackDescriptor.uuid */
+	pb_bytes(&track, 4, thread.data, thread.len);   /* TrackDescriptor.thread */
+
+	pb_uint(&packet, 10, trace_perfetto_sequence(ring)); /* trusted_packet_sequence_id */
+	pb_uint(&packet, 13, 1);                        /* sequence_flags: SEQ_INCREMENTAL_STATE_CLEARED */
+	pb_bytes(&packet, 60, track.data, track.len);   /* track_descriptor */
+	trace_perfetto_packet(&packet);
+}
+
+/* TrackEvent.type: 1 = SLICE_BEGIN, 2 = SLICE_END, 3 = INSTANT */
+static void trace_perfetto_track_event(const struct trace_ring *ring, const struct trace_event *event,
+		int type, uint64_t timestamp)
+{
+	struct pb_buffer annotation = { .len = 0 }, track_event = { .len = 0 }, packet = { .len = 0 };
+
+	pb_uint(&track_event, 9, type);                 /* TrackEvent.type */
+	pb_uint(&track_event, 11, ring->tid);           /* TrackEvent.track_uuid */
+	if (type != 2) {
+		pb_string(&track_event, 22, event->category); /* TrackEvent.categories */
+		pb_string(&track_event, 23, event->name);   /* TrackEvent.name */
+		if (event->arg_name) {
+			pb_string(&annotation, 10, event->arg_name);         /* DebugAnnotation.name */
+			pb_uint(&annotation, 4, (uint64_t) event->arg_value); /* DebugAnnotation.int_value */
+			pb_bytes(&track_event, 4, annotation.data, annotation.len);
+		}
+	}
+
+	pb_uint(&packet, 8, timestamp);                 /* TracePacket.timestamp */
+	pb_uint(&packet, 58, PERFETTO_CLOCK_MONOTONIC); /* TracePacket.timestamp_clock_id */
+	pb_uint(&packet, 10, trace_perfetto_sequence(ring));
+	pb_bytes(&packet, 11, track_event.data, track_event.len);
+	trace_perfetto_packet(&packet);
+}
+
+static void trace_perfetto_event(const struct trace_ring *ring, const struct trace_event *event)
+{
+	if (event->phase == 'X') {
+		trace_perfetto_track_event(ring, event, 1, event->start_ns);
+		trace_perfetto_track_event(ring, event, 2, event->end_ns);
+	} else
+		trace_perfetto_track_event(ring, event, 3, event->start_ns);
+}
+
+/**
+ * Writes all queued events to the trace file and frees the rings of
+ * threads that have exited.
+ * @return number of events written.
+ */
+static int trace_drain(void)
+{
+	struct trace_ring *ring, *prev = NULL, *next;
+	int count = 0;
+
+	pthread_mutex_lock(&rings_mutex);
+	for (ring = rings; ring; ring = next) {
+		bool orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = ring->tail;
+
+		next = ring->next;
+		if (tail != head && ! ring->described) {
+			__atomic_store_n(&ring->described, true, __ATOMIC_RELEASE);
+			if (trace_format == TRACE_FORMAT_PERFETTO)
+				trace_perfetto_describe(ring);
+			else
+				trace_json_describe(ring);
+		}
+		for (; tail != head; ++tail, ++count) {
+			struct trace_event *event = &ring->events[tail & (TRACE_RING_SIZE - 1)];
+			if (trace_format == TRACE_FORMAT_PERFETTO)
+				trace_perfetto_event(ring, event);
+			else
+				trace_json_event(ring, event);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		if (orphaned) {
+			if (prev)
+				prev->next = next;
+			else
+				rings = next;
+			free(ring);
+		} else
+			prev = ring;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+
+	if (count)
+		fflush(trace_fp);
+	return count;
+}
+
+static void *trace_writer_thread(void *data)
+{
+	struct timespec interval = { 0, TRACE_DRAIN_INTERVAL_MS * 1000 * 1000 };
+
+	while (! __atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE))
+		if (trace_drain() == 0)
+			nanosleep(&interval, NULL);
+	trace_drain();
+	return NULL;
+}
+
+static bool trace_has_suffix(const char *path, const char *suffix)
+{
+	size_t len = strlen(path), suffix_len = strlen(suffix);
+	return len >= suffix_len && ! strcasecmp(&path[len - suffix_len], suffix);
+}
+
+int trace_open(const char *path)
+{
+	int i;
+
+	trace_fp = fopen(path, "w");
+	if (! trace_fp) {
+		fprintf(stderr, "Error opening trace file %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+	setvbuf(trace_fp, NULL, _IOFBF, 256 * 1024);
+
+	if (trace_has_suffix(path, ".pftrace") || trace_has_suffix(path, ".perfetto-trace"))
+		trace_format = TRACE_FORMAT_PERFETTO;
+	else {
+		trace_format = TRACE_FORMAT_JSON;
+		fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", trace_fp);
+	}
+
+	for (i=0; i<256; ++i)
+		snprintf(trace_section_names[i], sizeof(trace_section_names[i]), "section_%#04x", i);
+	return 0;
+}
+
+int trace_start(void)
+{
+	if (! trace_fp || trace_enabled)
+		return 0;
+	writer_stop = false;
+	if (pthread_create(&writer_thread, NULL, trace_writer_thread, NULL) != 0)
+		return -1;
+	__atomic_store_n(&trace_enabled, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void trace_shutdown(void)
+{
+	if (! trace_fp)
+		return;
+
+	if (trace_enabled) {
+		__atomic_store_n(&trace_enabled, false, __ATOMIC_RELEASE);
+		__atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+		pthread_join(writer_thread, NULL);
+	}
+	if (trace_format == TRACE_FORMAT_JSON)
+		fputs("\n]}\n", trace_fp);
+	fclose(trace_fp);
+	trace_fp = NULL;
+
+	if (trace_dropped)
+		fprintf(stderr, "Trace: %" PRIu64 " events dropped due to full trace rings\n", trace_dropped);
+}
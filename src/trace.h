@@ -0,0 +1,86 @@
+#ifndef __trace_h
+#define __trace_h
+
+#include "stats.h"
+
+/*
+ * Timeline of the demux pipeline, written with -o trace=FILE. Events are
+ * queued in per-thread rings and written to FILE by a background thread.
+ * Files whose name end in .pftrace or .perfetto-trace are written in the
+ * Perfetto protobuf format; anything else gets the Chrome JSON format.
+ *
+ * Event names, categories and argument names must point to static storage,
+ * as they are only dereferenced when the event is written to disk.
+ */
+
+/* True while the trace writer is running */
+extern bool trace_enabled;
+
+struct trace_scope {
+	const char *category;
+	const char *name;
+	uint64_t start_ns;
+};
+
+/**
+ * Queues an event in the calling thread's ring. @phase is either 'X' for
+ * an event that lasted from @start_ns to @end_ns or 'i' for an instant.
+ */
+void trace_write(char phase, const char *category, const char *name,
+		uint64_t start_ns, uint64_t end_ns, const char *arg_name, int64_t arg_value);
+
+/**
+ * Opens the trace file. Called before FUSE daemonizes so that relative
+ * paths are resolved against the current directory.
+ */
+int trace_open(const char *path);
+
+/**
+ * Starts the background writer. Events are discarded until this is called.
+ */
+int trace_start(void);
+
+/**
+ * Writes all pending events and closes the trace file.
+ */
+void trace_shutdown(void);
+
+/**
+ * Names the calling thread on the timeline.
+ */
+void trace_set_thread_name(const char *name);
+
+/**
+ * Returns a static event name for sections with the given table_id.
+ */
+const char *trace_section_name(uint8_t table_id);
+
+static inline uint64_t trace_begin(void)
+{
+	return __builtin_expect(trace_enabled, 0) ? stats_now() : 0;
+}
+
+#define trace_end(category, name, start_ns, arg_name, arg_value) do { \
+		if (start_ns) \
+			trace_write('X', category, name, start_ns, stats_now(), arg_name, arg_value); \
+	} while(0)
+
+#define trace_instant(category, name, arg_name, arg_value) do { \
+		if (__builtin_expect(trace_enabled, 0)) { \
+			uint64_t __trace_now = stats_now(); \
+			trace_write('i', category, name, __trace_now, __trace_now, arg_name, arg_value); \
+		} \
+	} while(0)
+
+static inline void trace_scope_end(struct trace_scope *scope)
+{
+	if (scope->start_ns)
+		trace_write('X', scope->category, scope->name, scope->start_ns, stats_now(), NULL, 0);
+}
+
+/* Records the time spent in the enclosing function */
+#define TRACE_FUNCTION(category) \
+	struct trace_scope __trace_scope __attribute__((cleanup(trace_scope_end))) = \
+		{ category, __FUNCTION__, trace_begin() }
+
+#endif /* __trace_h */
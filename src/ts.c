@@ -34,6 +34,14 @@
 #include "ts.h"
 #include "crc32.h"
 #include "fsutils.h"
+#include "stats.h"
+#include "trace.h"
+#include "warmstart.h"
+#include "journal.h"
+#include "dispatch.h"
+#include "scan.h"
+#include "backend.h"
+#include "mem.h"
 
 /* PSI tables */
 #include "tables/psi.h"
@@ -45,6 +53,9 @@
 #include "tables/sdtt.h"
 #include "tables/tot.h"
 #include "tables/eit.h"
+#include "tables/descriptors/descriptors.h"
+#include "dsm-cc/descriptors/descriptors.h"
+#include "dsm-cc/stream_event.h"
 
 struct packet_parser {
 	uint8_t table_id;
@@ -176,6 +187,7 @@ static bool continuity_counter_is_ok(const struct ts_header *header, struct buff
 		return false;
 	} else if (! buf_empty) {
 		if ((last_cc == 15 && this_cc != 0) || (this_cc && (this_cc - last_cc) != 1)) {
+			priv->stats.continuity_errors++;
 			if (priv->options.verbose_mask & CONTINUITY_ERROR)
 				TS_WARNING("%s continuity error on pid=%d: last counter=%d, current counter=%d",
 					psi ? "PSI" : "PES", header->pid, last_cc, this_cc);
@@ -186,6 +198,234 @@ static bool continuity_counter_is_ok(const struct ts_header *header, struct buff
 	return true;
 }
 
+static inline void ts_stamp_buffer(struct buffer *buffer, struct demuxfs_data *priv)
+{
+	if (priv->latency && buffer_get_current_size(buffer) == 0)
+		buffer->ingest_ns = priv->latency->packet_ingest_ns;
+}
+
+/**
+ * Hands the PCR carried by an adaptation field, if any, to the journal and to
+ * the clocks of the DSM-CC stream events.
+ */
+static void ts_parse_pcr(uint16_t pid, const uint8_t *adaptation_field, struct demuxfs_data *priv)
+{
+	const uint8_t *p = adaptation_field;
+	uint64_t base, pcr;
+
+	/* adaptation_field_length and PCR_flag */
+	if (p[0] < 7 || ! (p[1] & 0x10))
+		return;
+	base = ((uint64_t) p[2] << 25) | (p[3] << 17) | (p[4] << 9) | (p[5] << 1) | (p[6] >> 7);
+	pcr = base * 300 + (((p[6] & 0x01) << 8) | p[7]);
+	journal_record_pcr(pid, pcr, priv);
+	stream_event_record_pcr(pid, pcr, priv);
+}
+
+/**
+ * Records a section once its parser has run. @complete is the time at which
+ * the section was complete and @generation the generation of the PSI tables
+ * hash before it was parsed; a change in it tells that the parser has
+ * published a new table version. Sections accepted by the parser are kept for
+ * the warm start snapshot.
+ */
+void ts_section_parsed(const struct ts_header *header, struct buffer *buffer, int ret,
+		uint64_t complete, uint64_t generation, struct demuxfs_data *priv)
+{
+	struct latency_stats *latency = priv->latency;
+	uint64_t parsed;
+
+	if (latency) {
+		parsed = stats_now();
+		histogram_record(&latency->section_reassembly, complete - buffer->ingest_ns);
+		histogram_record(&latency->table_parse, parsed - complete);
+		if (priv->psi_tables->generation != generation) {
+			stats_record_publish(buffer->data[0], parsed - buffer->ingest_ns, priv);
+			trace_instant("publish", "version_publish", "table_id", (uint8_t) buffer->data[0]);
+		}
+	}
+	if (priv->warmstart && ret >= 0)
+		warmstart_record(header->pid, buffer->data, buffer->current_size, priv);
+	if (priv->journal && ret >= 0)
+		journal_record(header->pid, buffer->data, buffer->current_size, priv);
+	if (priv->scan && ret >= 0)
+		scan_record(header->pid, buffer->data, buffer->current_size, priv);
+}
+
+/**
+ * Invokes a PSI parser on a complete section, recording how long the section
+ * took to be reassembled and parsed.
+ */
+static int ts_parse_psi_section(parse_function_t parse_function, const struct ts_header *header,
+		struct buffer *buffer, struct demuxfs_data *priv)
+{
+	uint64_t generation, complete = 0;
+	int ret;
+
+	dispatch_lock(priv);
+	if (priv->latency)
+		complete = stats_now();
+	generation = priv->psi_tables->generation;
+	ret = parse_function(header, buffer->data, buffer->current_size, priv);
+	ts_section_parsed(header, buffer, ret, complete, generation, priv);
+	dispatch_unlock(priv);
+	return ret;
+}
+
+/**
+ * Hands a complete section that did not come from the transport stream, such
+ * as one restored from a warm start snapshot, to the parser of its table.
+ */
+int ts_parse_section(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv)
+{
+	parse_function_t parse_function;
+	struct ts_header header;
+	int ret;
+
+	memset(&header, 0, sizeof(header));
+	header.sync_byte = TS_SYNC_BYTE;
+	header.payload_unit_start_indicator = 1;
+	header.adaptation_field = 0x01;
+	header.pid = pid;
+
+	parse_function = ts_get_psi_parser(&header, (uint8_t) section[0], priv);
+	if (! parse_function)
+		return -ENOENT;
+	dispatch_lock(priv);
+	ret = parse_function(&header, section, len, priv);
+	dispatch_unlock(priv);
+	return ret;
+}
+
+/**
+ * Creates a parsing context that builds its tree under a detached directory
+ * named @name, leaving the live tables alone. The memory held by its tables
+ * is accounted to @subsystem.
+ */
+struct demuxfs_data *ts_context_new(const char *name, int subsystem, struct demuxfs_data *priv)
+{
+	struct demuxfs_data *context = (struct demuxfs_data *) calloc(1, sizeof(struct demuxfs_data));
+	struct dentry *root = (struct dentry *) calloc(1, sizeof(struct dentry));
+
+	if (! context || ! root) {
+		free(context);
+		free(root);
+		return NULL;
+	}
+	root->name = strdup(name);
+	root->mode = S_IFDIR | 0555;
+	INITIALIZE_DENTRY_UNLINKED(root);
+	INIT_LIST_HEAD(&root->list);
+
+	context->options = priv->options;
+	context->options.parse_pes = false;
+	context->mount_point = priv->mount_point;
+	context->psi_tables = hashtable_new(DEMUXFS_MAX_PIDS);
+	hashtable_set_accounting(context->psi_tables, subsystem);
+	context->pes_tables = hashtable_new(DEMUXFS_MAX_PIDS);
+	context->psi_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
+	context->pes_parsers = hashtable_new(DEMUXFS_MAX_PIDS);
+	context->packet_buffer = hashtable_new(DEMUXFS_MAX_PIDS);
+	context->ts_descriptors = descriptors_init(context);
+	context->dsmcc_descriptors = dsmcc_descriptors_init(context);
+	context->root = root;
+	return context;
+}
+
+/**
+ * Disposes a parsing context created by ts_context_new() and its tree.
+ */
+void ts_context_destroy(struct demuxfs_data *context)
+{
+	descriptors_destroy(context->ts_descriptors);
+	dsmcc_descriptors_destroy(context->dsmcc_descriptors);
+	hashtable_destroy(context->pes_parsers, NULL);
+	hashtable_destroy(context->psi_parsers, NULL);
+	hashtable_destroy(context->pes_tables, NULL);
+	hashtable_destroy(context->psi_tables, (hashtable_free_function_t) free);
+	hashtable_destroy(context->packet_buffer, (hashtable_free_function_t) buffer_destroy);
+	fsutils_dispose_tree(context->root);
+	free(context);
+}
+
+/**
+ * Asks the backend to deliver the packets of @pid, for backends that filter
+ * PIDs in hardware. Requests are counted, as a PID may be shared by several
+ * tables and streams: each one must be matched by a call to ts_release_pid().
+ * Both are called from the TS parser thread.
+ */
+void ts_request_pid(uint16_t pid, struct demuxfs_data *priv)
+{
+	if (! priv->backend || ! priv->backend->set_pid_filter || pid >= TS_NULL_PID)
+		return;
+	if (! priv->pid_requests) {
+		priv->pid_requests = (uint16_t *) calloc(TS_NULL_PID, sizeof(uint16_t));
+		if (! priv->pid_requests)
+			return;
+	}
+	if (priv->pid_requests[pid]++ == 0)
+		priv->backend->set_pid_filter(pid, true, priv);
+}
+
+/**
+ * Tells the backend that the packets of @pid are no longer consumed by the
+ * caller. The PID is dropped once all of its requests have been released.
+ */
+void ts_release_pid(uint16_t pid, struct demuxfs_data *priv)
+{
+	if (! priv->pid_requests || pid >= TS_NULL_PID || priv->pid_requests[pid] == 0)
+		return;
+	if (--priv->pid_requests[pid] == 0)
+		priv->backend->set_pid_filter(pid, false, priv);
+}
+
+/**
+ * Tells if a complete section is intact. MPE datagram sections with the short
+ * syntax carry a checksum instead of a CRC, which is not verified.
+ */
+static bool ts_section_is_intact(const char *section, uint32_t len)
+{
+	if ((uint8_t) section[0] == TS_MPE_TABLE_ID && ! (section[1] & 0x80))
+		return true;
+	return crc32_check(section, len);
+}
+
+/**
+ * Checks a complete section held by @buffer and hands it to the parser of its table.
+ */
+static void ts_handle_psi_section(const struct ts_header *header, struct buffer *buffer,
+		struct demuxfs_data *priv)
+{
+	uint8_t table_id = buffer->data[0];
+	parse_function_t parse_function;
+
+	if (! ts_section_is_intact(buffer->data, buffer->current_size)) {
+		priv->stats.crc_errors++;
+		trace_instant("section", "crc_error", "pid", header->pid);
+		if (priv->options.verbose_mask & CRC_ERROR)
+			TS_WARNING("CRC error on PID %d(%#x), table_id %d(%#x)", 
+				header->pid, header->pid, table_id, table_id);
+	} else {
+		trace_instant("section", trace_section_name(table_id), "pid", header->pid);
+		if ((parse_function = ts_get_psi_parser(header, table_id, priv)) &&
+			! dispatch_section(header, parse_function, buffer, priv))
+			/* Invoke the PSI parser for this packet */
+			ts_parse_psi_section(parse_function, header, buffer, priv);
+	}
+}
+
+/**
+ * Appends the continuation of a section to its reassembly buffer, parsing it once complete.
+ */
+static void ts_append_psi_data(const struct ts_header *header, struct buffer *buffer,
+		const char *data, size_t size, struct demuxfs_data *priv)
+{
+	if (buffer_append(buffer, data, size) >= 0 && buffer_contains_full_psi_section(buffer)) {
+		ts_handle_psi_section(header, buffer, priv);
+		buffer_reset_size(buffer);
+	}
+}
+
 /**
  * ts_parse_packet - Parse a transport stream packet. Called by the backend's process() function.
  */
@@ -203,6 +443,9 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 		return -EBADMSG;
 	}
 
+	if ((header->adaptation_field & 0x02) && (priv->journal || priv->stream_events))
+		ts_parse_pcr(header->pid, (const uint8_t *) payload, priv);
+
 	if (header->adaptation_field == 0x00) {
 		/* ITU-T Rec. H.222.0 decoders shall discard this packet */
 		return 0;
@@ -232,95 +475,71 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 
 	if (ts_is_psi_packet(header->pid, priv)) {
 		const char *start = payload_start;
-		const char *end = payload_end;
-		bool is_new_packet = false;
-		bool pusi = header->payload_unit_start_indicator;
-		uint8_t table_id;
-
-		if (pusi) {
-			/* The first byte of the payload carries the pointer_field */
-			pointer_field = payload_start[0];
-			start = payload_start + 1;
-			if ((payload_start + pointer_field) > payload_end) {
-				TS_WARNING("pointer_field > TS packet size (%d)", pointer_field);
-				return -ENOBUFS;
-			}
-			section_length = CONVERT_TO_16(start[1], start[2]) & 0x0fff;
-			if ((int) pointer_field > 0) {
-				end = payload_start + pointer_field;
-			} else {
-				is_new_packet = true;
-				end = ((payload_start + 3 + section_length) <= payload_end) ?
-						payload_start + 3 + section_length : 
-						payload_end;
-			}
-		}
 
-		while (start <= payload_end) {
-			buffer = hashtable_get(priv->packet_buffer, header->pid);
-			if (! buffer && is_new_packet) {
-				buffer = buffer_create(header->pid, section_length + 3, false);
-				if (! buffer)
-					return 0;
-				buffer->continuity_counter = header->continuity_counter;
-				hashtable_add(priv->packet_buffer, header->pid, buffer, NULL);
-			} else if (buffer && ! continuity_counter_is_ok(header, buffer, true, priv)) {
+		buffer = hashtable_get(priv->packet_buffer, header->pid);
+		if (buffer) {
+			/* Repeated packets are dropped. After a discontinuity only new sections are parsed. */
+			if (! continuity_counter_is_ok(header, buffer, true, priv) &&
+				buffer->continuity_counter == header->continuity_counter)
 				return 0;
-			} else if (buffer && buffer->current_size == 0 && ! is_new_packet) {
-				/*
-				 * Cannot start appending data if we don't have PUSI set and there are
-				 * no contents in the buffer yet.
-				 */
-				if (! pusi)
-					return 0;
-
-				/*
-				 * The second half of the packet can very well have valid data.
-				 * Just invalidate the buffer to return to the beginning of the loop.
-				 */
-				buffer = NULL;
-			}
-
-			if (is_new_packet && IS_STUFFING_PACKET(start))
-				buffer = NULL;
-
-			if (buffer) {
-				int ret = buffer_append(buffer, start, end - start + 1);
-				if (ret >= 0 && buffer_contains_full_psi_section(buffer)) {
-					table_id = buffer->data[0];
-					if (! crc32_check(buffer->data, buffer->current_size) && 
-						priv->options.verbose_mask & CRC_ERROR)
-						TS_WARNING("CRC error on PID %d(%#x), table_id %d(%#x)", 
-							header->pid, header->pid, table_id, table_id);
-					else if ((parse_function = ts_get_psi_parser(header, table_id, priv)))
-						/* Invoke the PSI parser for this packet */
-						ret = parse_function(header, buffer->data, buffer->current_size, priv);
-					buffer_reset_size(buffer);
-				}
-			}
-			
-			if (! pusi || pointer_field == 0)
-				break;
+			buffer->continuity_counter = header->continuity_counter;
+		}
 
-			if (buffer)
-				buffer_reset_size(buffer);
+		if (! header->payload_unit_start_indicator) {
+			if (buffer && buffer->current_size)
+				ts_append_psi_data(header, buffer, start, payload_end - start + 1, priv);
+			return 0;
+		}
 
-			start = end + 1;
-			if (start >= (payload_end-1))
-				/* No more data to parse */
-				break;
+		/* The first byte of the payload carries the pointer_field */
+		pointer_field = payload_start[0];
+		start = payload_start + 1;
+		if ((payload_start + pointer_field) > payload_end) {
+			TS_WARNING("pointer_field > TS packet size (%d)", pointer_field);
+			return -ENOBUFS;
+		}
+		/* The bytes up to the pointer_field complete the section being reassembled */
+		if (buffer && buffer->current_size) {
+			ts_append_psi_data(header, buffer, start, pointer_field, priv);
+			buffer_reset_size(buffer);
+		}
+		start += pointer_field;
 
-			section_length = CONVERT_TO_16(start[1], start[2]) & 0x0fff;
-			if (IS_STUFFING_PACKET(start) || section_length == 0)
-				/* Nothing to parse */
-				break;
+		/* Sections may be packed back to back up to the stuffing bytes */
+		while (start <= payload_end && ! IS_STUFFING_PACKET(start)) {
+			size_t available = payload_end - start + 1;
 
-			end = ((start + section_length + 2) <= payload_end) ? 
-					start + section_length + 2 :
-					payload_end;
+			if (available >= 3) {
+				section_length = CONVERT_TO_16(start[1], start[2]) & 0x0fff;
+				if (section_length == 0)
+					/* Nothing to parse */
+					break;
+				if (section_length + 3 <= available) {
+					/* The whole section lies in this packet, so it is parsed in place */
+					struct buffer view = {
+						.data = (char *) start,
+						.pid = header->pid,
+						.max_size = section_length + 3,
+						.current_size = section_length + 3,
+						.ingest_ns = priv->latency ? priv->latency->packet_ingest_ns : 0,
+					};
+					ts_handle_psi_section(header, &view, priv);
+					start += section_length + 3;
+					continue;
+				}
+			}
 
-			pusi = false;
-			is_new_packet = true;
+			/* The section goes on in the next packets */
+			if (! buffer) {
+				buffer = buffer_create(header->pid, available >= 3 ? section_length + 3 : MAX_SECTION_SIZE, false);
+				if (! buffer)
+					return 0;
+				buffer->continuity_counter = header->continuity_counter;
+				hashtable_add(priv->packet_buffer, header->pid, buffer, NULL);
+			}
+			ts_stamp_buffer(buffer, priv);
+			buffer_append(buffer, start, available);
+			break;
 		}
 	} else if (ts_is_pes_packet(header->pid, priv)) {
 		bool pusi = header->payload_unit_start_indicator;
@@ -338,6 +557,7 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 				hashtable_add(priv->packet_buffer, header->pid, buffer, NULL);
 			}
 			buffer_reset_size(buffer);
+			ts_stamp_buffer(buffer, priv);
 			buffer_append(buffer, payload_start, payload_end - payload_start + 1);
 		} else {
 			buffer = hashtable_get(priv->packet_buffer, header->pid);
@@ -347,11 +567,14 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 				return 0;
 			if (buffer_get_current_size(buffer) == 0 && !buffer_is_unbounded(buffer))
 				return 0;
+			ts_stamp_buffer(buffer, priv);
 			buffer_append(buffer, payload_start, payload_end - payload_start + 1);
 		}
 		if (buffer_contains_full_pes_section(buffer)) {
 			/* Invoke the PES parser for this packet */
 			ret = parse_function(header, buffer->data, buffer->current_size, priv);
+			if (priv->latency)
+				histogram_record(&priv->latency->pes_fifo_write, stats_now() - buffer->ingest_ns);
 			buffer_reset_size(buffer);
 		}
 	}
@@ -359,3 +582,227 @@ int ts_parse_packet(const struct ts_header *header, const char *payload, struct
 		buffer->continuity_counter = header->continuity_counter;
 	return ret;
 }
+
+/**
+ * Batch decoding. The four header bytes of a packet, read as a little-endian
+ * 32-bit word, map to a struct ts_packet_info word with shifts and masks
+ * alone, which lets the vector version decode eight headers at a time.
+ */
+static inline uint32_t ts_classify_word(uint32_t w)
+{
+	uint32_t flags =
+		((w & 0xff) != TS_SYNC_BYTE ? TS_PACKET_SYNC_ERROR : 0) |
+		((w >> 14) & TS_PACKET_TEI) |
+		((w >> 12) & TS_PACKET_PUSI) |
+		((w >> 25) & (TS_PACKET_PAYLOAD | TS_PACKET_ADAPTATION)) |
+		((w >> 30) ? TS_PACKET_SCRAMBLED : 0) |
+		((w >> 7) & TS_PACKET_PRIORITY);
+	return (w & 0x1f00) | ((w >> 16) & 0xff) | (flags << 16) | (w & 0x0f000000);
+}
+
+static void ts_classify_packets_scalar(const uint8_t *packets, size_t num_packets, size_t packet_size,
+		struct ts_packet_info *info)
+{
+	for (size_t i=0; i<num_packets; ++i) {
+		const uint8_t *p = &packets[i * packet_size];
+		uint32_t word = ts_classify_word(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+		info[i].pid = word & 0xffff;
+		info[i].flags = (word >> 16) & 0xff;
+		info[i].continuity_counter = word >> 24;
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void ts_classify_packets_avx2(const uint8_t *packets, size_t num_packets, size_t packet_size,
+		struct ts_packet_info *info)
+{
+	const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+			_mm256_set1_epi32(packet_size));
+	const __m256i sync = _mm256_set1_epi32(TS_SYNC_BYTE);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i;
+
+	for (i=0; i+8<=num_packets; i+=8) {
+		__m256i w = _mm256_i32gather_epi32((const int *) &packets[i * packet_size], index, 1);
+		__m256i byte0 = _mm256_and_si256(w, _mm256_set1_epi32(0xff));
+		__m256i sync_error = _mm256_andnot_si256(_mm256_cmpeq_epi32(byte0, sync),
+				_mm256_set1_epi32(TS_PACKET_SYNC_ERROR));
+		__m256i scrambled = _mm256_andnot_si256(_mm256_cmpeq_epi32(_mm256_srli_epi32(w, 30), zero),
+				_mm256_set1_epi32(TS_PACKET_SCRAMBLED));
+		__m256i flags = _mm256_or_si256(
+			_mm256_or_si256(sync_error, scrambled),
+			_mm256_or_si256(
+				_mm256_or_si256(
+					_mm256_and_si256(_mm256_srli_epi32(w, 14), _mm256_set1_epi32(TS_PACKET_TEI)),
+					_mm256_and_si256(_mm256_srli_epi32(w, 12), _mm256_set1_epi32(TS_PACKET_PUSI))),
+				_mm256_or_si256(
+					_mm256_and_si256(_mm256_srli_epi32(w, 25),
+						_mm256_set1_epi32(TS_PACKET_PAYLOAD | TS_PACKET_ADAPTATION)),
+					_mm256_and_si256(_mm256_srli_epi32(w, 7), _mm256_set1_epi32(TS_PACKET_PRIORITY)))));
+		__m256i pid = _mm256_or_si256(
+			_mm256_and_si256(w, _mm256_set1_epi32(0x1f00)),
+			_mm256_and_si256(_mm256_srli_epi32(w, 16), _mm256_set1_epi32(0xff)));
+		__m256i out = _mm256_or_si256(
+			_mm256_or_si256(pid, _mm256_slli_epi32(flags, 16)),
+			_mm256_and_si256(w, _mm256_set1_epi32(0x0f000000)));
+		_mm256_storeu_si256((__m256i *) &info[i], out);
+	}
+	ts_classify_packets_scalar(&packets[i * packet_size], num_packets - i, packet_size, &info[i]);
+}
+#endif
+
+/**
+ * Decodes the headers of @num_packets packets stored back to back, @packet_size bytes apart.
+ */
+void ts_classify_packets(const uint8_t *packets, size_t num_packets, size_t packet_size,
+		struct ts_packet_info *info)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	static int has_avx2 = -1;
+	if (has_avx2 < 0)
+		has_avx2 = __builtin_cpu_supports("avx2");
+	if (has_avx2) {
+		ts_classify_packets_avx2(packets, num_packets, packet_size, info);
+		return;
+	}
+#endif
+	ts_classify_packets_scalar(packets, num_packets, packet_size, info);
+}
+
+/* PES packets of a batch waiting to be parsed, grouped by PID */
+struct ts_packet_groups {
+	/* Open addressing: PID -> group. Batches hold a few dozen PIDs at most. */
+	int16_t slot_group[TS_BATCH_PACKETS * 2];
+	uint16_t slot_pid[TS_BATCH_PACKETS * 2];
+	uint16_t group_slot[TS_BATCH_PACKETS];
+	int16_t group_head[TS_BATCH_PACKETS], group_tail[TS_BATCH_PACKETS], next[TS_BATCH_PACKETS];
+	size_t num_groups;
+};
+
+/**
+ * Appends packet @i to the group of its PID, creating the group on the
+ * PID's first appearance.
+ */
+static void ts_group_packet(struct ts_packet_groups *groups, const struct ts_packet_info *info, size_t i)
+{
+	uint16_t pid = info[i].pid;
+	uint32_t slot = ((pid * 0x9e3779b1U) >> 16) & (TS_BATCH_PACKETS * 2 - 1);
+
+	while (groups->slot_group[slot] >= 0 && groups->slot_pid[slot] != pid)
+		slot = (slot + 1) & (TS_BATCH_PACKETS * 2 - 1);
+	if (groups->slot_group[slot] < 0) {
+		groups->slot_group[slot] = groups->num_groups;
+		groups->slot_pid[slot] = pid;
+		groups->group_slot[groups->num_groups] = slot;
+		groups->group_head[groups->num_groups] = i;
+		groups->num_groups++;
+	} else
+		groups->next[groups->group_tail[groups->slot_group[slot]]] = i;
+	groups->group_tail[groups->slot_group[slot]] = i;
+	groups->next[i] = -1;
+}
+
+/**
+ * Parses packet @i of a batch decoded by ts_classify_packets().
+ */
+static int ts_parse_batch_packet(const uint8_t *packets, const struct ts_packet_info *info, size_t i,
+		struct demuxfs_data *priv)
+{
+	const uint8_t *packet = &packets[i * priv->options.packet_size];
+	const struct ts_packet_info *pi = &info[i];
+	struct ts_header header = {
+		.sync_byte = TS_SYNC_BYTE,
+		.transport_error_indicator = !! (pi->flags & TS_PACKET_TEI),
+		.payload_unit_start_indicator = !! (pi->flags & TS_PACKET_PUSI),
+		.transport_priority = !! (pi->flags & TS_PACKET_PRIORITY),
+		.pid = pi->pid,
+		.transport_scrambling_control = packet[3] >> 6,
+		.adaptation_field = (pi->flags & (TS_PACKET_PAYLOAD | TS_PACKET_ADAPTATION)) >> 3,
+		.continuity_counter = pi->continuity_counter,
+	};
+	int ret = ts_parse_packet(&header, (const char *) &packet[4], priv);
+	return ret < 0 && ret != -ENOBUFS ? ret : 0;
+}
+
+/**
+ * Parses the pending groups one PID after the other and empties them.
+ */
+static int ts_flush_groups(struct ts_packet_groups *groups, const uint8_t *packets,
+		const struct ts_packet_info *info, struct demuxfs_data *priv)
+{
+	int ret = 0;
+
+	for (size_t g=0; g<groups->num_groups; ++g) {
+		for (int16_t i=groups->group_head[g]; i >= 0 && ret == 0; i=groups->next[i])
+			ret = ts_parse_batch_packet(packets, info, i, priv);
+		groups->slot_group[groups->group_slot[g]] = -1;
+	}
+	groups->num_groups = 0;
+	return ret;
+}
+
+/**
+ * ts_parse_batch - Parse up to TS_BATCH_PACKETS packets stored back to back.
+ * Headers are decoded in one go and the packets of each PES PID are parsed
+ * in a row, so that the reassembly buffer and parser of a PID stay in cache.
+ *
+ * Only PES packets are grouped, by PID in order of first appearance and
+ * keeping the relative order of the packets of each PID. Every other packet
+ * is parsed in stream order after the groups pending before it: PSI sections
+ * change the PID maps (a PAT registers the PMT PIDs, a PMT binds the PES
+ * PIDs) and stream events are scheduled against the PCRs seen so far, so
+ * none of them may overtake or fall behind the packets around them.
+ */
+int ts_parse_batch(const uint8_t *packets, size_t num_packets, struct demuxfs_data *priv)
+{
+	struct ts_packet_info info[TS_BATCH_PACKETS];
+	struct ts_packet_groups groups;
+	size_t packet_size = priv->options.packet_size;
+	size_t num_valid;
+	int ret;
+
+	if (num_packets > TS_BATCH_PACKETS)
+		num_packets = TS_BATCH_PACKETS;
+	ts_classify_packets(packets, num_packets, packet_size, info);
+
+	/* Packets past a sync loss are not parsed, as with ts_parse_packet() */
+	for (num_valid=0; num_valid<num_packets; ++num_valid)
+		if (info[num_valid].flags & TS_PACKET_SYNC_ERROR)
+			break;
+
+	memset(groups.slot_group, 0xff, sizeof(groups.slot_group));
+	groups.num_groups = 0;
+	for (size_t i=0; i<num_valid; ++i) {
+		uint16_t pid = info[i].pid;
+
+		/* Null packets are ignored, and packets without payload only matter for their PCR */
+		if (pid == TS_NULL_PID)
+			continue;
+		if (! (info[i].flags & TS_PACKET_PAYLOAD) &&
+			(! (info[i].flags & TS_PACKET_ADAPTATION) || ! (priv->journal || priv->stream_events)))
+			continue;
+
+		if ((info[i].flags & TS_PACKET_PAYLOAD) && ts_is_pes_packet(pid, priv) && ! ts_is_psi_packet(pid, priv)) {
+			ts_group_packet(&groups, info, i);
+			continue;
+		}
+		ret = ts_flush_groups(&groups, packets, info, priv);
+		if (ret == 0)
+			ret = ts_parse_batch_packet(packets, info, i, priv);
+		if (ret < 0)
+			return ret;
+	}
+	ret = ts_flush_groups(&groups, packets, info, priv);
+	if (ret < 0)
+		return ret;
+
+	if (num_valid < num_packets) {
+		struct ts_header header;
+		ts_decode_header(&packets[num_valid * packet_size], &header);
+		return ts_parse_packet(&header, (const char *) &packets[num_valid * packet_size + 4], priv);
+	}
+	return 0;
+}
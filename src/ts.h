@@ -2,11 +2,12 @@
 #define __ts_h
 
 #include "colors.h"
+#include "log.h"
 
-#define TS_WARNING(x...) dprintf(colorYellow    "WARNING: " colorWhite x)
-#define TS_ERROR(x...)   dprintf(colorBoldRed   "ERROR:   " colorWhite x)
-#define TS_INFO(x...)    dprintf(colorBoldGreen "INFO:    " colorWhite x)
-#define TS_VERBOSE(x...) dprintf(colorBrown     "DEBUG:   " colorGray  x)
+#define TS_WARNING(x...) log_message(LOG_LEVEL_WARNING, colorYellow    "WARNING: " colorWhite x)
+#define TS_ERROR(x...)   log_message(LOG_LEVEL_ERROR,   colorBoldRed   "ERROR:   " colorWhite x)
+#define TS_INFO(x...)    log_message(LOG_LEVEL_INFO,    colorBoldGreen "INFO:    " colorWhite x)
+#define TS_VERBOSE(x...) log_message(LOG_LEVEL_DEBUG,   colorBrown     "DEBUG:   " colorGray  x)
 
 #define TS_SYNC_BYTE             0x47
 #define TS_MAX_SECTION_LENGTH    0x03FD
@@ -44,6 +45,8 @@
 #define TS_PMT_TABLE_ID                        0x02
 #define TS_DII_TABLE_ID                        0x3b
 #define TS_DDB_TABLE_ID                        0x3c
+#define TS_STREAM_DESCRIPTORS_TABLE_ID         0x3d
+#define TS_MPE_TABLE_ID                        0x3e
 #define TS_NIT_TABLE_ID                        0x40
 #define TS_SDT_TABLE_ID                        0x42
 #define TS_H_EIT_P_F_TABLE_ID                  0x4e /* Shared */
@@ -88,6 +91,42 @@ struct ts_header {
     uint8_t continuity_counter:4;
 } __attribute__((__packed__));
 
+/* Maximum number of packets handed to ts_parse_batch() at a time */
+#define TS_BATCH_PACKETS 256
+
+/* Flags of struct ts_packet_info */
+#define TS_PACKET_SYNC_ERROR    0x01
+#define TS_PACKET_TEI           0x02
+#define TS_PACKET_PUSI          0x04
+#define TS_PACKET_PAYLOAD       0x08 /* adaptation_field_control bit 0 */
+#define TS_PACKET_ADAPTATION    0x10 /* adaptation_field_control bit 1 */
+#define TS_PACKET_SCRAMBLED     0x20
+#define TS_PACKET_PRIORITY      0x40
+
+/**
+ * Compact TS packet header, as decoded by ts_classify_packets().
+ */
+struct ts_packet_info {
+	uint16_t pid;
+	uint8_t flags;
+	uint8_t continuity_counter;
+};
+
+/**
+ * Decodes the 4-byte header at the start of @packet.
+ */
+static inline void ts_decode_header(const uint8_t *packet, struct ts_header *header)
+{
+	header->sync_byte                    =  packet[0];
+	header->transport_error_indicator    = (packet[1] >> 7) & 0x01;
+	header->payload_unit_start_indicator = (packet[1] >> 6) & 0x01;
+	header->transport_priority           = (packet[1] >> 5) & 0x01;
+	header->pid                          = ((packet[1] << 8) | packet[2]) & 0x1fff;
+	header->transport_scrambling_control = (packet[3] >> 6) & 0x03;
+	header->adaptation_field             = (packet[3] >> 4) & 0x03;
+	header->continuity_counter           = (packet[3]) & 0x0f;
+}
+
 struct adaptation_field {
     uint8_t length;
     uint8_t discontinuity_indicator:1;
@@ -95,19 +134,57 @@ struct adaptation_field {
 
 /* Forward declaration */
 struct psi_common_header;
+struct buffer;
+
+/*
+ * Identity of a sub-table: PID, table_id, table_id_extension and, for tables
+ * whose sections are tracked separately, the section number. It keys the
+ * table state in the private hash table and is the inode of its directory.
+ */
+#define TS_TABLE_IDENTITY(pid,table_id,extension,section_number) \
+	((((uint64_t) (pid) & 0x1fff) << 40) | \
+	 (((uint64_t) (table_id) & 0xff) << 32) | \
+	 (((uint64_t) (extension) & 0xffff) << 16) | \
+	  ((uint64_t) (section_number) & 0xffff))
 
-/* The hash key generator of the private hash table */
+/* Identity of tables that keep a single state per PID and table_id */
 #define TS_PACKET_HASH_KEY(ts_header,packet_header) \
-	((((ts_header)->pid & 0xffff) << 8) | ((struct psi_common_header*)(packet_header))->table_id)
+	TS_TABLE_IDENTITY((ts_header)->pid, ((struct psi_common_header*)(packet_header))->table_id, 0, 0)
 
 /**
  * Function prototypes
  */
 int ts_parse_packet(const struct ts_header *header, const char *payload, struct demuxfs_data *priv);
+void ts_classify_packets(const uint8_t *packets, size_t num_packets, size_t packet_size,
+		struct ts_packet_info *info);
+int ts_parse_batch(const uint8_t *packets, size_t num_packets, struct demuxfs_data *priv);
+void ts_section_parsed(const struct ts_header *header, struct buffer *buffer, int ret,
+		uint64_t complete, uint64_t generation, struct demuxfs_data *priv);
+int ts_parse_section(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv);
+struct demuxfs_data *ts_context_new(const char *name, int subsystem, struct demuxfs_data *priv);
+void ts_context_destroy(struct demuxfs_data *context);
+void ts_request_pid(uint16_t pid, struct demuxfs_data *priv);
+void ts_release_pid(uint16_t pid, struct demuxfs_data *priv);
 void ts_dump_header(const struct ts_header *header);
 void ts_dump_psi_header(struct psi_common_header *header);
 
 typedef int (*parse_function_t)(const struct ts_header *header, const char *payload, uint32_t payload_len, 
 		struct demuxfs_data *priv);
 
+/*
+ * Tables that can be parsed off the packet thread come in two halves. The
+ * build function parses a section into a table whose version directory is not
+ * linked to the tree yet, leaving built->table NULL if the section holds no
+ * new version. The publish function links a built table into the tree.
+ */
+struct built_table {
+	void *table;
+	struct dentry *version_dentry;
+};
+
+typedef int (*build_function_t)(const struct ts_header *header, const char *payload, uint32_t payload_len,
+		struct built_table *built, struct demuxfs_data *priv);
+typedef int (*publish_function_t)(const struct ts_header *header, struct built_table *built,
+		struct demuxfs_data *priv);
+
 #endif /* __ts_h */
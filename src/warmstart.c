@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2008-2018, Lucas C. Villa Real <lucasvr@gobolinux.org>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ * notice, this list of conditions and the following disclaimer in the
+ * documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of GoboLinux nor the names of its contributors may
+ * be used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "demuxfs.h"
+#include "byteops.h"
+#include "fsutils.h"
+#include "xattr.h"
+#include "sections.h"
+#include "crc32.h"
+#include "hash.h"
+#include "mem.h"
+#include "ts.h"
+#include "tables/psi.h"
+#include "stats.h"
+#include "warmstart.h"
+
+/*
+ * Snapshot file layout, in host byte order:
+ *   char     magic[8]         "DMXFSWS1"
+ *   uint32_t num_sections
+ *   followed by num_sections records of
+ *   uint16_t pid
+ *   uint16_t length
+ *   char     section[length]  (complete section, CRC included)
+ * Records are stored in the order in which their sections first appeared on
+ * the stream, so that the PAT is replayed before the PMTs it announces.
+ */
+#define WARMSTART_MAGIC "DMXFSWS1"
+
+/* Flags of the stored sections */
+#define WARMSTART_RESTORED   0x01 /* Loaded from the snapshot file */
+#define WARMSTART_CONFIRMED  0x02 /* Seen on the live stream since the filesystem was mounted */
+
+struct warmstart {
+	char *path;
+	bool carousels;
+	bool dirty;
+	uint32_t num_restored;
+	uint32_t num_confirmed;
+	uint64_t saves;
+	time_t last_save;
+	/* Protects the store against the /Stats/warmstart reader */
+	pthread_mutex_t mutex;
+	struct section_store *store;
+};
+
+static time_t warmstart_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+/**
+ * Computes the store key of a section.
+ * @return false if the section is not meant to be kept.
+ */
+static bool warmstart_section_key(uint16_t pid, const char *section, uint32_t len, bool carousels,
+		ino_t *key)
+{
+	uint8_t table_id = section[0];
+
+	if (table_id == TS_DII_TABLE_ID || table_id == TS_DDB_TABLE_ID) {
+		if (! carousels)
+			return false;
+	} else if (table_id >= 0x3a && table_id <= 0x3f) {
+		/* Stream events and other DSM-CC sections only make sense live */
+		return false;
+	}
+	return section_store_key(pid, section, len, key);
+}
+
+/**
+ * Looks up the directory of the table a stored section has been parsed into.
+ * Tables are keyed by their identity with the parts they don't track
+ * separately zeroed, so the most specific identity is tried first.
+ * @return the table directory or NULL if the section has no table.
+ */
+static struct dentry *warmstart_table_dentry(struct stored_section *entry, struct demuxfs_data *priv)
+{
+	const ino_t masks[] = { ~0ULL, ~0xffffULL, ~0xffffffffULL };
+	size_t i;
+
+	for (i=0; i<sizeof(masks)/sizeof(masks[0]); ++i) {
+		ino_t key = entry->key & masks[i];
+		struct psi_common_header *table = hashtable_get(priv->psi_tables, key);
+		if (table && table->dentry && table->dentry->inode == key)
+			return table->dentry;
+	}
+	return NULL;
+}
+
+/**
+ * Stores a copy of @section, keeping the counters in sync with the flags of
+ * the entry it replaces.
+ */
+static struct stored_section *warmstart_store(struct warmstart *ws, ino_t key, uint16_t pid,
+		const char *section, uint32_t len, struct stored_section *old)
+{
+	uint8_t old_flags = old ? old->flags : 0;
+	struct stored_section *entry;
+
+	entry = section_store_put(ws->store, key, pid, section, len);
+	if (! entry)
+		return NULL;
+	if (old_flags & WARMSTART_RESTORED)
+		ws->num_restored--;
+	if (old_flags & WARMSTART_CONFIRMED)
+		ws->num_confirmed--;
+	ws->dirty = true;
+	return entry;
+}
+
+void warmstart_record(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv)
+{
+	struct warmstart *ws = priv->warmstart;
+	struct stored_section *entry;
+	bool save_due;
+	ino_t key;
+
+	if (! ws || ! warmstart_section_key(pid, section, len, ws->carousels, &key))
+		return;
+
+	pthread_mutex_lock(&ws->mutex);
+	entry = section_store_get(ws->store, key);
+	if (! entry || ! stored_section_equals(entry, section, len)) {
+		struct stored_section *new_entry = warmstart_store(ws, key, pid, section, len, entry);
+		if (! new_entry && ! entry)
+			dprintf("warm start store is full, dropping section (pid=%#x, table_id=%#x)",
+				pid, (uint8_t) section[0]);
+		entry = new_entry;
+	}
+	if (entry && ! (entry->flags & WARMSTART_CONFIRMED)) {
+		struct dentry *dentry = warmstart_table_dentry(entry, priv);
+		/* The live stream carries the table, whether or not the section changed */
+		if (dentry)
+			dentry->stale = false;
+		entry->flags |= WARMSTART_CONFIRMED;
+		ws->num_confirmed++;
+	}
+	save_due = ws->dirty && warmstart_now() - ws->last_save >= WARMSTART_SAVE_INTERVAL;
+	pthread_mutex_unlock(&ws->mutex);
+
+	if (save_due)
+		warmstart_save(priv);
+}
+
+int warmstart_save(struct demuxfs_data *priv)
+{
+	struct warmstart *ws = priv->warmstart;
+	struct stored_section *entry;
+	char *tmp_path = NULL;
+	int ret = 0;
+	FILE *fp;
+
+	if (! ws)
+		return 0;
+	if (asprintf(&tmp_path, "%s.tmp", ws->path) < 0)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&ws->mutex);
+	fp = fopen(tmp_path, "w");
+	if (! fp) {
+		ret = -errno;
+		goto out;
+	}
+	fwrite(WARMSTART_MAGIC, 1, strlen(WARMSTART_MAGIC), fp);
+	fwrite(&ws->store->count, sizeof(ws->store->count), 1, fp);
+	list_for_each_entry(entry, &ws->store->list, list) {
+		fwrite(&entry->pid, sizeof(entry->pid), 1, fp);
+		fwrite(&entry->length, sizeof(entry->length), 1, fp);
+		fwrite(entry->data, 1, entry->length, fp);
+	}
+	if (ferror(fp))
+		ret = -EIO;
+	if (fclose(fp) != 0 && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp_path, ws->path) < 0)
+		ret = -errno;
+	if (ret < 0)
+		unlink(tmp_path);
+out:
+	/* Failed attempts are not retried before the next interval */
+	ws->last_save = warmstart_now();
+	if (ret == 0) {
+		ws->dirty = false;
+		ws->saves++;
+	}
+	pthread_mutex_unlock(&ws->mutex);
+	if (ret < 0)
+		TS_WARNING("failed to write warm start snapshot %s: %s", ws->path, strerror(-ret));
+	free(tmp_path);
+	return ret;
+}
+
+/**
+ * Reads the snapshot file and replays its sections.
+ * @return number of sections restored or a negative errno value.
+ */
+static int warmstart_load(struct warmstart *ws, struct demuxfs_data *priv)
+{
+	char magic[sizeof(WARMSTART_MAGIC)-1];
+	struct stored_section *entry;
+	uint32_t i, num_sections;
+	char *section = NULL;
+	int restored = 0;
+	FILE *fp;
+
+	fp = fopen(ws->path, "r");
+	if (! fp)
+		return errno == ENOENT ? 0 : -errno;
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, WARMSTART_MAGIC, sizeof(magic)) ||
+		fread(&num_sections, sizeof(num_sections), 1, fp) != 1) {
+		TS_WARNING("%s is not a warm start snapshot, ignoring it", ws->path);
+		fclose(fp);
+		return -EINVAL;
+	}
+
+	section = malloc(UINT16_MAX);
+	if (! section) {
+		fclose(fp);
+		return -ENOMEM;
+	}
+
+	for (i=0; i<num_sections; ++i) {
+		uint16_t pid, length;
+		ino_t key;
+
+		if (fread(&pid, sizeof(pid), 1, fp) != 1 || fread(&length, sizeof(length), 1, fp) != 1 ||
+			fread(section, 1, length, fp) != length) {
+			TS_WARNING("%s is truncated, restored %d out of %d sections", ws->path, restored, num_sections);
+			break;
+		}
+		if (length < 3 || (CONVERT_TO_16(section[1], section[2]) & 0x0fff) + 3 != length ||
+			! crc32_check(section, length) ||
+			! warmstart_section_key(pid, section, length, ws->carousels, &key) ||
+			section_store_get(ws->store, key))
+			continue;
+
+		entry = warmstart_store(ws, key, pid, section, length, NULL);
+		if (! entry)
+			break;
+		entry->flags |= WARMSTART_RESTORED;
+		ws->num_restored++;
+		restored++;
+	}
+	free(section);
+	fclose(fp);
+
+	/*
+	 * Data blocks are only assembled into modules once their DII is known,
+	 * and the carousel tree is built when the DII repeats after the last
+	 * block, just like it happens on the live stream.
+	 */
+	list_for_each_entry(entry, &ws->store->list, list)
+		if (entry->data[0] != TS_DDB_TABLE_ID)
+			ts_parse_section(entry->pid, entry->data, entry->length, priv);
+	list_for_each_entry(entry, &ws->store->list, list)
+		if (entry->data[0] == TS_DDB_TABLE_ID)
+			ts_parse_section(entry->pid, entry->data, entry->length, priv);
+	list_for_each_entry(entry, &ws->store->list, list)
+		if (entry->data[0] == TS_DII_TABLE_ID)
+			ts_parse_section(entry->pid, entry->data, entry->length, priv);
+
+	/* Restored tables carry the system.stale xattr until the live stream confirms them */
+	list_for_each_entry(entry, &ws->store->list, list) {
+		struct dentry *dentry = warmstart_table_dentry(entry, priv);
+		if (dentry)
+			dentry->stale = true;
+	}
+
+	ws->dirty = false;
+	return restored;
+}
+
+static char *warmstart_generate_stats(void *data, struct demuxfs_data *priv)
+{
+	struct warmstart *ws = (struct warmstart *) data;
+	struct stored_section *entry;
+	uint32_t stale = 0;
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &size);
+	if (! fp)
+		return NULL;
+
+	pthread_mutex_lock(&ws->mutex);
+	list_for_each_entry(entry, &ws->store->list, list)
+		if (! (entry->flags & WARMSTART_CONFIRMED))
+			stale++;
+	fprintf(fp, "file: %s\n"
+		"sections: %u\n"
+		"restored: %u\n"
+		"confirmed: %u\n"
+		"stale: %u\n"
+		"saves: %" PRIu64 "\n",
+		ws->path, ws->store->count, ws->num_restored, ws->num_confirmed, stale, ws->saves);
+	if (stale) {
+		fprintf(fp, "\n%-8s %-8s %-20s %s\n", "pid", "table_id", "table_id_extension", "section");
+		list_for_each_entry(entry, &ws->store->list, list)
+			if (! (entry->flags & WARMSTART_CONFIRMED))
+				fprintf(fp, "%#-8x %#-8x %#-20x %u\n", entry->pid, (uint8_t) entry->data[0],
+					(unsigned int) (entry->key >> 16) & 0xffff, (unsigned int) entry->key & 0xffff);
+	}
+	pthread_mutex_unlock(&ws->mutex);
+	fclose(fp);
+	return buf;
+}
+
+int warmstart_init(struct demuxfs_data *priv)
+{
+	struct warmstart *ws;
+	int ret;
+
+	if (! priv->options.warmstart)
+		return 0;
+
+	ws = (struct warmstart *) calloc(1, sizeof(struct warmstart));
+	if (! ws)
+		return -ENOMEM;
+	ws->path = strdup(priv->options.warmstart);
+	ws->carousels = priv->options.warmstart_carousels;
+	ws->last_save = warmstart_now();
+	ws->store = section_store_new(WARMSTART_MAX_SECTIONS, MEM_WARMSTART);
+	pthread_mutex_init(&ws->mutex, NULL);
+
+	ret = warmstart_load(ws, priv);
+	if (ret < 0 && ret != -EINVAL)
+		TS_WARNING("failed to read warm start snapshot %s: %s", ws->path, strerror(-ret));
+	else if (ret > 0)
+		dprintf("restored %d sections from %s", ret, ws->path);
+
+	CREATE_STATS_FILE(CREATE_DIRECTORY(priv->root, FS_STATS_NAME), FS_STATS_WARMSTART_NAME,
+		warmstart_generate_stats, ws);
+	priv->warmstart = ws;
+	return 0;
+}
+
+void warmstart_destroy(struct demuxfs_data *priv)
+{
+	struct warmstart *ws = priv->warmstart;
+
+	if (! ws)
+		return;
+	warmstart_save(priv);
+	priv->warmstart = NULL;
+	section_store_destroy(ws->store);
+	pthread_mutex_destroy(&ws->mutex);
+	free(ws->path);
+	free(ws);
+}
@@ -0,0 +1,49 @@
+#ifndef __warmstart_h
+#define __warmstart_h
+
+/*
+ * Warm start: the raw "Current" sections of every PSI/SI table seen on the
+ * stream are kept in a store that is written to a snapshot file under tmpdir
+ * periodically and on unmount. On the next mount the snapshot is replayed
+ * through the table parsers before the first packet arrives, so the tree is
+ * populated immediately. Restored sections are reported as stale in
+ * /Stats/warmstart until the live stream carries them again, and the
+ * directories of their tables carry the system.stale xattr meanwhile.
+ */
+
+#define FS_STATS_WARMSTART_NAME   "warmstart"
+
+/* Interval, in seconds, between two periodic snapshots of a modified store */
+#define WARMSTART_SAVE_INTERVAL   60
+
+/* Maximum number of sections held by the store */
+#define WARMSTART_MAX_SECTIONS    65536
+
+struct warmstart;
+
+/**
+ * Loads the snapshot file at priv->options.warmstart, if any, and replays its
+ * sections through the table parsers. Must be called before the TS parser
+ * thread is started.
+ * @return 0 on success or a negative errno value.
+ */
+int warmstart_init(struct demuxfs_data *priv);
+
+/**
+ * Records a CRC-checked section that has just been handed to its parser.
+ * Also writes the periodic snapshot when it is due.
+ */
+void warmstart_record(uint16_t pid, const char *section, uint32_t len, struct demuxfs_data *priv);
+
+/**
+ * Writes the snapshot file.
+ * @return 0 on success or a negative errno value.
+ */
+int warmstart_save(struct demuxfs_data *priv);
+
+/**
+ * Writes the final snapshot and releases the store.
+ */
+void warmstart_destroy(struct demuxfs_data *priv);
+
+#endif /* __warmstart_h */
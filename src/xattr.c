@@ -29,19 +29,44 @@
 #include "demuxfs.h"
 #include "xattr.h"
 
-void xattr_free(struct xattr *xattr)
+struct xattr_format_value {
+	const char *value;
+	size_t size;
+};
+
+#define XATTR_FORMAT_VALUE(str) { str, sizeof(str)-1 }
+
+static const struct xattr_format_value xattr_format_values[] = {
+	[XATTR_FORMAT_NONE]              = { NULL, 0 },
+	[XATTR_FORMAT_BIN]               = XATTR_FORMAT_VALUE("binary data"),
+	[XATTR_FORMAT_NUMBER]            = XATTR_FORMAT_VALUE("number"),
+	[XATTR_FORMAT_STRING]            = XATTR_FORMAT_VALUE("string"),
+	[XATTR_FORMAT_STRING_AND_NUMBER] = XATTR_FORMAT_VALUE("string [number]"),
+	[XATTR_FORMAT_NUMBER_ARRAY]      = XATTR_FORMAT_VALUE("number [<new_line>number]"),
+};
+
+/**
+ * Looks up a built-in attribute of a dentry.
+ * @return true if @name is a built-in attribute, in which case @value and
+ * @size are set to its value or to NULL if the dentry doesn't carry it.
+ */
+static bool xattr_get_builtin(struct dentry *dentry, const char *name, const char **value, size_t *size)
 {
-	if (! xattr)
-		return;
-	if (xattr->putname) {
-		free(xattr->name);
-		free(xattr->value);
+	if (strncmp(name, "system.", 7))
+		return false;
+	*value = NULL;
+	*size = 0;
+	if (! strcmp(name, XATTR_FORMAT) && dentry->format != XATTR_FORMAT_NONE) {
+		*value = xattr_format_values[dentry->format].value;
+		*size = xattr_format_values[dentry->format].size;
+	} else if (! strcmp(name, XATTR_STALE) && dentry->stale) {
+		*value = XATTR_STALE_VALUE;
+		*size = sizeof(XATTR_STALE_VALUE)-1;
 	}
-	list_del(&xattr->list);
-	free(xattr);
+	return true;
 }
 
-struct xattr *xattr_get(struct dentry *dentry, const char *name)
+static struct xattr *xattr_find(struct dentry *dentry, const char *name)
 {
 	struct xattr *xattr;
 	list_for_each_entry(xattr, &dentry->xattrs, list)
@@ -50,31 +75,70 @@ struct xattr *xattr_get(struct dentry *dentry, const char *name)
 	return NULL;
 }
 
+void xattr_free(struct xattr *xattr)
+{
+	if (! xattr)
+		return;
+	free(xattr->name);
+	free(xattr->value);
+	list_del(&xattr->list);
+	free(xattr);
+}
+
+/**
+ * Copies the value of an extended attribute into @value.
+ * @return the size of the value, which is all that is returned when @size
+ * is 0, or a negative errno value.
+ */
+int xattr_get(struct dentry *dentry, const char *name, char *value, size_t size)
+{
+	const char *attr_value;
+	size_t attr_size;
+
+	if (! xattr_get_builtin(dentry, name, &attr_value, &attr_size)) {
+		struct xattr *xattr = xattr_find(dentry, name);
+		attr_value = xattr ? xattr->value : NULL;
+		attr_size = xattr ? xattr->size : 0;
+	}
+	if (! attr_value)
+		return -ENOATTR;
+	if (size == 0)
+		return attr_size;
+	else if (size < attr_size)
+		return -ERANGE;
+	memcpy(value, attr_value, attr_size);
+	return attr_size;
+}
+
 bool xattr_exists(struct dentry *dentry, const char *name)
 {
-	struct xattr *xattr;
-	list_for_each_entry(xattr, &dentry->xattrs, list)
-		if (! strcmp(xattr->name, name))
-			return true;
-	return false;
+	const char *value;
+	size_t size;
+
+	if (xattr_get_builtin(dentry, name, &value, &size))
+		return value != NULL;
+	return xattr_find(dentry, name) != NULL;
 }
 
-int xattr_add(struct dentry *dentry, const char *name, const char *value, size_t size, bool putname)
+/**
+ * Adds a user attribute to a dentry. Both @name and @value are copied.
+ */
+int xattr_add(struct dentry *dentry, const char *name, const char *value, size_t size)
 {
 	struct xattr *xattr = malloc(sizeof(struct xattr));
 	if (! xattr)
 		return -ENOMEM;
 
-	if (putname) {
-		xattr->name = strdup(name);
-		xattr->value = calloc(size, sizeof(char));
-		memcpy(xattr->value, value, size);
-	} else {
-		xattr->name = (char *) name;
-		xattr->value = (char *) value;
+	xattr->name = strdup(name);
+	xattr->value = malloc(size ? size : 1);
+	if (! xattr->name || ! xattr->value) {
+		free(xattr->name);
+		free(xattr->value);
+		free(xattr);
+		return -ENOMEM;
 	}
+	memcpy(xattr->value, value, size);
 	xattr->size = size;
-	xattr->putname = putname;
 
 	list_add_tail(&xattr->list, &dentry->xattrs);
 	return 0;
@@ -84,8 +148,11 @@ int xattr_list(struct dentry *dentry, char *buf, size_t size)
 {
 	size_t required = 0, copied = 0;
 	struct xattr *xattr;
-	char zero = 0;
 
+	if (dentry->format != XATTR_FORMAT_NONE)
+		required += sizeof(XATTR_FORMAT);
+	if (dentry->stale)
+		required += sizeof(XATTR_STALE);
 	list_for_each_entry(xattr, &dentry->xattrs, list)
 		required += strlen(xattr->name) + 1;
 
@@ -94,22 +161,34 @@ int xattr_list(struct dentry *dentry, char *buf, size_t size)
 	else if (size < required)
 		return -ERANGE;
 
+	if (dentry->format != XATTR_FORMAT_NONE) {
+		memcpy(buf+copied, XATTR_FORMAT, sizeof(XATTR_FORMAT));
+		copied += sizeof(XATTR_FORMAT);
+	}
+	if (dentry->stale) {
+		memcpy(buf+copied, XATTR_STALE, sizeof(XATTR_STALE));
+		copied += sizeof(XATTR_STALE);
+	}
 	list_for_each_entry(xattr, &dentry->xattrs, list) {
-		memcpy(buf+copied, xattr->name, strlen(xattr->name));
-		copied += strlen(xattr->name);
-		memcpy(buf+copied, &zero, 1);
-		copied++;
+		size_t len = strlen(xattr->name) + 1;
+		memcpy(buf+copied, xattr->name, len);
+		copied += len;
 	}
 	return copied;
 }
 
 int xattr_remove(struct dentry *dentry, const char *name)
 {
-	struct xattr *xattr, *aux;
-	list_for_each_entry_safe(xattr, aux, &dentry->xattrs, list)
-		if (! strcmp(xattr->name, name)) {
-			xattr_free(xattr);
-			return 0;
-		}
-	return -ENOENT;
+	const char *value;
+	size_t size;
+	struct xattr *xattr;
+
+	/* Built-in attributes are derived from the dentry and cannot be removed */
+	if (xattr_get_builtin(dentry, name, &value, &size))
+		return value ? -EPERM : -ENOATTR;
+	xattr = xattr_find(dentry, name);
+	if (! xattr)
+		return -ENOATTR;
+	xattr_free(xattr);
+	return 0;
 }
@@ -5,18 +5,30 @@
 #define ENOATTR ENODATA
 #endif
 
+/*
+ * Built-in attributes are computed from fields of the dentry and take no
+ * memory of their own. Only user.* attributes are kept in dentry->xattrs.
+ */
+
 /* Attribute name */
 #define XATTR_FORMAT                    "system.format"
-/* List of allowed values for above attribute */
-#define XATTR_FORMAT_BIN                "binary data"
-#define XATTR_FORMAT_NUMBER             "number"
-#define XATTR_FORMAT_STRING             "string"
-#define XATTR_FORMAT_STRING_AND_NUMBER  "string [number]"
-#define XATTR_FORMAT_NUMBER_ARRAY       "number [<new_line>number]"
+/* List of allowed values for above attribute, stored in dentry->format */
+enum xattr_format {
+	XATTR_FORMAT_NONE = 0,
+	XATTR_FORMAT_BIN,               /* "binary data" */
+	XATTR_FORMAT_NUMBER,            /* "number" */
+	XATTR_FORMAT_STRING,            /* "string" */
+	XATTR_FORMAT_STRING_AND_NUMBER, /* "string [number]" */
+	XATTR_FORMAT_NUMBER_ARRAY,      /* "number [<new_line>number]" */
+};
+
+/* Attribute carried by table directories while dentry->stale is set */
+#define XATTR_STALE                     "system.stale"
+#define XATTR_STALE_VALUE               "warmstart"
 
-struct xattr *xattr_get(struct dentry *dentry, const char *name);
+int xattr_get(struct dentry *dentry, const char *name, char *value, size_t size);
 bool xattr_exists(struct dentry *dentry, const char *name);
-int xattr_add(struct dentry *dentry, const char *name, const char *value, size_t size, bool putname);
+int xattr_add(struct dentry *dentry, const char *name, const char *value, size_t size);
 int xattr_list(struct dentry *dentry, char *buf, size_t size);
 int xattr_remove(struct dentry *dentry, const char *name);
 void xattr_free(struct xattr *xattr);